@@ -1,5 +1,8 @@
 #include "EPUB3.h"
 #include "EPUB3_private.h"
+#if EPUB3_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 const char * kEPUB3TypeID = "_EPUB3_t";
 const char * kEPUB3MetadataTypeID = "_EPUB3Metadata_t";
@@ -9,6 +12,10 @@ const char * kEPUB3SpineTypeID = "_EPUB3Spine_t";
 const char * kEPUB3SpineItemTypeID = "_EPUB3SpineItem_t";
 const char * kEPUB3TocTypeID = "_EPUB3Toc_t";
 const char * kEPUB3TocItemTypeID = "_EPUB3TocItem_t";
+const char * kEPUB3ResourceTypeID = "_EPUB3Resource_t";
+const char * kEPUB3PrefetcherTypeID = "_EPUB3Prefetcher_t";
+const char * kEPUB3ResourceStreamTypeID = "_EPUB3ResourceStream_t";
+const char * kEPUB3WorkPoolTypeID = "_EPUB3WorkPool_t";
 
 
 #ifndef PARSE_CONTEXT_STACK_DEPTH
@@ -127,7 +134,7 @@ EXPORT char * EPUB3TocItemCopyTitle(EPUB3TocItemRef tocItem)
 
   if(tocItem->title == NULL) return NULL;
 
-  char * title = strdup(tocItem->title);
+  char * title = EPUB3Strdup(tocItem->title);
   return title;
 }
 
@@ -137,7 +144,136 @@ EXPORT char * EPUB3TocItemCopyPath(EPUB3TocItemRef tocItem)
 
   if(tocItem->href == NULL) return NULL;
 
-  return strdup(tocItem->href);
+  return EPUB3Strdup(tocItem->href);
+}
+
+#pragma mark - Memory Management
+
+static void * _EPUB3SystemAllocate(void * context, size_t size)
+{
+  return malloc(size);
+}
+
+static void * _EPUB3SystemReallocate(void * context, void * ptr, size_t size)
+{
+  return realloc(ptr, size);
+}
+
+static void _EPUB3SystemDeallocate(void * context, void * ptr)
+{
+  free(ptr);
+}
+
+static char * _EPUB3SystemCopyString(void * context, const char * string)
+{
+  return strdup(string);
+}
+
+static EPUB3Allocator _EPUB3CurrentAllocator = {
+  NULL,
+  _EPUB3SystemAllocate,
+  _EPUB3SystemReallocate,
+  _EPUB3SystemDeallocate,
+  _EPUB3SystemCopyString
+};
+
+// libxml2's hooks carry no context pointer, so these trampolines forward to whatever allocator is current.
+static void * _EPUB3XMLMalloc(size_t size)
+{
+  return EPUB3Malloc(size);
+}
+
+static void * _EPUB3XMLRealloc(void * ptr, size_t size)
+{
+  return EPUB3Realloc(ptr, size);
+}
+
+static void _EPUB3XMLFree(void * ptr)
+{
+  EPUB3Free(ptr);
+}
+
+static char * _EPUB3XMLStrdup(const char * string)
+{
+  return EPUB3Strdup(string);
+}
+
+EXPORT EPUB3Error EPUB3SetAllocator(const EPUB3Allocator * allocator)
+{
+  if(allocator == NULL) {
+    _EPUB3CurrentAllocator.context = NULL;
+    _EPUB3CurrentAllocator.allocate = _EPUB3SystemAllocate;
+    _EPUB3CurrentAllocator.reallocate = _EPUB3SystemReallocate;
+    _EPUB3CurrentAllocator.deallocate = _EPUB3SystemDeallocate;
+    _EPUB3CurrentAllocator.copyString = _EPUB3SystemCopyString;
+  } else {
+    if(allocator->allocate == NULL || allocator->reallocate == NULL || allocator->deallocate == NULL) {
+      return kEPUB3InvalidArgumentError;
+    }
+    _EPUB3CurrentAllocator = *allocator;
+  }
+
+  if(xmlMemSetup(_EPUB3XMLFree, _EPUB3XMLMalloc, _EPUB3XMLRealloc, _EPUB3XMLStrdup) != 0) {
+    return kEPUB3UnknownError;
+  }
+  return kEPUB3Success;
+}
+
+void * EPUB3Malloc(size_t size)
+{
+  return _EPUB3CurrentAllocator.allocate(_EPUB3CurrentAllocator.context, size);
+}
+
+void * EPUB3Calloc(size_t count, size_t size)
+{
+  if(size != 0 && count > SIZE_MAX / size) return NULL;
+
+  void * memory = EPUB3Malloc(count * size);
+  if(memory != NULL) {
+    (void)memset(memory, 0, count * size);
+  }
+  return memory;
+}
+
+void * EPUB3Realloc(void * ptr, size_t size)
+{
+  return _EPUB3CurrentAllocator.reallocate(_EPUB3CurrentAllocator.context, ptr, size);
+}
+
+char * EPUB3Strdup(const char * string)
+{
+  assert(string != NULL);
+
+  if(_EPUB3CurrentAllocator.copyString != NULL) {
+    return _EPUB3CurrentAllocator.copyString(_EPUB3CurrentAllocator.context, string);
+  }
+  size_t length = strlen(string) + 1U;
+  char * copy = EPUB3Malloc(length);
+  if(copy != NULL) {
+    (void)memcpy(copy, string, length);
+  }
+  return copy;
+}
+
+EXPORT void EPUB3Free(void * ptr)
+{
+  if(ptr == NULL) return;
+  _EPUB3CurrentAllocator.deallocate(_EPUB3CurrentAllocator.context, ptr);
+}
+
+// Attribute values come from libxml2's allocator. Copy them into memory we own so everything hanging off
+// the EPUB3 objects is released with EPUB3Free, whoever happens to have installed xmlMemSetup hooks.
+char * EPUB3CopyXMLAttribute(xmlTextReaderPtr reader, const char * name)
+{
+  assert(reader != NULL);
+  assert(name != NULL);
+
+  xmlChar * value = xmlTextReaderGetAttribute(reader, BAD_CAST name);
+  if(value == NULL) return NULL;
+
+  char * copy = EPUB3Strdup((const char *)value);
+  xmlFree(value);
+  return copy;
 }
 
 #pragma mark - Base Object
@@ -174,7 +310,7 @@ void * EPUB3ObjectInitWithTypeID(void *object, const char *typeID)
 
 EPUB3Ref EPUB3Create()
 {
-  EPUB3Ref memory = malloc(sizeof(struct EPUB3));
+  EPUB3Ref memory = EPUB3Malloc(sizeof(struct EPUB3));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3TypeID);
   memory->metadata = NULL;
   memory->manifest = NULL;
@@ -183,6 +319,21 @@ EPUB3Ref EPUB3Create()
   memory->archive = NULL;
   memory->archivePath = NULL;
   memory->archiveFileCount = 0;
+  (void)memset(&memory->archiveIdentity, 0, sizeof(EPUB3ArchiveIdentity));
+  memory->rootFileDirectory = NULL;
+  memory->prefetcher = NULL;
+  (void)pthread_mutex_init(&memory->entryLock, NULL);
+  (void)memset(memory->entryTable, 0, sizeof(memory->entryTable));
+  memory->rangeCheckpointSpan = RANGE_CHECKPOINT_DEFAULT_SPAN;
+  memory->rangeIndexDirectory = NULL;
+  memory->snapshot = NULL;
+  memory->snapshotSize = 0;
+  memory->verifiesReads = kEPUB3_NO;
+  memory->recoveredArchive = NULL;
+  memory->renditions = NULL;
+  memory->renditionCount = 0;
+  memory->selectedRendition = 0;
+  memory->cacheEntry = NULL;
   return memory;
 }
 
@@ -206,18 +357,30 @@ EXPORT EPUB3Ref EPUB3CreateWithArchiveAtPath(const char * path, EPUB3Error *erro
   return epub;
 }
 
+static void _EPUB3AttachArchive(EPUB3Ref epub, unzFile archive, const char * path)
+{
+  epub->archive = archive;
+  epub->archiveFileCount = EPUB3GetFileCountInArchive(epub);
+  epub->archivePath = EPUB3Strdup(path);
+  struct stat st;
+  if(stat(path, &st) == 0) {
+    epub->archiveIdentity.device = (uint64_t)st.st_dev;
+    epub->archiveIdentity.inode = (uint64_t)st.st_ino;
+    epub->archiveIdentity.size = (uint64_t)st.st_size;
+    epub->archiveIdentity.modificationTime = (int64_t)st.st_mtime;
+  }
+}
+
 EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path)
 {
   assert(epub != NULL);
   assert(path != NULL);
 
   EPUB3Error error = kEPUB3Success;
-  unzFile archive = unzOpen(path);
+  unzFile archive = unzOpen64(path);
   if (archive != NULL)
   {
-    epub->archive = archive;
-    epub->archiveFileCount = EPUB3GetFileCountInArchive(archive);
-    epub->archivePath = strdup(path);
+    _EPUB3AttachArchive(epub, archive, path);
   }
   else // unzOpen can return a NULL filestream
     error = kEPUB3UnknownError;
@@ -225,25 +388,93 @@ EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path)
   return error;
 }
 
+// unzOpen only checks the end records, which can point at a directory that is gone or cut short
+static EPUB3Bool _EPUB3ArchiveDirectoryIsReadable(unzFile archive)
+{
+  unz_global_info64 globalInfo;
+  if(unzGetGlobalInfo64(archive, &globalInfo) != UNZ_OK) return kEPUB3_NO;
+  ZPOS64_T entryCount = 0;
+  int status = unzGoToFirstFile(archive);
+  while(status == UNZ_OK) {
+    entryCount++;
+    status = unzGoToNextFile(archive);
+  }
+  return status == UNZ_END_OF_LIST_OF_FILE && entryCount == globalInfo.number_entry;
+}
+
+EPUB3Error EPUB3PrepareArchiveAtPathRecovering(EPUB3Ref epub, const char * path)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  unzFile archive = unzOpen64(path);
+  if(archive != NULL && !_EPUB3ArchiveDirectoryIsReadable(archive)) {
+    (void)unzClose(archive);
+    archive = NULL;
+  }
+  if(archive == NULL) {
+    EPUB3RecoveredArchiveRef recovered = NULL;
+    EPUB3Error error = EPUB3RecoverArchive(path, &recovered);
+    if(error != kEPUB3Success) return error;
+    archive = EPUB3RecoveredArchiveOpen(recovered, path);
+    if(archive == NULL) {
+      EPUB3RecoveredArchiveFree(recovered);
+      return kEPUB3ArchiveUnavailableError;
+    }
+    epub->recoveredArchive = recovered;
+  }
+  _EPUB3AttachArchive(epub, archive, path);
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Ref EPUB3CreateWithArchiveAtPathRecovering(const char * path, EPUB3Error *error)
+{
+  assert(path != NULL);
+
+  EPUB3Ref epub = EPUB3Create();
+  *error = EPUB3PrepareArchiveAtPathRecovering(epub, path);
+  if(*error == kEPUB3Success) {
+    *error = EPUB3InitAndValidate(epub);
+  }
+  if(*error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return NULL;
+  }
+  return epub;
+}
+
+EXPORT EPUB3Bool EPUB3ArchiveWasRecovered(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+  return epub->recoveredArchive != NULL ? kEPUB3_YES : kEPUB3_NO;
+}
+
 EPUB3Error EPUB3InitAndValidate(EPUB3Ref epub)
 {
   assert(epub != NULL);
-  char * opfPath = NULL;
-  EPUB3Error error = EPUB3CopyRootFilePathFromContainer(epub, &opfPath);
+  EPUB3Error error = epub->renditions == NULL ? EPUB3ParseContainer(epub) : kEPUB3Success;
   if(error != kEPUB3Success) {
     fprintf(stderr, "Error (%d[%d]) opening and validating epub file at %s.\n", error, __LINE__, epub->archivePath);
+    return error;
   }
-  error = EPUB3InitFromOPF(epub, opfPath);
+  // Only the default rendition is built now, others when they are selected
+  EPUB3Rendition * rendition = &epub->renditions[epub->selectedRendition];
+  EPUB3_FREE_AND_NULL(epub->rootFileDirectory);
+  epub->rootFileDirectory = EPUB3Strdup(rendition->rootFileDirectory);
+  error = EPUB3InitFromOPF(epub, rendition->path);
   if(error != kEPUB3Success) {
     fprintf(stderr, "Error (%d[%d]) parsing epub file at %s.\n", error, __LINE__, epub->archivePath);
   }
-  EPUB3_FREE_AND_NULL(opfPath);
   return error;
 }
 
 EXPORT void EPUB3Retain(EPUB3Ref epub)
 {
   if(epub == NULL) return;
+  if(epub->cacheEntry != NULL) {
+    EPUB3CacheRetainBook(epub);
+    return;
+  }
 
   EPUB3MetadataRetain(epub->metadata);
   EPUB3ManifestRetain(epub->manifest);
@@ -254,13 +485,25 @@ EXPORT void EPUB3Retain(EPUB3Ref epub)
 EXPORT void EPUB3Release(EPUB3Ref epub)
 {
   if(epub == NULL) return;
+  if(epub->cacheEntry != NULL) {
+    EPUB3CacheReleaseBook(epub);
+    return;
+  }
 
   if(epub->_type.refCount == 1) {
     if(epub->archive != NULL) {
       unzClose(epub->archive);
       epub->archive = NULL;
     }
+    EPUB3RecoveredArchiveFree(epub->recoveredArchive);
+    epub->recoveredArchive = NULL;
     EPUB3_FREE_AND_NULL(epub->archivePath);
+    EPUB3_FREE_AND_NULL(epub->rootFileDirectory);
+    EPUB3_FREE_AND_NULL(epub->rangeIndexDirectory);
+    EPUB3RenditionsFree(epub);
+    EPUB3ReleaseArchiveEntries(epub);
+    EPUB3SnapshotUnmap(epub);
+    (void)pthread_mutex_destroy(&epub->entryLock);
   }
 
   EPUB3MetadataRelease(epub->metadata);
@@ -330,7 +573,7 @@ void EPUB3SetStringValue(char ** location, const char *value)
   if(value == NULL) {
     return;
   }
-  char * valueCopy = strdup(value);
+  char * valueCopy = EPUB3Strdup(value);
   *location = valueCopy;
 }
 
@@ -338,7 +581,7 @@ char * EPUB3CopyStringValue(char ** location)
 {
   if(*location == NULL) return NULL;
 
-  char * copy = strdup(*location);
+  char * copy = EPUB3Strdup(*location);
   return copy;
 }
 
@@ -385,17 +628,12 @@ EXPORT EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint32_t * b
   {
       return kEPUB3FileNotFoundInArchiveError;
   }
-  char * rootFilePath = NULL;
-  EPUB3Error error = EPUB3CopyRootFilePathFromContainer(epub, &rootFilePath);
-  if(error == kEPUB3Success) {
-    char * rootPath = EPUB3CopyOfPathByDeletingLastPathComponent(rootFilePath);
-    char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(rootPath, path);
-    error = EPUB3CopyFileIntoBuffer(epub, bytes, NULL, byteCount, fullPath);
-    EPUB3_FREE_AND_NULL(rootPath);
-    EPUB3_FREE_AND_NULL(fullPath);
-  }
+  // The package's directory was found when the book was opened, there's no need to read the container again
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(root, path);
+  EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, bytes, NULL, byteCount, fullPath);
+  EPUB3_FREE_AND_NULL(fullPath);
   EPUB3_FREE_AND_NULL(path);
-  EPUB3_FREE_AND_NULL(rootFilePath);
   return error;
 }
 
@@ -403,7 +641,7 @@ EXPORT EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint32_t * b
 
 EPUB3TocRef EPUB3TocCreate()
 {
-  EPUB3TocRef memory = malloc(sizeof(struct EPUB3Toc));
+  EPUB3TocRef memory = EPUB3Malloc(sizeof(struct EPUB3Toc));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3TocTypeID);
   memory->rootItemCount = 0;
   memory->rootItemsHead = NULL;
@@ -443,7 +681,7 @@ void EPUB3TocRelease(EPUB3TocRef toc)
 
 EPUB3TocItemRef EPUB3TocItemCreate()
 {
-  EPUB3TocItemRef memory = malloc(sizeof(struct EPUB3TocItem));
+  EPUB3TocItemRef memory = EPUB3Malloc(sizeof(struct EPUB3TocItem));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3TocItemTypeID);
   memory->title = NULL;
   memory->href = NULL;
@@ -490,7 +728,7 @@ void EPUB3TocAddRootItem(EPUB3TocRef toc, EPUB3TocItemRef item)
   assert(item != NULL);
 
   EPUB3TocItemRetain(item);
-  EPUB3TocItemChildListItemPtr itemPtr = (EPUB3TocItemChildListItemPtr) calloc(1, sizeof(struct EPUB3TocItemChildListItem));
+  EPUB3TocItemChildListItemPtr itemPtr = (EPUB3TocItemChildListItemPtr) EPUB3Calloc(1, sizeof(struct EPUB3TocItemChildListItem));
   itemPtr->item = item;
 
   if(toc->rootItemsHead == NULL) {
@@ -510,7 +748,7 @@ void EPUB3TocItemAppendChild(EPUB3TocItemRef parent, EPUB3TocItemRef child)
   assert(child != NULL);
 
   EPUB3TocItemRetain(child);
-  EPUB3TocItemChildListItemPtr itemPtr = (EPUB3TocItemChildListItemPtr) calloc(1, sizeof(struct EPUB3TocItemChildListItem));
+  EPUB3TocItemChildListItemPtr itemPtr = (EPUB3TocItemChildListItemPtr) EPUB3Calloc(1, sizeof(struct EPUB3TocItemChildListItem));
   itemPtr->item = child;
 
   if(parent->childrenHead == NULL) {
@@ -553,7 +791,7 @@ void EPUB3MetadataRelease(EPUB3MetadataRef metadata)
 
 EPUB3MetadataRef EPUB3MetadataCreate()
 {
-  EPUB3MetadataRef memory = malloc(sizeof(struct EPUB3Metadata));
+  EPUB3MetadataRef memory = EPUB3Malloc(sizeof(struct EPUB3Metadata));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3MetadataTypeID);
   memory->ncxItem = NULL;
   memory->title = NULL;
@@ -662,7 +900,7 @@ void EPUB3ManifestItemRelease(EPUB3ManifestItemRef item)
 
 EPUB3ManifestRef EPUB3ManifestCreate()
 {
-  EPUB3ManifestRef memory = malloc(sizeof(struct EPUB3Manifest));
+  EPUB3ManifestRef memory = EPUB3Malloc(sizeof(struct EPUB3Manifest));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3ManifestTypeID);
   memory->itemCount = 0;
   for(int i = 0; i < MANIFEST_HASH_SIZE; i++) {
@@ -673,7 +911,7 @@ EPUB3ManifestRef EPUB3ManifestCreate()
 
 EPUB3ManifestItemRef EPUB3ManifestItemCreate()
 {
-  EPUB3ManifestItemRef memory = malloc(sizeof(struct EPUB3ManifestItem));
+  EPUB3ManifestItemRef memory = EPUB3Malloc(sizeof(struct EPUB3ManifestItem));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3ManifestItemTypeID);
   memory->itemId = NULL;
   memory->href = NULL;
@@ -691,7 +929,7 @@ void EPUB3ManifestInsertItem(EPUB3ManifestRef manifest, EPUB3ManifestItemRef ite
   EPUB3ManifestItemRetain(item);
   EPUB3ManifestItemListItemPtr itemPtr = EPUB3ManifestFindItemWithId(manifest, item->itemId);
   if(itemPtr == NULL) {
-    itemPtr = (EPUB3ManifestItemListItemPtr) malloc(sizeof(struct EPUB3ManifestItemListItem));
+    itemPtr = (EPUB3ManifestItemListItemPtr) EPUB3Malloc(sizeof(struct EPUB3ManifestItemListItem));
     int32_t bucket = SuperFastHash(item->itemId, (int32_t)strlen(item->itemId)) % MANIFEST_HASH_SIZE;
     itemPtr->item = item;
     itemPtr->next = manifest->itemTable[bucket];
@@ -716,13 +954,30 @@ EPUB3ManifestItemRef EPUB3ManifestCopyItemWithId(EPUB3ManifestRef manifest, cons
 
   EPUB3ManifestItemRef item = itemPtr->item;
   EPUB3ManifestItemRef copy = EPUB3ManifestItemCreate();
-  copy->itemId = item->itemId != NULL ? strdup(item->itemId) : NULL;
-  copy->href = item->href != NULL ? strdup(item->href) : NULL;
-  copy->mediaType = item->mediaType != NULL ? strdup(item->mediaType) : NULL;
-  copy->properties = item->properties != NULL ? strdup(item->properties) : NULL;
+  copy->itemId = item->itemId != NULL ? EPUB3Strdup(item->itemId) : NULL;
+  copy->href = item->href != NULL ? EPUB3Strdup(item->href) : NULL;
+  copy->mediaType = item->mediaType != NULL ? EPUB3Strdup(item->mediaType) : NULL;
+  copy->properties = item->properties != NULL ? EPUB3Strdup(item->properties) : NULL;
   return copy;
 }
 
+EPUB3Bool EPUB3ManifestItemHasProperty(EPUB3ManifestItemRef item, const char * property)
+{
+  assert(item != NULL);
+  assert(property != NULL);
+
+  if(item->properties == NULL) return kEPUB3_NO;
+  size_t propertyLength = strlen(property);
+  const char * cursor = item->properties;
+  while(*cursor != '\0') {
+    cursor += strspn(cursor, " \t\r\n");
+    size_t length = strcspn(cursor, " \t\r\n");
+    if(length == propertyLength && strncmp(cursor, property, length) == 0) return kEPUB3_YES;
+    cursor += length;
+  }
+  return kEPUB3_NO;
+}
+
 EPUB3ManifestItemListItemPtr EPUB3ManifestFindItemWithId(EPUB3ManifestRef manifest, const char * itemId)
 {
   assert(manifest != NULL);
@@ -743,7 +998,7 @@ EPUB3ManifestItemListItemPtr EPUB3ManifestFindItemWithId(EPUB3ManifestRef manife
 
 EPUB3SpineRef EPUB3SpineCreate()
 {
-  EPUB3SpineRef memory = malloc(sizeof(struct EPUB3Spine));
+  EPUB3SpineRef memory = EPUB3Malloc(sizeof(struct EPUB3Spine));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3SpineTypeID);
   memory->itemCount = 0;
   memory->linearItemCount = 0;
@@ -785,7 +1040,7 @@ void EPUB3SpineRelease(EPUB3SpineRef spine)
 
 EPUB3SpineItemRef EPUB3SpineItemCreate()
 {
-  EPUB3SpineItemRef memory = malloc(sizeof(struct EPUB3SpineItem));
+  EPUB3SpineItemRef memory = EPUB3Malloc(sizeof(struct EPUB3SpineItem));
   memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3SpineItemTypeID);
   memory->isLinear = kEPUB3_NO;
   memory->idref = NULL;
@@ -815,7 +1070,7 @@ void EPUB3SpineItemSetManifestItem(EPUB3SpineItemRef spineItem, EPUB3ManifestIte
 {
   assert(spineItem != NULL);
   spineItem->manifestItem = manifestItem;
-  spineItem->idref = strdup(manifestItem->itemId);
+  spineItem->idref = EPUB3Strdup(manifestItem->itemId);
 }
 
 void EPUB3SpineAppendItem(EPUB3SpineRef spine, EPUB3SpineItemRef item)
@@ -824,7 +1079,7 @@ void EPUB3SpineAppendItem(EPUB3SpineRef spine, EPUB3SpineItemRef item)
   assert(item != NULL);
 
   EPUB3SpineItemRetain(item);
-  EPUB3SpineItemListItemPtr itemPtr = (EPUB3SpineItemListItemPtr) calloc(1, sizeof(struct EPUB3SpineItemListItem));
+  EPUB3SpineItemListItemPtr itemPtr = (EPUB3SpineItemListItemPtr) EPUB3Calloc(1, sizeof(struct EPUB3SpineItemListItem));
   itemPtr->item = item;
 
   if(spine->head == NULL) {
@@ -877,12 +1132,12 @@ EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename)
     if(error == kEPUB3Success) { //&& epub->metadata->version == kEPUB3Version_2) {
     // Parse NCX only if this is a v2 epub (per the EPUB 3 spec)
     if(epub->metadata->ncxItem != NULL) {
-      char * ncxPath = strdup(epub->metadata->ncxItem->href);
+      char * ncxPath = EPUB3Strdup(epub->metadata->ncxItem->href);
       if(*ncxPath != '/') {
         char * opfRoot = EPUB3CopyOfPathByDeletingLastPathComponent(opfFilename);
         char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(opfRoot, ncxPath);
-        free(ncxPath);
-        free(opfRoot);
+        EPUB3Free(ncxPath);
+        EPUB3Free(opfRoot);
         ncxPath = fullPath;
       }
       bufferSize = 0;
@@ -890,7 +1145,7 @@ EPUB3Error EPUB3InitFromOPF(EPUB3Ref epub, const char * opfFilename)
       if(error == kEPUB3Success) {
         error = EPUB3ParseNCXFromData(epub, buffer, bufferSize);
       }
-      free(ncxPath);
+      EPUB3Free(ncxPath);
       EPUB3_FREE_AND_NULL(buffer);
     }
   }
@@ -986,7 +1241,7 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForMetadataInOPF(EPUB3Ref epub, xmlTextReade
     }
     case XML_READER_TYPE_TEXT:
     {
-      const xmlChar *value = xmlTextReaderValue(reader);
+      const xmlChar *value = xmlTextReaderConstValue(reader);
       if(value != NULL && (*context)->shouldParseTextNode) {
         if(xmlStrcmp((*context)->tagName, BAD_CAST "title") == 0) {
           (void)EPUB3MetadataSetTitle(epub->metadata, (const char *)value);
@@ -1028,21 +1283,13 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForManifestInOPF(EPUB3Ref epub, xmlTextReade
       } else {
         if(xmlStrcmp(name, BAD_CAST "item") == 0) {
           EPUB3ManifestItemRef newItem = EPUB3ManifestItemCreate();
-          newItem->itemId = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "id");
-          newItem->href = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "href");
-          newItem->mediaType = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "media-type");
-          newItem->properties = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "properties");
-
-          if(newItem->properties != NULL) {
-            // Look for the cover-image property
-            char *prop, *props, *tofree;
-            tofree = props = strdup(newItem->properties);
-            while((prop = strsep(&props, " ")) != NULL) {
-              if(strcmp(prop, "cover-image") == 0) {
-                EPUB3MetadataSetCoverImageId(epub->metadata, newItem->itemId);
-              }
-            }
-            EPUB3_FREE_AND_NULL(tofree);
+          newItem->itemId = EPUB3CopyXMLAttribute(reader, "id");
+          newItem->href = EPUB3CopyXMLAttribute(reader, "href");
+          newItem->mediaType = EPUB3CopyXMLAttribute(reader, "media-type");
+          newItem->properties = EPUB3CopyXMLAttribute(reader, "properties");
+
+          if(EPUB3ManifestItemHasProperty(newItem, "cover-image")) {
+            EPUB3MetadataSetCoverImageId(epub->metadata, newItem->itemId);
           }
           if(newItem->mediaType != NULL && strcmp(newItem->mediaType, "application/x-dtbncx+xml") == 0) {
             //This is the ref for the ncx document. Set it for v2 epubs
@@ -1094,7 +1341,7 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForSpineInOPF(EPUB3Ref epub, xmlTextReaderPt
             epub->spine->linearItemCount++;
           }
           EPUB3_XML_FREE_AND_NULL(linear);
-          newItem->idref = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "idref");
+          newItem->idref = EPUB3CopyXMLAttribute(reader, "idref");
           if(newItem->idref != NULL) {
             EPUB3ManifestItemListItemPtr manifestPtr = EPUB3ManifestFindItemWithId(epub->manifest, newItem->idref);
             if(manifestPtr == NULL) {
@@ -1141,7 +1388,7 @@ EPUB3Error EPUB3ParseXMLReaderNodeForOPF(EPUB3Ref epub, xmlTextReaderPtr reader,
         if(currentNodeType == XML_READER_TYPE_ELEMENT) {
           if(xmlStrcmp(name, BAD_CAST "package") == 0 && xmlTextReaderHasAttributes(reader)) {
             EPUB3_FREE_AND_NULL(epub->metadata->_uniqueIdentifierID);
-            epub->metadata->_uniqueIdentifierID = (char *)xmlTextReaderGetAttribute(reader, BAD_CAST "unique-identifier");
+            epub->metadata->_uniqueIdentifierID = EPUB3CopyXMLAttribute(reader, "unique-identifier");
             xmlChar *versionString = xmlTextReaderGetAttribute(reader, BAD_CAST "version");
             if(versionString != NULL) {
               if(*versionString == '2') {
@@ -1229,7 +1476,6 @@ EPUB3Error EPUB3ParseOPFFromData(EPUB3Ref epub, void * buffer, uint32_t bufferSi
     error = kEPUB3XMLReadFromBufferError;
   }
   xmlFreeTextReader(reader);
-  xmlCleanupParser();
   return error;
 }
 
@@ -1272,7 +1518,6 @@ EPUB3Error EPUB3ParseNCXFromData(EPUB3Ref epub, void * buffer, uint32_t bufferSi
     error = kEPUB3XMLReadFromBufferError;
   }
   xmlFreeTextReader(reader);
-  xmlCleanupParser();
   return error;
 }
 
@@ -1340,11 +1585,14 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForNavMapInNCX(EPUB3Ref epub, xmlTextReaderP
         else if(xmlStrcmp(name, BAD_CAST "content") == 0) {
             void * userInfo = (*context)->userInfo;
             (void)EPUB3SaveParseContext(context, kEPUB3NCXStateNavMap, name, 0, NULL, kEPUB3_NO, userInfo);
-            const xmlChar *value = xmlTextReaderGetAttribute(reader, BAD_CAST "src");
+            char *value = EPUB3CopyXMLAttribute(reader, "src");
             if(value != NULL) {
                 EPUB3TocItemRef tocItem = (EPUB3TocItemRef)userInfo;
                 if(tocItem != NULL) {
-                    tocItem->href = strdup((const char *)value);
+                    EPUB3_FREE_AND_NULL(tocItem->href);
+                    tocItem->href = value;
+                } else {
+                    EPUB3_FREE_AND_NULL(value);
                 }
             }
         }
@@ -1357,12 +1605,12 @@ EPUB3Error EPUB3ProcessXMLReaderNodeForNavMapInNCX(EPUB3Ref epub, xmlTextReaderP
     case XML_READER_TYPE_TEXT:
     {
       if((*context)->shouldParseTextNode) {
-        const xmlChar *value = xmlTextReaderValue(reader);
+        const xmlChar *value = xmlTextReaderConstValue(reader);
         if(value != NULL) {
           if(xmlStrcmp((*context)->tagName, BAD_CAST "text") == 0) {
             EPUB3TocItemRef tocItem = (EPUB3TocItemRef) (*context)->userInfo;
             if(tocItem != NULL) {
-              tocItem->title = strdup((const char *)value);
+              tocItem->title = EPUB3Strdup((const char *)value);
             }
           }
         }
@@ -1393,29 +1641,56 @@ EPUB3Error EPUB3ValidateMimetype(EPUB3Ref epub)
 {
   assert(epub != NULL);
 
-  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+  if(epub->archive == NULL || epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
 
-  EPUB3Error status = kEPUB3InvalidMimetypeError;
-  static const char * requiredMimetype = "application/epub+zip";
-  static const int stringLength = 20;
-  char buffer[stringLength];
-
-  if(unzGoToFirstFile(epub->archive) == UNZ_OK) {
-    uint32_t stringLength = (uint32_t)strlen(requiredMimetype);
-    if(unzOpenCurrentFile(epub->archive) == UNZ_OK) {
-      int byteCount = unzReadCurrentFile(epub->archive, buffer, stringLength);
-      if(byteCount == stringLength) {
-        if(strncmp(requiredMimetype, buffer, stringLength) == 0) {
-          status = kEPUB3Success;
-        }
+  // The mimetype entry is checked in place, without inflating anything
+  EPUB3SniffClassification classification = kEPUB3SniffUnreadable;
+  if(epub->recoveredArchive != NULL) {
+    // The end records of a recovered archive are damaged, so only its head is checked
+    int fd = open(epub->archivePath, O_RDONLY);
+    if(fd >= 0) {
+      struct stat st;
+      if(fstat(fd, &st) == 0) {
+        classification = EPUB3SniffHead(fd, (uint64_t)st.st_size);
       }
+      (void)close(fd);
     }
-    unzCloseCurrentFile(epub->archive);
+  } else {
+    classification = EPUB3Sniff(epub->archivePath, NULL);
   }
-  return status;
+  if(classification == kEPUB3SniffUnreadable) return kEPUB3ArchiveUnavailableError;
+  return classification == kEPUB3SniffEPUB ? kEPUB3Success : kEPUB3InvalidMimetypeError;
 }
 
-EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** rootPath)
+static const char * kEPUB3RenditionNamespace = "http://www.idpf.org/2013/rendition";
+
+static char * _EPUB3CopyRenditionAttribute(xmlTextReaderPtr reader, const char * name)
+{
+  xmlChar * value = xmlTextReaderGetAttributeNs(reader, BAD_CAST name, BAD_CAST kEPUB3RenditionNamespace);
+  if(value == NULL) return NULL;
+  char * copy = EPUB3Strdup((const char *)value);
+  xmlFree(value);
+  return copy;
+}
+
+static void _EPUB3RenditionFinalize(EPUB3Rendition * rendition)
+{
+  EPUB3_FREE_AND_NULL(rendition->path);
+  EPUB3_FREE_AND_NULL(rendition->mediaType);
+  EPUB3_FREE_AND_NULL(rendition->rootFileDirectory);
+  EPUB3_FREE_AND_NULL(rendition->media);
+  EPUB3_FREE_AND_NULL(rendition->layout);
+  EPUB3_FREE_AND_NULL(rendition->language);
+  EPUB3_FREE_AND_NULL(rendition->accessMode);
+  EPUB3_FREE_AND_NULL(rendition->label);
+  EPUB3MetadataRelease(rendition->metadata);
+  EPUB3ManifestRelease(rendition->manifest);
+  EPUB3SpineRelease(rendition->spine);
+  EPUB3TocRelease(rendition->toc);
+}
+
+// Every rootfile, in order: the first is the default rendition. Done once per book.
+EPUB3Error EPUB3ParseContainer(EPUB3Ref epub)
 {
   assert(epub != NULL);
 
@@ -1428,7 +1703,9 @@ EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** root
   uint32_t bytesCopied;
 
   xmlTextReaderPtr reader = NULL;
-  EPUB3Bool foundPath = kEPUB3_NO;
+  EPUB3Rendition * renditions = NULL;
+  int32_t renditionCount = 0;
+  EPUB3Bool foundRootFile = kEPUB3_NO;
 
   EPUB3Error error = kEPUB3Success;
 
@@ -1443,24 +1720,30 @@ EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** root
         const xmlChar *name = xmlTextReaderConstLocalName(reader);
 
         if(xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT && xmlStrcmp(name, BAD_CAST rootFileName) == 0) {
-          xmlChar *fullPath = xmlTextReaderGetAttribute(reader, BAD_CAST "full-path");
-          if(fullPath != NULL) {
-            // TODD: validate that the full-path attribute is of the form path-rootless
-            //       see http://idpf.org/epub/30/spec/epub30-ocf.html#sec-container-metainf-container.xml
-            foundPath = kEPUB3_YES;
-            *rootPath = strdup((char *)fullPath);
-          } else {
-            // The spec requires the full-path attribute
-            error = kEPUB3XMLXDocumentInvalidError;
-          }
-          break;
+          foundRootFile = kEPUB3_YES;
+          char *fullPath = EPUB3CopyXMLAttribute(reader, "full-path");
+          // TODD: validate that the full-path attribute is of the form path-rootless
+          //       see http://idpf.org/epub/30/spec/epub30-ocf.html#sec-container-metainf-container.xml
+          if(fullPath == NULL) continue;
+          renditions = EPUB3Realloc(renditions, (renditionCount + 1) * sizeof(EPUB3Rendition));
+          EPUB3Rendition * rendition = &renditions[renditionCount++];
+          (void)memset(rendition, 0, sizeof(EPUB3Rendition));
+          rendition->path = fullPath;
+          rendition->rootFileDirectory = EPUB3CopyOfPathByDeletingLastPathComponent(fullPath);
+          rendition->mediaType = EPUB3CopyXMLAttribute(reader, "media-type");
+          rendition->media = _EPUB3CopyRenditionAttribute(reader, "media");
+          rendition->layout = _EPUB3CopyRenditionAttribute(reader, "layout");
+          rendition->language = _EPUB3CopyRenditionAttribute(reader, "language");
+          rendition->accessMode = _EPUB3CopyRenditionAttribute(reader, "accessMode");
+          rendition->label = _EPUB3CopyRenditionAttribute(reader, "label");
         }
       }
       if(retVal < 0) {
         error = kEPUB3XMLParseError;
       }
-      if(!foundPath) {
-        error = kEPUB3XMLXElementNotFoundError;
+      if(renditionCount == 0) {
+        // The spec requires the full-path attribute
+        error = foundRootFile ? kEPUB3XMLXDocumentInvalidError : kEPUB3XMLXElementNotFoundError;
       }
     } else {
       error = kEPUB3XMLReadFromBufferError;
@@ -1468,9 +1751,170 @@ EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** root
     EPUB3_FREE_AND_NULL(buffer);
   }
   xmlFreeTextReader(reader);
+
+  if(error != kEPUB3Success) {
+    for(int32_t i = 0; i < renditionCount; i++) {
+      _EPUB3RenditionFinalize(&renditions[i]);
+    }
+    EPUB3_FREE_AND_NULL(renditions);
+    return error;
+  }
+  // A book opened from a snapshot already holds the objects of the rendition it was saved with
+  if(epub->selectedRendition >= renditionCount) {
+    for(int32_t i = 0; i < renditionCount; i++) {
+      _EPUB3RenditionFinalize(&renditions[i]);
+    }
+    EPUB3_FREE_AND_NULL(renditions);
+    return kEPUB3SnapshotInvalidError;
+  }
+  epub->renditions = renditions;
+  epub->renditionCount = renditionCount;
+  return kEPUB3Success;
+}
+
+void EPUB3RenditionsFree(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+
+  for(int32_t i = 0; i < epub->renditionCount; i++) {
+    _EPUB3RenditionFinalize(&epub->renditions[i]);
+  }
+  EPUB3_FREE_AND_NULL(epub->renditions);
+  epub->renditionCount = 0;
+}
+
+EXPORT EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** rootPath)
+{
+  assert(epub != NULL);
+
+  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3Error error = epub->renditions == NULL ? EPUB3ParseContainer(epub) : kEPUB3Success;
+  if(error == kEPUB3Success) {
+    *rootPath = EPUB3Strdup(epub->renditions[epub->selectedRendition].path);
+  }
   return error;
 }
 
+EXPORT int32_t EPUB3CountOfRenditions(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+
+  if(epub->renditions == NULL && epub->archive != NULL) {
+    (void)EPUB3ParseContainer(epub);
+  }
+  return epub->renditionCount;
+}
+
+EXPORT EPUB3Error EPUB3GetRenditionInfo(EPUB3Ref epub, int32_t index, EPUB3RenditionInfo * info)
+{
+  assert(epub != NULL);
+  assert(info != NULL);
+
+  if(index < 0 || index >= EPUB3CountOfRenditions(epub)) return kEPUB3InvalidArgumentError;
+
+  const EPUB3Rendition * rendition = &epub->renditions[index];
+  info->path = rendition->path;
+  info->mediaType = rendition->mediaType;
+  info->media = rendition->media;
+  info->layout = rendition->layout;
+  info->language = rendition->language;
+  info->accessMode = rendition->accessMode;
+  info->label = rendition->label;
+  return kEPUB3Success;
+}
+
+EXPORT int32_t EPUB3GetSelectedRendition(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+  return epub->selectedRendition;
+}
+
+// The selected rendition's objects hold a reference for each reference to epub (see EPUB3Retain), a
+// parked one just the one
+static void _EPUB3ParkRendition(EPUB3Ref epub, EPUB3Rendition * rendition)
+{
+  for(uint32_t i = 1; i < epub->_type.refCount; i++) {
+    EPUB3MetadataRelease(epub->metadata);
+    EPUB3ManifestRelease(epub->manifest);
+    EPUB3SpineRelease(epub->spine);
+  }
+  rendition->metadata = epub->metadata;
+  rendition->manifest = epub->manifest;
+  rendition->spine = epub->spine;
+  rendition->toc = epub->toc;
+  epub->metadata = NULL;
+  epub->manifest = NULL;
+  epub->spine = NULL;
+  epub->toc = NULL;
+}
+
+static void _EPUB3UnparkRendition(EPUB3Ref epub, EPUB3Rendition * rendition)
+{
+  epub->metadata = rendition->metadata;
+  epub->manifest = rendition->manifest;
+  epub->spine = rendition->spine;
+  epub->toc = rendition->toc;
+  rendition->metadata = NULL;
+  rendition->manifest = NULL;
+  rendition->spine = NULL;
+  rendition->toc = NULL;
+  for(uint32_t i = 1; i < epub->_type.refCount; i++) {
+    EPUB3MetadataRetain(epub->metadata);
+    EPUB3ManifestRetain(epub->manifest);
+    EPUB3SpineRetain(epub->spine);
+  }
+}
+
+EXPORT EPUB3Error EPUB3SelectRendition(EPUB3Ref epub, int32_t index)
+{
+  assert(epub != NULL);
+
+  if(index < 0 || index >= EPUB3CountOfRenditions(epub)) return kEPUB3InvalidArgumentError;
+  if(index == epub->selectedRendition) return kEPUB3Success;
+  // Other holders of a shared book rely on what it shows
+  if(epub->cacheEntry != NULL) return kEPUB3InvalidArgumentError;
+
+  EPUB3Rendition * rendition = &epub->renditions[index];
+  if(rendition->mediaType != NULL && strcmp(rendition->mediaType, RENDITION_PACKAGE_MEDIA_TYPE) != 0) return kEPUB3InvalidArgumentError;
+
+  EPUB3Rendition * previous = &epub->renditions[epub->selectedRendition];
+  _EPUB3ParkRendition(epub, previous);
+
+  EPUB3Error error = kEPUB3Success;
+  if(rendition->metadata != NULL) {
+    _EPUB3UnparkRendition(epub, rendition);
+  } else {
+    error = EPUB3InitFromOPF(epub, rendition->path);
+    if(error == kEPUB3Success) {
+      // Fresh objects hold one reference each, like a parked rendition's
+      EPUB3Rendition built;
+      (void)memset(&built, 0, sizeof(built));
+      built.metadata = epub->metadata;
+      built.manifest = epub->manifest;
+      built.spine = epub->spine;
+      built.toc = epub->toc;
+      _EPUB3UnparkRendition(epub, &built);
+    } else {
+      EPUB3MetadataRelease(epub->metadata);
+      EPUB3ManifestRelease(epub->manifest);
+      EPUB3SpineRelease(epub->spine);
+      EPUB3TocRelease(epub->toc);
+      epub->metadata = NULL;
+      epub->manifest = NULL;
+      epub->spine = NULL;
+      epub->toc = NULL;
+      _EPUB3UnparkRendition(epub, previous);
+      return error;
+    }
+  }
+
+  epub->selectedRendition = index;
+  EPUB3_FREE_AND_NULL(epub->rootFileDirectory);
+  epub->rootFileDirectory = EPUB3Strdup(rendition->rootFileDirectory);
+  return kEPUB3Success;
+}
+
 EPUB3Error EPUB3ValidateFileExistsAndSeekInArchive(EPUB3Ref epub, const char * filename)
 {
   assert(epub != NULL);
@@ -1544,7 +1988,7 @@ EXPORT EPUB3Error EPUB3ExtractArchiveToPath(EPUB3Ref epub, const char * path)
 EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path)
 {
   EPUB3Error error = kEPUB3Success;
-  char * pathCopy = strdup(path);
+  char * pathCopy = EPUB3Strdup(path);
   char pathBuildup[strlen(path) + 1];
   pathBuildup[0] = '\0';
   char * pathseg;
@@ -1588,9 +2032,9 @@ EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path)
 EPUB3Error EPUB3WriteCurrentArchiveFileToPath(EPUB3Ref epub, const char * path)
 {
   EPUB3Error error = kEPUB3Success;
-  unz_file_info fileInfo;
+  unz_file_info64 fileInfo;
   char filename[MAXNAMLEN];
-  if(unzGetCurrentFileInfo(epub->archive, &fileInfo, filename, MAXNAMLEN, NULL, 0, NULL, 0) == UNZ_OK) {
+  if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, filename, MAXNAMLEN, NULL, 0, NULL, 0) == UNZ_OK) {
     uLong pathlen = strlen(path) + 1U + strlen(filename) + 1U;
     char fullpath[pathlen];
     (void)strcpy(fullpath, path);
@@ -1614,7 +2058,7 @@ EPUB3Error EPUB3WriteCurrentArchiveFileToPath(EPUB3Ref epub, const char * path)
       }
     }
     if(destination != NULL) {
-      void *buffer = malloc(FILE_EXTRACT_BUFFER_SIZE);
+      void *buffer = EPUB3Malloc(FILE_EXTRACT_BUFFER_SIZE);
       if(unzOpenCurrentFile(epub->archive) == UNZ_OK) {
         int bytesRead;
         do {
@@ -1645,32 +2089,28 @@ EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *buffe
 
   EPUB3Error error = kEPUB3InvalidArgumentError;
   if(filename != NULL) {
-    uint32_t bufSize = 1;
-    error = EPUB3GetUncompressedSizeOfFileInArchive(epub, &bufSize, filename);
+    // The archive handle is shared with EPUB3GetArchiveEntry, which another thread may be in
+    (void)pthread_mutex_lock(&epub->entryLock);
+    error = EPUB3ValidateFileExistsAndSeekInArchive(epub, filename);
+    uint32_t copied = 0;
     if(error == kEPUB3Success) {
-      if(unzOpenCurrentFile(epub->archive) == UNZ_OK) {
-        *buffer = calloc(bufSize, sizeof(char));
-        int32_t copied = unzReadCurrentFile(epub->archive, *buffer, bufSize);
-        if(copied >= 0) {
-          if(bytesCopied != NULL) {
-            *bytesCopied = copied;
-          }
-          if(bufferSize != NULL) {
-            *bufferSize = bufSize;
-          }
-          error = kEPUB3Success;
-        } else {
-          free(*buffer);
-          *buffer = NULL;
-          error = kEPUB3FileReadFromArchiveError;
-        }
+      // One extra zero byte past the end, so text files can be handed around as C strings
+      error = EPUB3CopyCurrentArchiveFileIntoBuffer(epub->archive, epub->verifiesReads, 1U, buffer, &copied);
+    }
+    (void)pthread_mutex_unlock(&epub->entryLock);
+    if(error == kEPUB3Success) {
+      if(bytesCopied != NULL) {
+        *bytesCopied = copied;
+      }
+      if(bufferSize != NULL) {
+        *bufferSize = copied;
       }
     }
   }
   return error;
 }
 
-EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *uncompressedSize, const char *filename)
+EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint64_t *uncompressedSize, const char *filename)
 {
   assert(epub != NULL);
   assert(filename != NULL);
@@ -1680,9 +2120,9 @@ EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *unco
 
   EPUB3Error error = EPUB3ValidateFileExistsAndSeekInArchive(epub, filename);
   if(error == kEPUB3Success) {
-    unz_file_info fileInfo;
-    if(unzGetCurrentFileInfo(epub->archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) == UNZ_OK) {
-      *uncompressedSize = (uint32_t)fileInfo.uncompressed_size;
+    unz_file_info64 fileInfo;
+    if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) == UNZ_OK) {
+      *uncompressedSize = fileInfo.uncompressed_size;
       error = kEPUB3Success;
     }
   }
@@ -1691,8 +2131,8 @@ EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *unco
 
 uint32_t EPUB3GetFileCountInArchive(EPUB3Ref epub)
 {
-  unz_global_info gi;
-	int err = unzGetGlobalInfo(epub->archive, &gi);
+  unz_global_info64 gi;
+	int err = unzGetGlobalInfo64(epub->archive, &gi);
 	if (err != UNZ_OK)
     return err;
 
@@ -1703,7 +2143,7 @@ char * EPUB3CopyOfPathByDeletingLastPathComponent(const char * path)
 {
   assert(path != NULL);
 
-  char * pathCopy = strdup(path);
+  char * pathCopy = EPUB3Strdup(path);
   char pathBuildup[strlen(path) + 1];
   pathBuildup[0] = '\0';
   char * pathseg;
@@ -1722,7 +2162,7 @@ char * EPUB3CopyOfPathByDeletingLastPathComponent(const char * path)
   }
   EPUB3_FREE_AND_NULL(pathCopy);
 
-  return strdup(pathBuildup);
+  return EPUB3Strdup(pathBuildup);
 }
 
 char * EPUB3CopyOfPathByAppendingPathComponent(const char * path, const char * componentToAppend)
@@ -1746,6 +2186,1917 @@ char * EPUB3CopyOfPathByAppendingPathComponent(const char * path, const char * c
     (void)strncat(fullpath, "/", 1U);
   }
   (void)strncat(fullpath, componentToAppend, strlen(componentToAppend));
-  return strdup(fullpath);
+  return EPUB3Strdup(fullpath);
+}
+
+#pragma mark - Resources
+
+static uint64_t _EPUB3ResourceCacheByteBudget = 0;
+static EPUB3ResourceCacheStorage _EPUB3ResourceCacheStorage = kEPUB3ResourceCacheStoreInflated;
+
+EPUB3ResourceRef EPUB3ResourceCreateWithBytes(void * bytes, uint32_t byteCount)
+{
+  EPUB3ResourceRef memory = EPUB3Malloc(sizeof(struct EPUB3Resource));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3ResourceTypeID);
+  memory->bytes = bytes;
+  memory->byteCount = byteCount;
+  return memory;
+}
+
+// Resources are shared between threads, so unlike the other objects their ref count is updated atomically.
+EXPORT void EPUB3ResourceRetain(EPUB3ResourceRef resource)
+{
+  if(resource == NULL) return;
+  (void)__sync_add_and_fetch(&resource->_type.refCount, 1);
+}
+
+EXPORT void EPUB3ResourceRelease(EPUB3ResourceRef resource)
+{
+  if(resource == NULL) return;
+  if(__sync_sub_and_fetch(&resource->_type.refCount, 1) == 0) {
+    EPUB3_FREE_AND_NULL(resource->bytes);
+    EPUB3_FREE_AND_NULL(resource);
+  }
+}
+
+EXPORT const void * EPUB3ResourceGetBytes(EPUB3ResourceRef resource)
+{
+  assert(resource != NULL);
+  return resource->bytes;
+}
+
+EXPORT uint32_t EPUB3ResourceGetByteCount(EPUB3ResourceRef resource)
+{
+  assert(resource != NULL);
+  return resource->byteCount;
+}
+
+static EPUB3Bool _EPUB3ResourceMatchesEntryCRC(EPUB3Ref epub, const char * path, const void * bytes, uint32_t byteCount)
+{
+  EPUB3ArchiveEntryPtr entry = NULL;
+  if(EPUB3GetArchiveEntry(epub, path, &entry) != kEPUB3Success) return kEPUB3_NO;
+  return EPUB3CRC32(0, bytes, byteCount) == entry->crc;
+}
+
+EXPORT EPUB3ResourceRef EPUB3CopyResource(EPUB3Ref epub, const char * path, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  EPUB3Error status = kEPUB3Success;
+  EPUB3ResourceRef resource = NULL;
+  if(epub->prefetcher != NULL) {
+    // The prefetcher drops anything that fails its CRC, so pooled bytes are always verified
+    resource = EPUB3PrefetcherCopyPooledResource(epub->prefetcher, path);
+  }
+  if(resource == NULL) {
+    EPUB3ArchiveEntryPtr entry = NULL;
+    if(!epub->verifiesReads) {
+      resource = EPUB3ResourceCacheCopyResource(&epub->archiveIdentity, path, kEPUB3_NO, 0);
+    } else if(EPUB3GetArchiveEntry(epub, path, &entry) == kEPUB3Success) {
+      // Another book on the same file may have cached these bytes without checking them
+      resource = EPUB3ResourceCacheCopyResource(&epub->archiveIdentity, path, kEPUB3_YES, entry->crc);
+    }
+  }
+  if(resource == NULL && _EPUB3ResourceCacheStorage == kEPUB3ResourceCacheStoreCompressed && __sync_add_and_fetch(&_EPUB3ResourceCacheByteBudget, 0) > 0) {
+    void * raw = NULL;
+    uint32_t compressedSize = 0;
+    uint32_t uncompressedSize = 0;
+    int method = 0;
+    status = EPUB3CopyRawFileIntoBuffer(epub, &raw, &compressedSize, &uncompressedSize, &method, path);
+    if(status == kEPUB3Success && method == 0 && epub->verifiesReads && !_EPUB3ResourceMatchesEntryCRC(epub, path, raw, compressedSize)) {
+      EPUB3_FREE_AND_NULL(raw);
+      status = kEPUB3FileChecksumError;
+    }
+    if(status == kEPUB3Success) {
+      if(method == 0) {
+        // Stored entries are their own "compressed" form; share them like inflated ones.
+        resource = EPUB3ResourceCreateWithBytes(raw, compressedSize);
+        EPUB3ResourceCacheInsertResource(&epub->archiveIdentity, path, resource, kEPUB3_NO, compressedSize, epub->verifiesReads);
+      } else {
+        void * bytes = EPUB3Malloc(uncompressedSize > 0 ? uncompressedSize : 1U);
+        status = EPUB3InflateRawBuffer(raw, compressedSize, bytes, uncompressedSize);
+        if(status == kEPUB3Success && epub->verifiesReads && !_EPUB3ResourceMatchesEntryCRC(epub, path, bytes, uncompressedSize)) {
+          status = kEPUB3FileChecksumError;
+        }
+        if(status == kEPUB3Success) {
+          EPUB3ResourceRef compressed = EPUB3ResourceCreateWithBytes(raw, compressedSize);
+          EPUB3ResourceCacheInsertResource(&epub->archiveIdentity, path, compressed, kEPUB3_YES, uncompressedSize, epub->verifiesReads);
+          EPUB3ResourceRelease(compressed);
+          resource = EPUB3ResourceCreateWithBytes(bytes, uncompressedSize);
+        } else {
+          EPUB3_FREE_AND_NULL(raw);
+          EPUB3_FREE_AND_NULL(bytes);
+        }
+      }
+    }
+  }
+  else if(resource == NULL) {
+    void * buffer = NULL;
+    uint32_t bufferSize = 0;
+    uint32_t bytesCopied = 0;
+    status = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, path);
+    if(status == kEPUB3Success) {
+      resource = EPUB3ResourceCreateWithBytes(buffer, bytesCopied);
+      EPUB3ResourceCacheInsertResource(&epub->archiveIdentity, path, resource, kEPUB3_NO, bytesCopied, epub->verifiesReads);
+    }
+  }
+  if(error != NULL) {
+    *error = status;
+  }
+  return resource;
+}
+
+#pragma mark - Resource Cache
+
+static EPUB3ResourceCacheShard _EPUB3ResourceCacheShards[RESOURCE_CACHE_SHARD_COUNT];
+static pthread_once_t _EPUB3ResourceCacheOnce = PTHREAD_ONCE_INIT;
+
+static void _EPUB3ResourceCacheInitialize(void)
+{
+  for(int i = 0; i < RESOURCE_CACHE_SHARD_COUNT; i++) {
+    EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[i];
+    (void)memset(shard, 0, sizeof(EPUB3ResourceCacheShard));
+    (void)pthread_mutex_init(&shard->lock, NULL);
+  }
+}
+
+static inline EPUB3Bool _EPUB3ArchiveIdentityIsEqual(const EPUB3ArchiveIdentity * a, const EPUB3ArchiveIdentity * b)
+{
+  return (a->device == b->device && a->inode == b->inode && a->size == b->size && a->modificationTime == b->modificationTime) ? kEPUB3_YES : kEPUB3_NO;
 }
 
+// Each shard gets an equal slice of the budget so that eviction never has to take more than one lock.
+static inline uint64_t _EPUB3ResourceCacheShardByteBudget(void)
+{
+  return __sync_add_and_fetch(&_EPUB3ResourceCacheByteBudget, 0) / RESOURCE_CACHE_SHARD_COUNT;
+}
+
+uint32_t EPUB3ResourceCacheHashForKey(const EPUB3ArchiveIdentity * identity, const char * path)
+{
+  uint32_t hash = SuperFastHash(path, (int)strlen(path));
+  uint64_t mix = identity->inode ^ (identity->device << 32) ^ identity->size ^ (uint64_t)identity->modificationTime;
+  hash ^= (uint32_t)(mix ^ (mix >> 32)) * 2654435761U;
+  return hash;
+}
+
+static void _EPUB3ResourceCacheShardUnlinkEntry(EPUB3ResourceCacheShard * shard, EPUB3ResourceCacheEntryPtr entry)
+{
+  EPUB3ResourceCacheEntryPtr * link = &shard->table[(entry->hash / RESOURCE_CACHE_SHARD_COUNT) % RESOURCE_CACHE_SHARD_HASH_SIZE];
+  while(*link != NULL && *link != entry) {
+    link = &(*link)->hashNext;
+  }
+  if(*link == entry) {
+    *link = entry->hashNext;
+  }
+
+  if(entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+  else shard->lruHead = entry->lruNext;
+  if(entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+  else shard->lruTail = entry->lruPrev;
+  entry->lruPrev = entry->lruNext = NULL;
+
+  shard->byteCount -= entry->storedByteCount;
+}
+
+static void _EPUB3ResourceCacheEntryFree(EPUB3ResourceCacheEntryPtr entry)
+{
+  EPUB3ResourceRelease(entry->resource);
+  EPUB3_FREE_AND_NULL(entry->path);
+  EPUB3_FREE_AND_NULL(entry);
+}
+
+static void _EPUB3ResourceCacheShardEvict(EPUB3ResourceCacheShard * shard, uint64_t budget)
+{
+  while(shard->byteCount > budget && shard->lruTail != NULL) {
+    EPUB3ResourceCacheEntryPtr victim = shard->lruTail;
+    _EPUB3ResourceCacheShardUnlinkEntry(shard, victim);
+    _EPUB3ResourceCacheEntryFree(victim);
+  }
+}
+
+EXPORT EPUB3Error EPUB3ResourceCacheConfigure(uint64_t byteBudget, EPUB3ResourceCacheStorage storage)
+{
+  if(storage != kEPUB3ResourceCacheStoreInflated && storage != kEPUB3ResourceCacheStoreCompressed) {
+    return kEPUB3InvalidArgumentError;
+  }
+  (void)pthread_once(&_EPUB3ResourceCacheOnce, _EPUB3ResourceCacheInitialize);
+
+  if(storage != _EPUB3ResourceCacheStorage) {
+    EPUB3ResourceCachePurge();
+    _EPUB3ResourceCacheStorage = storage;
+  }
+  (void)__sync_lock_test_and_set(&_EPUB3ResourceCacheByteBudget, byteBudget);
+
+  uint64_t shardBudget = _EPUB3ResourceCacheShardByteBudget();
+  for(int i = 0; i < RESOURCE_CACHE_SHARD_COUNT; i++) {
+    EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[i];
+    (void)pthread_mutex_lock(&shard->lock);
+    _EPUB3ResourceCacheShardEvict(shard, shardBudget);
+    (void)pthread_mutex_unlock(&shard->lock);
+  }
+  return kEPUB3Success;
+}
+
+EXPORT uint64_t EPUB3ResourceCacheGetByteCount(void)
+{
+  (void)pthread_once(&_EPUB3ResourceCacheOnce, _EPUB3ResourceCacheInitialize);
+
+  uint64_t total = 0;
+  for(int i = 0; i < RESOURCE_CACHE_SHARD_COUNT; i++) {
+    EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[i];
+    (void)pthread_mutex_lock(&shard->lock);
+    total += shard->byteCount;
+    (void)pthread_mutex_unlock(&shard->lock);
+  }
+  return total;
+}
+
+EXPORT void EPUB3ResourceCachePurge(void)
+{
+  (void)pthread_once(&_EPUB3ResourceCacheOnce, _EPUB3ResourceCacheInitialize);
+
+  for(int i = 0; i < RESOURCE_CACHE_SHARD_COUNT; i++) {
+    EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[i];
+    (void)pthread_mutex_lock(&shard->lock);
+    _EPUB3ResourceCacheShardEvict(shard, 0);
+    (void)pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+static EPUB3ResourceCacheEntryPtr _EPUB3ResourceCacheShardFindEntry(EPUB3ResourceCacheShard * shard, uint32_t hash, const EPUB3ArchiveIdentity * identity, const char * path)
+{
+  EPUB3ResourceCacheEntryPtr entry = shard->table[(hash / RESOURCE_CACHE_SHARD_COUNT) % RESOURCE_CACHE_SHARD_HASH_SIZE];
+  while(entry != NULL) {
+    if(entry->hash == hash && _EPUB3ArchiveIdentityIsEqual(&entry->identity, identity) && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+    entry = entry->hashNext;
+  }
+  return NULL;
+}
+
+EPUB3ResourceRef EPUB3ResourceCacheCopyResource(const EPUB3ArchiveIdentity * identity, const char * path, EPUB3Bool verifiesCRC, uint32_t crc)
+{
+  assert(identity != NULL);
+  assert(path != NULL);
+
+  if(__sync_add_and_fetch(&_EPUB3ResourceCacheByteBudget, 0) == 0) return NULL;
+  (void)pthread_once(&_EPUB3ResourceCacheOnce, _EPUB3ResourceCacheInitialize);
+
+  uint32_t hash = EPUB3ResourceCacheHashForKey(identity, path);
+  EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[hash % RESOURCE_CACHE_SHARD_COUNT];
+
+  EPUB3ResourceRef cached = NULL;
+  EPUB3Bool isCompressed = kEPUB3_NO;
+  EPUB3Bool needsCheck = kEPUB3_NO;
+  uint32_t uncompressedSize = 0;
+
+  (void)pthread_mutex_lock(&shard->lock);
+  EPUB3ResourceCacheEntryPtr entry = _EPUB3ResourceCacheShardFindEntry(shard, hash, identity, path);
+  if(entry != NULL) {
+    if(entry != shard->lruHead) {
+      // Move to the front of the LRU list
+      entry->lruPrev->lruNext = entry->lruNext;
+      if(entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+      else shard->lruTail = entry->lruPrev;
+      entry->lruPrev = NULL;
+      entry->lruNext = shard->lruHead;
+      shard->lruHead->lruPrev = entry;
+      shard->lruHead = entry;
+    }
+    cached = entry->resource;
+    isCompressed = entry->isCompressed;
+    uncompressedSize = entry->uncompressedSize;
+    needsCheck = verifiesCRC && !entry->isVerified;
+    EPUB3ResourceRetain(cached);
+  }
+  (void)pthread_mutex_unlock(&shard->lock);
+
+  if(cached == NULL || (!isCompressed && !needsCheck)) {
+    return cached;
+  }
+
+  // Inflate and check outside of the lock; the cached bytes can't go away while we hold a reference.
+  EPUB3ResourceRef resource = NULL;
+  if(!isCompressed) {
+    resource = cached;
+    EPUB3ResourceRetain(resource);
+  } else {
+    void * bytes = EPUB3Malloc(uncompressedSize > 0 ? uncompressedSize : 1U);
+    if(bytes != NULL) {
+      if(EPUB3InflateRawBuffer(cached->bytes, cached->byteCount, bytes, uncompressedSize) == kEPUB3Success) {
+        resource = EPUB3ResourceCreateWithBytes(bytes, uncompressedSize);
+      } else {
+        EPUB3_FREE_AND_NULL(bytes);
+      }
+    }
+  }
+  if(needsCheck) {
+    EPUB3Bool matches = resource != NULL && EPUB3CRC32(0, resource->bytes, resource->byteCount) == crc;
+    (void)pthread_mutex_lock(&shard->lock);
+    entry = _EPUB3ResourceCacheShardFindEntry(shard, hash, identity, path);
+    if(entry != NULL && entry->resource == cached) {
+      if(matches) {
+        entry->isVerified = kEPUB3_YES;
+      } else {
+        // Whoever cached these bytes didn't check them; the caller reads (and checks) them again
+        _EPUB3ResourceCacheShardUnlinkEntry(shard, entry);
+        _EPUB3ResourceCacheEntryFree(entry);
+      }
+    }
+    (void)pthread_mutex_unlock(&shard->lock);
+    if(!matches) {
+      EPUB3ResourceRelease(resource);
+      resource = NULL;
+    }
+  }
+  EPUB3ResourceRelease(cached);
+  return resource;
+}
+
+void EPUB3ResourceCacheInsertResource(const EPUB3ArchiveIdentity * identity, const char * path, EPUB3ResourceRef resource, EPUB3Bool isCompressed, uint32_t uncompressedSize, EPUB3Bool isVerified)
+{
+  assert(identity != NULL);
+  assert(path != NULL);
+  assert(resource != NULL);
+
+  uint64_t shardBudget = _EPUB3ResourceCacheShardByteBudget();
+  if(shardBudget == 0 || resource->byteCount > shardBudget) return;
+  (void)pthread_once(&_EPUB3ResourceCacheOnce, _EPUB3ResourceCacheInitialize);
+
+  uint32_t hash = EPUB3ResourceCacheHashForKey(identity, path);
+  EPUB3ResourceCacheShard * shard = &_EPUB3ResourceCacheShards[hash % RESOURCE_CACHE_SHARD_COUNT];
+
+  (void)pthread_mutex_lock(&shard->lock);
+  EPUB3ResourceCacheEntryPtr existing = _EPUB3ResourceCacheShardFindEntry(shard, hash, identity, path);
+  if(existing == NULL) {
+    EPUB3ResourceCacheEntryPtr entry = EPUB3Calloc(1, sizeof(struct EPUB3ResourceCacheEntry));
+    entry->hash = hash;
+    entry->identity = *identity;
+    entry->path = EPUB3Strdup(path);
+    entry->resource = resource;
+    EPUB3ResourceRetain(resource);
+    entry->isCompressed = isCompressed;
+    entry->uncompressedSize = uncompressedSize;
+    entry->storedByteCount = resource->byteCount;
+    entry->isVerified = isVerified;
+
+    uint32_t bucket = (hash / RESOURCE_CACHE_SHARD_COUNT) % RESOURCE_CACHE_SHARD_HASH_SIZE;
+    entry->hashNext = shard->table[bucket];
+    shard->table[bucket] = entry;
+    entry->lruNext = shard->lruHead;
+    if(shard->lruHead != NULL) shard->lruHead->lruPrev = entry;
+    shard->lruHead = entry;
+    if(shard->lruTail == NULL) shard->lruTail = entry;
+    shard->byteCount += entry->storedByteCount;
+
+    _EPUB3ResourceCacheShardEvict(shard, shardBudget);
+  }
+  (void)pthread_mutex_unlock(&shard->lock);
+}
+
+static EPUB3Error _EPUB3CopyRawFileIntoBufferLocked(EPUB3Ref epub, void **buffer, uint32_t *compressedSize, uint32_t *uncompressedSize, int *method, const char * filename)
+{
+  EPUB3Error error = EPUB3ValidateFileExistsAndSeekInArchive(epub, filename);
+  if(error != kEPUB3Success) return error;
+
+  unz_file_info64 fileInfo;
+  if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) != UNZ_OK) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+  if(fileInfo.compressed_size > WHOLE_FILE_MAX_SIZE || fileInfo.uncompressed_size > WHOLE_FILE_MAX_SIZE) {
+    return kEPUB3FileTooLargeError;
+  }
+  int level = 0;
+  if(unzOpenCurrentFile2(epub->archive, method, &level, 1) != UNZ_OK) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+
+  uint32_t size = (uint32_t)fileInfo.compressed_size;
+  *buffer = EPUB3Malloc(size > 0 ? size : 1U);
+  int32_t copied = unzReadCurrentFile(epub->archive, *buffer, size);
+  (void)unzCloseCurrentFile(epub->archive);
+  if(copied < 0 || (uint32_t)copied != size) {
+    EPUB3_FREE_AND_NULL(*buffer);
+    return kEPUB3FileReadFromArchiveError;
+  }
+  *compressedSize = size;
+  *uncompressedSize = (uint32_t)fileInfo.uncompressed_size;
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3CopyRawFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *compressedSize, uint32_t *uncompressedSize, int *method, const char * filename)
+{
+  assert(epub != NULL);
+  assert(buffer != NULL);
+  assert(filename != NULL);
+
+  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+
+  (void)pthread_mutex_lock(&epub->entryLock);
+  EPUB3Error error = _EPUB3CopyRawFileIntoBufferLocked(epub, buffer, compressedSize, uncompressedSize, method, filename);
+  (void)pthread_mutex_unlock(&epub->entryLock);
+  return error;
+}
+
+#pragma mark - Inflate Backends
+
+static int32_t _EPUB3InflateBackend = kEPUB3InflateBackendZlib;
+
+#if EPUB3_USE_LIBDEFLATE
+// Decompressors are cheap to keep but not to share, so every thread gets its own on first use
+static pthread_key_t _EPUB3LibdeflateDecompressorKey;
+static pthread_once_t _EPUB3LibdeflateDecompressorKeyOnce = PTHREAD_ONCE_INIT;
+
+static void _EPUB3LibdeflateDecompressorFree(void * decompressor)
+{
+  libdeflate_free_decompressor(decompressor);
+}
+
+static void _EPUB3LibdeflateDecompressorKeyCreate(void)
+{
+  (void)pthread_key_create(&_EPUB3LibdeflateDecompressorKey, _EPUB3LibdeflateDecompressorFree);
+}
+
+static struct libdeflate_decompressor * _EPUB3LibdeflateCopyThreadDecompressor(void)
+{
+  (void)pthread_once(&_EPUB3LibdeflateDecompressorKeyOnce, _EPUB3LibdeflateDecompressorKeyCreate);
+  struct libdeflate_decompressor * decompressor = pthread_getspecific(_EPUB3LibdeflateDecompressorKey);
+  if(decompressor == NULL) {
+    decompressor = libdeflate_alloc_decompressor();
+    if(decompressor != NULL) {
+      (void)pthread_setspecific(_EPUB3LibdeflateDecompressorKey, decompressor);
+    }
+  }
+  return decompressor;
+}
+#endif
+
+EXPORT EPUB3Bool EPUB3InflateBackendIsAvailable(EPUB3InflateBackend backend)
+{
+  switch(backend) {
+    case kEPUB3InflateBackendZlib:
+      return kEPUB3_YES;
+    case kEPUB3InflateBackendLibdeflate:
+#if EPUB3_USE_LIBDEFLATE
+      return kEPUB3_YES;
+#else
+      return kEPUB3_NO;
+#endif
+  }
+  return kEPUB3_NO;
+}
+
+EXPORT EPUB3Error EPUB3SetInflateBackend(EPUB3InflateBackend backend)
+{
+  if(!EPUB3InflateBackendIsAvailable(backend)) return kEPUB3InvalidArgumentError;
+  (void)__sync_lock_test_and_set(&_EPUB3InflateBackend, (int32_t)backend);
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3InflateBackend EPUB3GetInflateBackend(void)
+{
+  return (EPUB3InflateBackend)__sync_add_and_fetch(&_EPUB3InflateBackend, 0);
+}
+
+EPUB3Error EPUB3InflateRawBuffer(const void * source, uint32_t sourceSize, void * destination, uint32_t destinationSize)
+{
+#if EPUB3_USE_LIBDEFLATE
+  if(EPUB3GetInflateBackend() == kEPUB3InflateBackendLibdeflate) {
+    struct libdeflate_decompressor * decompressor = _EPUB3LibdeflateCopyThreadDecompressor();
+    if(decompressor == NULL) return kEPUB3UnknownError;
+    // Without somewhere to put the actual size, anything short of destinationSize is an error
+    enum libdeflate_result result = libdeflate_deflate_decompress(decompressor, source, sourceSize, destination, destinationSize, NULL);
+    return result == LIBDEFLATE_SUCCESS ? kEPUB3Success : kEPUB3FileReadFromArchiveError;
+  }
+#endif
+
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(z_stream));
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    return kEPUB3UnknownError;
+  }
+  stream.next_in = (Bytef *)source;
+  stream.avail_in = sourceSize;
+  stream.next_out = destination;
+  stream.avail_out = destinationSize;
+  int status = inflate(&stream, Z_FINISH);
+  uLong produced = stream.total_out;
+  (void)inflateEnd(&stream);
+  return (status == Z_STREAM_END && produced == destinationSize) ? kEPUB3Success : kEPUB3FileReadFromArchiveError;
+}
+
+EPUB3Error EPUB3CopyCurrentArchiveFileIntoBuffer(unzFile archive, EPUB3Bool verifiesCRC, uint32_t extraBytes, void **buffer, uint32_t *bytesCopied)
+{
+  assert(archive != NULL);
+  assert(buffer != NULL);
+  assert(bytesCopied != NULL);
+
+  unz_file_info64 fileInfo;
+  if(unzGetCurrentFileInfo64(archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) != UNZ_OK) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+  if(fileInfo.compressed_size > WHOLE_FILE_MAX_SIZE || fileInfo.uncompressed_size > WHOLE_FILE_MAX_SIZE - extraBytes) {
+    return kEPUB3FileTooLargeError;
+  }
+  int method = 0;
+  int level = 0;
+  if(unzOpenCurrentFile2(archive, &method, &level, 1) != UNZ_OK) {
+    return kEPUB3FileReadFromArchiveError;
+  }
+  if(method != 0 && method != Z_DEFLATED) {
+    (void)unzCloseCurrentFile(archive);
+    return kEPUB3FileReadFromArchiveError;
+  }
+
+  // Stored bytes land where they belong; deflated ones are read whole and inflated in one call
+  uint32_t size = (uint32_t)fileInfo.uncompressed_size;
+  uint32_t compressedSize = (uint32_t)fileInfo.compressed_size;
+  unsigned char * bytes = EPUB3Malloc(size + extraBytes > 0 ? size + extraBytes : 1U);
+  (void)memset(bytes + size, 0, extraBytes);
+  uint32_t toRead = method == 0 ? size : compressedSize;
+  unsigned char * input = method == 0 ? bytes : EPUB3Malloc(compressedSize > 0 ? compressedSize : 1U);
+  int32_t copied = toRead > 0 ? unzReadCurrentFile(archive, input, toRead) : 0;
+  (void)unzCloseCurrentFile(archive);
+
+  EPUB3Error error = (copied >= 0 && (uint32_t)copied == toRead) ? kEPUB3Success : kEPUB3FileReadFromArchiveError;
+  if(method == Z_DEFLATED) {
+    if(error == kEPUB3Success) {
+      error = EPUB3InflateRawBuffer(input, compressedSize, bytes, size);
+    }
+    EPUB3_FREE_AND_NULL(input);
+  }
+  if(error == kEPUB3Success && verifiesCRC && EPUB3CRC32(0, bytes, size) != (uint32_t)fileInfo.crc) {
+    error = kEPUB3FileChecksumError;
+  }
+  if(error != kEPUB3Success) {
+    EPUB3_FREE_AND_NULL(bytes);
+    return error;
+  }
+  *buffer = bytes;
+  *bytesCopied = size;
+  return kEPUB3Success;
+}
+
+#pragma mark - Compressed Passthrough
+
+EXPORT EPUB3Error EPUB3CopyResourceAsGzip(EPUB3Ref epub, const char * path, void ** bytes, uint32_t * byteCount)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(bytes != NULL);
+  assert(byteCount != NULL);
+
+  *bytes = NULL;
+  *byteCount = 0;
+  if(epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = NULL;
+  EPUB3Error error = EPUB3GetArchiveEntry(epub, path, &entry);
+  if(error != kEPUB3Success) return error;
+
+  // Stored entries are framed as stored deflate blocks, which is still only a copy
+  uint64_t blockCount = entry->method == 0 ? (entry->uncompressedSize + 65534) / 65535 : 0;
+  if(entry->method == 0 && blockCount == 0) blockCount = 1;
+  uint64_t payloadSize = entry->method == 0 ? entry->uncompressedSize + blockCount * 5 : entry->compressedSize;
+  uint64_t totalSize = GZIP_HEADER_SIZE + payloadSize + GZIP_TRAILER_SIZE;
+  if(totalSize > UINT32_MAX) return kEPUB3FileTooLargeError;
+
+  int fd = open(epub->archivePath, O_RDONLY);
+  if(fd < 0) return kEPUB3ArchiveUnavailableError;
+
+  unsigned char * buffer = EPUB3Malloc((size_t)totalSize);
+  unsigned char * cursor = buffer;
+  EPUB3WriteGzipHeader(cursor);
+  cursor += GZIP_HEADER_SIZE;
+
+  uint64_t remaining = entry->method == 0 ? entry->uncompressedSize : entry->compressedSize;
+  uint64_t position = 0;
+  do {
+    uint32_t chunk = remaining > 65535 ? 65535 : (uint32_t)remaining;
+    if(entry->method == 0) {
+      cursor[0] = remaining == chunk ? 1 : 0; // BFINAL on the last block, BTYPE 00
+      cursor[1] = chunk & 0xff;
+      cursor[2] = (chunk >> 8) & 0xff;
+      cursor[3] = ~chunk & 0xff;
+      cursor[4] = (~chunk >> 8) & 0xff;
+      cursor += 5;
+    }
+    uint32_t copied = 0;
+    while(copied < chunk) {
+      ssize_t count = pread(fd, cursor + copied, chunk - copied, (off_t)(entry->dataOffset + position + copied));
+      if(count <= 0) {
+        error = kEPUB3FileReadFromArchiveError;
+        break;
+      }
+      copied += (uint32_t)count;
+    }
+    cursor += copied;
+    position += copied;
+    remaining -= copied;
+  } while(error == kEPUB3Success && remaining > 0);
+  (void)close(fd);
+
+  if(error != kEPUB3Success) {
+    EPUB3_FREE_AND_NULL(buffer);
+    return error;
+  }
+  EPUB3WriteGzipTrailer(cursor, entry->crc, entry->uncompressedSize);
+  *bytes = buffer;
+  *byteCount = (uint32_t)totalSize;
+  return kEPUB3Success;
+}
+
+void EPUB3WriteGzipHeader(unsigned char * header)
+{
+  // Magic, CM=8 (deflate), no flags, no mtime, no extra flags, OS unknown
+  static const unsigned char gzipHeader[GZIP_HEADER_SIZE] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  (void)memcpy(header, gzipHeader, GZIP_HEADER_SIZE);
+}
+
+void EPUB3WriteGzipTrailer(unsigned char * trailer, uint32_t crc, uint64_t uncompressedSize)
+{
+  // CRC32 and ISIZE (the size modulo 2^32), both little-endian
+  uint32_t size = (uint32_t)uncompressedSize;
+  for(int i = 0; i < 4; i++) {
+    trailer[i] = (crc >> (8 * i)) & 0xff;
+    trailer[4 + i] = (size >> (8 * i)) & 0xff;
+  }
+}
+
+#pragma mark - Prefetching
+
+static void * _EPUB3PrefetcherThreadMain(void * context);
+
+EXPORT EPUB3PrefetcherRef EPUB3PrefetcherCreate(EPUB3Ref epub, int32_t depth, uint64_t byteBudget, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(error != NULL);
+
+  if(depth <= 0 || byteBudget == 0 || epub->prefetcher != NULL || epub->cacheEntry != NULL) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  if(epub->archivePath == NULL || epub->spine == NULL) {
+    *error = kEPUB3ArchiveUnavailableError;
+    return NULL;
+  }
+
+  unzFile archive = epub->recoveredArchive != NULL ? EPUB3RecoveredArchiveOpen(epub->recoveredArchive, epub->archivePath) : unzOpen64(epub->archivePath);
+  if(archive == NULL) {
+    *error = kEPUB3ArchiveUnavailableError;
+    return NULL;
+  }
+
+  EPUB3PrefetcherRef memory = EPUB3Malloc(sizeof(struct EPUB3Prefetcher));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3PrefetcherTypeID);
+  memory->epub = epub;
+  memory->archive = archive;
+  memory->depth = depth;
+  memory->byteBudget = byteBudget;
+  memory->shouldStop = kEPUB3_NO;
+  memory->generation = 0;
+  memory->targetCount = 0;
+  memory->targetCapacity = 0;
+  memory->targets = NULL;
+  memory->pool = NULL;
+  memory->poolByteCount = 0;
+  (void)pthread_mutex_init(&memory->lock, NULL);
+  (void)pthread_cond_init(&memory->condition, NULL);
+
+  if(pthread_create(&memory->thread, NULL, _EPUB3PrefetcherThreadMain, memory) != 0) {
+    (void)pthread_cond_destroy(&memory->condition);
+    (void)pthread_mutex_destroy(&memory->lock);
+    (void)unzClose(archive);
+    EPUB3_FREE_AND_NULL(memory);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+
+  EPUB3Retain(epub);
+  epub->prefetcher = memory;
+  *error = kEPUB3Success;
+  return memory;
+}
+
+static void _EPUB3PrefetcherClearTargets(EPUB3PrefetcherRef prefetcher)
+{
+  for(int32_t i = 0; i < prefetcher->targetCount; i++) {
+    EPUB3_FREE_AND_NULL(prefetcher->targets[i]);
+  }
+  prefetcher->targetCount = 0;
+}
+
+EXPORT void EPUB3PrefetcherRelease(EPUB3PrefetcherRef prefetcher)
+{
+  if(prefetcher == NULL) return;
+
+  (void)pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->shouldStop = kEPUB3_YES;
+  (void)pthread_cond_signal(&prefetcher->condition);
+  (void)pthread_mutex_unlock(&prefetcher->lock);
+  (void)pthread_join(prefetcher->thread, NULL);
+
+  if(prefetcher->epub->prefetcher == prefetcher) {
+    prefetcher->epub->prefetcher = NULL;
+  }
+  EPUB3Release(prefetcher->epub);
+  prefetcher->epub = NULL;
+
+  EPUB3PrefetchPoolItemPtr item = prefetcher->pool;
+  while(item != NULL) {
+    EPUB3PrefetchPoolItemPtr tmp = item;
+    item = item->next;
+    EPUB3ResourceRelease(tmp->resource);
+    EPUB3_FREE_AND_NULL(tmp->path);
+    EPUB3_FREE_AND_NULL(tmp);
+  }
+  _EPUB3PrefetcherClearTargets(prefetcher);
+  EPUB3_FREE_AND_NULL(prefetcher->targets);
+  (void)unzClose(prefetcher->archive);
+  (void)pthread_cond_destroy(&prefetcher->condition);
+  (void)pthread_mutex_destroy(&prefetcher->lock);
+  EPUB3ObjectRelease(prefetcher);
+}
+
+// Call with the prefetcher's lock held
+void EPUB3PrefetcherAddTarget(EPUB3PrefetcherRef prefetcher, const char * path)
+{
+  for(int32_t i = 0; i < prefetcher->targetCount; i++) {
+    if(strcmp(prefetcher->targets[i], path) == 0) return;
+  }
+  if(prefetcher->targetCount == prefetcher->targetCapacity) {
+    int32_t newCapacity = prefetcher->targetCapacity > 0 ? prefetcher->targetCapacity * 2 : 16;
+    char ** newTargets = EPUB3Realloc(prefetcher->targets, newCapacity * sizeof(char *));
+    if(newTargets == NULL) return;
+    prefetcher->targets = newTargets;
+    prefetcher->targetCapacity = newCapacity;
+  }
+  prefetcher->targets[prefetcher->targetCount++] = EPUB3Strdup(path);
+}
+
+EXPORT void EPUB3PrefetcherSetCurrentSpineIndex(EPUB3PrefetcherRef prefetcher, int32_t index)
+{
+  assert(prefetcher != NULL);
+
+  EPUB3Ref epub = prefetcher->epub;
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+
+  (void)pthread_mutex_lock(&prefetcher->lock);
+  _EPUB3PrefetcherClearTargets(prefetcher);
+
+  int32_t linearIndex = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL; itemPtr = itemPtr->next) {
+    if(!itemPtr->item->isLinear) continue;
+    if(linearIndex > index + prefetcher->depth) break;
+    // The current item stays in the window: callers move the index first and then read the chapter
+    if(linearIndex >= index && itemPtr->item->manifestItem != NULL && itemPtr->item->manifestItem->href != NULL) {
+      char * fullPath = EPUB3CopyOfPathByAppendingPathComponent(root, itemPtr->item->manifestItem->href);
+      EPUB3PrefetcherAddTarget(prefetcher, fullPath);
+      EPUB3_FREE_AND_NULL(fullPath);
+    }
+    linearIndex++;
+  }
+
+  // Stylesheets stay wanted for as long as a pooled chapter in the window links them
+  int32_t chapterCount = prefetcher->targetCount;
+  for(EPUB3PrefetchPoolItemPtr item = prefetcher->pool; item != NULL; item = item->next) {
+    for(int32_t i = 0; i < chapterCount; i++) {
+      if(strcmp(prefetcher->targets[i], item->path) == 0) {
+        EPUB3PrefetcherCollectStylesheetPaths(prefetcher, item->path, item->resource->bytes, item->resource->byteCount);
+        break;
+      }
+    }
+  }
+
+  // Drop what the reader has moved past, keeping anything that is still wanted
+  EPUB3PrefetchPoolItemPtr * link = &prefetcher->pool;
+  while(*link != NULL) {
+    EPUB3PrefetchPoolItemPtr item = *link;
+    EPUB3Bool wanted = kEPUB3_NO;
+    for(int32_t i = 0; i < prefetcher->targetCount; i++) {
+      if(strcmp(prefetcher->targets[i], item->path) == 0) {
+        wanted = kEPUB3_YES;
+        break;
+      }
+    }
+    if(!wanted) {
+      *link = item->next;
+      prefetcher->poolByteCount -= item->resource->byteCount;
+      EPUB3ResourceRelease(item->resource);
+      EPUB3_FREE_AND_NULL(item->path);
+      EPUB3_FREE_AND_NULL(item);
+    } else {
+      link = &item->next;
+    }
+  }
+
+  prefetcher->generation++;
+  (void)pthread_cond_signal(&prefetcher->condition);
+  (void)pthread_mutex_unlock(&prefetcher->lock);
+}
+
+EPUB3ResourceRef EPUB3PrefetcherCopyPooledResource(EPUB3PrefetcherRef prefetcher, const char * path)
+{
+  assert(prefetcher != NULL);
+  assert(path != NULL);
+
+  EPUB3ResourceRef resource = NULL;
+  (void)pthread_mutex_lock(&prefetcher->lock);
+  for(EPUB3PrefetchPoolItemPtr item = prefetcher->pool; item != NULL; item = item->next) {
+    if(strcmp(item->path, path) == 0) {
+      resource = item->resource;
+      EPUB3ResourceRetain(resource);
+      break;
+    }
+  }
+  (void)pthread_mutex_unlock(&prefetcher->lock);
+  return resource;
+}
+
+// A deliberately small scan for <link ... href="..."> in the head of a content document. Anything that
+// looks like a stylesheet is queued, resolved relative to the document.
+// Call with the prefetcher's lock held.
+void EPUB3PrefetcherCollectStylesheetPaths(EPUB3PrefetcherRef prefetcher, const char * documentPath, const char * bytes, uint32_t byteCount)
+{
+  const char * cursor = bytes;
+  const char * end = bytes + byteCount;
+  char * documentDirectory = EPUB3CopyOfPathByDeletingLastPathComponent(documentPath);
+
+  while(cursor < end) {
+    const char * tag = memchr(cursor, '<', end - cursor);
+    if(tag == NULL || end - tag < 6) break;
+    cursor = tag + 1;
+    if(strncasecmp(cursor, "body", 4) == 0) break;
+    if(strncasecmp(cursor, "link", 4) != 0) continue;
+
+    const char * tagEnd = memchr(cursor, '>', end - cursor);
+    if(tagEnd == NULL) break;
+
+    const char * href = NULL;
+    for(const char * c = cursor; c + 6 < tagEnd; c++) {
+      if(strncasecmp(c, "href=", 5) == 0 && (c[5] == '"' || c[5] == '\'')) {
+        href = c + 5;
+        break;
+      }
+    }
+    if(href != NULL) {
+      char quote = *href++;
+      const char * hrefEnd = memchr(href, quote, tagEnd - href);
+      if(hrefEnd != NULL && hrefEnd > href && memchr(href, ':', hrefEnd - href) == NULL) {
+        size_t length = hrefEnd - href;
+        char relativePath[length + 1];
+        (void)memcpy(relativePath, href, length);
+        relativePath[length] = '\0';
+        char * fragment = strpbrk(relativePath, "#?");
+        if(fragment != NULL) *fragment = '\0';
+
+        size_t pathLength = strlen(relativePath);
+        if(pathLength > 4 && strcasecmp(relativePath + pathLength - 4, ".css") == 0) {
+          char * joined = EPUB3CopyOfPathByAppendingPathComponent(documentDirectory, relativePath);
+          char * normalized = EPUB3CopyOfPathByNormalizingPath(joined);
+          EPUB3PrefetcherAddTarget(prefetcher, normalized);
+          EPUB3_FREE_AND_NULL(normalized);
+          EPUB3_FREE_AND_NULL(joined);
+        }
+      }
+    }
+    cursor = tagEnd + 1;
+  }
+  EPUB3_FREE_AND_NULL(documentDirectory);
+}
+
+static EPUB3Bool _EPUB3PrefetcherPoolContainsPath(EPUB3PrefetcherRef prefetcher, const char * path)
+{
+  for(EPUB3PrefetchPoolItemPtr item = prefetcher->pool; item != NULL; item = item->next) {
+    if(strcmp(item->path, path) == 0) return kEPUB3_YES;
+  }
+  return kEPUB3_NO;
+}
+
+static void * _EPUB3PrefetcherThreadMain(void * context)
+{
+  EPUB3PrefetcherRef prefetcher = (EPUB3PrefetcherRef)context;
+  uint32_t completedGeneration = 0;
+
+  (void)pthread_mutex_lock(&prefetcher->lock);
+  while(!prefetcher->shouldStop) {
+    if(completedGeneration == prefetcher->generation) {
+      (void)pthread_cond_wait(&prefetcher->condition, &prefetcher->lock);
+      continue;
+    }
+
+    uint32_t generation = prefetcher->generation;
+    // Targets can grow while we work (stylesheets), so walk by index and re-check after each read.
+    for(int32_t i = 0; i < prefetcher->targetCount && generation == prefetcher->generation && !prefetcher->shouldStop; i++) {
+      if(_EPUB3PrefetcherPoolContainsPath(prefetcher, prefetcher->targets[i])) continue;
+      if(prefetcher->poolByteCount >= prefetcher->byteBudget) break;
+
+      char * path = EPUB3Strdup(prefetcher->targets[i]);
+      (void)pthread_mutex_unlock(&prefetcher->lock);
+
+      void * buffer = NULL;
+      uint32_t byteCount = 0;
+      EPUB3Error error = EPUB3CopyFileFromArchiveIntoBuffer(prefetcher->archive, &buffer, &byteCount, path);
+
+      (void)pthread_mutex_lock(&prefetcher->lock);
+      if(error == kEPUB3Success) {
+        if(generation == prefetcher->generation && prefetcher->poolByteCount + byteCount <= prefetcher->byteBudget) {
+          EPUB3PrefetcherCollectStylesheetPaths(prefetcher, path, buffer, byteCount);
+          EPUB3PrefetchPoolItemPtr item = EPUB3Malloc(sizeof(struct EPUB3PrefetchPoolItem));
+          item->path = path;
+          item->resource = EPUB3ResourceCreateWithBytes(buffer, byteCount);
+          item->next = prefetcher->pool;
+          prefetcher->pool = item;
+          prefetcher->poolByteCount += byteCount;
+          path = NULL;
+        } else {
+          EPUB3_FREE_AND_NULL(buffer);
+        }
+      }
+      EPUB3_FREE_AND_NULL(path);
+    }
+    if(generation == prefetcher->generation) {
+      completedGeneration = generation;
+      (void)pthread_cond_broadcast(&prefetcher->condition);
+    }
+  }
+  (void)pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+EPUB3Error EPUB3CopyFileFromArchiveIntoBuffer(unzFile archive, void **buffer, uint32_t *bytesCopied, const char * filename)
+{
+  assert(archive != NULL);
+  assert(buffer != NULL);
+  assert(filename != NULL);
+
+  if(unzLocateFile(archive, filename, 1) != UNZ_OK) return kEPUB3FileNotFoundInArchiveError;
+  EPUB3Error error = EPUB3CopyCurrentArchiveFileIntoBuffer(archive, kEPUB3_YES, 0, buffer, bytesCopied);
+  return error == kEPUB3FileChecksumError ? kEPUB3FileReadFromArchiveError : error;
+}
+
+char * EPUB3CopyOfPathByNormalizingPath(const char * path)
+{
+  assert(path != NULL);
+
+  char * pathCopy = EPUB3Strdup(path);
+  size_t pathLength = strlen(path);
+  char * segments[pathLength / 2 + 1];
+  int32_t segmentCount = 0;
+  char * loc;
+
+  for(char * segment = strtok_r(pathCopy, "/", &loc); segment != NULL; segment = strtok_r(NULL, "/", &loc)) {
+    if(strcmp(segment, ".") == 0) continue;
+    if(strcmp(segment, "..") == 0) {
+      if(segmentCount > 0) segmentCount--;
+      continue;
+    }
+    segments[segmentCount++] = segment;
+  }
+
+  char normalized[pathLength + 1];
+  normalized[0] = '\0';
+  for(int32_t i = 0; i < segmentCount; i++) {
+    if(i > 0) (void)strcat(normalized, "/");
+    (void)strcat(normalized, segments[i]);
+  }
+  EPUB3_FREE_AND_NULL(pathCopy);
+  return EPUB3Strdup(normalized);
+}
+
+#pragma mark - Archive Entries and Range Reads
+
+#define RANGE_INDEX_FILE_MAGIC "EPUB3IDX"
+#define RANGE_INDEX_FILE_VERSION 1
+
+EXPORT EPUB3Error EPUB3SetRangeReadOptions(EPUB3Ref epub, uint32_t checkpointSpan, const char * indexDirectory)
+{
+  assert(epub != NULL);
+
+  if(checkpointSpan == 0) {
+    checkpointSpan = RANGE_CHECKPOINT_DEFAULT_SPAN;
+  }
+  // Checkpoints closer together than a window would cost more memory than the data they skip
+  if(checkpointSpan < RANGE_CHECKPOINT_WINDOW_SIZE) {
+    return kEPUB3InvalidArgumentError;
+  }
+
+  (void)pthread_mutex_lock(&epub->entryLock);
+  epub->rangeCheckpointSpan = checkpointSpan;
+  EPUB3_FREE_AND_NULL(epub->rangeIndexDirectory);
+  if(indexDirectory != NULL) {
+    epub->rangeIndexDirectory = EPUB3Strdup(indexDirectory);
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3ReadResourceRange(EPUB3Ref epub, const char * path, uint64_t offset, uint32_t length, void * buffer, uint32_t *bytesRead)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(buffer != NULL || length == 0);
+  assert(bytesRead != NULL);
+
+  *bytesRead = 0;
+  if(epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3ArchiveEntryPtr entry = NULL;
+  EPUB3Error error = EPUB3GetArchiveEntry(epub, path, &entry);
+  if(error != kEPUB3Success) return error;
+
+  if(offset > entry->uncompressedSize) return kEPUB3InvalidArgumentError;
+  if(length > entry->uncompressedSize - offset) {
+    length = (uint32_t)(entry->uncompressedSize - offset);
+  }
+  if(length == 0) return kEPUB3Success;
+
+  int fd = open(epub->archivePath, O_RDONLY);
+  if(fd < 0) return kEPUB3ArchiveUnavailableError;
+
+  if(entry->method == Z_DEFLATED && !EPUB3ArchiveEntryHasCheckpoints(epub, entry)) {
+    error = EPUB3ArchiveEntryBuildCheckpoints(epub, entry, fd);
+  }
+  if(error == kEPUB3Success) {
+    error = EPUB3ArchiveEntryReadRange(epub, entry, fd, offset, length, buffer);
+  }
+  (void)close(fd);
+
+  if(error == kEPUB3Success) {
+    *bytesRead = length;
+  }
+  return error;
+}
+
+EPUB3Error EPUB3GetArchiveEntry(EPUB3Ref epub, const char * path, EPUB3ArchiveEntryPtr *entry)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(entry != NULL);
+
+  if(epub->archive == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3Error error = kEPUB3Success;
+  uint32_t bucket = SuperFastHash(path, (int)strlen(path)) % ARCHIVE_ENTRY_HASH_SIZE;
+
+  (void)pthread_mutex_lock(&epub->entryLock);
+  EPUB3ArchiveEntryPtr found = epub->entryTable[bucket];
+  while(found != NULL && strcmp(found->path, path) != 0) {
+    found = found->next;
+  }
+
+  if(found == NULL && epub->snapshot != NULL) {
+    // The snapshot lists every entry, nothing needs to be read from the archive
+    const EPUB3SnapshotEntry * snapshotEntry = EPUB3SnapshotFindEntry(epub, path);
+    if(snapshotEntry == NULL) {
+      error = kEPUB3FileNotFoundInArchiveError;
+    } else if(snapshotEntry->method != 0 && snapshotEntry->method != Z_DEFLATED) {
+      error = kEPUB3FileReadFromArchiveError;
+    } else {
+      found = EPUB3Calloc(1, sizeof(struct EPUB3ArchiveEntry));
+      found->path = EPUB3Strdup(path);
+      found->method = snapshotEntry->method;
+      found->crc = snapshotEntry->crc;
+      found->compressedSize = snapshotEntry->compressedSize;
+      found->uncompressedSize = snapshotEntry->uncompressedSize;
+      found->dataOffset = snapshotEntry->dataOffset;
+      found->next = epub->entryTable[bucket];
+      epub->entryTable[bucket] = found;
+    }
+  }
+  else if(found == NULL) {
+    unz_file_info64 fileInfo;
+    int method = 0;
+    int level = 0;
+    if(unzLocateFile(epub->archive, path, 1) != UNZ_OK) {
+      error = kEPUB3FileNotFoundInArchiveError;
+    }
+    else if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0) != UNZ_OK ||
+            unzOpenCurrentFile2(epub->archive, &method, &level, 1) != UNZ_OK) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+    else {
+      found = EPUB3Calloc(1, sizeof(struct EPUB3ArchiveEntry));
+      found->path = EPUB3Strdup(path);
+      found->method = method;
+      found->crc = (uint32_t)fileInfo.crc;
+      found->compressedSize = fileInfo.compressed_size;
+      found->uncompressedSize = fileInfo.uncompressed_size;
+      found->dataOffset = unzGetCurrentFileZStreamPos64(epub->archive);
+      (void)unzCloseCurrentFile(epub->archive);
+
+      if(method != 0 && method != Z_DEFLATED) {
+        EPUB3ArchiveEntryFree(found);
+        found = NULL;
+        error = kEPUB3FileReadFromArchiveError;
+      } else {
+        found->next = epub->entryTable[bucket];
+        epub->entryTable[bucket] = found;
+      }
+    }
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+
+  *entry = found;
+  return error;
+}
+
+static void _EPUB3RangeCheckpointsFree(EPUB3RangeCheckpoint * checkpoints, int32_t count)
+{
+  if(checkpoints == NULL) return;
+
+  for(int32_t i = 0; i < count; i++) {
+    EPUB3_FREE_AND_NULL(checkpoints[i].window);
+  }
+  EPUB3_FREE_AND_NULL(checkpoints);
+}
+
+void EPUB3ArchiveEntryFree(EPUB3ArchiveEntryPtr entry)
+{
+  if(entry == NULL) return;
+
+  _EPUB3RangeCheckpointsFree(entry->checkpoints, entry->checkpointCount);
+  EPUB3_FREE_AND_NULL(entry->path);
+  EPUB3_FREE_AND_NULL(entry);
+}
+
+void EPUB3ReleaseArchiveEntries(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+
+  for(int i = 0; i < ARCHIVE_ENTRY_HASH_SIZE; i++) {
+    EPUB3ArchiveEntryPtr entry = epub->entryTable[i];
+    while(entry != NULL) {
+      EPUB3ArchiveEntryPtr next = entry->next;
+      EPUB3ArchiveEntryFree(entry);
+      entry = next;
+    }
+    epub->entryTable[i] = NULL;
+  }
+}
+
+static EPUB3Error _EPUB3RangeCheckpointsAdd(EPUB3RangeCheckpoint **checkpoints, int32_t *count, int32_t *capacity, uint64_t uncompressedOffset, uint64_t compressedOffset, int32_t bitCount, const unsigned char * window, uint32_t windowSpaceLeft)
+{
+  if(*count == *capacity) {
+    int32_t newCapacity = *capacity > 0 ? *capacity * 2 : 8;
+    EPUB3RangeCheckpoint * grown = EPUB3Realloc(*checkpoints, newCapacity * sizeof(EPUB3RangeCheckpoint));
+    if(grown == NULL) return kEPUB3UnknownError;
+    *checkpoints = grown;
+    *capacity = newCapacity;
+  }
+
+  EPUB3RangeCheckpoint * checkpoint = &(*checkpoints)[*count];
+  checkpoint->uncompressedOffset = uncompressedOffset;
+  checkpoint->compressedOffset = compressedOffset;
+  checkpoint->bitCount = bitCount;
+  checkpoint->window = NULL;
+  if(window != NULL) {
+    // The output window is circular: the oldest bytes start right after the write position
+    checkpoint->window = EPUB3Malloc(RANGE_CHECKPOINT_WINDOW_SIZE);
+    if(windowSpaceLeft > 0) {
+      (void)memcpy(checkpoint->window, window + RANGE_CHECKPOINT_WINDOW_SIZE - windowSpaceLeft, windowSpaceLeft);
+    }
+    if(windowSpaceLeft < RANGE_CHECKPOINT_WINDOW_SIZE) {
+      (void)memcpy(checkpoint->window + windowSpaceLeft, window, RANGE_CHECKPOINT_WINDOW_SIZE - windowSpaceLeft);
+    }
+  }
+  (*count)++;
+  return kEPUB3Success;
+}
+
+// Once attached, an entry's checkpoints are never changed or freed before the entry itself, so the
+// array can be used without the lock by whoever saw it attached. Hands ownership to the entry, or
+// frees the checkpoints if another thread attached its own first.
+static void _EPUB3ArchiveEntryAttachCheckpoints(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, EPUB3RangeCheckpoint * checkpoints, int32_t count)
+{
+  (void)pthread_mutex_lock(&epub->entryLock);
+  if(entry->checkpointCount == 0) {
+    entry->checkpoints = checkpoints;
+    entry->checkpointCount = count;
+    checkpoints = NULL;
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+  _EPUB3RangeCheckpointsFree(checkpoints, count);
+}
+
+EPUB3Bool EPUB3ArchiveEntryHasCheckpoints(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+
+  (void)pthread_mutex_lock(&epub->entryLock);
+  EPUB3Bool hasCheckpoints = entry->checkpointCount > 0 ? kEPUB3_YES : kEPUB3_NO;
+  (void)pthread_mutex_unlock(&epub->entryLock);
+  return hasCheckpoints;
+}
+
+static EPUB3Error _EPUB3ArchiveEntryReadCheckpointsFromFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const char * path, EPUB3RangeCheckpoint **checkpoints, int32_t *count);
+static EPUB3Error _EPUB3ArchiveEntryWriteCheckpointsToFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const EPUB3RangeCheckpoint * checkpoints, int32_t count, const char * path);
+
+// Call without the epub's entry lock held: the pass inflates the whole entry into a private list and
+// only takes the lock to attach it. Concurrent first reads may each make a pass; one list is kept.
+EPUB3Error EPUB3ArchiveEntryBuildCheckpoints(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(entry->method == Z_DEFLATED);
+
+  EPUB3RangeCheckpoint * checkpoints = NULL;
+  int32_t count = 0;
+  char * indexPath = EPUB3CopyRangeIndexPathForEntry(epub, entry);
+  if(indexPath != NULL && _EPUB3ArchiveEntryReadCheckpointsFromFile(epub, entry, indexPath, &checkpoints, &count) == kEPUB3Success) {
+    EPUB3_FREE_AND_NULL(indexPath);
+    _EPUB3ArchiveEntryAttachCheckpoints(epub, entry, checkpoints, count);
+    return kEPUB3Success;
+  }
+
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(z_stream));
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    EPUB3_FREE_AND_NULL(indexPath);
+    return kEPUB3UnknownError;
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  int32_t capacity = 0;
+  unsigned char input[RESOURCE_STREAM_CHUNK_SIZE];
+  unsigned char * window = EPUB3Malloc(RANGE_CHECKPOINT_WINDOW_SIZE);
+  uint64_t totalIn = 0;
+  uint64_t totalOut = 0;
+  uint64_t lastCheckpoint = 0;
+  uint64_t readPosition = 0;
+  int status = Z_OK;
+
+  error = _EPUB3RangeCheckpointsAdd(&checkpoints, &count, &capacity, 0, 0, 0, NULL, 0);
+  stream.avail_out = 0;
+
+  while(error == kEPUB3Success && status != Z_STREAM_END) {
+    uint64_t remaining = entry->compressedSize - readPosition;
+    // Z_BLOCK can hand back the last of the output before it reports the end of the stream
+    if(remaining == 0 && totalOut == entry->uncompressedSize) break;
+    size_t toRead = remaining < RESOURCE_STREAM_CHUNK_SIZE ? (size_t)remaining : RESOURCE_STREAM_CHUNK_SIZE;
+    ssize_t bytesRead = toRead > 0 ? pread(fd, input, toRead, (off_t)(entry->dataOffset + readPosition)) : 0;
+    if(bytesRead <= 0) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    readPosition += (uint64_t)bytesRead;
+    stream.next_in = input;
+    stream.avail_in = (uInt)bytesRead;
+
+    do {
+      if(stream.avail_out == 0) {
+        stream.next_out = window;
+        stream.avail_out = RANGE_CHECKPOINT_WINDOW_SIZE;
+      }
+      totalIn += stream.avail_in;
+      totalOut += stream.avail_out;
+      status = inflate(&stream, Z_BLOCK);
+      totalIn -= stream.avail_in;
+      totalOut -= stream.avail_out;
+      if(status == Z_NEED_DICT || status == Z_DATA_ERROR || status == Z_MEM_ERROR) {
+        error = kEPUB3FileReadFromArchiveError;
+        break;
+      }
+      if(status == Z_STREAM_END) break;
+
+      // At the end of a block that is not the last one, and far enough past the previous checkpoint
+      if((stream.data_type & 128) && !(stream.data_type & 64) && totalOut - lastCheckpoint > epub->rangeCheckpointSpan) {
+        error = _EPUB3RangeCheckpointsAdd(&checkpoints, &count, &capacity, totalOut, totalIn, stream.data_type & 7, window, stream.avail_out);
+        lastCheckpoint = totalOut;
+      }
+    } while(stream.avail_in != 0 && error == kEPUB3Success);
+  }
+  (void)inflateEnd(&stream);
+  EPUB3_FREE_AND_NULL(window);
+
+  if(error == kEPUB3Success && totalOut != entry->uncompressedSize) {
+    error = kEPUB3FileReadFromArchiveError;
+  }
+  if(error != kEPUB3Success) {
+    _EPUB3RangeCheckpointsFree(checkpoints, count);
+  }
+  else {
+    if(indexPath != NULL && count > 1) {
+      // Failing to persist only costs another pass next time
+      (void)_EPUB3ArchiveEntryWriteCheckpointsToFile(epub, entry, checkpoints, count, indexPath);
+    }
+    _EPUB3ArchiveEntryAttachCheckpoints(epub, entry, checkpoints, count);
+  }
+  EPUB3_FREE_AND_NULL(indexPath);
+  return error;
+}
+
+EPUB3Error EPUB3ArchiveEntryReadRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd, uint64_t offset, uint32_t length, void * buffer)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(buffer != NULL);
+  assert(offset + length <= entry->uncompressedSize);
+
+  struct EPUB3ResourceStream stream;
+  EPUB3ResourceStreamInit(&stream, epub, entry, fd);
+  EPUB3Error error = EPUB3ResourceStreamSeek(&stream, offset);
+  uint32_t copied = 0;
+  while(error == kEPUB3Success && copied < length) {
+    uint32_t bytesRead = 0;
+    error = EPUB3ResourceStreamRead(&stream, (char *)buffer + copied, length - copied, &bytesRead);
+    if(error == kEPUB3Success && bytesRead == 0) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+    copied += bytesRead;
+  }
+  EPUB3ResourceStreamFinalize(&stream);
+  return error;
+}
+
+char * EPUB3CopyRangeIndexPathForEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+
+  if(epub->rangeIndexDirectory == NULL) return NULL;
+
+  // The hash only picks the file name; the file itself records what it indexes and is checked on load
+  char name[32];
+  uint32_t hash = EPUB3ResourceCacheHashForKey(&epub->archiveIdentity, entry->path);
+  (void)snprintf(name, sizeof(name), "%08x-%08x.epub3idx", hash, entry->crc);
+  return EPUB3CopyOfPathByAppendingPathComponent(epub->rangeIndexDirectory, name);
+}
+
+static EPUB3Error _EPUB3ArchiveEntryWriteCheckpointsToFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const EPUB3RangeCheckpoint * checkpoints, int32_t count, const char * path)
+{
+  // Written to the side and renamed into place, so that readers never see a partial index
+  size_t pathLength = strlen(path);
+  char temporaryPath[pathLength + 24];
+  (void)snprintf(temporaryPath, sizeof(temporaryPath), "%s.%ld.tmp", path, (long)getpid());
+
+  FILE * file = fopen(temporaryPath, "wb");
+  if(file == NULL) return kEPUB3UnknownError;
+
+  uint32_t version = RANGE_INDEX_FILE_VERSION;
+  uint32_t entryPathLength = (uint32_t)strlen(entry->path);
+  EPUB3Bool ok = kEPUB3_YES;
+  ok &= fwrite(RANGE_INDEX_FILE_MAGIC, 8, 1, file) == 1;
+  ok &= fwrite(&version, sizeof(version), 1, file) == 1;
+  ok &= fwrite(&epub->archiveIdentity, sizeof(EPUB3ArchiveIdentity), 1, file) == 1;
+  ok &= fwrite(&entry->crc, sizeof(entry->crc), 1, file) == 1;
+  ok &= fwrite(&entry->compressedSize, sizeof(entry->compressedSize), 1, file) == 1;
+  ok &= fwrite(&entry->uncompressedSize, sizeof(entry->uncompressedSize), 1, file) == 1;
+  ok &= fwrite(&entryPathLength, sizeof(entryPathLength), 1, file) == 1;
+  ok &= fwrite(entry->path, entryPathLength, 1, file) == 1;
+  ok &= fwrite(&count, sizeof(count), 1, file) == 1;
+  for(int32_t i = 0; ok && i < count; i++) {
+    const EPUB3RangeCheckpoint * checkpoint = &checkpoints[i];
+    ok &= fwrite(&checkpoint->uncompressedOffset, sizeof(uint64_t), 1, file) == 1;
+    ok &= fwrite(&checkpoint->compressedOffset, sizeof(uint64_t), 1, file) == 1;
+    ok &= fwrite(&checkpoint->bitCount, sizeof(int32_t), 1, file) == 1;
+    if(checkpoint->window != NULL) {
+      ok &= fwrite(checkpoint->window, RANGE_CHECKPOINT_WINDOW_SIZE, 1, file) == 1;
+    }
+  }
+  ok &= fclose(file) == 0;
+
+  if(!ok || rename(temporaryPath, path) != 0) {
+    (void)unlink(temporaryPath);
+    return kEPUB3UnknownError;
+  }
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3ArchiveEntryReadCheckpointsFromFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const char * path)
+{
+  assert(epub != NULL);
+  assert(entry != NULL);
+  assert(path != NULL);
+
+  EPUB3RangeCheckpoint * checkpoints = NULL;
+  int32_t count = 0;
+  EPUB3Error error = _EPUB3ArchiveEntryReadCheckpointsFromFile(epub, entry, path, &checkpoints, &count);
+  if(error == kEPUB3Success) {
+    _EPUB3ArchiveEntryAttachCheckpoints(epub, entry, checkpoints, count);
+  }
+  return error;
+}
+
+static EPUB3Error _EPUB3ArchiveEntryReadCheckpointsFromFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const char * path, EPUB3RangeCheckpoint **checkpoints, int32_t *count)
+{
+  *checkpoints = NULL;
+  *count = 0;
+
+  FILE * file = fopen(path, "rb");
+  if(file == NULL) return kEPUB3FileNotFoundInArchiveError;
+
+  char magic[8];
+  uint32_t version = 0;
+  EPUB3ArchiveIdentity identity;
+  uint32_t crc = 0;
+  uint64_t compressedSize = 0;
+  uint64_t uncompressedSize = 0;
+  uint32_t entryPathLength = 0;
+  int32_t fileCount = 0;
+
+  EPUB3Bool ok = kEPUB3_YES;
+  ok &= fread(magic, 8, 1, file) == 1 && memcmp(magic, RANGE_INDEX_FILE_MAGIC, 8) == 0;
+  ok &= ok && fread(&version, sizeof(version), 1, file) == 1 && version == RANGE_INDEX_FILE_VERSION;
+  ok &= ok && fread(&identity, sizeof(EPUB3ArchiveIdentity), 1, file) == 1 && memcmp(&identity, &epub->archiveIdentity, sizeof(EPUB3ArchiveIdentity)) == 0;
+  ok &= ok && fread(&crc, sizeof(crc), 1, file) == 1 && crc == entry->crc;
+  ok &= ok && fread(&compressedSize, sizeof(compressedSize), 1, file) == 1 && compressedSize == entry->compressedSize;
+  ok &= ok && fread(&uncompressedSize, sizeof(uncompressedSize), 1, file) == 1 && uncompressedSize == entry->uncompressedSize;
+  ok &= ok && fread(&entryPathLength, sizeof(entryPathLength), 1, file) == 1 && entryPathLength == strlen(entry->path);
+  if(ok) {
+    char entryPath[entryPathLength];
+    ok &= fread(entryPath, entryPathLength, 1, file) == 1 && memcmp(entryPath, entry->path, entryPathLength) == 0;
+  }
+  ok &= ok && fread(&fileCount, sizeof(fileCount), 1, file) == 1 && fileCount > 0;
+
+  int32_t capacity = 0;
+  for(int32_t i = 0; ok && i < fileCount; i++) {
+    uint64_t uncompressedOffset = 0;
+    uint64_t compressedOffset = 0;
+    int32_t bitCount = 0;
+    unsigned char window[RANGE_CHECKPOINT_WINDOW_SIZE];
+    ok &= fread(&uncompressedOffset, sizeof(uint64_t), 1, file) == 1;
+    ok &= ok && fread(&compressedOffset, sizeof(uint64_t), 1, file) == 1;
+    ok &= ok && fread(&bitCount, sizeof(int32_t), 1, file) == 1 && bitCount >= 0 && bitCount < 8;
+    ok &= ok && compressedOffset <= compressedSize && uncompressedOffset <= uncompressedSize;
+    if(ok && i > 0) {
+      ok &= fread(window, RANGE_CHECKPOINT_WINDOW_SIZE, 1, file) == 1;
+    }
+    if(ok) {
+      ok &= _EPUB3RangeCheckpointsAdd(checkpoints, count, &capacity, uncompressedOffset, compressedOffset, bitCount, i > 0 ? window : NULL, RANGE_CHECKPOINT_WINDOW_SIZE) == kEPUB3Success;
+    }
+  }
+  (void)fclose(file);
+
+  if(!ok) {
+    _EPUB3RangeCheckpointsFree(*checkpoints, *count);
+    *checkpoints = NULL;
+    *count = 0;
+    return kEPUB3UnknownError;
+  }
+  return kEPUB3Success;
+}
+
+#pragma mark - Resource Streams
+
+EXPORT EPUB3ResourceStreamRef EPUB3ResourceStreamOpen(EPUB3Ref epub, const char * path, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(error != NULL);
+
+  if(epub->archivePath == NULL) {
+    *error = kEPUB3ArchiveUnavailableError;
+    return NULL;
+  }
+
+  EPUB3ArchiveEntryPtr entry = NULL;
+  *error = EPUB3GetArchiveEntry(epub, path, &entry);
+  if(*error != kEPUB3Success) return NULL;
+
+  // Every stream has its own descriptor so reads never contend on a shared file position
+  int fd = open(epub->archivePath, O_RDONLY);
+  if(fd < 0) {
+    *error = kEPUB3ArchiveUnavailableError;
+    return NULL;
+  }
+
+  EPUB3ResourceStreamRef stream = EPUB3Malloc(sizeof(struct EPUB3ResourceStream));
+  EPUB3ResourceStreamInit(stream, epub, entry, fd);
+  stream->verifiesCRC = epub->verifiesReads;
+  stream = EPUB3ObjectInitWithTypeID(stream, kEPUB3ResourceStreamTypeID);
+  return stream;
+}
+
+EXPORT void EPUB3ResourceStreamClose(EPUB3ResourceStreamRef stream)
+{
+  if(stream == NULL) return;
+
+  EPUB3ResourceStreamFinalize(stream);
+  (void)close(stream->fd);
+  EPUB3ObjectRelease(stream);
+}
+
+EXPORT uint64_t EPUB3ResourceStreamGetLength(EPUB3ResourceStreamRef stream)
+{
+  assert(stream != NULL);
+  return stream->entry->uncompressedSize;
+}
+
+EXPORT uint64_t EPUB3ResourceStreamGetOffset(EPUB3ResourceStreamRef stream)
+{
+  assert(stream != NULL);
+  return stream->position;
+}
+
+EXPORT EPUB3Error EPUB3ResourceStreamSkip(EPUB3ResourceStreamRef stream, uint64_t byteCount)
+{
+  assert(stream != NULL);
+
+  if(byteCount > stream->entry->uncompressedSize - stream->position) {
+    return kEPUB3InvalidArgumentError;
+  }
+  return EPUB3ResourceStreamSeek(stream, stream->position + byteCount);
+}
+
+EXPORT EPUB3Error EPUB3ResourceStreamSeek(EPUB3ResourceStreamRef stream, uint64_t offset)
+{
+  assert(stream != NULL);
+
+  EPUB3ArchiveEntryPtr entry = stream->entry;
+  if(offset > entry->uncompressedSize) return kEPUB3InvalidArgumentError;
+
+  if(entry->method == 0) {
+    stream->position = offset;
+    return kEPUB3Success;
+  }
+
+  // Jump to the closest checkpoint when that beats inflating forward from where we are. Without a
+  // checkpoint index (the entry was never range-read) the only point to restart from is the start.
+  // The checkpoints may be attached by another thread at any time, but never change once they are.
+  const EPUB3RangeCheckpoint * checkpoint = NULL;
+  (void)pthread_mutex_lock(&stream->epub->entryLock);
+  for(int32_t i = 0; i < entry->checkpointCount && entry->checkpoints[i].uncompressedOffset <= offset; i++) {
+    checkpoint = &entry->checkpoints[i];
+  }
+  (void)pthread_mutex_unlock(&stream->epub->entryLock);
+  EPUB3Error error = kEPUB3Success;
+  if(offset < stream->position || !stream->isInflating) {
+    error = EPUB3ResourceStreamResumeAtCheckpoint(stream, checkpoint);
+  }
+  else if(checkpoint != NULL && checkpoint->uncompressedOffset > stream->position) {
+    error = EPUB3ResourceStreamResumeAtCheckpoint(stream, checkpoint);
+  }
+
+  unsigned char discard[RESOURCE_STREAM_CHUNK_SIZE];
+  while(error == kEPUB3Success && stream->position < offset) {
+    uint64_t toSkip = offset - stream->position;
+    uint32_t bytesRead = 0;
+    error = EPUB3ResourceStreamRead(stream, discard, toSkip < sizeof(discard) ? (uint32_t)toSkip : (uint32_t)sizeof(discard), &bytesRead);
+    if(error == kEPUB3Success && bytesRead == 0) {
+      error = kEPUB3FileReadFromArchiveError;
+    }
+  }
+  return error;
+}
+
+// Called with bytes just handed out. Only a pass that started at 0 and never jumped can be checked.
+static EPUB3Error _EPUB3ResourceStreamUpdateCRC(EPUB3ResourceStreamRef stream, const void * bytes, uint32_t count)
+{
+  if(!stream->verifiesCRC) return kEPUB3Success;
+
+  uint64_t start = stream->position - count;
+  if(start == 0) {
+    stream->crc = EPUB3CRC32(0, NULL, 0);
+    stream->crcPosition = 0;
+  }
+  if(start != stream->crcPosition) return kEPUB3Success;
+
+  stream->crc = EPUB3CRC32(stream->crc, bytes, count);
+  stream->crcPosition = stream->position;
+  if(stream->crcPosition == stream->entry->uncompressedSize && stream->crc != stream->entry->crc) {
+    return kEPUB3FileChecksumError;
+  }
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3ResourceStreamRead(EPUB3ResourceStreamRef stream, void * buffer, uint32_t length, uint32_t *bytesRead)
+{
+  assert(stream != NULL);
+  assert(buffer != NULL || length == 0);
+  assert(bytesRead != NULL);
+
+  EPUB3ArchiveEntryPtr entry = stream->entry;
+  *bytesRead = 0;
+
+  uint64_t remaining = entry->uncompressedSize - stream->position;
+  if(length > remaining) {
+    length = (uint32_t)remaining;
+  }
+  if(length == 0) return kEPUB3Success;
+
+  if(entry->method == 0) {
+    ssize_t count = pread(stream->fd, buffer, length, (off_t)(entry->dataOffset + stream->position));
+    if(count <= 0) return kEPUB3FileReadFromArchiveError;
+    stream->position += (uint64_t)count;
+    *bytesRead = (uint32_t)count;
+    return _EPUB3ResourceStreamUpdateCRC(stream, buffer, (uint32_t)count);
+  }
+
+  if(!stream->isInflating) {
+    EPUB3Error error = EPUB3ResourceStreamResumeAtCheckpoint(stream, NULL);
+    if(error != kEPUB3Success) return error;
+  }
+
+  z_stream * zstream = &stream->inflateStream;
+  zstream->next_out = buffer;
+  zstream->avail_out = length;
+  while(zstream->avail_out > 0) {
+    if(zstream->avail_in == 0) {
+      uint64_t compressedRemaining = entry->compressedSize - stream->compressedPosition;
+      size_t toRead = compressedRemaining < RESOURCE_STREAM_CHUNK_SIZE ? (size_t)compressedRemaining : RESOURCE_STREAM_CHUNK_SIZE;
+      ssize_t count = toRead > 0 ? pread(stream->fd, stream->input, toRead, (off_t)(entry->dataOffset + stream->compressedPosition)) : 0;
+      if(count <= 0) return kEPUB3FileReadFromArchiveError;
+      stream->compressedPosition += (uint64_t)count;
+      zstream->next_in = stream->input;
+      zstream->avail_in = (uInt)count;
+    }
+    int status = inflate(zstream, Z_NO_FLUSH);
+    if(status == Z_NEED_DICT || status == Z_DATA_ERROR || status == Z_MEM_ERROR) {
+      return kEPUB3FileReadFromArchiveError;
+    }
+    if(status == Z_STREAM_END) break;
+  }
+
+  uint32_t produced = length - zstream->avail_out;
+  if(produced < length) return kEPUB3FileReadFromArchiveError; // the entry is shorter than its header says
+  stream->position += produced;
+  *bytesRead = produced;
+  return _EPUB3ResourceStreamUpdateCRC(stream, buffer, produced);
+}
+
+void EPUB3ResourceStreamInit(EPUB3ResourceStreamRef stream, EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd)
+{
+  assert(stream != NULL);
+  assert(epub != NULL);
+  assert(entry != NULL);
+
+  stream->epub = epub;
+  stream->entry = entry;
+  stream->fd = fd;
+  stream->position = 0;
+  stream->compressedPosition = 0;
+  stream->isInflating = kEPUB3_NO;
+  (void)memset(&stream->inflateStream, 0, sizeof(z_stream));
+  stream->verifiesCRC = kEPUB3_NO;
+  stream->crc = EPUB3CRC32(0, NULL, 0);
+  stream->crcPosition = 0;
+}
+
+void EPUB3ResourceStreamFinalize(EPUB3ResourceStreamRef stream)
+{
+  assert(stream != NULL);
+
+  if(stream->isInflating) {
+    (void)inflateEnd(&stream->inflateStream);
+    stream->isInflating = kEPUB3_NO;
+  }
+}
+
+EPUB3Error EPUB3ResourceStreamResumeAtCheckpoint(EPUB3ResourceStreamRef stream, const EPUB3RangeCheckpoint * checkpoint)
+{
+  assert(stream != NULL);
+
+  z_stream * zstream = &stream->inflateStream;
+  if(stream->isInflating) {
+    if(inflateReset(zstream) != Z_OK) return kEPUB3UnknownError;
+  } else {
+    (void)memset(zstream, 0, sizeof(z_stream));
+    if(inflateInit2(zstream, -MAX_WBITS) != Z_OK) return kEPUB3UnknownError;
+    stream->isInflating = kEPUB3_YES;
+  }
+  zstream->avail_in = 0;
+  stream->position = 0;
+  stream->compressedPosition = 0;
+  if(checkpoint == NULL) return kEPUB3Success;
+
+  stream->position = checkpoint->uncompressedOffset;
+  stream->compressedPosition = checkpoint->compressedOffset;
+  if(checkpoint->bitCount > 0) {
+    unsigned char partialByte = 0;
+    if(pread(stream->fd, &partialByte, 1, (off_t)(stream->entry->dataOffset + checkpoint->compressedOffset - 1)) != 1) {
+      return kEPUB3FileReadFromArchiveError;
+    }
+    (void)inflatePrime(zstream, checkpoint->bitCount, partialByte >> (8 - checkpoint->bitCount));
+  }
+  if(checkpoint->window != NULL) {
+    (void)inflateSetDictionary(zstream, checkpoint->window, RANGE_CHECKPOINT_WINDOW_SIZE);
+  }
+  return kEPUB3Success;
+}
+
+#pragma mark - Work Pool
+
+typedef struct _EPUB3WorkerIdentity {
+  EPUB3WorkPoolRef pool;
+  int32_t index;
+} _EPUB3WorkerIdentity;
+
+static pthread_key_t _EPUB3WorkerIdentityKey;
+static pthread_once_t _EPUB3WorkerIdentityKeyOnce = PTHREAD_ONCE_INIT;
+
+static void _EPUB3WorkerIdentityKeyCreate(void)
+{
+  (void)pthread_key_create(&_EPUB3WorkerIdentityKey, NULL);
+}
+
+int32_t EPUB3GetProcessorCount(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int32_t)count : 1;
+}
+
+static void _EPUB3WorkDequePush(EPUB3WorkDeque * deque, EPUB3WorkItem item)
+{
+  (void)pthread_mutex_lock(&deque->lock);
+  if(deque->count == deque->capacity) {
+    int32_t newCapacity = deque->capacity > 0 ? deque->capacity * 2 : 64;
+    EPUB3WorkItem * items = EPUB3Malloc(newCapacity * sizeof(EPUB3WorkItem));
+    for(int32_t i = 0; i < deque->count; i++) {
+      items[i] = deque->items[(deque->head + i) % deque->capacity];
+    }
+    EPUB3_FREE_AND_NULL(deque->items);
+    deque->items = items;
+    deque->capacity = newCapacity;
+    deque->head = 0;
+  }
+  deque->items[(deque->head + deque->count) % deque->capacity] = item;
+  deque->count++;
+  (void)pthread_mutex_unlock(&deque->lock);
+}
+
+static EPUB3Bool _EPUB3WorkDequePop(EPUB3WorkDeque * deque, EPUB3WorkItem * item, EPUB3Bool newest)
+{
+  EPUB3Bool found = kEPUB3_NO;
+  (void)pthread_mutex_lock(&deque->lock);
+  if(deque->count > 0) {
+    if(newest) {
+      *item = deque->items[(deque->head + deque->count - 1) % deque->capacity];
+    } else {
+      *item = deque->items[deque->head];
+      deque->head = (deque->head + 1) % deque->capacity;
+    }
+    deque->count--;
+    found = kEPUB3_YES;
+  }
+  (void)pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Own deque first (newest task, it is the warmest), then the oldest task of every other worker in turn
+static EPUB3Bool _EPUB3WorkPoolFindWork(EPUB3WorkPoolRef pool, int32_t index, EPUB3WorkItem * item)
+{
+  if(index >= 0 && _EPUB3WorkDequePop(&pool->deques[index], item, kEPUB3_YES)) return kEPUB3_YES;
+  int32_t start = index >= 0 ? index + 1 : 0;
+  for(int32_t i = 0; i < pool->threadCount; i++) {
+    int32_t victim = (start + i) % pool->threadCount;
+    if(victim != index && _EPUB3WorkDequePop(&pool->deques[victim], item, kEPUB3_NO)) return kEPUB3_YES;
+  }
+  return kEPUB3_NO;
+}
+
+static void _EPUB3WorkPoolRunItem(EPUB3WorkPoolRef pool, EPUB3WorkItem item)
+{
+  (void)__sync_sub_and_fetch(&pool->queuedCount, 1);
+  item.function(item.context);
+  if(__sync_sub_and_fetch(&pool->pendingCount, 1) == 0) {
+    (void)pthread_mutex_lock(&pool->lock);
+    (void)pthread_cond_broadcast(&pool->allDone);
+    (void)pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void * _EPUB3WorkPoolThreadMain(void * context)
+{
+  _EPUB3WorkerIdentity * identity = (_EPUB3WorkerIdentity *)context;
+  EPUB3WorkPoolRef pool = identity->pool;
+  int32_t index = identity->index;
+  (void)pthread_setspecific(_EPUB3WorkerIdentityKey, identity);
+  (void)pthread_mutex_lock(&pool->lock);
+  (void)pthread_mutex_unlock(&pool->lock);
+
+  for(;;) {
+    EPUB3WorkItem item;
+    if(_EPUB3WorkPoolFindWork(pool, index, &item)) {
+      _EPUB3WorkPoolRunItem(pool, item);
+      continue;
+    }
+
+    (void)pthread_mutex_lock(&pool->lock);
+    // Submitters bump queuedCount before taking the lock to signal, so checking it here cannot miss a wakeup
+    while(__sync_add_and_fetch(&pool->queuedCount, 0) == 0 && !pool->shouldStop) {
+      (void)pthread_cond_wait(&pool->workAvailable, &pool->lock);
+    }
+    EPUB3Bool shouldStop = pool->shouldStop && __sync_add_and_fetch(&pool->queuedCount, 0) == 0;
+    (void)pthread_mutex_unlock(&pool->lock);
+    if(shouldStop) break;
+  }
+  EPUB3_FREE_AND_NULL(identity);
+  return NULL;
+}
+
+EPUB3WorkPoolRef EPUB3WorkPoolCreate(int32_t threadCount)
+{
+  (void)pthread_once(&_EPUB3WorkerIdentityKeyOnce, _EPUB3WorkerIdentityKeyCreate);
+
+  if(threadCount <= 0) {
+    threadCount = EPUB3GetProcessorCount();
+  }
+
+  EPUB3WorkPoolRef memory = EPUB3Malloc(sizeof(struct EPUB3WorkPool));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3WorkPoolTypeID);
+  memory->threadCount = 0;
+  memory->threads = EPUB3Calloc(threadCount, sizeof(pthread_t));
+  memory->deques = EPUB3Calloc(threadCount, sizeof(EPUB3WorkDeque));
+  memory->queuedCount = 0;
+  memory->pendingCount = 0;
+  memory->nextDeque = 0;
+  memory->shouldStop = kEPUB3_NO;
+  (void)pthread_mutex_init(&memory->lock, NULL);
+  (void)pthread_cond_init(&memory->workAvailable, NULL);
+  (void)pthread_cond_init(&memory->allDone, NULL);
+  for(int32_t i = 0; i < threadCount; i++) {
+    (void)pthread_mutex_init(&memory->deques[i].lock, NULL);
+  }
+
+  // Workers wait for this lock before looking at threadCount, which only settles once every thread is up
+  (void)pthread_mutex_lock(&memory->lock);
+  for(int32_t i = 0; i < threadCount; i++) {
+    _EPUB3WorkerIdentity * identity = EPUB3Malloc(sizeof(_EPUB3WorkerIdentity));
+    identity->pool = memory;
+    identity->index = i;
+    if(pthread_create(&memory->threads[i], NULL, _EPUB3WorkPoolThreadMain, identity) != 0) {
+      EPUB3_FREE_AND_NULL(identity);
+      break;
+    }
+    memory->threadCount++;
+  }
+  (void)pthread_mutex_unlock(&memory->lock);
+
+  if(memory->threadCount == 0) {
+    EPUB3WorkPoolRelease(memory);
+    return NULL;
+  }
+  return memory;
+}
+
+void EPUB3WorkPoolRelease(EPUB3WorkPoolRef pool)
+{
+  if(pool == NULL) return;
+
+  EPUB3WorkPoolWait(pool);
+  (void)pthread_mutex_lock(&pool->lock);
+  pool->shouldStop = kEPUB3_YES;
+  (void)pthread_cond_broadcast(&pool->workAvailable);
+  (void)pthread_mutex_unlock(&pool->lock);
+  for(int32_t i = 0; i < pool->threadCount; i++) {
+    (void)pthread_join(pool->threads[i], NULL);
+  }
+  int32_t dequeCount = pool->threadCount > 0 ? pool->threadCount : 0;
+  for(int32_t i = 0; i < dequeCount; i++) {
+    EPUB3_FREE_AND_NULL(pool->deques[i].items);
+    (void)pthread_mutex_destroy(&pool->deques[i].lock);
+  }
+  EPUB3_FREE_AND_NULL(pool->deques);
+  EPUB3_FREE_AND_NULL(pool->threads);
+  (void)pthread_cond_destroy(&pool->allDone);
+  (void)pthread_cond_destroy(&pool->workAvailable);
+  (void)pthread_mutex_destroy(&pool->lock);
+  EPUB3ObjectRelease(pool);
+}
+
+void EPUB3WorkPoolSubmit(EPUB3WorkPoolRef pool, EPUB3WorkFunction function, void * context)
+{
+  assert(pool != NULL);
+  assert(function != NULL);
+
+  // Tasks submitted from a worker stay on that worker's deque
+  _EPUB3WorkerIdentity * identity = pthread_getspecific(_EPUB3WorkerIdentityKey);
+  int32_t index = (identity != NULL && identity->pool == pool) ? identity->index : (int32_t)(__sync_fetch_and_add(&pool->nextDeque, 1) % (uint32_t)pool->threadCount);
+
+  (void)__sync_add_and_fetch(&pool->pendingCount, 1);
+  EPUB3WorkItem item = {function, context};
+  _EPUB3WorkDequePush(&pool->deques[index], item);
+  (void)__sync_add_and_fetch(&pool->queuedCount, 1);
+
+  (void)pthread_mutex_lock(&pool->lock);
+  (void)pthread_cond_signal(&pool->workAvailable);
+  (void)pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for every submitted task, including the ones those tasks submit, running queued tasks on the
+// calling thread in the meantime. Must not be called from inside a task of the same pool.
+void EPUB3WorkPoolWait(EPUB3WorkPoolRef pool)
+{
+  assert(pool != NULL);
+
+  _EPUB3WorkerIdentity * identity = pthread_getspecific(_EPUB3WorkerIdentityKey);
+  int32_t index = (identity != NULL && identity->pool == pool) ? identity->index : -1;
+
+  while(__sync_add_and_fetch(&pool->pendingCount, 0) > 0) {
+    EPUB3WorkItem item;
+    if(_EPUB3WorkPoolFindWork(pool, index, &item)) {
+      _EPUB3WorkPoolRunItem(pool, item);
+      continue;
+    }
+    // Everything left is running on other threads
+    (void)pthread_mutex_lock(&pool->lock);
+    if(__sync_add_and_fetch(&pool->pendingCount, 0) > 0 && __sync_add_and_fetch(&pool->queuedCount, 0) == 0) {
+      (void)pthread_cond_wait(&pool->allDone, &pool->lock);
+    }
+    (void)pthread_mutex_unlock(&pool->lock);
+  }
+}
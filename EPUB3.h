@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum _EPUB3Error {
   kEPUB3Success = 0,
@@ -20,12 +21,43 @@ typedef enum _EPUB3Error {
   kEPUB3XMLXElementNotFoundError = 1009,
   kEPUB3XMLXDocumentInvalidError = 1010,
   kEPUB3NCXNavMapEnd = 1011,
+  kEPUB3SnapshotInvalidError = 1012,
+  kEPUB3SnapshotStaleError = 1013,
+  kEPUB3FileChecksumError = 1014,
+  kEPUB3FileTooLargeError = 1015, // for a copy of a whole resource; open a stream on it instead
+  kEPUB3FileWriteError = 1016, // an output file couldn't be created or written
 } EPUB3Error;
 
 typedef enum { kEPUB3_NO = 0 , kEPUB3_YES = 1 } EPUB3Bool;
 
 typedef struct EPUB3 * EPUB3Ref;
 typedef struct EPUB3TocItem * EPUB3TocItemRef;
+typedef struct EPUB3Resource * EPUB3ResourceRef;
+typedef struct EPUB3Prefetcher * EPUB3PrefetcherRef;
+typedef struct EPUB3ResourceStream * EPUB3ResourceStreamRef;
+typedef struct EPUB3Server * EPUB3ServerRef;
+typedef struct EPUB3Batch * EPUB3BatchRef;
+typedef struct EPUB3Positions * EPUB3PositionsRef;
+typedef struct EPUB3SearchIndex * EPUB3SearchIndexRef;
+typedef struct EPUB3Writer * EPUB3WriterRef;
+typedef struct EPUB3AsyncReader * EPUB3AsyncReaderRef;
+
+// Memory hooks. Every allocation made by the library (including the ones libxml2 makes on its behalf)
+// goes through the installed allocator. The context pointer is handed back to each callback untouched.
+// copyString may be NULL, in which case it is built on top of allocate.
+typedef struct EPUB3Allocator {
+  void * context;
+  void * (*allocate)(void * context, size_t size);
+  void * (*reallocate)(void * context, void * ptr, size_t size);
+  void (*deallocate)(void * context, void * ptr);
+  char * (*copyString)(void * context, const char * string);
+} EPUB3Allocator;
+
+// Must be called before any other EPUB3 function (and before anything else uses libxml2), since memory
+// handed out by one allocator can't be returned to another. Pass NULL to restore the system allocator.
+EPUB3Error EPUB3SetAllocator(const EPUB3Allocator * allocator);
+// Frees memory returned by the EPUB3Copy* functions.
+void EPUB3Free(void * ptr);
 
 EPUB3Ref EPUB3CreateWithArchiveAtPath(const char * path, EPUB3Error *error);
 void EPUB3Retain(EPUB3Ref epub);
@@ -38,8 +70,32 @@ EPUB3Error EPUB3CopyCoverImage(EPUB3Ref epub, void ** bytes, uint32_t * byteCoun
 int32_t EPUB3CountOfSequentialResources(EPUB3Ref epub);
 EPUB3Error EPUB3GetPathsOfSequentialResources(EPUB3Ref epub, const char ** resources);
 EPUB3Error EPUB3ExtractArchiveToPath(EPUB3Ref epub, const char * path);
+// The selected rendition's package document (the first rootfile unless another was selected)
 EPUB3Error EPUB3CopyRootFilePathFromContainer(EPUB3Ref epub, char ** rootPath);
 
+// Multiple-rendition publications list a package document per rendition in META-INF/container.xml. The
+// container is parsed once, when the book is opened, but only the default rendition (the first rootfile)
+// is loaded then; any other is loaded the first time it is selected and kept after. Selecting changes
+// what the metadata, spine, manifest and table of contents functions return, so don't select while other
+// threads are using the book. The strings in an info belong to epub.
+typedef struct EPUB3RenditionInfo {
+  const char * path; // of the package document in the archive
+  const char * mediaType;
+  // The selection attributes of the rendition vocabulary, NULL when the rootfile doesn't have one
+  const char * media;
+  const char * layout;
+  const char * language;
+  const char * accessMode;
+  const char * label;
+} EPUB3RenditionInfo;
+
+int32_t EPUB3CountOfRenditions(EPUB3Ref epub);
+EPUB3Error EPUB3GetRenditionInfo(EPUB3Ref epub, int32_t index, EPUB3RenditionInfo * info);
+int32_t EPUB3GetSelectedRendition(EPUB3Ref epub);
+// kEPUB3InvalidArgumentError for a rootfile that isn't a package document. When the rendition can't be
+// loaded the error is returned and the previous one stays selected.
+EPUB3Error EPUB3SelectRendition(EPUB3Ref epub, int32_t index);
+
 int32_t EPUB3CountOfTocRootItems(EPUB3Ref epub);
 EPUB3Error EPUB3GetTocRootItems(EPUB3Ref epub, EPUB3TocItemRef *tocItems);
 EPUB3Bool EPUB3TocItemHasParent(EPUB3TocItemRef tocItem);
@@ -49,6 +105,369 @@ EPUB3Error EPUB3TocItemGetChildren(EPUB3TocItemRef parent, EPUB3TocItemRef *chil
 char * EPUB3TocItemCopyTitle(EPUB3TocItemRef tocItem);
 char * EPUB3TocItemCopyPath(EPUB3TocItemRef tocItem);
 
+// Resources are immutable, reference counted buffers holding the bytes of a file in the archive.
+// They are safe to share and release from any thread.
+EPUB3ResourceRef EPUB3CopyResource(EPUB3Ref epub, const char * path, EPUB3Error *error);
+void EPUB3ResourceRetain(EPUB3ResourceRef resource);
+void EPUB3ResourceRelease(EPUB3ResourceRef resource);
+const void * EPUB3ResourceGetBytes(EPUB3ResourceRef resource);
+uint32_t EPUB3ResourceGetByteCount(EPUB3ResourceRef resource);
+
+// Process-wide cache of resources, keyed by archive file identity and path. Disabled (a zero byte budget)
+// by default. When storing compressed bytes the cache holds several times more resources, but each hit
+// pays for an inflate into a private buffer instead of sharing the cached one.
+typedef enum {
+  kEPUB3ResourceCacheStoreInflated = 0,
+  kEPUB3ResourceCacheStoreCompressed = 1,
+} EPUB3ResourceCacheStorage;
+
+EPUB3Error EPUB3ResourceCacheConfigure(uint64_t byteBudget, EPUB3ResourceCacheStorage storage);
+uint64_t EPUB3ResourceCacheGetByteCount(void);
+void EPUB3ResourceCachePurge(void);
+
+// Process-wide cache of open books, keyed by the archive file's device, inode, size and modification time.
+// EPUB3CacheCopyArchiveAtPath returns the book at path shared with everyone else who asked for the same file,
+// and concurrent calls for a book that isn't cached yet all wait for one of them to open it. A book whose
+// file has been written to or replaced since is dropped the next time its path is asked for. Shared books
+// can be retained and released from any thread, and read from several at once through EPUB3CopyResource,
+// resource streams and range reads; they can't select another rendition or have a prefetcher attached.
+// Past maxCount books, or byteBudget bytes (0 for no limit), the least recently used are dropped; a book is
+// charged for its package documents and archive index. Books dropped while in use stay open until the last
+// reference to them is released. Disabled (maxCount 0) by default, which opens a new book on every call.
+EPUB3Error EPUB3CacheConfigure(int32_t maxCount, uint64_t byteBudget);
+EPUB3Ref EPUB3CacheCopyArchiveAtPath(const char * path, EPUB3Error *error);
+int32_t EPUB3CacheGetCount(void);
+uint64_t EPUB3CacheGetByteCount(void);
+void EPUB3CachePurge(void);
+
+// Decoders for reads of whole entries (resources, prefetched items), which know the inflated size up front
+// and decode straight into the destination in one call. Streams and range reads always use zlib. libdeflate
+// is only available when the library is built with EPUB3_USE_LIBDEFLATE=1 (and linked with -ldeflate); for
+// zlib-ng, link against it in zlib-compatible mode instead of zlib. Applies process-wide, defaults to zlib.
+typedef enum {
+  kEPUB3InflateBackendZlib = 0,
+  kEPUB3InflateBackendLibdeflate = 1,
+} EPUB3InflateBackend;
+
+EPUB3Bool EPUB3InflateBackendIsAvailable(EPUB3InflateBackend backend);
+// kEPUB3InvalidArgumentError when the backend isn't built in
+EPUB3Error EPUB3SetInflateBackend(EPUB3InflateBackend backend);
+EPUB3InflateBackend EPUB3GetInflateBackend(void);
+
+// Background prefetching of upcoming spine items. Once attached, EPUB3CopyResource on the same EPUB3Ref
+// is served from the prefetcher's pool when possible. depth is the number of linear spine items to read
+// ahead of the current one (their stylesheets are fetched as well), byteBudget bounds the pool. The current
+// item is kept in the pool so it can be read after the index moves to it.
+EPUB3PrefetcherRef EPUB3PrefetcherCreate(EPUB3Ref epub, int32_t depth, uint64_t byteBudget, EPUB3Error *error);
+// index is a position in the list returned by EPUB3GetPathsOfSequentialResources
+void EPUB3PrefetcherSetCurrentSpineIndex(EPUB3PrefetcherRef prefetcher, int32_t index);
+// Stops the background thread and detaches the prefetcher from its EPUB3Ref
+void EPUB3PrefetcherRelease(EPUB3PrefetcherRef prefetcher);
+
+// Random access into archive entries. The first range read of a deflated entry makes one full pass over
+// it and keeps a checkpoint (a copy of the inflate window) every checkpointSpan bytes of output, so later
+// reads only inflate from the closest checkpoint. When indexDirectory is not NULL, checkpoints are saved
+// there and reused by any EPUB3Ref opened on the same file. A span of 0 restores the default (1MB).
+EPUB3Error EPUB3SetRangeReadOptions(EPUB3Ref epub, uint32_t checkpointSpan, const char * indexDirectory);
+// Copies up to length bytes of the uncompressed entry at path, starting at offset. bytesRead is less than
+// length only when the range runs past the end of the entry.
+EPUB3Error EPUB3ReadResourceRange(EPUB3Ref epub, const char * path, uint64_t offset, uint32_t length, void * buffer, uint32_t *bytesRead);
+// The entry as a gzip member (e.g. for Content-Encoding: gzip), made from the deflate stream already in the
+// archive and its central directory CRC, without inflating anything. Free the bytes with EPUB3Free.
+EPUB3Error EPUB3CopyResourceAsGzip(EPUB3Ref epub, const char * path, void ** bytes, uint32_t * byteCount);
+
+// Incremental reads of a single resource in constant memory, into caller-owned buffers. Each stream has its
+// own file descriptor and inflate state, so different streams on one EPUB3Ref can be used from different
+// threads at once (a single stream is not thread-safe). The EPUB3Ref must outlive its streams.
+EPUB3ResourceStreamRef EPUB3ResourceStreamOpen(EPUB3Ref epub, const char * path, EPUB3Error *error);
+// bytesRead is 0 once the end of the resource has been reached
+EPUB3Error EPUB3ResourceStreamRead(EPUB3ResourceStreamRef stream, void * buffer, uint32_t length, uint32_t *bytesRead);
+EPUB3Error EPUB3ResourceStreamSkip(EPUB3ResourceStreamRef stream, uint64_t byteCount);
+// Seeking backwards in a deflated resource restarts from its closest checkpoint (see EPUB3ReadResourceRange)
+EPUB3Error EPUB3ResourceStreamSeek(EPUB3ResourceStreamRef stream, uint64_t offset);
+uint64_t EPUB3ResourceStreamGetOffset(EPUB3ResourceStreamRef stream);
+uint64_t EPUB3ResourceStreamGetLength(EPUB3ResourceStreamRef stream);
+void EPUB3ResourceStreamClose(EPUB3ResourceStreamRef stream);
+
+// Reads for event loops, which are submitted without blocking. Their callbacks run on whichever thread
+// calls EPUB3AsyncReaderDispatch, and the reader's file descriptor is readable whenever some have finished,
+// so it can be polled with the loop's other descriptors. Entries are looked up and inflated on a pool of
+// threadCount threads (0 for one per online processor). The archive's bytes are read through io_uring when
+// the library is built with EPUB3_USE_IO_URING=1 (Linux only) and the kernel allows it, and with pread on
+// the pool otherwise. An EPUB3Ref must outlive the reads submitted on it.
+typedef enum {
+  kEPUB3AsyncBackendThreadPool = 0,
+  kEPUB3AsyncBackendIOUring = 1,
+} EPUB3AsyncBackend;
+
+// resource is NULL unless error is kEPUB3Success, and released after the callback returns (retain it to
+// keep it)
+typedef void (*EPUB3AsyncReadCallback)(void * context, EPUB3ResourceRef resource, EPUB3Error error);
+
+EPUB3AsyncReaderRef EPUB3AsyncReaderCreate(int32_t threadCount, EPUB3Error *error);
+EPUB3AsyncBackend EPUB3AsyncReaderGetBackend(EPUB3AsyncReaderRef reader);
+int EPUB3AsyncReaderGetFileDescriptor(EPUB3AsyncReaderRef reader);
+// Whole entries go through the resource cache, like EPUB3CopyResource
+EPUB3Error EPUB3AsyncReadResource(EPUB3AsyncReaderRef reader, EPUB3Ref epub, const char * path, EPUB3AsyncReadCallback callback, void * context);
+// The resource holds up to length bytes of the uncompressed entry starting at offset, fewer only when the
+// range runs past its end. Ranges of deflated entries are read on the pool, as EPUB3ReadResourceRange does.
+EPUB3Error EPUB3AsyncReadResourceRange(EPUB3AsyncReaderRef reader, EPUB3Ref epub, const char * path, uint64_t offset, uint32_t length, EPUB3AsyncReadCallback callback, void * context);
+// Calls back for every read that has finished, in the order they finished, and returns how many there were
+int32_t EPUB3AsyncReaderDispatch(EPUB3AsyncReaderRef reader);
+// Waits for the reads in flight. Callbacks that haven't been dispatched yet are not called.
+void EPUB3AsyncReaderRelease(EPUB3AsyncReaderRef reader);
+
+// Admission control without opening the book. Reads the first local header, which must be the stored
+// "mimetype" entry holding "application/epub+zip" that OCF requires, and only for files that pass, the end
+// of central directory record (plus the ZIP64 one when present), which must describe a single-disk archive
+// whose central directory fits in front of it. That is a few KB at most (more only for archives with long
+// comments) and nothing is parsed or inflated. result may be NULL.
+typedef enum {
+  kEPUB3SniffEPUB = 0,
+  kEPUB3SniffUnreadable = 1, // couldn't be opened or read, or not a regular file
+  kEPUB3SniffNotZip = 2, // doesn't start with a local file header
+  kEPUB3SniffMissingMimetype = 3, // a ZIP file whose first entry isn't "mimetype"
+  kEPUB3SniffCompressedMimetype = 4,
+  kEPUB3SniffWrongMimetype = 5, // some other media type (or another OCF-based format)
+  kEPUB3SniffTruncated = 6, // no end of central directory record
+  kEPUB3SniffBadCentralDirectory = 7,
+} EPUB3SniffClassification;
+
+typedef struct EPUB3SniffResult {
+  EPUB3SniffClassification classification;
+  uint64_t entryCount; // from the end of central directory record, once the head passed
+  uint64_t centralDirectoryOffset;
+  uint64_t centralDirectorySize;
+} EPUB3SniffResult;
+
+EPUB3SniffClassification EPUB3Sniff(const char * path, EPUB3SniffResult * result);
+// For files already in memory (e.g. an upload), length being the whole file
+EPUB3SniffClassification EPUB3SniffBuffer(const void * bytes, size_t length, EPUB3SniffResult * result);
+
+// For archives whose central directory is missing, truncated or corrupt, which EPUB3CreateWithArchiveAtPath
+// refuses. When the directory can't be read, the file is scanned for local file headers and an index of the
+// entries is rebuilt from them in memory (following data descriptors where the header has no sizes); nothing
+// is written to disk. Entries cut off by truncation are left out. Intact archives open as they always do.
+EPUB3Ref EPUB3CreateWithArchiveAtPathRecovering(const char * path, EPUB3Error *error);
+// kEPUB3_YES when the book was opened through a rebuilt central directory
+EPUB3Bool EPUB3ArchiveWasRecovered(EPUB3Ref epub);
+
+// Integrity checks against the CRCs the archive records. EPUB3VerifyArchive reads every entry in the
+// central directory, in parallel on threadCount threads (0 for one per CPU), and reports each one; it
+// returns kEPUB3FileChecksumError when any of them is not valid. Free the reports with
+// EPUB3ArchiveEntryReportsFree.
+typedef enum {
+  kEPUB3ArchiveEntryValid = 0,
+  kEPUB3ArchiveEntryChecksumMismatch = 1, // the data doesn't match the central directory's CRC
+  kEPUB3ArchiveEntryHeaderMismatch = 2, // the local header (or data descriptor) disagrees with the central directory
+  kEPUB3ArchiveEntryDataError = 3, // unreadable, truncated or not the size the central directory says
+  kEPUB3ArchiveEntryUnsupported = 4, // encrypted, or compressed with something other than deflate
+} EPUB3ArchiveEntryStatus;
+
+typedef struct EPUB3ArchiveEntryReport {
+  char * path;
+  EPUB3ArchiveEntryStatus status;
+  uint32_t centralCRC;
+  uint32_t localCRC;
+  uint32_t computedCRC;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+} EPUB3ArchiveEntryReport;
+
+EPUB3Error EPUB3VerifyArchive(EPUB3Ref epub, int32_t threadCount, EPUB3ArchiveEntryReport ** reports, int32_t * reportCount);
+void EPUB3ArchiveEntryReportsFree(EPUB3ArchiveEntryReport * reports, int32_t reportCount);
+// Off by default. When on, EPUB3CopyResource and streams read to their end fail with kEPUB3FileChecksumError
+// instead of handing out bytes that don't match the entry's CRC. Range reads are never checked.
+void EPUB3SetVerifiesReads(EPUB3Ref epub, EPUB3Bool verifies);
+
+// Pixel dimensions of every image in the manifest, without decoding any of them: only the header is read
+// (and inflated), a few hundred bytes for most files, skipping from marker to marker in JPEGs and up to
+// 4KB to find the root element of an SVG. Images are probed in parallel on threadCount threads (0 for one
+// per CPU). The infos are sorted by path; free them with EPUB3ImageInfosFree.
+typedef enum {
+  kEPUB3ImageFormatUnknown = 0, // not an image format that is recognized, or the header is damaged
+  kEPUB3ImageFormatJPEG = 1,
+  kEPUB3ImageFormatPNG = 2,
+  kEPUB3ImageFormatGIF = 3,
+  kEPUB3ImageFormatWebP = 4,
+  kEPUB3ImageFormatSVG = 5,
+} EPUB3ImageFormat;
+
+typedef struct EPUB3ImageInfo {
+  char * path; // in the archive
+  EPUB3ImageFormat format;
+  uint32_t width; // 0 when the header doesn't say, e.g. an SVG sized in percent and without a viewBox
+  uint32_t height;
+  EPUB3Error error; // reading the entry, e.g. kEPUB3FileNotFoundInArchiveError for a missing file
+} EPUB3ImageInfo;
+
+EPUB3Error EPUB3CopyImageInfos(EPUB3Ref epub, int32_t threadCount, EPUB3ImageInfo ** infos, int32_t * infoCount);
+void EPUB3ImageInfosFree(EPUB3ImageInfo * infos, int32_t infoCount);
+
+// A small HTTP/1.1 server for web-based readers, listening on the loopback interface and run by one
+// background thread. GET and HEAD requests for /book/<bookID>/<path inside the archive> are answered
+// with the entry's bytes; single byte Range requests and If-None-Match (against an ETag made from the
+// entry's CRC) are supported. Pass port 0 to let the system pick one.
+EPUB3ServerRef EPUB3ServerCreate(uint16_t port, EPUB3Error *error);
+uint16_t EPUB3ServerGetPort(EPUB3ServerRef server);
+// The server opens its own handle on the archive; bookID may not contain '/'
+EPUB3Error EPUB3ServerAddBook(EPUB3ServerRef server, const char * bookID, const char * archivePath);
+EPUB3Error EPUB3ServerRemoveBook(EPUB3ServerRef server, const char * bookID);
+// Stops the server, dropping any open connections
+void EPUB3ServerRelease(EPUB3ServerRef server);
+
+
+// The book as a Readium Web Publication Manifest: metadata, the linear spine as readingOrder, the other
+// manifest items as resources and the table of contents as toc. Hrefs are relative to the root of the
+// archive. selfHref, when not NULL, is written as the manifest's "self" link. The JSON is streamed out
+// without an intermediate tree, so it is cheap enough to produce on every request.
+// Into a buffer of *capacity bytes that is grown with EPUB3Realloc as needed (*buffer may start out NULL),
+// NUL-terminated. The buffer can be reused across calls and is freed with EPUB3Free.
+EPUB3Error EPUB3WriteWebPublicationManifest(EPUB3Ref epub, const char * selfHref, char ** buffer, size_t * capacity, size_t * length);
+EPUB3Error EPUB3WriteWebPublicationManifestToFD(EPUB3Ref epub, const char * selfHref, int fd);
+
+// Snapshots hold everything parsing a book produces (metadata, manifest, spine, TOC) plus an index of the
+// archive's entries, in a position independent image that is mapped read-only when reopened. Opening from
+// a snapshot reads no XML and no local file headers, and processes opening the same snapshot share its
+// pages. The snapshot names the archive by its absolute path and is only accepted while the archive's
+// central directory is unchanged (kEPUB3SnapshotStaleError otherwise). The selected rendition is saved
+// too; reopening one other than the default reads the container to find the others.
+EPUB3Error EPUB3WriteSnapshot(EPUB3Ref epub, int fd);
+EPUB3Ref EPUB3CreateFromSnapshot(const char * path, EPUB3Error *error);
+
+// Library-scale ingestion. Files added to a batch go through sniff, open, parse and (optionally) cover and
+// extract stages on a pool of work-stealing threads, and each one produces exactly one JSON object, on a
+// single line ending in a newline, handed to recordCallback. A failure only ends its own file's record:
+// {"status":"error","stage":"<stage>","error":<EPUB3Error>}. Records arrive in completion order; the
+// "index" member is the order in which files were added. The callback is never called concurrently.
+typedef void (*EPUB3BatchRecordCallback)(void * context, const char * record, size_t length);
+
+typedef struct EPUB3BatchOptions {
+  int32_t threadCount; // 0 for one per online processor
+  int32_t maxFilesInFlight; // EPUB3BatchAdd* blocks past this many unfinished files, 0 for 4 per thread
+  EPUB3Bool includeCover; // reads the cover image and reports its path and size
+  const char * extractDirectory; // when not NULL, each book is extracted to <extractDirectory>/<index>
+  // When not NULL, the scan index kept at this path lets a later batch skip files that haven't changed
+  // since (after a single stat), and re-parse only the OPF and NCX of books where nothing else changed.
+  // Records then carry "scan":"skipped", "verified", "reparsed" or "full". Books are still extracted
+  // when extractDirectory is set, and read again for their cover when the index doesn't have it. The
+  // index is rewritten by EPUB3BatchFinish with the files seen by this batch.
+  const char * indexPath;
+  EPUB3BatchRecordCallback recordCallback;
+  void * callbackContext;
+} EPUB3BatchOptions;
+
+typedef struct EPUB3BatchStatistics {
+  uint64_t fileCount;
+  uint64_t succeededCount;
+  uint64_t failedCount;
+  uint64_t unchangedCount; // answered from the scan index
+} EPUB3BatchStatistics;
+
+EPUB3BatchRef EPUB3BatchCreate(const EPUB3BatchOptions * options, EPUB3Error *error);
+EPUB3Error EPUB3BatchAddPath(EPUB3BatchRef batch, const char * path);
+// Adds every *.epub file below directory, recursively
+EPUB3Error EPUB3BatchAddDirectory(EPUB3BatchRef batch, const char * directory);
+// Waits for every added file, then frees the batch. statistics may be NULL.
+void EPUB3BatchFinish(EPUB3BatchRef batch, EPUB3BatchStatistics * statistics);
+
+// Plain text of the book for search indexing. Each linear spine document is streamed through a small
+// XHTML reader, without building a DOM: markup, comments, head, script and style are dropped, character
+// references are decoded, whitespace is collapsed (except inside pre) and block-level elements and br
+// start new lines. The text is UTF-8, as are the documents (a UTF-8 BOM is skipped).
+// Up to the next mapping, text byte mappings[i].textOffset + n stands for byte sourceOffset + n of the
+// document. Text copied from the source is found there as is; collapsed or inserted whitespace and decoded
+// references point at the whitespace or markup they replace.
+typedef struct EPUB3TextMapping {
+  uint32_t textOffset;
+  uint32_t sourceOffset;
+} EPUB3TextMapping;
+
+// spineIndex is a position in the list returned by EPUB3GetPathsOfSequentialResources, path the document's
+// path inside the archive. text, mappings and path are only valid during the call.
+typedef void (*EPUB3TextCallback)(void * context, int32_t spineIndex, const char * path, const char * text, uint32_t length, const EPUB3TextMapping * mappings, int32_t mappingCount);
+
+// Documents are extracted in parallel on threadCount threads (0 for one per online processor) and handed
+// to callback one at a time, in spine order, on the calling thread. A document that can't be read is
+// skipped; the first such error is returned after the others have been delivered.
+EPUB3Error EPUB3ExtractText(EPUB3Ref epub, int32_t threadCount, EPUB3TextCallback callback, void * context);
+
+// Reading positions, Readium style, and sizes of the linear spine: each document has a position at its start
+// and another every 1024 characters after that. Characters are the Unicode code points of the text, leaving
+// out whitespace, markup and the parts EPUB3ExtractText drops; a character reference counts as one. Each
+// document is scanned with a tag-skipping counter rather than parsed, in parallel on threadCount threads
+// (0 for one per online processor).
+EPUB3PositionsRef EPUB3CopyPositions(EPUB3Ref epub, int32_t threadCount, EPUB3Error *error);
+void EPUB3PositionsRelease(EPUB3PositionsRef positions);
+// The offset arrays have one entry per linear spine item plus one: item i covers [offsets[i], offsets[i + 1])
+// and the last entry is the total for the book.
+int32_t EPUB3PositionsGetSpineCount(EPUB3PositionsRef positions);
+const uint64_t * EPUB3PositionsGetCharacterOffsets(EPUB3PositionsRef positions);
+const uint64_t * EPUB3PositionsGetWordOffsets(EPUB3PositionsRef positions);
+const uint32_t * EPUB3PositionsGetPositionOffsets(EPUB3PositionsRef positions);
+// For each position, the byte offset in its spine document where it starts
+const uint32_t * EPUB3PositionsGetSourceOffsets(EPUB3PositionsRef positions);
+// Seconds to read spine item index, or the whole book for -1, at wordsPerMinute (0 for 250)
+uint32_t EPUB3PositionsGetReadingTime(EPUB3PositionsRef positions, int32_t index, uint32_t wordsPerMinute);
+// Positions can be kept next to a snapshot so they're computed once per version of a book. Like snapshots,
+// they are only accepted for an archive with the same central directory (kEPUB3SnapshotStaleError otherwise).
+EPUB3Error EPUB3WritePositions(EPUB3PositionsRef positions, int fd);
+EPUB3PositionsRef EPUB3CreatePositionsFromFile(EPUB3Ref epub, const char * path, EPUB3Error *error);
+
+// Full-text search within a book. The index holds every word of the text EPUB3ExtractText produces, case
+// folded, with its place in the text, plus the text itself for snippets. It is built in parallel, one task
+// per spine document, and written to fd; it is then mapped read-only, so opening it is cheap and queries
+// don't touch the archive. Like snapshots, an index is only accepted for an archive with the same central
+// directory (kEPUB3SnapshotStaleError otherwise).
+EPUB3Error EPUB3WriteSearchIndex(EPUB3Ref epub, int32_t threadCount, int fd);
+EPUB3SearchIndexRef EPUB3CreateSearchIndexFromFile(EPUB3Ref epub, const char * path, EPUB3Error *error);
+void EPUB3SearchIndexRelease(EPUB3SearchIndexRef index);
+
+typedef struct EPUB3SearchResult {
+  int32_t spineIndex; // a position in the list returned by EPUB3GetPathsOfSequentialResources
+  uint32_t sourceOffset; // of the match in the spine document
+  uint32_t textOffset; // of the match in the document's text
+  uint32_t textLength;
+  char * snippet; // the match and some text around it, on one line
+  uint32_t snippetMatchOffset;
+} EPUB3SearchResult;
+
+// The words of query are looked up as a phrase: a result is a place where they follow one another, whatever
+// the case and punctuation in between. Results are in book order, at most maxResults of them (0 for all).
+// Free them with EPUB3SearchResultsFree.
+EPUB3Error EPUB3SearchIndexQuery(EPUB3SearchIndexRef index, const char * query, int32_t maxResults, EPUB3SearchResult ** results, int32_t * resultCount);
+void EPUB3SearchResultsFree(EPUB3SearchResult * results, int32_t resultCount);
+
+// Packaging. The writer starts the archive with the stored "mimetype" entry OCF requires; entries added
+// after it are written in the order they were added. Their bytes are deflated on a pool of threadCount
+// threads (0 for one per online processor): small entries each in one task, large ones in 1MB chunks
+// compressed independently and joined into a single deflate stream, so one big entry keeps every thread
+// busy. Only a few chunks per thread are held in memory at once, and adding blocks until there is room.
+// level is a zlib compression level (Z_DEFAULT_COMPRESSION is -1). Archives are limited to 4GB.
+EPUB3WriterRef EPUB3WriterCreate(const char * path, int32_t threadCount, int32_t level, EPUB3Error *error);
+// Pass kEPUB3_NO for compress to store an entry (e.g. images and audio that are compressed already).
+// The bytes are copied before the call returns.
+EPUB3Error EPUB3WriterAddBuffer(EPUB3WriterRef writer, const char * path, const void * bytes, uint64_t length, EPUB3Bool compress);
+// read fills buffer with up to length bytes and returns how many it copied: 0 at the end, -1 on failure
+// (which fails the writer with kEPUB3FileReadFromArchiveError)
+typedef int64_t (*EPUB3WriterReadFunction)(void * context, void * buffer, uint32_t length);
+EPUB3Error EPUB3WriterAddStream(EPUB3WriterRef writer, const char * path, EPUB3WriterReadFunction read, void * context, EPUB3Bool compress);
+// Waits for every entry, writes the central directory and frees the writer. After any failure the first
+// error is returned and the partly written file is removed.
+EPUB3Error EPUB3WriterFinish(EPUB3WriterRef writer);
+
+// Rewrites epub's archive for reading: the mimetype, META-INF, the package document, the NCX and nav
+// document, then the spine in reading order with each document followed by the stylesheets, images and
+// fonts it references. Every rendition is kept, the selected one first. Images, audio, video and fonts that are compressed already are stored; everything
+// else is deflated again at level. Files the package doesn't list are dropped unless
+// keepsUnreferencedEntries is set. Passing NULL for options uses threadCount 0, level 9 and drops them.
+typedef struct EPUB3RepackOptions {
+  int32_t threadCount; // for the writer, 0 for one per online processor
+  int32_t level; // zlib compression level for the entries that are deflated
+  EPUB3Bool keepsUnreferencedEntries;
+} EPUB3RepackOptions;
+
+EPUB3Error EPUB3Repack(EPUB3Ref epub, const char * path, const EPUB3RepackOptions * options);
 
 #if defined(__cplusplus)
 } //EXTERN "C"
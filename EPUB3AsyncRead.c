@@ -0,0 +1,474 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <zlib.h>
+#if EPUB3_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+const char * kEPUB3AsyncReaderTypeID = "_EPUB3AsyncReader_t";
+
+static void _EPUB3AsyncReadFinish(void * context);
+
+#pragma mark - Completion Queue
+
+static void _EPUB3AsyncReadComplete(EPUB3AsyncReadPtr request)
+{
+  EPUB3AsyncReaderRef reader = request->reader;
+  (void)pthread_mutex_lock(&reader->lock);
+  request->next = NULL;
+  EPUB3Bool wasEmpty = reader->firstCompletion == NULL ? kEPUB3_YES : kEPUB3_NO;
+  if(reader->lastCompletion != NULL) {
+    reader->lastCompletion->next = request;
+  } else {
+    reader->firstCompletion = request;
+  }
+  reader->lastCompletion = request;
+  if(wasEmpty) {
+    char wake = 1;
+    (void)write(reader->wakePipe[1], &wake, 1);
+  }
+  reader->outstandingCount--;
+  if(reader->outstandingCount == 0) {
+    (void)pthread_cond_broadcast(&reader->allFinished);
+  }
+  (void)pthread_mutex_unlock(&reader->lock);
+}
+
+static void _EPUB3AsyncReadFree(EPUB3AsyncReadPtr request)
+{
+  EPUB3ResourceRelease(request->resource);
+  EPUB3_FREE_AND_NULL(request->buffer);
+  EPUB3_FREE_AND_NULL(request->path);
+  EPUB3_FREE_AND_NULL(request);
+}
+
+#pragma mark - io_uring
+
+#if EPUB3_USE_IO_URING
+
+static void * _EPUB3AsyncRingReaperMain(void * context);
+
+static EPUB3Bool _EPUB3AsyncRingCreate(EPUB3AsyncReaderRef reader)
+{
+  EPUB3AsyncRing * ring = &reader->ring;
+  struct io_uring_params params;
+  (void)memset(&params, 0, sizeof(struct io_uring_params));
+  int fd = (int)syscall(__NR_io_uring_setup, ASYNC_RING_ENTRY_COUNT, &params);
+  // Not built into the kernel, or forbidden (by seccomp in many containers)
+  if(fd < 0) return kEPUB3_NO;
+
+  ring->submissionMappingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->completionMappingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring->completionMappingSize > ring->submissionMappingSize) {
+      ring->submissionMappingSize = ring->completionMappingSize;
+    }
+    ring->completionMappingSize = ring->submissionMappingSize;
+  }
+  ring->submissionMapping = mmap(NULL, ring->submissionMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->completionMapping = MAP_FAILED;
+  ring->submissionEntries = MAP_FAILED;
+  if(ring->submissionMapping != MAP_FAILED) {
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->completionMapping = ring->submissionMapping;
+    } else {
+      ring->completionMapping = mmap(NULL, ring->completionMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->submissionEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->submissionEntries = mmap(NULL, ring->submissionEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  }
+  if(ring->submissionMapping == MAP_FAILED || ring->completionMapping == MAP_FAILED || ring->submissionEntries == MAP_FAILED) {
+    if(ring->submissionEntries != MAP_FAILED) (void)munmap(ring->submissionEntries, ring->submissionEntriesSize);
+    if(ring->completionMapping != MAP_FAILED && ring->completionMapping != ring->submissionMapping) (void)munmap(ring->completionMapping, ring->completionMappingSize);
+    if(ring->submissionMapping != MAP_FAILED) (void)munmap(ring->submissionMapping, ring->submissionMappingSize);
+    (void)close(fd);
+    return kEPUB3_NO;
+  }
+
+  unsigned char * submission = ring->submissionMapping;
+  unsigned char * completion = ring->completionMapping;
+  ring->submissionHead = (volatile unsigned *)(submission + params.sq_off.head);
+  ring->submissionTail = (volatile unsigned *)(submission + params.sq_off.tail);
+  ring->submissionMask = *(unsigned *)(submission + params.sq_off.ring_mask);
+  ring->submissionArray = (unsigned *)(submission + params.sq_off.array);
+  ring->completionHead = (volatile unsigned *)(completion + params.cq_off.head);
+  ring->completionTail = (volatile unsigned *)(completion + params.cq_off.tail);
+  ring->completionMask = *(unsigned *)(completion + params.cq_off.ring_mask);
+  ring->completions = (struct io_uring_cqe *)(completion + params.cq_off.cqes);
+  // The completion ring is at least as large, so it can't overflow while this many are in flight
+  ring->entryCount = params.sq_entries;
+  ring->inFlight = 0;
+  ring->fd = fd;
+  (void)pthread_mutex_init(&ring->lock, NULL);
+  (void)pthread_cond_init(&ring->roomAvailable, NULL);
+
+  if(pthread_create(&ring->reaper, NULL, _EPUB3AsyncRingReaperMain, reader) != 0) {
+    (void)pthread_cond_destroy(&ring->roomAvailable);
+    (void)pthread_mutex_destroy(&ring->lock);
+    (void)munmap(ring->submissionEntries, ring->submissionEntriesSize);
+    if(ring->completionMapping != ring->submissionMapping) (void)munmap(ring->completionMapping, ring->completionMappingSize);
+    (void)munmap(ring->submissionMapping, ring->submissionMappingSize);
+    (void)close(fd);
+    ring->fd = -1;
+    return kEPUB3_NO;
+  }
+  return kEPUB3_YES;
+}
+
+// With ring->lock held. A read of what is left of request's iovec, or a no-op (which stops the reaper) for NULL.
+static void _EPUB3AsyncRingQueue(EPUB3AsyncRing * ring, EPUB3AsyncReadPtr request)
+{
+  unsigned tail = *ring->submissionTail;
+  unsigned index = tail & ring->submissionMask;
+  struct io_uring_sqe * entry = &ring->submissionEntries[index];
+  (void)memset(entry, 0, sizeof(struct io_uring_sqe));
+  if(request != NULL) {
+    entry->opcode = IORING_OP_READV;
+    entry->fd = request->fd;
+    entry->off = request->fileOffset + request->transferred;
+    entry->addr = (uint64_t)(uintptr_t)&request->ioVector;
+    entry->len = 1;
+  } else {
+    entry->opcode = IORING_OP_NOP;
+  }
+  entry->user_data = (uint64_t)(uintptr_t)request;
+  ring->submissionArray[index] = index;
+  // The entry has to be visible before the tail that hands it to the kernel
+  __sync_synchronize();
+  *ring->submissionTail = tail + 1;
+  __sync_synchronize();
+  while(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0 && errno == EINTR);
+}
+
+static void _EPUB3AsyncRingSubmit(EPUB3AsyncRing * ring, EPUB3AsyncReadPtr request)
+{
+  (void)pthread_mutex_lock(&ring->lock);
+  while(ring->inFlight >= ring->entryCount) {
+    (void)pthread_cond_wait(&ring->roomAvailable, &ring->lock);
+  }
+  ring->inFlight++;
+  _EPUB3AsyncRingQueue(ring, request);
+  (void)pthread_mutex_unlock(&ring->lock);
+}
+
+static void * _EPUB3AsyncRingReaperMain(void * context)
+{
+  EPUB3AsyncReaderRef reader = context;
+  EPUB3AsyncRing * ring = &reader->ring;
+  for(;;) {
+    unsigned head = *ring->completionHead;
+    unsigned tail = *ring->completionTail;
+    __sync_synchronize();
+    if(head == tail) {
+      (void)syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      continue;
+    }
+    struct io_uring_cqe * completion = &ring->completions[head & ring->completionMask];
+    EPUB3AsyncReadPtr request = (EPUB3AsyncReadPtr)(uintptr_t)completion->user_data;
+    int32_t result = completion->res;
+    __sync_synchronize();
+    *ring->completionHead = head + 1;
+
+    if(request == NULL) break;
+
+    // The request was filled in under the lock before it went to the kernel
+    (void)pthread_mutex_lock(&ring->lock);
+    if(result > 0) {
+      request->transferred += (uint32_t)result;
+      request->ioVector.iov_base = (unsigned char *)request->buffer + request->transferred;
+      request->ioVector.iov_len = request->bufferSize - request->transferred;
+    } else {
+      request->error = kEPUB3FileReadFromArchiveError;
+    }
+    if(request->error == kEPUB3Success && request->transferred < request->bufferSize) {
+      // A short read, the rest takes the same slot
+      _EPUB3AsyncRingQueue(ring, request);
+      (void)pthread_mutex_unlock(&ring->lock);
+      continue;
+    }
+    ring->inFlight--;
+    (void)pthread_cond_signal(&ring->roomAvailable);
+    (void)pthread_mutex_unlock(&ring->lock);
+    EPUB3WorkPoolSubmit(reader->pool, _EPUB3AsyncReadFinish, request);
+  }
+  return NULL;
+}
+
+static void _EPUB3AsyncRingRelease(EPUB3AsyncRing * ring)
+{
+  (void)pthread_mutex_lock(&ring->lock);
+  _EPUB3AsyncRingQueue(ring, NULL);
+  (void)pthread_mutex_unlock(&ring->lock);
+  (void)pthread_join(ring->reaper, NULL);
+  (void)pthread_cond_destroy(&ring->roomAvailable);
+  (void)pthread_mutex_destroy(&ring->lock);
+  (void)munmap(ring->submissionEntries, ring->submissionEntriesSize);
+  if(ring->completionMapping != ring->submissionMapping) (void)munmap(ring->completionMapping, ring->completionMappingSize);
+  (void)munmap(ring->submissionMapping, ring->submissionMappingSize);
+  (void)close(ring->fd);
+  ring->fd = -1;
+}
+
+#endif
+
+#pragma mark - Reads
+
+// On the pool, once the archive's bytes are in (or the read has failed)
+static void _EPUB3AsyncReadFinish(void * context)
+{
+  EPUB3AsyncReadPtr request = context;
+  if(request->fd >= 0) {
+    (void)close(request->fd);
+    request->fd = -1;
+  }
+  EPUB3ArchiveEntryPtr entry = request->entry;
+  if(request->error == kEPUB3Success && !request->isRange && entry->method == Z_DEFLATED) {
+    void * bytes = EPUB3Malloc(entry->uncompressedSize > 0 ? (size_t)entry->uncompressedSize : 1U);
+    request->error = EPUB3InflateRawBuffer(request->buffer, request->bufferSize, bytes, (uint32_t)entry->uncompressedSize);
+    EPUB3_FREE_AND_NULL(request->buffer);
+    request->buffer = bytes;
+    request->bufferSize = (uint32_t)entry->uncompressedSize;
+  }
+  if(request->error == kEPUB3Success && !request->isRange && request->epub->verifiesReads && EPUB3CRC32(0, request->buffer, request->bufferSize) != entry->crc) {
+    request->error = kEPUB3FileChecksumError;
+  }
+  if(request->error == kEPUB3Success) {
+    request->resource = EPUB3ResourceCreateWithBytes(request->buffer, request->bufferSize);
+    request->buffer = NULL;
+    if(!request->isRange) {
+      EPUB3ResourceCacheInsertResource(&request->epub->archiveIdentity, request->path, request->resource, kEPUB3_NO, EPUB3ResourceGetByteCount(request->resource), request->epub->verifiesReads);
+    }
+  }
+  EPUB3_FREE_AND_NULL(request->buffer);
+  _EPUB3AsyncReadComplete(request);
+}
+
+// On the pool: finds the entry and works out which bytes of the archive file to read
+static void _EPUB3AsyncReadStart(void * context)
+{
+  EPUB3AsyncReadPtr request = context;
+  request->error = EPUB3GetArchiveEntry(request->epub, request->path, &request->entry);
+  if(request->error != kEPUB3Success) {
+    _EPUB3AsyncReadFinish(request);
+    return;
+  }
+  EPUB3ArchiveEntryPtr entry = request->entry;
+
+  if(!request->isRange) {
+    request->resource = EPUB3ResourceCacheCopyResource(&request->epub->archiveIdentity, request->path, request->epub->verifiesReads, entry->crc);
+    if(request->resource != NULL) {
+      _EPUB3AsyncReadComplete(request);
+      return;
+    }
+    if(entry->compressedSize > WHOLE_FILE_MAX_SIZE || entry->uncompressedSize > WHOLE_FILE_MAX_SIZE) {
+      request->error = kEPUB3FileTooLargeError;
+      _EPUB3AsyncReadFinish(request);
+      return;
+    }
+    request->fileOffset = entry->dataOffset;
+    request->bufferSize = (uint32_t)entry->compressedSize;
+  } else {
+    if(request->offset > entry->uncompressedSize) {
+      request->error = kEPUB3InvalidArgumentError;
+      _EPUB3AsyncReadFinish(request);
+      return;
+    }
+    if(request->length > entry->uncompressedSize - request->offset) {
+      request->length = (uint32_t)(entry->uncompressedSize - request->offset);
+    }
+    if(entry->method == Z_DEFLATED) {
+      // Only the checkpoints know where to start inflating
+      uint32_t bytesRead = 0;
+      request->buffer = EPUB3Malloc(request->length > 0 ? request->length : 1U);
+      request->error = EPUB3ReadResourceRange(request->epub, request->path, request->offset, request->length, request->buffer, &bytesRead);
+      request->bufferSize = bytesRead;
+      _EPUB3AsyncReadFinish(request);
+      return;
+    }
+    request->fileOffset = entry->dataOffset + request->offset;
+    request->bufferSize = request->length;
+  }
+
+  request->buffer = EPUB3Malloc(request->bufferSize > 0 ? request->bufferSize : 1U);
+  if(request->bufferSize == 0) {
+    _EPUB3AsyncReadFinish(request);
+    return;
+  }
+  request->fd = open(request->epub->archivePath, O_RDONLY);
+  if(request->fd < 0) {
+    request->error = kEPUB3ArchiveUnavailableError;
+    _EPUB3AsyncReadFinish(request);
+    return;
+  }
+
+#if EPUB3_USE_IO_URING
+  if(request->reader->ring.fd >= 0) {
+    request->ioVector.iov_base = request->buffer;
+    request->ioVector.iov_len = request->bufferSize;
+    _EPUB3AsyncRingSubmit(&request->reader->ring, request);
+    return;
+  }
+#endif
+  while(request->transferred < request->bufferSize) {
+    ssize_t count = pread(request->fd, (unsigned char *)request->buffer + request->transferred, request->bufferSize - request->transferred, (off_t)(request->fileOffset + request->transferred));
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) {
+      request->error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    request->transferred += (uint32_t)count;
+  }
+  _EPUB3AsyncReadFinish(request);
+}
+
+static EPUB3Error _EPUB3AsyncReaderSubmit(EPUB3AsyncReaderRef reader, EPUB3Ref epub, const char * path, EPUB3Bool isRange, uint64_t offset, uint32_t length, EPUB3AsyncReadCallback callback, void * context)
+{
+  if(epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3AsyncReadPtr request = EPUB3Calloc(1, sizeof(struct EPUB3AsyncRead));
+  request->reader = reader;
+  request->epub = epub;
+  request->path = EPUB3Strdup(path);
+  request->isRange = isRange;
+  request->offset = offset;
+  request->length = length;
+  request->callback = callback;
+  request->context = context;
+  request->fd = -1;
+  request->error = kEPUB3Success;
+
+  (void)pthread_mutex_lock(&reader->lock);
+  reader->outstandingCount++;
+  (void)pthread_mutex_unlock(&reader->lock);
+  EPUB3WorkPoolSubmit(reader->pool, _EPUB3AsyncReadStart, request);
+  return kEPUB3Success;
+}
+
+#pragma mark - Public API
+
+EXPORT EPUB3AsyncReaderRef EPUB3AsyncReaderCreate(int32_t threadCount, EPUB3Error *error)
+{
+  assert(error != NULL);
+
+  if(threadCount < 0) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  if(threadCount == 0) {
+    threadCount = EPUB3GetProcessorCount();
+  }
+
+  EPUB3AsyncReaderRef memory = EPUB3Malloc(sizeof(struct EPUB3AsyncReader));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3AsyncReaderTypeID);
+  memory->firstCompletion = NULL;
+  memory->lastCompletion = NULL;
+  memory->outstandingCount = 0;
+  (void)memset(&memory->ring, 0, sizeof(EPUB3AsyncRing));
+  memory->ring.fd = -1;
+  if(pipe(memory->wakePipe) != 0) {
+    EPUB3_FREE_AND_NULL(memory);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+  // Neither side may block: the loop drains what is there, and one unread byte is enough of a wakeup
+  (void)fcntl(memory->wakePipe[0], F_SETFL, fcntl(memory->wakePipe[0], F_GETFL) | O_NONBLOCK);
+  (void)fcntl(memory->wakePipe[1], F_SETFL, fcntl(memory->wakePipe[1], F_GETFL) | O_NONBLOCK);
+  (void)pthread_mutex_init(&memory->lock, NULL);
+  (void)pthread_cond_init(&memory->allFinished, NULL);
+  memory->pool = EPUB3WorkPoolCreate(threadCount);
+#if EPUB3_USE_IO_URING
+  (void)_EPUB3AsyncRingCreate(memory);
+#endif
+
+  *error = kEPUB3Success;
+  return memory;
+}
+
+EXPORT EPUB3AsyncBackend EPUB3AsyncReaderGetBackend(EPUB3AsyncReaderRef reader)
+{
+  assert(reader != NULL);
+  return reader->ring.fd >= 0 ? kEPUB3AsyncBackendIOUring : kEPUB3AsyncBackendThreadPool;
+}
+
+EXPORT int EPUB3AsyncReaderGetFileDescriptor(EPUB3AsyncReaderRef reader)
+{
+  assert(reader != NULL);
+  return reader->wakePipe[0];
+}
+
+EXPORT EPUB3Error EPUB3AsyncReadResource(EPUB3AsyncReaderRef reader, EPUB3Ref epub, const char * path, EPUB3AsyncReadCallback callback, void * context)
+{
+  assert(reader != NULL);
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(callback != NULL);
+
+  return _EPUB3AsyncReaderSubmit(reader, epub, path, kEPUB3_NO, 0, 0, callback, context);
+}
+
+EXPORT EPUB3Error EPUB3AsyncReadResourceRange(EPUB3AsyncReaderRef reader, EPUB3Ref epub, const char * path, uint64_t offset, uint32_t length, EPUB3AsyncReadCallback callback, void * context)
+{
+  assert(reader != NULL);
+  assert(epub != NULL);
+  assert(path != NULL);
+  assert(callback != NULL);
+
+  return _EPUB3AsyncReaderSubmit(reader, epub, path, kEPUB3_YES, offset, length, callback, context);
+}
+
+EXPORT int32_t EPUB3AsyncReaderDispatch(EPUB3AsyncReaderRef reader)
+{
+  assert(reader != NULL);
+
+  // Drained before the queue is taken, so a read finishing in between leaves a byte for the next poll
+  char drain[64];
+  while(read(reader->wakePipe[0], drain, sizeof(drain)) > 0);
+
+  (void)pthread_mutex_lock(&reader->lock);
+  EPUB3AsyncReadPtr completed = reader->firstCompletion;
+  reader->firstCompletion = NULL;
+  reader->lastCompletion = NULL;
+  (void)pthread_mutex_unlock(&reader->lock);
+
+  int32_t count = 0;
+  while(completed != NULL) {
+    EPUB3AsyncReadPtr next = completed->next;
+    completed->callback(completed->context, completed->error == kEPUB3Success ? completed->resource : NULL, completed->error);
+    _EPUB3AsyncReadFree(completed);
+    completed = next;
+    count++;
+  }
+  return count;
+}
+
+EXPORT void EPUB3AsyncReaderRelease(EPUB3AsyncReaderRef reader)
+{
+  if(reader == NULL) return;
+
+  (void)pthread_mutex_lock(&reader->lock);
+  while(reader->outstandingCount > 0) {
+    (void)pthread_cond_wait(&reader->allFinished, &reader->lock);
+  }
+  (void)pthread_mutex_unlock(&reader->lock);
+
+#if EPUB3_USE_IO_URING
+  if(reader->ring.fd >= 0) {
+    _EPUB3AsyncRingRelease(&reader->ring);
+  }
+#endif
+  EPUB3WorkPoolRelease(reader->pool);
+
+  EPUB3AsyncReadPtr completed = reader->firstCompletion;
+  while(completed != NULL) {
+    EPUB3AsyncReadPtr next = completed->next;
+    _EPUB3AsyncReadFree(completed);
+    completed = next;
+  }
+  (void)close(reader->wakePipe[0]);
+  (void)close(reader->wakePipe[1]);
+  (void)pthread_cond_destroy(&reader->allFinished);
+  (void)pthread_mutex_destroy(&reader->lock);
+  EPUB3ObjectRelease(reader);
+}
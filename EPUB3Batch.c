@@ -0,0 +1,728 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <stdarg.h>
+#include <strings.h>
+
+const char * kEPUB3BatchTypeID = "_EPUB3Batch_t";
+
+static void _EPUB3BatchSniffStage(void * context);
+static void _EPUB3BatchOpenStage(void * context);
+static void _EPUB3BatchParseStage(void * context);
+static void _EPUB3BatchCoverStage(void * context);
+static void _EPUB3BatchExtractStage(void * context);
+static void _EPUB3BatchFinishJob(EPUB3BatchJobRef job);
+static EPUB3ScanIndexEntryPtr _EPUB3BatchCopyScanIndexEntry(EPUB3BatchRef batch, const char * path);
+static void _EPUB3BatchStoreScanIndexEntry(EPUB3BatchRef batch, EPUB3ScanIndexEntryPtr entry);
+
+#pragma mark - Public API
+
+EXPORT EPUB3BatchRef EPUB3BatchCreate(const EPUB3BatchOptions * options, EPUB3Error *error)
+{
+  assert(options != NULL);
+  assert(options->recordCallback != NULL);
+  assert(error != NULL);
+
+  if(options->threadCount < 0 || options->maxFilesInFlight < 0) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+
+  if(options->extractDirectory != NULL) {
+    struct stat st;
+    (void)mkdir(options->extractDirectory, 0755);
+    if(stat(options->extractDirectory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      *error = kEPUB3InvalidArgumentError;
+      return NULL;
+    }
+  }
+
+  // libxml2 has to be initialized once, before the workers start parsing concurrently
+  xmlInitParser();
+
+  EPUB3WorkPoolRef pool = EPUB3WorkPoolCreate(options->threadCount);
+  if(pool == NULL) {
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+
+  EPUB3BatchRef memory = EPUB3Malloc(sizeof(struct EPUB3Batch));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3BatchTypeID);
+  memory->pool = pool;
+  memory->recordCallback = options->recordCallback;
+  memory->callbackContext = options->callbackContext;
+  memory->includeCover = options->includeCover;
+  memory->extractDirectory = options->extractDirectory != NULL ? EPUB3Strdup(options->extractDirectory) : NULL;
+  memory->maxFilesInFlight = options->maxFilesInFlight > 0 ? options->maxFilesInFlight : pool->threadCount * BATCH_FILES_IN_FLIGHT_PER_THREAD;
+  memory->filesInFlight = 0;
+  memory->nextIndex = 0;
+  memory->statistics.fileCount = 0;
+  memory->statistics.succeededCount = 0;
+  memory->statistics.failedCount = 0;
+  memory->statistics.unchangedCount = 0;
+  memory->indexPath = NULL;
+  memory->indexTable = NULL;
+  memory->indexBucketCount = 0;
+  memory->indexEntryCount = 0;
+  (void)pthread_mutex_init(&memory->lock, NULL);
+  (void)pthread_cond_init(&memory->slotAvailable, NULL);
+  (void)pthread_mutex_init(&memory->outputLock, NULL);
+  if(options->indexPath != NULL) {
+    memory->indexPath = EPUB3Strdup(options->indexPath);
+    memory->indexBucketCount = SCAN_INDEX_INITIAL_BUCKET_COUNT;
+    memory->indexTable = EPUB3Calloc(memory->indexBucketCount, sizeof(EPUB3ScanIndexEntryPtr));
+    // An unreadable or outdated index only costs a full scan
+    (void)EPUB3BatchLoadScanIndex(memory);
+  }
+  *error = kEPUB3Success;
+  return memory;
+}
+
+EXPORT EPUB3Error EPUB3BatchAddPath(EPUB3BatchRef batch, const char * path)
+{
+  assert(batch != NULL);
+  assert(path != NULL);
+
+  // Backpressure: the producer waits here instead of queueing an unbounded number of files
+  (void)pthread_mutex_lock(&batch->lock);
+  while(batch->filesInFlight >= batch->maxFilesInFlight) {
+    (void)pthread_cond_wait(&batch->slotAvailable, &batch->lock);
+  }
+  batch->filesInFlight++;
+  uint64_t index = batch->nextIndex++;
+  (void)pthread_mutex_unlock(&batch->lock);
+
+  EPUB3BatchJobRef job = EPUB3Calloc(1, sizeof(struct EPUB3BatchJob));
+  job->batch = batch;
+  job->path = EPUB3Strdup(path);
+  job->index = index;
+  job->error = kEPUB3Success;
+  EPUB3WorkPoolSubmit(batch->pool, _EPUB3BatchSniffStage, job);
+  return kEPUB3Success;
+}
+
+EXPORT EPUB3Error EPUB3BatchAddDirectory(EPUB3BatchRef batch, const char * directory)
+{
+  assert(batch != NULL);
+  assert(directory != NULL);
+
+  DIR * dir = opendir(directory);
+  if(dir == NULL) {
+    return kEPUB3InvalidArgumentError;
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  size_t directoryLength = strlen(directory);
+  struct dirent * entry;
+  while((entry = readdir(dir)) != NULL) {
+    if(entry->d_name[0] == '.') continue; // ".", ".." and hidden files
+
+    size_t nameLength = strlen(entry->d_name);
+    char * path = EPUB3Malloc(directoryLength + nameLength + 2);
+    (void)sprintf(path, "%s/%s", directory, entry->d_name);
+
+    struct stat st;
+    if(stat(path, &st) == 0) {
+      if(S_ISDIR(st.st_mode)) {
+        error = EPUB3BatchAddDirectory(batch, path);
+      } else if(S_ISREG(st.st_mode) && nameLength > 5 && strcasecmp(entry->d_name + nameLength - 5, ".epub") == 0) {
+        error = EPUB3BatchAddPath(batch, path);
+      }
+    }
+    EPUB3_FREE_AND_NULL(path);
+    if(error != kEPUB3Success) break;
+  }
+  (void)closedir(dir);
+  return error;
+}
+
+EXPORT void EPUB3BatchFinish(EPUB3BatchRef batch, EPUB3BatchStatistics * statistics)
+{
+  if(batch == NULL) return;
+
+  EPUB3WorkPoolRelease(batch->pool);
+  if(statistics != NULL) {
+    *statistics = batch->statistics;
+  }
+  if(batch->indexPath != NULL) {
+    (void)EPUB3BatchWriteScanIndex(batch);
+    for(uint32_t i = 0; i < batch->indexBucketCount; i++) {
+      EPUB3ScanIndexEntryPtr entry = batch->indexTable[i];
+      while(entry != NULL) {
+        EPUB3ScanIndexEntryPtr next = entry->next;
+        EPUB3ScanIndexEntryFree(entry);
+        entry = next;
+      }
+    }
+    EPUB3_FREE_AND_NULL(batch->indexTable);
+    EPUB3_FREE_AND_NULL(batch->indexPath);
+  }
+  EPUB3_FREE_AND_NULL(batch->extractDirectory);
+  (void)pthread_mutex_destroy(&batch->outputLock);
+  (void)pthread_cond_destroy(&batch->slotAvailable);
+  (void)pthread_mutex_destroy(&batch->lock);
+  EPUB3ObjectRelease(batch);
+}
+
+#pragma mark - Scan Index
+
+static uint64_t _EPUB3BatchDigestBytes(uint64_t digest, const void * bytes, size_t length)
+{
+  // 64-bit FNV-1a
+  const unsigned char * c = (const unsigned char *)bytes;
+  for(size_t i = 0; i < length; i++) {
+    digest ^= c[i];
+    digest *= 1099511628211ULL;
+  }
+  return digest;
+}
+
+// Fills in the digest of the central directory and the CRCs of the OPF and NCX at job->opfPath and
+// job->ncxPath. Nothing is read past the central directory.
+static void _EPUB3BatchDigestArchive(EPUB3BatchJobRef job)
+{
+  unzFile archive = job->epub->archive;
+  uint64_t digest = 14695981039346656037ULL;
+  job->opfCRC = 0;
+  job->ncxCRC = 0;
+
+  char name[PATH_MAX];
+  unz_file_info64 info;
+  for(int status = unzGoToFirstFile(archive); status == UNZ_OK; status = unzGoToNextFile(archive)) {
+    if(unzGetCurrentFileInfo64(archive, &info, name, sizeof(name), NULL, 0, NULL, 0) != UNZ_OK) break;
+    if(job->opfPath != NULL && strcmp(name, job->opfPath) == 0) {
+      job->opfCRC = (uint32_t)info.crc;
+      continue;
+    }
+    if(job->ncxPath != NULL && strcmp(name, job->ncxPath) == 0) {
+      job->ncxCRC = (uint32_t)info.crc;
+      continue;
+    }
+    uint32_t crc = (uint32_t)info.crc;
+    uint64_t size = (uint64_t)info.uncompressed_size;
+    digest = _EPUB3BatchDigestBytes(digest, name, strlen(name) + 1);
+    digest = _EPUB3BatchDigestBytes(digest, &crc, sizeof(crc));
+    digest = _EPUB3BatchDigestBytes(digest, &size, sizeof(size));
+  }
+  job->contentDigest = digest;
+}
+
+// Same resolution as EPUB3InitFromOPF uses to find the NCX
+static char * _EPUB3BatchCopyNCXPath(EPUB3Ref epub, const char * opfPath)
+{
+  if(epub->metadata == NULL || epub->metadata->ncxItem == NULL || epub->metadata->ncxItem->href == NULL) {
+    return NULL;
+  }
+  const char * href = epub->metadata->ncxItem->href;
+  if(*href == '/') {
+    return EPUB3Strdup(href);
+  }
+  char * opfRoot = EPUB3CopyOfPathByDeletingLastPathComponent(opfPath);
+  char * ncxPath = EPUB3CopyOfPathByAppendingPathComponent(opfRoot, href);
+  EPUB3Free(opfRoot);
+  return ncxPath;
+}
+
+void EPUB3ScanIndexEntryFree(EPUB3ScanIndexEntryPtr entry)
+{
+  if(entry == NULL) return;
+  EPUB3_FREE_AND_NULL(entry->path);
+  EPUB3_FREE_AND_NULL(entry->opfPath);
+  EPUB3_FREE_AND_NULL(entry->ncxPath);
+  EPUB3_FREE_AND_NULL(entry->coverPath);
+  EPUB3_FREE_AND_NULL(entry->recordBody);
+  EPUB3_FREE_AND_NULL(entry);
+}
+
+static EPUB3ScanIndexEntryPtr _EPUB3BatchCopyScanIndexEntry(EPUB3BatchRef batch, const char * path)
+{
+  EPUB3ScanIndexEntryPtr copy = NULL;
+  (void)pthread_mutex_lock(&batch->outputLock);
+  uint32_t bucket = SuperFastHash(path, (int)strlen(path)) % batch->indexBucketCount;
+  for(EPUB3ScanIndexEntryPtr entry = batch->indexTable[bucket]; entry != NULL; entry = entry->next) {
+    if(strcmp(entry->path, path) == 0) {
+      copy = EPUB3Calloc(1, sizeof(struct EPUB3ScanIndexEntry));
+      *copy = *entry;
+      copy->path = EPUB3Strdup(entry->path);
+      copy->opfPath = entry->opfPath != NULL ? EPUB3Strdup(entry->opfPath) : NULL;
+      copy->ncxPath = entry->ncxPath != NULL ? EPUB3Strdup(entry->ncxPath) : NULL;
+      copy->coverPath = entry->coverPath != NULL ? EPUB3Strdup(entry->coverPath) : NULL;
+      copy->recordBody = EPUB3Strdup(entry->recordBody);
+      copy->next = NULL;
+      break;
+    }
+  }
+  (void)pthread_mutex_unlock(&batch->outputLock);
+  return copy;
+}
+
+// Takes ownership of entry, replacing any entry for the same path. Call with outputLock held.
+static void _EPUB3BatchStoreScanIndexEntry(EPUB3BatchRef batch, EPUB3ScanIndexEntryPtr entry)
+{
+  if(batch->indexEntryCount >= (uint64_t)batch->indexBucketCount * 2) {
+    uint32_t bucketCount = batch->indexBucketCount * 4;
+    EPUB3ScanIndexEntryPtr * table = EPUB3Calloc(bucketCount, sizeof(EPUB3ScanIndexEntryPtr));
+    for(uint32_t i = 0; i < batch->indexBucketCount; i++) {
+      EPUB3ScanIndexEntryPtr existing = batch->indexTable[i];
+      while(existing != NULL) {
+        EPUB3ScanIndexEntryPtr next = existing->next;
+        uint32_t bucket = SuperFastHash(existing->path, (int)strlen(existing->path)) % bucketCount;
+        existing->next = table[bucket];
+        table[bucket] = existing;
+        existing = next;
+      }
+    }
+    EPUB3_FREE_AND_NULL(batch->indexTable);
+    batch->indexTable = table;
+    batch->indexBucketCount = bucketCount;
+  }
+
+  uint32_t bucket = SuperFastHash(entry->path, (int)strlen(entry->path)) % batch->indexBucketCount;
+  EPUB3ScanIndexEntryPtr * link = &batch->indexTable[bucket];
+  while(*link != NULL) {
+    if(strcmp((*link)->path, entry->path) == 0) {
+      EPUB3ScanIndexEntryPtr replaced = *link;
+      entry->next = replaced->next;
+      *link = entry;
+      EPUB3ScanIndexEntryFree(replaced);
+      return;
+    }
+    link = &(*link)->next;
+  }
+  entry->next = batch->indexTable[bucket];
+  batch->indexTable[bucket] = entry;
+  batch->indexEntryCount++;
+}
+
+// One line per file, fields separated by tabs, the record body last:
+// path dev inode size mtime contentDigest opfCRC ncxCRC opfPath ncxPath coverPath coverBytes coverIsKnown recordBody
+EPUB3Error EPUB3BatchLoadScanIndex(EPUB3BatchRef batch)
+{
+  assert(batch != NULL);
+  assert(batch->indexPath != NULL);
+
+  FILE * file = fopen(batch->indexPath, "r");
+  if(file == NULL) {
+    return errno == ENOENT ? kEPUB3Success : kEPUB3UnknownError;
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  char * line = NULL;
+  size_t lineCapacity = 0;
+  ssize_t lineLength = getline(&line, &lineCapacity, file);
+  if(lineLength < 0 || strncmp(line, SCAN_INDEX_MAGIC "\n", lineLength) != 0) {
+    error = kEPUB3UnknownError;
+  }
+
+  while(error == kEPUB3Success && (lineLength = getline(&line, &lineCapacity, file)) > 0) {
+    if(line[lineLength - 1] == '\n') {
+      line[--lineLength] = '\0';
+    }
+    char * fields[SCAN_INDEX_FIELD_COUNT];
+    int32_t fieldCount = 0;
+    char * field = line;
+    fields[fieldCount++] = field;
+    while(fieldCount < SCAN_INDEX_FIELD_COUNT && (field = strchr(field, '\t')) != NULL) {
+      *field++ = '\0';
+      fields[fieldCount++] = field;
+    }
+    if(fieldCount != SCAN_INDEX_FIELD_COUNT) {
+      error = kEPUB3UnknownError;
+      break;
+    }
+
+    EPUB3ScanIndexEntryPtr entry = EPUB3Calloc(1, sizeof(struct EPUB3ScanIndexEntry));
+    entry->path = EPUB3Strdup(fields[0]);
+    entry->identity.device = strtoull(fields[1], NULL, 10);
+    entry->identity.inode = strtoull(fields[2], NULL, 10);
+    entry->identity.size = strtoull(fields[3], NULL, 10);
+    entry->identity.modificationTime = strtoll(fields[4], NULL, 10);
+    entry->contentDigest = strtoull(fields[5], NULL, 16);
+    entry->opfCRC = (uint32_t)strtoul(fields[6], NULL, 16);
+    entry->ncxCRC = (uint32_t)strtoul(fields[7], NULL, 16);
+    entry->opfPath = *fields[8] != '\0' ? EPUB3Strdup(fields[8]) : NULL;
+    entry->ncxPath = *fields[9] != '\0' ? EPUB3Strdup(fields[9]) : NULL;
+    entry->coverPath = *fields[10] != '\0' ? EPUB3Strdup(fields[10]) : NULL;
+    entry->coverByteCount = (uint32_t)strtoul(fields[11], NULL, 10);
+    entry->coverIsKnown = strcmp(fields[12], "1") == 0 ? kEPUB3_YES : kEPUB3_NO;
+    entry->recordBody = EPUB3Strdup(fields[13]);
+    entry->seen = kEPUB3_NO;
+    _EPUB3BatchStoreScanIndexEntry(batch, entry);
+  }
+  free(line); // allocated by getline
+  (void)fclose(file);
+  return error;
+}
+
+// Written next to the old index and renamed over it, so a crash never leaves a truncated index behind
+EPUB3Error EPUB3BatchWriteScanIndex(EPUB3BatchRef batch)
+{
+  assert(batch != NULL);
+  assert(batch->indexPath != NULL);
+
+  char temporaryPath[strlen(batch->indexPath) + 5];
+  (void)sprintf(temporaryPath, "%s.tmp", batch->indexPath);
+  FILE * file = fopen(temporaryPath, "w");
+  if(file == NULL) {
+    return kEPUB3UnknownError;
+  }
+
+  (void)fputs(SCAN_INDEX_MAGIC "\n", file);
+  for(uint32_t i = 0; i < batch->indexBucketCount; i++) {
+    for(EPUB3ScanIndexEntryPtr entry = batch->indexTable[i]; entry != NULL; entry = entry->next) {
+      if(!entry->seen) continue; // no longer part of the library
+      (void)fprintf(file, "%s\t%llu\t%llu\t%llu\t%lld\t%016llx\t%08x\t%08x\t%s\t%s\t%s\t%u\t%d\t%s\n", entry->path,
+                    (unsigned long long)entry->identity.device, (unsigned long long)entry->identity.inode,
+                    (unsigned long long)entry->identity.size, (long long)entry->identity.modificationTime,
+                    (unsigned long long)entry->contentDigest, entry->opfCRC, entry->ncxCRC,
+                    entry->opfPath != NULL ? entry->opfPath : "", entry->ncxPath != NULL ? entry->ncxPath : "",
+                    entry->coverPath != NULL ? entry->coverPath : "", entry->coverByteCount, entry->coverIsKnown ? 1 : 0,
+                    entry->recordBody);
+    }
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  if(fclose(file) != 0 || rename(temporaryPath, batch->indexPath) != 0) {
+    (void)unlink(temporaryPath);
+    error = kEPUB3UnknownError;
+  }
+  return error;
+}
+
+#pragma mark - Stages
+
+// Whether the index entry answers everything this batch reports. Extraction always needs the book.
+static EPUB3Bool _EPUB3BatchCanAnswerFromIndex(EPUB3BatchRef batch, EPUB3ScanIndexEntryPtr previous)
+{
+  return !batch->includeCover || previous->coverIsKnown;
+}
+
+static void _EPUB3BatchFail(EPUB3BatchJobRef job, const char * stage, EPUB3Error error)
+{
+  job->failedStage = stage;
+  job->error = error;
+  _EPUB3BatchFinishJob(job);
+}
+
+// Rejects anything that doesn't start the way the OCF spec requires (a stored "mimetype" entry first in
+// the archive holding "application/epub+zip"), or whose end of central directory record is damaged,
+// before paying for a central directory read.
+static void _EPUB3BatchSniffStage(void * context)
+{
+  EPUB3BatchJobRef job = (EPUB3BatchJobRef)context;
+
+  struct stat st;
+  if(stat(job->path, &st) != 0) {
+    _EPUB3BatchFail(job, "sniff", kEPUB3ArchiveUnavailableError);
+    return;
+  }
+  job->fileSize = (uint64_t)st.st_size;
+  job->hasIdentity = kEPUB3_YES;
+  job->identity.device = (uint64_t)st.st_dev;
+  job->identity.inode = (uint64_t)st.st_ino;
+  job->identity.size = (uint64_t)st.st_size;
+  job->identity.modificationTime = (int64_t)st.st_mtime;
+
+  if(job->batch->indexPath != NULL) {
+    job->previous = _EPUB3BatchCopyScanIndexEntry(job->batch, job->path);
+    if(job->previous != NULL && memcmp(&job->previous->identity, &job->identity, sizeof(EPUB3ArchiveIdentity)) == 0 &&
+       _EPUB3BatchCanAnswerFromIndex(job->batch, job->previous) && job->batch->extractDirectory == NULL) {
+      job->scanKind = kEPUB3BatchScanSkipped;
+      _EPUB3BatchFinishJob(job);
+      return;
+    }
+  }
+
+  int fd = open(job->path, O_RDONLY);
+  if(fd < 0) {
+    _EPUB3BatchFail(job, "sniff", kEPUB3ArchiveUnavailableError);
+    return;
+  }
+  EPUB3Error error = EPUB3ErrorForSniffClassification(EPUB3SniffFileDescriptor(fd, job->fileSize, NULL));
+  (void)close(fd);
+  if(error != kEPUB3Success) {
+    _EPUB3BatchFail(job, "sniff", error);
+    return;
+  }
+  EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchOpenStage, job);
+}
+
+static void _EPUB3BatchOpenStage(void * context)
+{
+  EPUB3BatchJobRef job = (EPUB3BatchJobRef)context;
+
+  job->epub = EPUB3Create();
+  EPUB3Error error = EPUB3PrepareArchiveAtPath(job->epub, job->path);
+  if(error != kEPUB3Success) {
+    _EPUB3BatchFail(job, "open", error);
+    return;
+  }
+
+  // The file was replaced or touched, see whether its contents really changed
+  EPUB3ScanIndexEntryPtr previous = job->previous;
+  if(previous != NULL && previous->opfPath != NULL) {
+    job->opfPath = EPUB3Strdup(previous->opfPath);
+    job->ncxPath = previous->ncxPath != NULL ? EPUB3Strdup(previous->ncxPath) : NULL;
+    _EPUB3BatchDigestArchive(job);
+    if(job->contentDigest == previous->contentDigest) {
+      if(job->opfCRC == previous->opfCRC && job->ncxCRC == previous->ncxCRC && _EPUB3BatchCanAnswerFromIndex(job->batch, previous)) {
+        job->scanKind = kEPUB3BatchScanVerified;
+        if(job->batch->extractDirectory != NULL) {
+          EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchExtractStage, job);
+        } else {
+          _EPUB3BatchFinishJob(job);
+        }
+        return;
+      }
+      job->scanKind = kEPUB3BatchScanReparsed;
+    }
+  }
+  EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchParseStage, job);
+}
+
+static void _EPUB3BatchParseStage(void * context)
+{
+  EPUB3BatchJobRef job = (EPUB3BatchJobRef)context;
+
+  EPUB3Error error = EPUB3InitAndValidate(job->epub);
+  if(error != kEPUB3Success) {
+    _EPUB3BatchFail(job, "parse", error);
+    return;
+  }
+
+  if(job->batch->indexPath != NULL) {
+    char * opfPath = NULL;
+    char * ncxPath = NULL;
+    if(EPUB3CopyRootFilePathFromContainer(job->epub, &opfPath) == kEPUB3Success) {
+      ncxPath = _EPUB3BatchCopyNCXPath(job->epub, opfPath);
+    }
+    EPUB3Bool samePaths = job->opfPath != NULL && opfPath != NULL && strcmp(job->opfPath, opfPath) == 0 &&
+      ((job->ncxPath == NULL && ncxPath == NULL) || (job->ncxPath != NULL && ncxPath != NULL && strcmp(job->ncxPath, ncxPath) == 0));
+    if(!samePaths) {
+      EPUB3_FREE_AND_NULL(job->opfPath);
+      EPUB3_FREE_AND_NULL(job->ncxPath);
+      job->opfPath = opfPath;
+      job->ncxPath = ncxPath;
+      uint64_t digest = job->contentDigest;
+      _EPUB3BatchDigestArchive(job);
+      if(job->scanKind == kEPUB3BatchScanReparsed && job->contentDigest != digest) {
+        job->scanKind = kEPUB3BatchScanFull;
+      }
+    } else {
+      EPUB3_FREE_AND_NULL(opfPath);
+      EPUB3_FREE_AND_NULL(ncxPath);
+    }
+  }
+
+  if(job->batch->includeCover) {
+    EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchCoverStage, job);
+  } else if(job->batch->extractDirectory != NULL) {
+    EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchExtractStage, job);
+  } else {
+    _EPUB3BatchFinishJob(job);
+  }
+}
+
+static void _EPUB3BatchCoverStage(void * context)
+{
+  EPUB3BatchJobRef job = (EPUB3BatchJobRef)context;
+
+  // A missing cover is not an error, the record just has no cover
+  job->coverPath = EPUB3CopyCoverImagePath(job->epub);
+  EPUB3ScanIndexEntryPtr previous = job->previous;
+  if(job->scanKind == kEPUB3BatchScanReparsed && previous->coverIsKnown && job->coverPath != NULL && previous->coverPath != NULL &&
+     strcmp(job->coverPath, previous->coverPath) == 0) {
+    // Every entry but the OPF and NCX is unchanged, so the cover is too
+    job->coverByteCount = previous->coverByteCount;
+  } else if(job->coverPath != NULL) {
+    void * bytes = NULL;
+    uint32_t byteCount = 0;
+    EPUB3Error error = EPUB3CopyCoverImage(job->epub, &bytes, &byteCount);
+    if(error != kEPUB3Success) {
+      _EPUB3BatchFail(job, "cover", error);
+      return;
+    }
+    job->coverByteCount = byteCount;
+    EPUB3_FREE_AND_NULL(bytes);
+  }
+  if(job->batch->extractDirectory != NULL) {
+    EPUB3WorkPoolSubmit(job->batch->pool, _EPUB3BatchExtractStage, job);
+  } else {
+    _EPUB3BatchFinishJob(job);
+  }
+}
+
+static void _EPUB3BatchExtractStage(void * context)
+{
+  EPUB3BatchJobRef job = (EPUB3BatchJobRef)context;
+
+  // One directory per input, named after its index so that identically named books don't collide
+  const char * extractDirectory = job->batch->extractDirectory;
+  job->extractedPath = EPUB3Malloc(strlen(extractDirectory) + 24);
+  (void)sprintf(job->extractedPath, "%s/%llu", extractDirectory, (unsigned long long)job->index);
+  EPUB3Error error = EPUB3ExtractArchiveToPath(job->epub, job->extractedPath);
+  if(error != kEPUB3Success) {
+    _EPUB3BatchFail(job, "extract", error);
+    return;
+  }
+  _EPUB3BatchFinishJob(job);
+}
+
+#pragma mark - Records
+
+static void _EPUB3BatchAppend(EPUB3BatchJobRef job, const char * format, ...)
+{
+  va_list arguments;
+  for(;;) {
+    size_t available = job->recordCapacity - job->recordLength;
+    va_start(arguments, format);
+    int count = vsnprintf(job->record + job->recordLength, available, format, arguments);
+    va_end(arguments);
+    if(count < 0) return;
+    if((size_t)count < available) {
+      job->recordLength += (size_t)count;
+      return;
+    }
+    job->recordCapacity = job->recordCapacity * 2 + (size_t)count + 1;
+    job->record = EPUB3Realloc(job->record, job->recordCapacity);
+  }
+}
+
+static void _EPUB3BatchAppendJSONString(EPUB3BatchJobRef job, const char * key, const char * value)
+{
+  _EPUB3BatchAppend(job, ",\"%s\":", key);
+  if(value == NULL) {
+    _EPUB3BatchAppend(job, "null");
+    return;
+  }
+  _EPUB3BatchAppend(job, "\"");
+  for(const unsigned char * c = (const unsigned char *)value; *c != '\0'; c++) {
+    if(*c == '"' || *c == '\\') {
+      _EPUB3BatchAppend(job, "\\%c", *c);
+    } else if(*c < 0x20) {
+      _EPUB3BatchAppend(job, "\\u%04x", *c);
+    } else {
+      _EPUB3BatchAppend(job, "%c", *c);
+    }
+  }
+  _EPUB3BatchAppend(job, "\"");
+}
+
+static void _EPUB3BatchFinishJob(EPUB3BatchJobRef job)
+{
+  EPUB3BatchRef batch = job->batch;
+
+  job->recordCapacity = 512;
+  job->record = EPUB3Malloc(job->recordCapacity);
+  job->recordLength = 0;
+  _EPUB3BatchAppend(job, "{\"index\":%llu", (unsigned long long)job->index);
+  _EPUB3BatchAppendJSONString(job, "path", job->path);
+  _EPUB3BatchAppend(job, ",\"fileSize\":%llu", (unsigned long long)job->fileSize);
+
+  size_t bodyStart = job->recordLength;
+  // A verified book whose extraction failed is reported (and indexed) as the failure
+  EPUB3Bool fromIndex = (job->scanKind == kEPUB3BatchScanSkipped || job->scanKind == kEPUB3BatchScanVerified) && job->failedStage == NULL;
+  if(fromIndex) {
+    EPUB3ScanIndexEntryPtr previous = job->previous;
+    _EPUB3BatchAppend(job, "%s", previous->recordBody);
+    if(previous->opfPath == NULL) {
+      job->error = kEPUB3UnknownError; // failed last time too
+    }
+    job->coverPath = previous->coverPath;
+    job->coverByteCount = previous->coverByteCount;
+    previous->coverPath = NULL;
+  } else if(job->error != kEPUB3Success) {
+    _EPUB3BatchAppend(job, ",\"status\":\"error\"");
+    _EPUB3BatchAppendJSONString(job, "stage", job->failedStage);
+    _EPUB3BatchAppend(job, ",\"error\":%d", (int)job->error);
+  } else {
+    EPUB3MetadataRef metadata = job->epub->metadata;
+    _EPUB3BatchAppend(job, ",\"status\":\"ok\",\"version\":\"%s\"", metadata->version == kEPUB3Version_3 ? "3.0" : "2.0");
+    _EPUB3BatchAppendJSONString(job, "title", metadata->title);
+    _EPUB3BatchAppendJSONString(job, "identifier", metadata->identifier);
+    _EPUB3BatchAppendJSONString(job, "language", metadata->language);
+    _EPUB3BatchAppend(job, ",\"manifestItems\":%d,\"spineItems\":%d", job->epub->manifest->itemCount, job->epub->spine->itemCount);
+  }
+  size_t bodyEnd = job->recordLength;
+  if(job->error == kEPUB3Success) {
+    if(batch->includeCover) {
+      _EPUB3BatchAppendJSONString(job, "cover", job->coverPath);
+      _EPUB3BatchAppend(job, ",\"coverBytes\":%u", job->coverByteCount);
+    }
+    if(batch->extractDirectory != NULL) {
+      _EPUB3BatchAppendJSONString(job, "extractedTo", job->extractedPath);
+    }
+  }
+  if(batch->indexPath != NULL) {
+    static const char * scanKinds[] = {"full", "skipped", "verified", "reparsed"};
+    _EPUB3BatchAppend(job, ",\"scan\":\"%s\"", scanKinds[job->scanKind]);
+  }
+  _EPUB3BatchAppend(job, "}\n");
+
+  // Paths the line based index can't hold are simply scanned in full every time
+  EPUB3ScanIndexEntryPtr entry = NULL;
+  if(batch->indexPath != NULL && job->hasIdentity && strpbrk(job->path, "\t\n") == NULL) {
+    entry = EPUB3Calloc(1, sizeof(struct EPUB3ScanIndexEntry));
+    entry->path = EPUB3Strdup(job->path);
+    entry->identity = job->identity;
+    entry->seen = kEPUB3_YES;
+    entry->recordBody = EPUB3Malloc(bodyEnd - bodyStart + 1);
+    (void)memcpy(entry->recordBody, job->record + bodyStart, bodyEnd - bodyStart);
+    entry->recordBody[bodyEnd - bodyStart] = '\0';
+    if(fromIndex) {
+      EPUB3ScanIndexEntryPtr previous = job->previous;
+      entry->contentDigest = previous->contentDigest;
+      entry->opfCRC = previous->opfCRC;
+      entry->ncxCRC = previous->ncxCRC;
+      entry->opfPath = previous->opfPath;
+      entry->ncxPath = previous->ncxPath;
+      entry->coverPath = job->coverPath;
+      entry->coverByteCount = job->coverByteCount;
+      entry->coverIsKnown = previous->coverIsKnown;
+      previous->opfPath = previous->ncxPath = NULL;
+      job->coverPath = NULL;
+    } else if(job->error == kEPUB3Success) {
+      entry->contentDigest = job->contentDigest;
+      entry->opfCRC = job->opfCRC;
+      entry->ncxCRC = job->ncxCRC;
+      entry->opfPath = job->opfPath;
+      entry->ncxPath = job->ncxPath;
+      entry->coverPath = job->coverPath;
+      entry->coverByteCount = job->coverByteCount;
+      entry->coverIsKnown = batch->includeCover;
+      job->opfPath = job->ncxPath = job->coverPath = NULL;
+    }
+  }
+
+  (void)pthread_mutex_lock(&batch->outputLock);
+  batch->recordCallback(batch->callbackContext, job->record, job->recordLength);
+  batch->statistics.fileCount++;
+  if(job->error == kEPUB3Success) {
+    batch->statistics.succeededCount++;
+  } else {
+    batch->statistics.failedCount++;
+  }
+  if(fromIndex) {
+    batch->statistics.unchangedCount++;
+  }
+  if(entry != NULL) {
+    _EPUB3BatchStoreScanIndexEntry(batch, entry);
+  }
+  (void)pthread_mutex_unlock(&batch->outputLock);
+
+  if(job->epub != NULL) {
+    EPUB3Release(job->epub);
+  }
+  EPUB3_FREE_AND_NULL(job->record);
+  EPUB3_FREE_AND_NULL(job->extractedPath);
+  EPUB3_FREE_AND_NULL(job->coverPath);
+  EPUB3_FREE_AND_NULL(job->opfPath);
+  EPUB3_FREE_AND_NULL(job->ncxPath);
+  EPUB3ScanIndexEntryFree(job->previous);
+  EPUB3_FREE_AND_NULL(job->path);
+  EPUB3_FREE_AND_NULL(job);
+
+  (void)pthread_mutex_lock(&batch->lock);
+  batch->filesInFlight--;
+  (void)pthread_cond_signal(&batch->slotAvailable);
+  (void)pthread_mutex_unlock(&batch->lock);
+}
@@ -0,0 +1,337 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <sys/stat.h>
+
+static const char _EPUB3CacheContainerPath[] = "META-INF/container.xml";
+
+// Everything below is guarded by _EPUB3CacheLock. Loading entries are only in the table; once loaded they
+// are also on the LRU list and counted.
+static pthread_mutex_t _EPUB3CacheLock;
+static pthread_cond_t _EPUB3CacheLoadFinished;
+static pthread_once_t _EPUB3CacheOnce = PTHREAD_ONCE_INIT;
+static EPUB3CacheEntryPtr _EPUB3CacheTable[ARCHIVE_CACHE_HASH_SIZE];
+static EPUB3CacheEntryPtr _EPUB3CacheLRUHead = NULL; // most recently used
+static EPUB3CacheEntryPtr _EPUB3CacheLRUTail = NULL;
+static int32_t _EPUB3CacheCount = 0;
+static uint64_t _EPUB3CacheByteCount = 0;
+static int32_t _EPUB3CacheMaxCount = 0;
+static uint64_t _EPUB3CacheByteBudget = 0;
+
+static void _EPUB3CacheInitialize(void)
+{
+  (void)pthread_mutex_init(&_EPUB3CacheLock, NULL);
+  (void)pthread_cond_init(&_EPUB3CacheLoadFinished, NULL);
+}
+
+// Only the file, not its version, so that older versions of a file are found next to the current one
+static inline uint32_t _EPUB3CacheBucketForIdentity(const EPUB3ArchiveIdentity * identity)
+{
+  uint64_t mix = identity->inode ^ (identity->device << 32);
+  return ((uint32_t)(mix ^ (mix >> 32)) * 2654435761U) % ARCHIVE_CACHE_HASH_SIZE;
+}
+
+static inline EPUB3Bool _EPUB3CacheIsSameFile(const EPUB3ArchiveIdentity * a, const EPUB3ArchiveIdentity * b)
+{
+  return (a->device == b->device && a->inode == b->inode) ? kEPUB3_YES : kEPUB3_NO;
+}
+
+static inline EPUB3Bool _EPUB3CacheIsSameVersion(const EPUB3ArchiveIdentity * a, const EPUB3ArchiveIdentity * b)
+{
+  return (_EPUB3CacheIsSameFile(a, b) && a->size == b->size && a->modificationTime == b->modificationTime) ? kEPUB3_YES : kEPUB3_NO;
+}
+
+#pragma mark - Entries
+
+static void _EPUB3CacheListEntry(EPUB3CacheEntryPtr entry)
+{
+  entry->lruPrev = NULL;
+  entry->lruNext = _EPUB3CacheLRUHead;
+  if(_EPUB3CacheLRUHead != NULL) _EPUB3CacheLRUHead->lruPrev = entry;
+  _EPUB3CacheLRUHead = entry;
+  if(_EPUB3CacheLRUTail == NULL) _EPUB3CacheLRUTail = entry;
+}
+
+static void _EPUB3CacheUnlistEntry(EPUB3CacheEntryPtr entry)
+{
+  if(entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+  else _EPUB3CacheLRUHead = entry->lruNext;
+  if(entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+  else _EPUB3CacheLRUTail = entry->lruPrev;
+  entry->lruPrev = entry->lruNext = NULL;
+}
+
+// Makes entry unfindable. When nobody holds it any more it is pushed onto *victims, to be freed once the
+// lock has been dropped (closing a book isn't something to do while other threads wait on the cache).
+static void _EPUB3CacheUnlinkEntry(EPUB3CacheEntryPtr entry, EPUB3CacheEntryPtr * victims)
+{
+  EPUB3CacheEntryPtr * link = &_EPUB3CacheTable[_EPUB3CacheBucketForIdentity(&entry->identity)];
+  while(*link != NULL && *link != entry) {
+    link = &(*link)->hashNext;
+  }
+  if(*link == entry) {
+    *link = entry->hashNext;
+  }
+  entry->hashNext = NULL;
+
+  if(!entry->isLoading) {
+    _EPUB3CacheUnlistEntry(entry);
+    _EPUB3CacheCount--;
+    _EPUB3CacheByteCount -= entry->byteCount;
+  }
+  entry->isLinked = kEPUB3_NO;
+
+  if(entry->referenceCount == 0) {
+    entry->hashNext = *victims;
+    *victims = entry;
+  }
+}
+
+static void _EPUB3CacheFreeEntries(EPUB3CacheEntryPtr entries)
+{
+  while(entries != NULL) {
+    EPUB3CacheEntryPtr next = entries->hashNext;
+    if(entries->epub != NULL) {
+      entries->epub->cacheEntry = NULL;
+      EPUB3Release(entries->epub);
+    }
+    EPUB3_FREE_AND_NULL(entries->path);
+    EPUB3_FREE_AND_NULL(entries);
+    entries = next;
+  }
+}
+
+static void _EPUB3CacheEvict(EPUB3CacheEntryPtr * victims)
+{
+  while(_EPUB3CacheLRUTail != NULL && (_EPUB3CacheCount > _EPUB3CacheMaxCount || (_EPUB3CacheByteBudget > 0 && _EPUB3CacheByteCount > _EPUB3CacheByteBudget))) {
+    _EPUB3CacheUnlinkEntry(_EPUB3CacheLRUTail, victims);
+  }
+}
+
+// Roughly what opening the book keeps in memory: what was parsed out of its package documents, and an
+// index record for each archive entry once it has been read.
+static uint64_t _EPUB3CacheByteCountOfBook(EPUB3Ref epub)
+{
+  uint64_t byteCount = (uint64_t)epub->archiveFileCount * sizeof(struct EPUB3ArchiveEntry);
+  uint64_t size = 0;
+  if(EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, _EPUB3CacheContainerPath) == kEPUB3Success) {
+    byteCount += size;
+  }
+  if(epub->renditions != NULL && EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, epub->renditions[epub->selectedRendition].path) == kEPUB3Success) {
+    byteCount += size;
+  }
+  if(epub->metadata != NULL && epub->metadata->ncxItem != NULL && epub->metadata->ncxItem->href != NULL) {
+    const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+    char * ncxPath = EPUB3CopyOfPathByAppendingPathComponent(root, epub->metadata->ncxItem->href);
+    if(EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, ncxPath) == kEPUB3Success) {
+      byteCount += size;
+    }
+    EPUB3_FREE_AND_NULL(ncxPath);
+  }
+  return byteCount;
+}
+
+#pragma mark - Public API
+
+EXPORT EPUB3Error EPUB3CacheConfigure(int32_t maxCount, uint64_t byteBudget)
+{
+  if(maxCount < 0) return kEPUB3InvalidArgumentError;
+  (void)pthread_once(&_EPUB3CacheOnce, _EPUB3CacheInitialize);
+
+  EPUB3CacheEntryPtr victims = NULL;
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  _EPUB3CacheMaxCount = maxCount;
+  _EPUB3CacheByteBudget = byteBudget;
+  _EPUB3CacheEvict(&victims);
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  _EPUB3CacheFreeEntries(victims);
+  return kEPUB3Success;
+}
+
+EXPORT int32_t EPUB3CacheGetCount(void)
+{
+  (void)pthread_once(&_EPUB3CacheOnce, _EPUB3CacheInitialize);
+
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  int32_t count = _EPUB3CacheCount;
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  return count;
+}
+
+EXPORT uint64_t EPUB3CacheGetByteCount(void)
+{
+  (void)pthread_once(&_EPUB3CacheOnce, _EPUB3CacheInitialize);
+
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  uint64_t byteCount = _EPUB3CacheByteCount;
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  return byteCount;
+}
+
+EXPORT void EPUB3CachePurge(void)
+{
+  (void)pthread_once(&_EPUB3CacheOnce, _EPUB3CacheInitialize);
+
+  EPUB3CacheEntryPtr victims = NULL;
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  while(_EPUB3CacheLRUTail != NULL) {
+    _EPUB3CacheUnlinkEntry(_EPUB3CacheLRUTail, &victims);
+  }
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  _EPUB3CacheFreeEntries(victims);
+}
+
+EXPORT EPUB3Ref EPUB3CacheCopyArchiveAtPath(const char * path, EPUB3Error *error)
+{
+  assert(path != NULL);
+  assert(error != NULL);
+
+  (void)pthread_once(&_EPUB3CacheOnce, _EPUB3CacheInitialize);
+
+  // Whatever can't be looked up is opened the usual way, which also reports why it can't be opened
+  struct stat st;
+  if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return EPUB3CreateWithArchiveAtPath(path, error);
+  }
+  EPUB3ArchiveIdentity identity;
+  (void)memset(&identity, 0, sizeof(EPUB3ArchiveIdentity));
+  identity.device = (uint64_t)st.st_dev;
+  identity.inode = (uint64_t)st.st_ino;
+  identity.size = (uint64_t)st.st_size;
+  identity.modificationTime = (int64_t)st.st_mtime;
+  uint32_t bucket = _EPUB3CacheBucketForIdentity(&identity);
+
+  EPUB3CacheEntryPtr victims = NULL;
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  if(_EPUB3CacheMaxCount == 0) {
+    (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+    return EPUB3CreateWithArchiveAtPath(path, error);
+  }
+
+  EPUB3CacheEntryPtr entry = NULL;
+  EPUB3CacheEntryPtr candidate = _EPUB3CacheTable[bucket];
+  while(candidate != NULL) {
+    EPUB3CacheEntryPtr next = candidate->hashNext;
+    if(_EPUB3CacheIsSameVersion(&candidate->identity, &identity)) {
+      entry = candidate;
+    } else if(_EPUB3CacheIsSameFile(&candidate->identity, &identity)) {
+      // Written to since it was opened
+      _EPUB3CacheUnlinkEntry(candidate, &victims);
+    }
+    candidate = next;
+  }
+  if(entry == NULL) {
+    // Or replaced by another file, renamed over the one that was opened
+    candidate = _EPUB3CacheLRUHead;
+    while(candidate != NULL) {
+      EPUB3CacheEntryPtr next = candidate->lruNext;
+      if(strcmp(candidate->path, path) == 0) {
+        _EPUB3CacheUnlinkEntry(candidate, &victims);
+      }
+      candidate = next;
+    }
+  }
+
+  EPUB3Ref epub = NULL;
+  if(entry != NULL) {
+    entry->referenceCount++;
+    while(entry->isLoading) {
+      (void)pthread_cond_wait(&_EPUB3CacheLoadFinished, &_EPUB3CacheLock);
+    }
+    epub = entry->epub;
+    if(epub != NULL) {
+      *error = kEPUB3Success;
+      if(entry->isLinked) {
+        _EPUB3CacheUnlistEntry(entry);
+        _EPUB3CacheListEntry(entry);
+      }
+    } else {
+      *error = entry->error;
+      entry->referenceCount--;
+      if(entry->referenceCount == 0 && !entry->isLinked) {
+        entry->hashNext = victims;
+        victims = entry;
+      }
+    }
+    (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+    _EPUB3CacheFreeEntries(victims);
+    return epub;
+  }
+
+  // Anyone else asking for this book from now on waits for this thread to open it
+  entry = EPUB3Calloc(1, sizeof(struct EPUB3CacheEntry));
+  entry->identity = identity;
+  entry->path = EPUB3Strdup(path);
+  entry->referenceCount = 1;
+  entry->isLoading = kEPUB3_YES;
+  entry->isLinked = kEPUB3_YES;
+  entry->hashNext = _EPUB3CacheTable[bucket];
+  _EPUB3CacheTable[bucket] = entry;
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  _EPUB3CacheFreeEntries(victims);
+  victims = NULL;
+
+  EPUB3Error status = kEPUB3Success;
+  epub = EPUB3CreateWithArchiveAtPath(path, &status);
+  uint64_t byteCount = epub != NULL ? _EPUB3CacheByteCountOfBook(epub) : 0;
+
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  entry->epub = epub;
+  entry->error = status;
+  entry->byteCount = byteCount;
+  if(epub != NULL) {
+    epub->cacheEntry = entry;
+  }
+  // A failed open isn't remembered, and a file that changed between the stat and the open isn't the version
+  // the entry was filed under
+  if(entry->isLinked && (epub == NULL || !_EPUB3CacheIsSameVersion(&epub->archiveIdentity, &identity))) {
+    _EPUB3CacheUnlinkEntry(entry, &victims);
+  }
+  entry->isLoading = kEPUB3_NO;
+  if(entry->isLinked) {
+    _EPUB3CacheListEntry(entry);
+    _EPUB3CacheCount++;
+    _EPUB3CacheByteCount += byteCount;
+    _EPUB3CacheEvict(&victims);
+  }
+  if(epub == NULL) {
+    entry->referenceCount--;
+    if(entry->referenceCount == 0) {
+      entry->hashNext = victims;
+      victims = entry;
+    }
+  }
+  (void)pthread_cond_broadcast(&_EPUB3CacheLoadFinished);
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  _EPUB3CacheFreeEntries(victims);
+
+  *error = status;
+  return epub;
+}
+
+#pragma mark - Shared References
+
+void EPUB3CacheRetainBook(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+  assert(epub->cacheEntry != NULL);
+
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  epub->cacheEntry->referenceCount++;
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+}
+
+void EPUB3CacheReleaseBook(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+  assert(epub->cacheEntry != NULL);
+
+  EPUB3CacheEntryPtr victims = NULL;
+  (void)pthread_mutex_lock(&_EPUB3CacheLock);
+  EPUB3CacheEntryPtr entry = epub->cacheEntry;
+  entry->referenceCount--;
+  if(entry->referenceCount == 0 && !entry->isLinked) {
+    victims = entry;
+  }
+  (void)pthread_mutex_unlock(&_EPUB3CacheLock);
+  _EPUB3CacheFreeEntries(victims);
+}
@@ -0,0 +1,341 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <ctype.h>
+#include <math.h>
+#include <strings.h>
+
+static uint32_t _EPUB3ImageGetUInt16BE(const unsigned char * bytes)
+{
+  return ((uint32_t)bytes[0] << 8) | bytes[1];
+}
+
+static uint32_t _EPUB3ImageGetUInt16LE(const unsigned char * bytes)
+{
+  return bytes[0] | ((uint32_t)bytes[1] << 8);
+}
+
+static uint32_t _EPUB3ImageGetUInt24LE(const unsigned char * bytes)
+{
+  return bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16);
+}
+
+static uint32_t _EPUB3ImageGetUInt32BE(const unsigned char * bytes)
+{
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+#pragma mark - Reading
+
+// The bytes of the entry at offset, reading (and inflating) no further than length of them past what is
+// buffered already, in IMAGE_PROBE_READ_SIZE steps. *available is how many are buffered from offset on:
+// fewer than length only at the end of the entry or after a read error.
+static const unsigned char * _EPUB3ImageProbeBytes(EPUB3ImageProbe * probe, uint64_t offset, uint32_t length, uint32_t * available)
+{
+  assert(length <= IMAGE_PROBE_BUFFER_SIZE);
+  *available = 0;
+
+  uint64_t bufferEnd = probe->bufferOffset + probe->bufferLength;
+  if(offset >= probe->bufferOffset && offset + length <= bufferEnd) {
+    *available = (uint32_t)(bufferEnd - offset);
+    return probe->buffer + (offset - probe->bufferOffset);
+  }
+
+  if(offset >= probe->bufferOffset && offset <= bufferEnd) {
+    // Keep the part that is still wanted rather than seeking back, which would inflate from the start again
+    uint32_t kept = (uint32_t)(bufferEnd - offset);
+    (void)memmove(probe->buffer, probe->buffer + (offset - probe->bufferOffset), kept);
+    probe->bufferLength = kept;
+  } else {
+    // Past the buffer (a JPEG segment being skipped): the stream inflates up to it without keeping anything
+    if(probe->isAtEnd || EPUB3ResourceStreamSeek(probe->stream, offset) != kEPUB3Success) return NULL;
+    probe->bufferLength = 0;
+  }
+  probe->bufferOffset = offset;
+
+  while(probe->bufferLength < length && !probe->isAtEnd) {
+    uint32_t wanted = IMAGE_PROBE_BUFFER_SIZE - probe->bufferLength;
+    if(wanted > IMAGE_PROBE_READ_SIZE) {
+      wanted = IMAGE_PROBE_READ_SIZE;
+    }
+    uint32_t bytesRead = 0;
+    EPUB3Error error = EPUB3ResourceStreamRead(probe->stream, probe->buffer + probe->bufferLength, wanted, &bytesRead);
+    if(error != kEPUB3Success) {
+      probe->info->error = error;
+      probe->isAtEnd = kEPUB3_YES;
+    } else if(bytesRead == 0) {
+      probe->isAtEnd = kEPUB3_YES;
+    }
+    probe->bufferLength += bytesRead;
+  }
+  *available = probe->bufferLength;
+  return probe->buffer;
+}
+
+#pragma mark - Formats
+
+// Markers up to the first start of frame, which holds the size. Segments in between (EXIF, ICC profiles,
+// thumbnails) can be large, so they are skipped over rather than read.
+static void _EPUB3ImageProbeJPEG(EPUB3ImageProbe * probe)
+{
+  uint64_t offset = 2;
+  uint32_t available = 0;
+  for(;;) {
+    const unsigned char * marker = _EPUB3ImageProbeBytes(probe, offset, 4, &available);
+    if(marker == NULL || available < 4 || marker[0] != 0xFF) return;
+    uint32_t type = marker[1];
+    if(type == 0xFF) {
+      // Fill byte before a marker
+      offset++;
+      continue;
+    }
+    if(type == 0x01 || (type >= 0xD0 && type <= 0xD8)) {
+      offset += 2;
+      continue;
+    }
+    // Image data or the end of the image, and no frame header before it
+    if(type == 0xD9 || type == 0xDA) return;
+
+    uint32_t segmentLength = _EPUB3ImageGetUInt16BE(marker + 2);
+    if(segmentLength < 2) return;
+    // SOF0-SOF15, except DHT, JPG and DAC, which share the range
+    if(type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC) {
+      const unsigned char * frame = _EPUB3ImageProbeBytes(probe, offset + 4, 5, &available);
+      if(frame == NULL || available < 5) return;
+      probe->info->format = kEPUB3ImageFormatJPEG;
+      probe->info->height = _EPUB3ImageGetUInt16BE(frame + 1);
+      probe->info->width = _EPUB3ImageGetUInt16BE(frame + 3);
+      return;
+    }
+    offset += 2 + segmentLength;
+  }
+}
+
+static void _EPUB3ImageProbeWebP(EPUB3ImageProbe * probe, const unsigned char * header, uint32_t available)
+{
+  if(available < 30) return;
+  if(memcmp(header + 12, "VP8 ", 4) == 0) {
+    // Lossy: a key frame's start code, then 14 bit sizes
+    if(header[23] != 0x9D || header[24] != 0x01 || header[25] != 0x2A) return;
+    probe->info->width = _EPUB3ImageGetUInt16LE(header + 26) & 0x3FFF;
+    probe->info->height = _EPUB3ImageGetUInt16LE(header + 28) & 0x3FFF;
+  } else if(memcmp(header + 12, "VP8L", 4) == 0) {
+    // Lossless: a signature byte, then the sizes less one in 14 bits each
+    if(header[20] != 0x2F) return;
+    probe->info->width = 1 + (header[21] | ((uint32_t)(header[22] & 0x3F) << 8));
+    probe->info->height = 1 + ((header[22] >> 6) | ((uint32_t)header[23] << 2) | ((uint32_t)(header[24] & 0x0F) << 10));
+  } else if(memcmp(header + 12, "VP8X", 4) == 0) {
+    // Extended (animation, alpha, metadata): the canvas size less one in 24 bits each
+    probe->info->width = 1 + _EPUB3ImageGetUInt24LE(header + 24);
+    probe->info->height = 1 + _EPUB3ImageGetUInt24LE(header + 27);
+  } else {
+    return;
+  }
+  probe->info->format = kEPUB3ImageFormatWebP;
+}
+
+// A length attribute in CSS pixels; 0 for relative units (percentages, ems) that depend on the page
+static uint32_t _EPUB3ImageSVGLength(const char * value)
+{
+  char * unit = NULL;
+  double length = strtod(value, &unit);
+  if(unit == value || length <= 0) return 0;
+  while(isspace((unsigned char)*unit)) unit++;
+  if(*unit == '\0' || strncasecmp(unit, "px", 2) == 0) {
+  } else if(strncasecmp(unit, "pt", 2) == 0) {
+    length *= 96.0 / 72.0;
+  } else if(strncasecmp(unit, "pc", 2) == 0) {
+    length *= 16.0;
+  } else if(strncasecmp(unit, "in", 2) == 0) {
+    length *= 96.0;
+  } else if(strncasecmp(unit, "cm", 2) == 0) {
+    length *= 96.0 / 2.54;
+  } else if(strncasecmp(unit, "mm", 2) == 0) {
+    length *= 96.0 / 25.4;
+  } else {
+    return 0;
+  }
+  return length < (double)UINT32_MAX ? (uint32_t)lround(length) : 0;
+}
+
+// Copies the value of attribute name from the tag between start and end into value, if it is there
+static EPUB3Bool _EPUB3ImageSVGAttribute(const char * start, const char * end, const char * name, char * value, size_t valueSize)
+{
+  size_t nameLength = strlen(name);
+  for(const char * cursor = start; cursor + nameLength < end; cursor++) {
+    if(!isspace((unsigned char)cursor[-1]) || strncmp(cursor, name, nameLength) != 0) continue;
+    const char * equals = cursor + nameLength;
+    while(equals < end && isspace((unsigned char)*equals)) equals++;
+    if(equals == end || *equals != '=') continue;
+    equals++;
+    while(equals < end && isspace((unsigned char)*equals)) equals++;
+    if(equals == end || (*equals != '"' && *equals != '\'')) continue;
+    const char * valueEnd = memchr(equals + 1, *equals, end - equals - 1);
+    if(valueEnd == NULL) return kEPUB3_NO;
+    size_t length = (size_t)(valueEnd - equals - 1);
+    if(length >= valueSize) {
+      length = valueSize - 1;
+    }
+    (void)memcpy(value, equals + 1, length);
+    value[length] = '\0';
+    return kEPUB3_YES;
+  }
+  return kEPUB3_NO;
+}
+
+// The width and height attributes of the root element, or failing those the size of its viewBox. The
+// prolog before it (XML declaration, doctype, comments) is usually short, so the buffer is grown a read
+// at a time until the whole start tag is in it.
+static void _EPUB3ImageProbeSVG(EPUB3ImageProbe * probe)
+{
+  const char * tag = NULL;
+  const char * tagEnd = NULL;
+  uint32_t available = 0;
+  for(uint32_t length = IMAGE_PROBE_READ_SIZE; tagEnd == NULL; length += IMAGE_PROBE_READ_SIZE) {
+    // Not found in the first IMAGE_PROBE_BUFFER_SIZE bytes, or the whole file was read without finding it
+    if(length > IMAGE_PROBE_BUFFER_SIZE || (length > IMAGE_PROBE_READ_SIZE && available < length - IMAGE_PROBE_READ_SIZE)) return;
+    const char * bytes = (const char *)_EPUB3ImageProbeBytes(probe, 0, length, &available);
+    if(bytes == NULL) return;
+    const char * end = bytes + available;
+    for(const char * cursor = memchr(bytes, '<', available); cursor != NULL && cursor + 5 <= end; cursor = memchr(cursor + 1, '<', end - cursor - 1)) {
+      // <svg, or with a namespace prefix such as <svg:svg
+      const char * name = cursor + 1;
+      const char * colon = name;
+      while(colon < end && (isalnum((unsigned char)*colon) || *colon == '-' || *colon == '_')) colon++;
+      if(colon < end && *colon == ':') {
+        name = colon + 1;
+      }
+      if(name + 4 <= end && strncmp(name, "svg", 3) == 0 && (isspace((unsigned char)name[3]) || name[3] == '>' || name[3] == '/')) {
+        tag = name + 3;
+        tagEnd = memchr(tag, '>', end - tag);
+        break;
+      }
+    }
+  }
+
+  probe->info->format = kEPUB3ImageFormatSVG;
+  char value[128];
+  if(_EPUB3ImageSVGAttribute(tag, tagEnd, "width", value, sizeof(value))) {
+    probe->info->width = _EPUB3ImageSVGLength(value);
+  }
+  if(_EPUB3ImageSVGAttribute(tag, tagEnd, "height", value, sizeof(value))) {
+    probe->info->height = _EPUB3ImageSVGLength(value);
+  }
+  if((probe->info->width == 0 || probe->info->height == 0) && _EPUB3ImageSVGAttribute(tag, tagEnd, "viewBox", value, sizeof(value))) {
+    double minX = 0, minY = 0, width = 0, height = 0;
+    for(char * separator = value; *separator != '\0'; separator++) {
+      if(*separator == ',') {
+        *separator = ' ';
+      }
+    }
+    if(sscanf(value, "%lf %lf %lf %lf", &minX, &minY, &width, &height) == 4 && width > 0 && height > 0 &&
+       width < (double)UINT32_MAX && height < (double)UINT32_MAX) {
+      probe->info->width = (uint32_t)lround(width);
+      probe->info->height = (uint32_t)lround(height);
+    }
+  }
+}
+
+static void _EPUB3ImageProbe(void * context)
+{
+  EPUB3ImageProbe * probe = context;
+  EPUB3Error error = kEPUB3Success;
+  probe->stream = EPUB3ResourceStreamOpen(probe->epub, probe->info->path, &error);
+  if(probe->stream == NULL) {
+    probe->info->error = error;
+    return;
+  }
+
+  // Recognized by their signatures rather than the media type the manifest claims
+  uint32_t available = 0;
+  const unsigned char * header = _EPUB3ImageProbeBytes(probe, 0, 32, &available);
+  if(header == NULL) {
+  } else if(available >= 3 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
+    _EPUB3ImageProbeJPEG(probe);
+  } else if(available >= 24 && memcmp(header, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(header + 12, "IHDR", 4) == 0) {
+    probe->info->format = kEPUB3ImageFormatPNG;
+    probe->info->width = _EPUB3ImageGetUInt32BE(header + 16);
+    probe->info->height = _EPUB3ImageGetUInt32BE(header + 20);
+  } else if(available >= 10 && (memcmp(header, "GIF87a", 6) == 0 || memcmp(header, "GIF89a", 6) == 0)) {
+    probe->info->format = kEPUB3ImageFormatGIF;
+    probe->info->width = _EPUB3ImageGetUInt16LE(header + 6);
+    probe->info->height = _EPUB3ImageGetUInt16LE(header + 8);
+  } else if(available >= 16 && memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WEBP", 4) == 0) {
+    _EPUB3ImageProbeWebP(probe, header, available);
+  } else if(available > 0) {
+    // Markup, possibly after a byte order mark and white space
+    uint32_t start = available >= 3 && memcmp(header, "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+    while(start < available && isspace(header[start])) start++;
+    if(start < available && header[start] == '<') {
+      _EPUB3ImageProbeSVG(probe);
+    }
+  }
+  EPUB3ResourceStreamClose(probe->stream);
+  probe->stream = NULL;
+}
+
+#pragma mark - Manifest
+
+static int _EPUB3ImageCompareInfos(const void * a, const void * b)
+{
+  return strcmp(((const EPUB3ImageInfo *)a)->path, ((const EPUB3ImageInfo *)b)->path);
+}
+
+EXPORT EPUB3Error EPUB3CopyImageInfos(EPUB3Ref epub, int32_t threadCount, EPUB3ImageInfo ** infos, int32_t * infoCount)
+{
+  assert(epub != NULL);
+  assert(infos != NULL);
+  assert(infoCount != NULL);
+
+  *infos = NULL;
+  *infoCount = 0;
+  if(threadCount < 0) return kEPUB3InvalidArgumentError;
+  if(epub->archive == NULL || epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+  if(epub->manifest == NULL || epub->manifest->itemCount == 0) return kEPUB3Success;
+
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  EPUB3ImageInfo * images = EPUB3Calloc(epub->manifest->itemCount, sizeof(EPUB3ImageInfo));
+  int32_t count = 0;
+  for(int32_t i = 0; i < MANIFEST_HASH_SIZE; i++) {
+    for(EPUB3ManifestItemListItemPtr itemPtr = epub->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3ManifestItemRef item = itemPtr->item;
+      if(item->href == NULL || item->mediaType == NULL || strncasecmp(item->mediaType, "image/", 6) != 0) continue;
+      char * joined = EPUB3CopyOfPathByAppendingPathComponent(root, item->href);
+      images[count].path = EPUB3CopyOfPathByNormalizingPath(joined);
+      images[count].error = kEPUB3Success;
+      EPUB3_FREE_AND_NULL(joined);
+      count++;
+    }
+  }
+  if(count == 0) {
+    EPUB3_FREE_AND_NULL(images);
+    return kEPUB3Success;
+  }
+  qsort(images, count, sizeof(EPUB3ImageInfo), _EPUB3ImageCompareInfos);
+
+  EPUB3WorkPoolRef pool = EPUB3WorkPoolCreate(threadCount);
+  if(pool == NULL) {
+    EPUB3ImageInfosFree(images, count);
+    return kEPUB3UnknownError;
+  }
+  EPUB3ImageProbe * probes = EPUB3Calloc(count, sizeof(EPUB3ImageProbe));
+  for(int32_t i = 0; i < count; i++) {
+    probes[i].epub = epub;
+    probes[i].info = &images[i];
+    EPUB3WorkPoolSubmit(pool, _EPUB3ImageProbe, &probes[i]);
+  }
+  EPUB3WorkPoolRelease(pool);
+  EPUB3_FREE_AND_NULL(probes);
+
+  *infos = images;
+  *infoCount = count;
+  return kEPUB3Success;
+}
+
+EXPORT void EPUB3ImageInfosFree(EPUB3ImageInfo * infos, int32_t infoCount)
+{
+  if(infos == NULL) return;
+  for(int32_t i = 0; i < infoCount; i++) {
+    EPUB3_FREE_AND_NULL(infos[i].path);
+  }
+  EPUB3Free(infos);
+}
@@ -0,0 +1,417 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <sys/mman.h>
+#include <limits.h>
+
+typedef struct _EPUB3RecoveredEntry {
+  uint64_t headerOffset;
+  const unsigned char * name; // in the archive's mapping
+  uint32_t nameLength;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t method;
+  uint32_t modified; // DOS time and date
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+} _EPUB3RecoveredEntry;
+
+typedef struct _EPUB3RecoveredFile {
+  int fd;
+  uint64_t position;
+  EPUB3RecoveredArchiveRef recovered;
+} _EPUB3RecoveredFile;
+
+static inline uint32_t _EPUB3RecoverGetUInt16(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8;
+}
+
+static inline uint32_t _EPUB3RecoverGetUInt32(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline uint64_t _EPUB3RecoverGetUInt64(const unsigned char * bytes)
+{
+  return (uint64_t)_EPUB3RecoverGetUInt32(bytes) | (uint64_t)_EPUB3RecoverGetUInt32(bytes + 4) << 32;
+}
+
+static inline unsigned char * _EPUB3RecoverPut(unsigned char * cursor, uint64_t value, int byteCount)
+{
+  for(int i = 0; i < byteCount; i++) {
+    *cursor++ = (unsigned char)(value >> (8 * i));
+  }
+  return cursor;
+}
+
+#pragma mark - Scanning Local Headers
+
+static EPUB3Bool _EPUB3RecoverReadZip64Sizes(const unsigned char * extra, uint32_t extraLength, _EPUB3RecoveredEntry * entry)
+{
+  uint32_t position = 0;
+  while(position + 4 <= extraLength) {
+    uint32_t tag = _EPUB3RecoverGetUInt16(extra + position);
+    uint32_t length = _EPUB3RecoverGetUInt16(extra + position + 2);
+    if(position + 4 + length > extraLength) break;
+    if(tag == 0x0001) {
+      // Only the sizes the header left as 0xFFFFFFFF are there, uncompressed first
+      const unsigned char * field = extra + position + 4;
+      if(entry->uncompressedSize == 0xFFFFFFFF) {
+        if(length < 8) return kEPUB3_NO;
+        entry->uncompressedSize = _EPUB3RecoverGetUInt64(field);
+        field += 8;
+        length -= 8;
+      }
+      if(entry->compressedSize == 0xFFFFFFFF) {
+        if(length < 8) return kEPUB3_NO;
+        entry->compressedSize = _EPUB3RecoverGetUInt64(field);
+      }
+      return kEPUB3_YES;
+    }
+    position += 4 + length;
+  }
+  return kEPUB3_NO;
+}
+
+// Descriptors may leave their signature out, but a deflate stream knows where it ends
+static EPUB3Bool _EPUB3RecoverInflateEntry(const unsigned char * bytes, uint64_t size, uint64_t dataOffset, _EPUB3RecoveredEntry * entry)
+{
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(stream));
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return kEPUB3_NO;
+
+  unsigned char * buffer = EPUB3Malloc(RECOVERY_INFLATE_BUFFER_SIZE);
+  uint64_t fedCount = 0;
+  uint64_t outCount = 0;
+  uint32_t crc = EPUB3CRC32(0, NULL, 0);
+  int status = Z_OK;
+  while(status == Z_OK) {
+    if(stream.avail_in == 0) {
+      uint64_t left = size - dataOffset - fedCount;
+      if(left == 0) break;
+      stream.next_in = (Bytef *)(bytes + dataOffset + fedCount);
+      stream.avail_in = left < (uint64_t)(UINT_MAX >> 1) ? (uInt)left : (uInt)(UINT_MAX >> 1);
+      fedCount += stream.avail_in;
+    }
+    stream.next_out = buffer;
+    stream.avail_out = RECOVERY_INFLATE_BUFFER_SIZE;
+    status = inflate(&stream, Z_NO_FLUSH);
+    uint32_t produced = RECOVERY_INFLATE_BUFFER_SIZE - stream.avail_out;
+    crc = EPUB3CRC32(crc, buffer, produced);
+    outCount += produced;
+  }
+  EPUB3Bool ended = status == Z_STREAM_END;
+  if(ended) {
+    entry->compressedSize = fedCount - stream.avail_in;
+    entry->uncompressedSize = outCount;
+    entry->crc = crc;
+  }
+  (void)inflateEnd(&stream);
+  EPUB3_FREE_AND_NULL(buffer);
+  return ended;
+}
+
+// The header's CRC and sizes are zero when they follow the data instead
+static EPUB3Bool _EPUB3RecoverReadDataDescriptor(const unsigned char * bytes, uint64_t size, uint64_t dataOffset, _EPUB3RecoveredEntry * entry)
+{
+  // A signed descriptor whose compressed size matches its distance from the data is the fast case
+  const unsigned char * cursor = bytes + dataOffset;
+  const unsigned char * end = bytes + size;
+  while(end - cursor >= 16) {
+    const unsigned char * found = memchr(cursor, 'P', (size_t)(end - cursor) - 15);
+    if(found == NULL) break;
+    if(found[1] == 'K' && found[2] == 7 && found[3] == 8) {
+      uint64_t distance = (uint64_t)(found - bytes) - dataOffset;
+      if(_EPUB3RecoverGetUInt32(found + 8) == distance) {
+        entry->crc = _EPUB3RecoverGetUInt32(found + 4);
+        entry->compressedSize = distance;
+        entry->uncompressedSize = _EPUB3RecoverGetUInt32(found + 12);
+        return kEPUB3_YES;
+      }
+      if(end - found >= 24 && _EPUB3RecoverGetUInt64(found + 8) == distance) {
+        entry->crc = _EPUB3RecoverGetUInt32(found + 4);
+        entry->compressedSize = distance;
+        entry->uncompressedSize = _EPUB3RecoverGetUInt64(found + 16);
+        return kEPUB3_YES;
+      }
+    }
+    cursor = found + 1;
+  }
+  if(entry->method != Z_DEFLATED) return kEPUB3_NO;
+  return _EPUB3RecoverInflateEntry(bytes, size, dataOffset, entry);
+}
+
+static EPUB3Bool _EPUB3RecoverReadEntry(const unsigned char * bytes, uint64_t size, uint64_t offset, _EPUB3RecoveredEntry * entry, uint64_t * nextOffset)
+{
+  const unsigned char * header = bytes + offset;
+  entry->headerOffset = offset;
+  entry->version = _EPUB3RecoverGetUInt16(header + 4);
+  entry->flags = _EPUB3RecoverGetUInt16(header + 6);
+  entry->method = _EPUB3RecoverGetUInt16(header + 8);
+  entry->modified = _EPUB3RecoverGetUInt32(header + 10);
+  entry->crc = _EPUB3RecoverGetUInt32(header + 14);
+  entry->compressedSize = _EPUB3RecoverGetUInt32(header + 18);
+  entry->uncompressedSize = _EPUB3RecoverGetUInt32(header + 22);
+  entry->nameLength = _EPUB3RecoverGetUInt16(header + 26);
+  entry->name = header + 30;
+  uint32_t extraLength = _EPUB3RecoverGetUInt16(header + 28);
+
+  uint64_t dataOffset = offset + 30 + entry->nameLength + extraLength;
+  if(entry->nameLength == 0 || dataOffset > size || (entry->method != 0 && entry->method != Z_DEFLATED)) {
+    return kEPUB3_NO;
+  }
+  if((entry->compressedSize == 0xFFFFFFFF || entry->uncompressedSize == 0xFFFFFFFF) &&
+     !_EPUB3RecoverReadZip64Sizes(header + 30 + entry->nameLength, extraLength, entry)) {
+    return kEPUB3_NO;
+  }
+  if((entry->flags & 8) != 0) {
+    if(!_EPUB3RecoverReadDataDescriptor(bytes, size, dataOffset, entry)) return kEPUB3_NO;
+  } else if(entry->compressedSize > size - dataOffset) {
+    return kEPUB3_NO; // cut off by truncation
+  }
+  *nextOffset = dataOffset + entry->compressedSize;
+  return kEPUB3_YES;
+}
+
+#pragma mark - Rebuilding the Central Directory
+
+static uint32_t _EPUB3RecoverZip64ExtraLength(const _EPUB3RecoveredEntry * entry)
+{
+  uint32_t length = 0;
+  if(entry->uncompressedSize >= 0xFFFFFFFF) length += 8;
+  if(entry->compressedSize >= 0xFFFFFFFF) length += 8;
+  if(entry->headerOffset >= 0xFFFFFFFF) length += 8;
+  return length > 0 ? length + 4 : 0;
+}
+
+static EPUB3RecoveredArchiveRef _EPUB3RecoverBuildDirectory(const _EPUB3RecoveredEntry * entries, uint64_t entryCount, uint64_t directoryOffset)
+{
+  uint64_t centralSize = 0;
+  for(uint64_t i = 0; i < entryCount; i++) {
+    centralSize += 46 + entries[i].nameLength + _EPUB3RecoverZip64ExtraLength(&entries[i]);
+  }
+  EPUB3Bool needsZip64 = entryCount >= 0xFFFF || centralSize >= 0xFFFFFFFF || directoryOffset >= 0xFFFFFFFF;
+
+  EPUB3RecoveredArchiveRef recovered = EPUB3Malloc(sizeof(struct EPUB3RecoveredArchive));
+  recovered->directoryOffset = directoryOffset;
+  recovered->directorySize = centralSize + (needsZip64 ? 56 + 20 : 0) + 22;
+  recovered->entryCount = entryCount;
+  recovered->directory = EPUB3Malloc((size_t)recovered->directorySize);
+
+  unsigned char * cursor = recovered->directory;
+  for(uint64_t i = 0; i < entryCount; i++) {
+    const _EPUB3RecoveredEntry * entry = &entries[i];
+    uint32_t extraLength = _EPUB3RecoverZip64ExtraLength(entry);
+    uint32_t version = extraLength > 0 ? 45 : entry->version;
+    cursor = _EPUB3RecoverPut(cursor, 0x02014b50, 4);
+    cursor = _EPUB3RecoverPut(cursor, version, 2);
+    cursor = _EPUB3RecoverPut(cursor, version, 2);
+    cursor = _EPUB3RecoverPut(cursor, entry->flags, 2);
+    cursor = _EPUB3RecoverPut(cursor, entry->method, 2);
+    cursor = _EPUB3RecoverPut(cursor, entry->modified, 4);
+    cursor = _EPUB3RecoverPut(cursor, entry->crc, 4);
+    cursor = _EPUB3RecoverPut(cursor, entry->compressedSize >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->compressedSize, 4);
+    cursor = _EPUB3RecoverPut(cursor, entry->uncompressedSize >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->uncompressedSize, 4);
+    cursor = _EPUB3RecoverPut(cursor, entry->nameLength, 2);
+    cursor = _EPUB3RecoverPut(cursor, extraLength, 2);
+    cursor = _EPUB3RecoverPut(cursor, 0, 2 + 2 + 2 + 4); // comment length, disk, internal and external attributes
+    cursor = _EPUB3RecoverPut(cursor, entry->headerOffset >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->headerOffset, 4);
+    (void)memcpy(cursor, entry->name, entry->nameLength);
+    cursor += entry->nameLength;
+    if(extraLength > 0) {
+      cursor = _EPUB3RecoverPut(cursor, 0x0001, 2);
+      cursor = _EPUB3RecoverPut(cursor, extraLength - 4, 2);
+      if(entry->uncompressedSize >= 0xFFFFFFFF) cursor = _EPUB3RecoverPut(cursor, entry->uncompressedSize, 8);
+      if(entry->compressedSize >= 0xFFFFFFFF) cursor = _EPUB3RecoverPut(cursor, entry->compressedSize, 8);
+      if(entry->headerOffset >= 0xFFFFFFFF) cursor = _EPUB3RecoverPut(cursor, entry->headerOffset, 8);
+    }
+  }
+
+  if(needsZip64) {
+    cursor = _EPUB3RecoverPut(cursor, 0x06064b50, 4);
+    cursor = _EPUB3RecoverPut(cursor, 44, 8);
+    cursor = _EPUB3RecoverPut(cursor, 45, 2);
+    cursor = _EPUB3RecoverPut(cursor, 45, 2);
+    cursor = _EPUB3RecoverPut(cursor, 0, 4 + 4);
+    cursor = _EPUB3RecoverPut(cursor, entryCount, 8);
+    cursor = _EPUB3RecoverPut(cursor, entryCount, 8);
+    cursor = _EPUB3RecoverPut(cursor, centralSize, 8);
+    cursor = _EPUB3RecoverPut(cursor, directoryOffset, 8);
+    cursor = _EPUB3RecoverPut(cursor, 0x07064b50, 4);
+    cursor = _EPUB3RecoverPut(cursor, 0, 4);
+    cursor = _EPUB3RecoverPut(cursor, directoryOffset + centralSize, 8);
+    cursor = _EPUB3RecoverPut(cursor, 1, 4);
+  }
+  cursor = _EPUB3RecoverPut(cursor, 0x06054b50, 4);
+  cursor = _EPUB3RecoverPut(cursor, 0, 2 + 2);
+  cursor = _EPUB3RecoverPut(cursor, needsZip64 ? 0xFFFF : entryCount, 2);
+  cursor = _EPUB3RecoverPut(cursor, needsZip64 ? 0xFFFF : entryCount, 2);
+  cursor = _EPUB3RecoverPut(cursor, needsZip64 ? 0xFFFFFFFF : centralSize, 4);
+  cursor = _EPUB3RecoverPut(cursor, needsZip64 ? 0xFFFFFFFF : directoryOffset, 4);
+  cursor = _EPUB3RecoverPut(cursor, 0, 2);
+  assert(cursor == recovered->directory + recovered->directorySize);
+  return recovered;
+}
+
+EPUB3Error EPUB3RecoverArchive(const char * path, EPUB3RecoveredArchiveRef * recovered)
+{
+  assert(path != NULL);
+  assert(recovered != NULL);
+
+  *recovered = NULL;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return kEPUB3ArchiveUnavailableError;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 30 || (uint64_t)st.st_size > SIZE_MAX) {
+    (void)close(fd);
+    return kEPUB3ArchiveUnavailableError;
+  }
+  uint64_t size = (uint64_t)st.st_size;
+  void * mapping = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+  (void)close(fd);
+  if(mapping == MAP_FAILED) return kEPUB3ArchiveUnavailableError;
+  (void)madvise(mapping, (size_t)size, MADV_SEQUENTIAL);
+
+  // Headers are found with memchr and whatever data follows a good one is skipped over, so the scan
+  // only touches the bytes of entries it can't make sense of
+  const unsigned char * bytes = mapping;
+  _EPUB3RecoveredEntry * entries = NULL;
+  uint64_t entryCount = 0;
+  uint64_t entryCapacity = 0;
+  uint64_t offset = 0;
+  while(size - offset >= 30) {
+    const unsigned char * found = memchr(bytes + offset, 'P', (size_t)(size - offset - 29));
+    if(found == NULL) break;
+    offset = (uint64_t)(found - bytes);
+    _EPUB3RecoveredEntry entry;
+    uint64_t nextOffset = 0;
+    if(_EPUB3RecoverGetUInt32(found) != 0x04034b50 || !_EPUB3RecoverReadEntry(bytes, size, offset, &entry, &nextOffset)) {
+      offset++;
+      continue;
+    }
+    if(entryCount == entryCapacity) {
+      entryCapacity = entryCapacity == 0 ? 64 : entryCapacity * 2;
+      entries = EPUB3Realloc(entries, (size_t)entryCapacity * sizeof(_EPUB3RecoveredEntry));
+    }
+    entries[entryCount++] = entry;
+    offset = nextOffset;
+  }
+
+  EPUB3Error error = kEPUB3ArchiveUnavailableError;
+  if(entryCount > 0) {
+    // The rebuilt directory goes after every byte of the file, so nothing the scan passed over is hidden
+    *recovered = _EPUB3RecoverBuildDirectory(entries, entryCount, size);
+    error = kEPUB3Success;
+  }
+  EPUB3_FREE_AND_NULL(entries);
+  (void)munmap(mapping, (size_t)size);
+  return error;
+}
+
+void EPUB3RecoveredArchiveFree(EPUB3RecoveredArchiveRef recovered)
+{
+  if(recovered == NULL) return;
+  EPUB3_FREE_AND_NULL(recovered->directory);
+  EPUB3_FREE_AND_NULL(recovered);
+}
+
+#pragma mark - MiniZip File Functions
+
+static voidpf ZCALLBACK _EPUB3RecoveredFileOpen(voidpf opaque, const void * filename, int mode)
+{
+  if(filename == NULL || (mode & ZLIB_FILEFUNC_MODE_READWRITEFILTER) != ZLIB_FILEFUNC_MODE_READ) return NULL;
+  int fd = open((const char *)filename, O_RDONLY);
+  if(fd < 0) return NULL;
+  _EPUB3RecoveredFile * file = EPUB3Malloc(sizeof(_EPUB3RecoveredFile));
+  file->fd = fd;
+  file->position = 0;
+  file->recovered = opaque;
+  return file;
+}
+
+static uLong ZCALLBACK _EPUB3RecoveredFileRead(voidpf opaque, voidpf stream, void * buf, uLong size)
+{
+  _EPUB3RecoveredFile * file = stream;
+  EPUB3RecoveredArchiveRef recovered = file->recovered;
+  unsigned char * bytes = buf;
+  uLong copied = 0;
+  while(copied < size) {
+    uint64_t wanted = size - copied;
+    if(file->position < recovered->directoryOffset) {
+      uint64_t left = recovered->directoryOffset - file->position;
+      ssize_t count = pread(file->fd, bytes + copied, (size_t)(wanted < left ? wanted : left), (off_t)file->position);
+      if(count <= 0) break;
+      copied += (uLong)count;
+      file->position += (uint64_t)count;
+    } else {
+      uint64_t index = file->position - recovered->directoryOffset;
+      if(index >= recovered->directorySize) break;
+      uint64_t left = recovered->directorySize - index;
+      uint64_t count = wanted < left ? wanted : left;
+      (void)memcpy(bytes + copied, recovered->directory + index, (size_t)count);
+      copied += (uLong)count;
+      file->position += count;
+    }
+  }
+  return copied;
+}
+
+static uLong ZCALLBACK _EPUB3RecoveredFileWrite(voidpf opaque, voidpf stream, const void * buf, uLong size)
+{
+  return 0;
+}
+
+static ZPOS64_T ZCALLBACK _EPUB3RecoveredFileTell(voidpf opaque, voidpf stream)
+{
+  return ((_EPUB3RecoveredFile *)stream)->position;
+}
+
+static long ZCALLBACK _EPUB3RecoveredFileSeek(voidpf opaque, voidpf stream, ZPOS64_T offset, int origin)
+{
+  _EPUB3RecoveredFile * file = stream;
+  switch(origin) {
+    case ZLIB_FILEFUNC_SEEK_SET:
+      file->position = offset;
+      break;
+    case ZLIB_FILEFUNC_SEEK_CUR:
+      file->position += offset;
+      break;
+    case ZLIB_FILEFUNC_SEEK_END:
+      file->position = file->recovered->directoryOffset + file->recovered->directorySize + offset;
+      break;
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+static int ZCALLBACK _EPUB3RecoveredFileClose(voidpf opaque, voidpf stream)
+{
+  _EPUB3RecoveredFile * file = stream;
+  int result = close(file->fd);
+  EPUB3_FREE_AND_NULL(file);
+  return result;
+}
+
+static int ZCALLBACK _EPUB3RecoveredFileError(voidpf opaque, voidpf stream)
+{
+  return 0;
+}
+
+unzFile EPUB3RecoveredArchiveOpen(EPUB3RecoveredArchiveRef recovered, const char * path)
+{
+  assert(recovered != NULL);
+  assert(path != NULL);
+
+  zlib_filefunc64_def functions;
+  functions.zopen64_file = _EPUB3RecoveredFileOpen;
+  functions.zread_file = _EPUB3RecoveredFileRead;
+  functions.zwrite_file = _EPUB3RecoveredFileWrite;
+  functions.ztell64_file = _EPUB3RecoveredFileTell;
+  functions.zseek64_file = _EPUB3RecoveredFileSeek;
+  functions.zclose_file = _EPUB3RecoveredFileClose;
+  functions.zerror_file = _EPUB3RecoveredFileError;
+  functions.opaque = recovered;
+  return unzOpen2_64(path, &functions);
+}
@@ -0,0 +1,414 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+
+static const char _EPUB3RepackContainerPath[] = "META-INF/container.xml";
+static const char _EPUB3RepackMetaInfPrefix[] = "META-INF/";
+
+// Formats that deflate can't shrink enough to be worth inflating on every read
+static const char * _EPUB3RepackStoredMediaTypes[] = {
+  "image/jpeg", "image/png", "image/gif", "image/webp",
+  "audio/mpeg", "audio/mp4", "audio/ogg", "audio/opus", "audio/aac", "video/mp4", "video/webm",
+  "font/woff", "font/woff2", "application/font-woff", "application/zip",
+};
+static const char * _EPUB3RepackStoredExtensions[] = {
+  "jpg", "jpeg", "png", "gif", "webp", "mp3", "m4a", "aac", "ogg", "oga", "opus", "mp4", "m4v", "webm",
+  "woff", "woff2", "zip",
+};
+
+#pragma mark - Entries
+
+static int _EPUB3RepackCompareEntryPaths(const void * a, const void * b)
+{
+  const EPUB3RepackEntry * first = *(EPUB3RepackEntry * const *)a;
+  const EPUB3RepackEntry * second = *(EPUB3RepackEntry * const *)b;
+  return strcmp(first->path, second->path);
+}
+
+static int _EPUB3RepackComparePathToEntry(const void * key, const void * element)
+{
+  const EPUB3RepackEntry * entry = *(EPUB3RepackEntry * const *)element;
+  return strcmp((const char *)key, entry->path);
+}
+
+static EPUB3RepackEntry * _EPUB3RepackFindEntry(EPUB3RepackState * repack, const char * path)
+{
+  EPUB3RepackEntry ** found = bsearch(path, repack->sortedEntries, repack->entryCount, sizeof(EPUB3RepackEntry *), _EPUB3RepackComparePathToEntry);
+  return found != NULL ? *found : NULL;
+}
+
+// The archive's files in their original order, leaving out directories and the mimetype (which the
+// writer adds itself)
+static EPUB3Error _EPUB3RepackCollectEntries(EPUB3RepackState * repack)
+{
+  EPUB3Ref epub = repack->epub;
+  int32_t capacity = epub->archiveFileCount > 0 ? (int32_t)epub->archiveFileCount : 16;
+  repack->entries = EPUB3Calloc(capacity, sizeof(EPUB3RepackEntry));
+
+  // The walk moves the book's shared archive cursor, which other threads may be using
+  EPUB3Error error = kEPUB3Success;
+  char name[PATH_MAX];
+  unz_file_info64 fileInfo;
+  (void)pthread_mutex_lock(&epub->entryLock);
+  for(int status = unzGoToFirstFile(epub->archive); status == UNZ_OK; status = unzGoToNextFile(epub->archive)) {
+    if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, name, sizeof(name), NULL, 0, NULL, 0) != UNZ_OK) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    size_t length = strlen(name);
+    if(length == 0 || name[length - 1] == '/' || strcmp(name, "mimetype") == 0) continue;
+    if(repack->entryCount == capacity) {
+      capacity *= 2;
+      repack->entries = EPUB3Realloc(repack->entries, capacity * sizeof(EPUB3RepackEntry));
+    }
+    EPUB3RepackEntry * entry = &repack->entries[repack->entryCount++];
+    (void)memset(entry, 0, sizeof(EPUB3RepackEntry));
+    entry->path = EPUB3Strdup(name);
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+  if(error != kEPUB3Success) return error;
+
+  repack->sortedEntries = EPUB3Calloc(repack->entryCount > 0 ? repack->entryCount : 1, sizeof(EPUB3RepackEntry *));
+  for(int32_t i = 0; i < repack->entryCount; i++) {
+    repack->sortedEntries[i] = &repack->entries[i];
+  }
+  qsort(repack->sortedEntries, repack->entryCount, sizeof(EPUB3RepackEntry *), _EPUB3RepackCompareEntryPaths);
+  return kEPUB3Success;
+}
+
+static EPUB3RepackEntry * _EPUB3RepackFindManifestItem(EPUB3RepackState * repack, const EPUB3RepackRendition * rendition, EPUB3ManifestItemRef item)
+{
+  if(item == NULL || item->href == NULL) return NULL;
+  const char * root = rendition->rootFileDirectory != NULL ? rendition->rootFileDirectory : "";
+  char * joined = EPUB3CopyOfPathByAppendingPathComponent(root, item->href);
+  char * normalized = EPUB3CopyOfPathByNormalizingPath(joined);
+  EPUB3RepackEntry * entry = _EPUB3RepackFindEntry(repack, normalized);
+  EPUB3_FREE_AND_NULL(normalized);
+  EPUB3_FREE_AND_NULL(joined);
+  return entry;
+}
+
+// Every rootfile in the container is written, so every package's content has to be as well. The ones epub
+// hasn't loaded are loaded into a private book rather than by selecting them on epub, which others may be
+// reading.
+static EPUB3Error _EPUB3RepackCollectRenditions(EPUB3RepackState * repack)
+{
+  EPUB3Ref epub = repack->epub;
+  EPUB3Error error = epub->renditions == NULL ? EPUB3ParseContainer(epub) : kEPUB3Success;
+  if(error != kEPUB3Success) return error;
+  int32_t count = epub->renditionCount;
+  repack->renditions = EPUB3Calloc(count, sizeof(EPUB3RepackRendition));
+
+  for(int32_t i = 0; i < count; i++) {
+    int32_t index = i == 0 ? epub->selectedRendition : (i <= epub->selectedRendition ? i - 1 : i);
+    const EPUB3Rendition * rendition = &epub->renditions[index];
+    EPUB3RepackRendition * collected = &repack->renditions[repack->renditionCount++];
+    collected->path = rendition->path;
+    collected->rootFileDirectory = rendition->rootFileDirectory;
+
+    if(index == epub->selectedRendition) {
+      collected->metadata = epub->metadata;
+      collected->manifest = epub->manifest;
+      collected->spine = epub->spine;
+      continue;
+    }
+    if(rendition->mediaType != NULL && strcmp(rendition->mediaType, RENDITION_PACKAGE_MEDIA_TYPE) != 0) continue;
+    if(rendition->metadata != NULL) {
+      collected->metadata = rendition->metadata;
+      collected->manifest = rendition->manifest;
+      collected->spine = rendition->spine;
+      continue;
+    }
+
+    if(repack->renditionBook == NULL) {
+      repack->renditionBook = epub->recoveredArchive != NULL ? EPUB3CreateWithArchiveAtPathRecovering(epub->archivePath, &error) :
+        EPUB3CreateWithArchiveAtPath(epub->archivePath, &error);
+      if(repack->renditionBook == NULL) return error;
+    }
+    error = EPUB3SelectRendition(repack->renditionBook, index);
+    if(error == kEPUB3FileNotFoundInArchiveError) {
+      // Nothing to place but the rootfile path, which isn't there either
+      error = kEPUB3Success;
+      continue;
+    }
+    if(error != kEPUB3Success) return error;
+    // Selecting the next one parks these objects on the private book, which keeps them alive
+    collected->metadata = repack->renditionBook->metadata;
+    collected->manifest = repack->renditionBook->manifest;
+    collected->spine = repack->renditionBook->spine;
+  }
+  return error;
+}
+
+static void _EPUB3RepackMarkManifestItems(EPUB3RepackState * repack, const EPUB3RepackRendition * rendition)
+{
+  if(rendition->manifest != NULL) {
+    for(int32_t i = 0; i < MANIFEST_HASH_SIZE; i++) {
+      for(EPUB3ManifestItemListItemPtr itemPtr = rendition->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+        EPUB3RepackEntry * entry = _EPUB3RepackFindManifestItem(repack, rendition, itemPtr->item);
+        if(entry == NULL) continue;
+        entry->isManifestItem = kEPUB3_YES;
+        entry->mediaType = itemPtr->item->mediaType;
+      }
+    }
+  }
+  if(rendition->spine != NULL) {
+    for(EPUB3SpineItemListItemPtr itemPtr = rendition->spine->head; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3RepackEntry * entry = _EPUB3RepackFindManifestItem(repack, rendition, itemPtr->item->manifestItem);
+      if(entry != NULL) {
+        entry->isSpineItem = kEPUB3_YES;
+      }
+    }
+  }
+}
+
+#pragma mark - Placement
+
+static const char * _EPUB3RepackExtension(const char * path)
+{
+  const char * dot = strrchr(path, '.');
+  const char * slash = strrchr(path, '/');
+  if(dot == NULL || (slash != NULL && dot < slash)) return "";
+  return dot + 1;
+}
+
+static EPUB3Bool _EPUB3RepackShouldStore(const EPUB3RepackEntry * entry)
+{
+  if(entry->mediaType != NULL) {
+    for(size_t i = 0; i < sizeof(_EPUB3RepackStoredMediaTypes) / sizeof(_EPUB3RepackStoredMediaTypes[0]); i++) {
+      if(strcasecmp(entry->mediaType, _EPUB3RepackStoredMediaTypes[i]) == 0) return kEPUB3_YES;
+    }
+  }
+  const char * extension = _EPUB3RepackExtension(entry->path);
+  for(size_t i = 0; i < sizeof(_EPUB3RepackStoredExtensions) / sizeof(_EPUB3RepackStoredExtensions[0]); i++) {
+    if(strcasecmp(extension, _EPUB3RepackStoredExtensions[i]) == 0) return kEPUB3_YES;
+  }
+  return kEPUB3_NO;
+}
+
+// Documents whose references are followed: content documents, SVG and stylesheets
+static EPUB3Bool _EPUB3RepackShouldScan(const EPUB3RepackEntry * entry)
+{
+  if(entry->mediaType != NULL) {
+    return strcasecmp(entry->mediaType, "application/xhtml+xml") == 0 || strcasecmp(entry->mediaType, "text/html") == 0 ||
+      strcasecmp(entry->mediaType, "image/svg+xml") == 0 || strcasecmp(entry->mediaType, "text/css") == 0;
+  }
+  const char * extension = _EPUB3RepackExtension(entry->path);
+  return strcasecmp(extension, "xhtml") == 0 || strcasecmp(extension, "html") == 0 || strcasecmp(extension, "htm") == 0 ||
+    strcasecmp(extension, "svg") == 0 || strcasecmp(extension, "css") == 0;
+}
+
+static int64_t _EPUB3RepackReadStream(void * context, void * buffer, uint32_t length)
+{
+  uint32_t bytesRead = 0;
+  if(EPUB3ResourceStreamRead((EPUB3ResourceStreamRef)context, buffer, length, &bytesRead) != kEPUB3Success) return -1;
+  return bytesRead;
+}
+
+static void _EPUB3RepackPlaceEntry(EPUB3RepackState * repack, EPUB3RepackEntry * entry);
+
+static void _EPUB3RepackPlaceReference(EPUB3RepackState * repack, const char * documentDirectory, const char * reference, size_t length)
+{
+  size_t end = 0;
+  while(end < length && reference[end] != '#' && reference[end] != '?') {
+    // Absolute URLs (and data: URIs) point outside the archive
+    if(reference[end] == ':') return;
+    end++;
+  }
+  while(end > 0 && isspace((unsigned char)reference[end - 1])) end--;
+  if(end == 0 || reference[0] == '/') return;
+
+  char href[end + 1];
+  (void)memcpy(href, reference, end);
+  href[end] = '\0';
+  char * joined = EPUB3CopyOfPathByAppendingPathComponent(documentDirectory, href);
+  char * normalized = EPUB3CopyOfPathByNormalizingPath(joined);
+  EPUB3RepackEntry * entry = _EPUB3RepackFindEntry(repack, normalized);
+  // Other spine items are links to follow, not resources needed to show this one; they keep their place
+  if(entry != NULL && !entry->isSpineItem) {
+    _EPUB3RepackPlaceEntry(repack, entry);
+  }
+  EPUB3_FREE_AND_NULL(normalized);
+  EPUB3_FREE_AND_NULL(joined);
+}
+
+static EPUB3Bool _EPUB3RepackHasPrefix(const char * bytes, const char * end, const char * prefix)
+{
+  size_t length = strlen(prefix);
+  return (size_t)(end - bytes) >= length && strncasecmp(bytes, prefix, length) == 0;
+}
+
+// A loose scan rather than a parse, in the manner of the prefetcher's stylesheet lookup: src, href (which
+// covers xlink:href) and poster attributes, and CSS url() and @import. Anything it misses is still written,
+// after the spine.
+static void _EPUB3RepackPlaceReferences(EPUB3RepackState * repack, const char * path, const char * bytes, uint32_t length)
+{
+  static const char * attributes[] = { "src", "href", "poster" };
+  char * documentDirectory = EPUB3CopyOfPathByDeletingLastPathComponent(path);
+  const char * end = bytes + length;
+
+  for(const char * cursor = bytes; cursor < end && repack->error == kEPUB3Success; cursor++) {
+    const char * value = NULL;
+    char terminator = '\0';
+
+    if(_EPUB3RepackHasPrefix(cursor, end, "url(")) {
+      value = cursor + 4;
+      while(value < end && isspace((unsigned char)*value)) value++;
+      terminator = ')';
+      if(value < end && (*value == '"' || *value == '\'')) terminator = *value++;
+    } else if(_EPUB3RepackHasPrefix(cursor, end, "@import")) {
+      value = cursor + 7;
+      while(value < end && isspace((unsigned char)*value)) value++;
+      if(value < end && (*value == '"' || *value == '\'')) {
+        terminator = *value++;
+      } else {
+        // @import url(...) is picked up as a url()
+        value = NULL;
+      }
+    } else if(cursor == bytes || !(isalnum((unsigned char)cursor[-1]) || cursor[-1] == '-' || cursor[-1] == '_')) {
+      for(size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]) && value == NULL; i++) {
+        if(!_EPUB3RepackHasPrefix(cursor, end, attributes[i])) continue;
+        const char * equals = cursor + strlen(attributes[i]);
+        while(equals < end && isspace((unsigned char)*equals)) equals++;
+        if(equals == end || *equals != '=') continue;
+        equals++;
+        while(equals < end && isspace((unsigned char)*equals)) equals++;
+        if(equals < end && (*equals == '"' || *equals == '\'')) {
+          terminator = *equals;
+          value = equals + 1;
+        }
+      }
+    }
+    if(value == NULL) continue;
+
+    const char * valueEnd = memchr(value, terminator, end - value);
+    if(valueEnd == NULL) break;
+    _EPUB3RepackPlaceReference(repack, documentDirectory, value, valueEnd - value);
+    cursor = valueEnd;
+  }
+  EPUB3_FREE_AND_NULL(documentDirectory);
+}
+
+// Writes entry, then whatever it references that hasn't been written yet. Each entry is placed once.
+static void _EPUB3RepackPlaceEntry(EPUB3RepackState * repack, EPUB3RepackEntry * entry)
+{
+  if(entry == NULL || entry->isPlaced || repack->error != kEPUB3Success) return;
+  entry->isPlaced = kEPUB3_YES;
+
+  EPUB3Bool compress = !_EPUB3RepackShouldStore(entry);
+  EPUB3Error error = kEPUB3Success;
+  if(_EPUB3RepackShouldScan(entry)) {
+    EPUB3ResourceRef resource = EPUB3CopyResource(repack->epub, entry->path, &error);
+    if(resource == NULL) {
+      repack->error = error;
+      return;
+    }
+    repack->error = EPUB3WriterAddBuffer(repack->writer, entry->path, EPUB3ResourceGetBytes(resource), EPUB3ResourceGetByteCount(resource), compress);
+    if(repack->error == kEPUB3Success) {
+      _EPUB3RepackPlaceReferences(repack, entry->path, EPUB3ResourceGetBytes(resource), EPUB3ResourceGetByteCount(resource));
+    }
+    EPUB3ResourceRelease(resource);
+    return;
+  }
+
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(repack->epub, entry->path, &error);
+  if(stream == NULL) {
+    repack->error = error;
+    return;
+  }
+  repack->error = EPUB3WriterAddStream(repack->writer, entry->path, _EPUB3RepackReadStream, stream, compress);
+  EPUB3ResourceStreamClose(stream);
+}
+
+#pragma mark - Repacking
+
+EXPORT EPUB3Error EPUB3Repack(EPUB3Ref epub, const char * path, const EPUB3RepackOptions * options)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  EPUB3RepackOptions defaultOptions = { 0, Z_BEST_COMPRESSION, kEPUB3_NO };
+  if(options == NULL) {
+    options = &defaultOptions;
+  }
+  if(options->threadCount < 0 || options->level < Z_DEFAULT_COMPRESSION || options->level > Z_BEST_COMPRESSION) return kEPUB3InvalidArgumentError;
+  if(epub->archive == NULL || epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+
+  EPUB3RepackState repack;
+  (void)memset(&repack, 0, sizeof(repack));
+  repack.epub = epub;
+  repack.error = _EPUB3RepackCollectRenditions(&repack);
+  if(repack.error == kEPUB3Success) {
+    repack.error = _EPUB3RepackCollectEntries(&repack);
+  }
+  if(repack.error == kEPUB3Success) {
+    repack.writer = EPUB3WriterCreate(path, options->threadCount, options->level, &repack.error);
+  }
+
+  if(repack.writer != NULL) {
+    for(int32_t i = 0; i < repack.renditionCount; i++) {
+      _EPUB3RepackMarkManifestItems(&repack, &repack.renditions[i]);
+    }
+
+    // The files a reading system opens first, in the order it opens them
+    _EPUB3RepackPlaceEntry(&repack, _EPUB3RepackFindEntry(&repack, _EPUB3RepackContainerPath));
+    for(int32_t i = 0; i < repack.entryCount; i++) {
+      if(strncmp(repack.entries[i].path, _EPUB3RepackMetaInfPrefix, sizeof(_EPUB3RepackMetaInfPrefix) - 1) == 0) {
+        _EPUB3RepackPlaceEntry(&repack, &repack.entries[i]);
+      }
+    }
+    for(int32_t r = 0; r < repack.renditionCount; r++) {
+      const EPUB3RepackRendition * rendition = &repack.renditions[r];
+      _EPUB3RepackPlaceEntry(&repack, _EPUB3RepackFindEntry(&repack, rendition->path));
+      if(rendition->metadata != NULL) {
+        _EPUB3RepackPlaceEntry(&repack, _EPUB3RepackFindManifestItem(&repack, rendition, rendition->metadata->ncxItem));
+      }
+      if(rendition->manifest != NULL) {
+        for(int32_t i = 0; i < MANIFEST_HASH_SIZE; i++) {
+          for(EPUB3ManifestItemListItemPtr itemPtr = rendition->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+            if(EPUB3ManifestItemHasProperty(itemPtr->item, "nav")) {
+              _EPUB3RepackPlaceEntry(&repack, _EPUB3RepackFindManifestItem(&repack, rendition, itemPtr->item));
+            }
+          }
+        }
+      }
+    }
+
+    // Then the reading orders, each document followed by what it needs to be shown
+    for(int32_t r = 0; r < repack.renditionCount; r++) {
+      const EPUB3RepackRendition * rendition = &repack.renditions[r];
+      if(rendition->spine == NULL) continue;
+      for(EPUB3SpineItemListItemPtr itemPtr = rendition->spine->head; itemPtr != NULL; itemPtr = itemPtr->next) {
+        _EPUB3RepackPlaceEntry(&repack, _EPUB3RepackFindManifestItem(&repack, rendition, itemPtr->item->manifestItem));
+      }
+    }
+
+    // Manifest items nothing pointed at, and finally (if asked for) the files the package doesn't list
+    for(int32_t i = 0; i < repack.entryCount; i++) {
+      if(repack.entries[i].isManifestItem) {
+        _EPUB3RepackPlaceEntry(&repack, &repack.entries[i]);
+      }
+    }
+    if(options->keepsUnreferencedEntries) {
+      for(int32_t i = 0; i < repack.entryCount; i++) {
+        _EPUB3RepackPlaceEntry(&repack, &repack.entries[i]);
+      }
+    }
+
+    EPUB3Error error = EPUB3WriterFinish(repack.writer);
+    if(repack.error == kEPUB3Success) {
+      repack.error = error;
+    }
+  }
+
+  for(int32_t i = 0; i < repack.entryCount; i++) {
+    EPUB3_FREE_AND_NULL(repack.entries[i].path);
+  }
+  EPUB3_FREE_AND_NULL(repack.entries);
+  EPUB3_FREE_AND_NULL(repack.sortedEntries);
+  EPUB3_FREE_AND_NULL(repack.renditions);
+  EPUB3Release(repack.renditionBook);
+  return repack.error;
+}
@@ -0,0 +1,671 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <ctype.h>
+#include <sys/mman.h>
+
+const char * kEPUB3SearchIndexTypeID = "_EPUB3SearchIndex_t";
+
+#pragma mark - Tokenizer
+
+static uint32_t _EPUB3SearchDecodeUTF8(const unsigned char * bytes, uint32_t length, uint32_t * codePoint)
+{
+  unsigned char lead = bytes[0];
+  uint32_t count = lead < 0x80 ? 1 : (lead & 0xE0) == 0xC0 ? 2 : (lead & 0xF0) == 0xE0 ? 3 : (lead & 0xF8) == 0xF0 ? 4 : 0;
+  if(count == 0 || count > length) {
+    *codePoint = 0xFFFD;
+    return 1;
+  }
+  uint32_t value = count == 1 ? lead : lead & (0x7F >> count);
+  for(uint32_t i = 1; i < count; i++) {
+    if((bytes[i] & 0xC0) != 0x80) {
+      *codePoint = 0xFFFD;
+      return 1;
+    }
+    value = (value << 6) | (bytes[i] & 0x3F);
+  }
+  *codePoint = value;
+  return count;
+}
+
+static EPUB3Bool _EPUB3SearchIsWordCharacter(uint32_t codePoint)
+{
+  if(codePoint < 0x80) return isalnum((int)codePoint) ? kEPUB3_YES : kEPUB3_NO;
+  if(codePoint < 0xC0) return codePoint == 0xAA || codePoint == 0xB5 || codePoint == 0xBA;
+  if(codePoint == 0xD7 || codePoint == 0xF7) return kEPUB3_NO;
+  if(codePoint >= 0x2000 && codePoint <= 0x2BFF) return kEPUB3_NO; // punctuation, symbols, arrows, shapes
+  if(codePoint >= 0x2E00 && codePoint <= 0x2E7F) return kEPUB3_NO;
+  if(codePoint >= 0x3000 && codePoint <= 0x303F) return kEPUB3_NO;
+  if(codePoint >= 0xFE30 && codePoint <= 0xFE4F) return kEPUB3_NO;
+  if(codePoint >= 0xFF00 && codePoint <= 0xFF0F) return kEPUB3_NO;
+  if(codePoint == 0xFEFF || codePoint == 0xFFFD) return kEPUB3_NO;
+  return kEPUB3_YES;
+}
+
+static EPUB3Bool _EPUB3SearchIsStandaloneCharacter(uint32_t codePoint)
+{
+  return (codePoint >= 0x3040 && codePoint <= 0x30FF) || (codePoint >= 0x3400 && codePoint <= 0x4DBF) ||
+    (codePoint >= 0x4E00 && codePoint <= 0x9FFF) || (codePoint >= 0xF900 && codePoint <= 0xFAFF);
+}
+
+static uint32_t _EPUB3SearchFoldCase(uint32_t codePoint)
+{
+  if(codePoint < 0x80) return (uint32_t)tolower((int)codePoint);
+  if(codePoint >= 0xC0 && codePoint <= 0xDE && codePoint != 0xD7) return codePoint + 0x20;
+  if(codePoint == 0x178) return 0xFF; // Y with diaeresis, whose lower case is in Latin-1
+  if(codePoint >= 0x100 && codePoint <= 0x17F) {
+    // Latin Extended-A pairs upper and lower case, the upper case letter first (odd ones in two stretches)
+    EPUB3Bool oddUpper = (codePoint >= 0x139 && codePoint <= 0x148) || (codePoint >= 0x179 && codePoint <= 0x17E);
+    if(codePoint == 0x130 || codePoint == 0x131 || codePoint == 0x138 || codePoint == 0x149 || codePoint == 0x17F) return codePoint;
+    if(oddUpper) return (codePoint & 1) ? codePoint + 1 : codePoint;
+    return codePoint | 1;
+  }
+  if(codePoint >= 0x391 && codePoint <= 0x3AB && codePoint != 0x3A2) return codePoint + 0x20;
+  if(codePoint == 0x3C2) return 0x3C3; // final sigma
+  if(codePoint >= 0x410 && codePoint <= 0x42F) return codePoint + 0x20;
+  if(codePoint >= 0x400 && codePoint <= 0x40F) return codePoint + 0x50;
+  return codePoint;
+}
+
+EPUB3Bool EPUB3SearchNextToken(const char * text, uint32_t length, uint32_t * offset, EPUB3SearchToken * token)
+{
+  assert(text != NULL || length == 0);
+  assert(offset != NULL);
+  assert(token != NULL);
+
+  const unsigned char * bytes = (const unsigned char *)text;
+  uint32_t i = *offset;
+  uint32_t termLength = 0;
+  while(i < length) {
+    uint32_t codePoint;
+    uint32_t count = _EPUB3SearchDecodeUTF8(bytes + i, length - i, &codePoint);
+    if(!_EPUB3SearchIsWordCharacter(codePoint)) {
+      if(termLength > 0) break;
+      i += count;
+      continue;
+    }
+    EPUB3Bool isStandalone = _EPUB3SearchIsStandaloneCharacter(codePoint);
+    if(termLength > 0 && isStandalone) break;
+    if(termLength == 0) {
+      token->textOffset = i;
+    }
+
+    char folded[4];
+    uint32_t foldedLength = EPUB3TextEncodeUTF8(_EPUB3SearchFoldCase(codePoint), folded);
+    if(termLength + foldedLength <= SEARCH_TERM_MAX_LENGTH) {
+      (void)memcpy(token->term + termLength, folded, foldedLength);
+      termLength += foldedLength;
+    }
+    i += count;
+    if(isStandalone) break;
+  }
+  *offset = i;
+  if(termLength == 0) return kEPUB3_NO;
+
+  token->term[termLength] = '\0';
+  token->textLength = i - token->textOffset;
+  return kEPUB3_YES;
+}
+
+#pragma mark - Building
+
+static void _EPUB3SearchIndexTokenizeDocument(void * context)
+{
+  EPUB3SearchIndexBuildDocumentRef document = context;
+  document->text.error = EPUB3TextDocumentRead(document->epub, &document->text);
+  if(document->text.error != kEPUB3Success) return;
+
+  uint32_t offset = 0;
+  EPUB3SearchToken token;
+  while(EPUB3SearchNextToken(document->text.text, document->text.length, &offset, &token)) {
+    uint32_t termLength = (uint32_t)strlen(token.term) + 1;
+    if(document->termsLength + termLength > document->termsCapacity) {
+      document->termsCapacity = document->termsCapacity > 0 ? document->termsCapacity * 2 : TEXT_READER_CHUNK_SIZE;
+      document->terms = EPUB3Realloc(document->terms, document->termsCapacity);
+    }
+    if(document->tokenCount == document->tokenCapacity) {
+      document->tokenCapacity = document->tokenCapacity > 0 ? document->tokenCapacity * 2 : 1024;
+      document->tokens = EPUB3Realloc(document->tokens, document->tokenCapacity * 2 * sizeof(uint32_t));
+    }
+    (void)memcpy(document->terms + document->termsLength, token.term, termLength);
+    document->tokens[document->tokenCount * 2] = document->termsLength;
+    document->tokens[document->tokenCount * 2 + 1] = token.textOffset;
+    document->tokenCount++;
+    document->termsLength += termLength;
+  }
+}
+
+static void _EPUB3SearchIndexPutVarint(EPUB3SearchIndexBuildTermRef term, uint32_t value)
+{
+  if(term->postingsSize + 5 > term->postingsCapacity) {
+    term->postingsCapacity = term->postingsCapacity > 0 ? term->postingsCapacity * 2 : 16;
+    term->postings = EPUB3Realloc(term->postings, term->postingsCapacity);
+  }
+  while(value >= 0x80) {
+    term->postings[term->postingsSize++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  term->postings[term->postingsSize++] = (unsigned char)value;
+}
+
+typedef struct _EPUB3SearchIndexTermTable {
+  EPUB3SearchIndexBuildTermRef * slots; // open addressing
+  uint32_t capacity; // a power of two
+  uint32_t count;
+} _EPUB3SearchIndexTermTable;
+
+static EPUB3SearchIndexBuildTermRef _EPUB3SearchIndexTermTableFind(_EPUB3SearchIndexTermTable * table, const char * term)
+{
+  uint32_t length = (uint32_t)strlen(term);
+  uint32_t hash = SuperFastHash(term, (int32_t)length);
+  uint32_t slot = hash & (table->capacity - 1);
+  while(table->slots[slot] != NULL) {
+    if(table->slots[slot]->hash == hash && strcmp(table->slots[slot]->term, term) == 0) {
+      return table->slots[slot];
+    }
+    slot = (slot + 1) & (table->capacity - 1);
+  }
+
+  EPUB3SearchIndexBuildTermRef entry = EPUB3Calloc(1, sizeof(struct EPUB3SearchIndexBuildTerm));
+  entry->term = EPUB3Strdup(term);
+  entry->hash = hash;
+  entry->lastDocument = -1;
+  table->slots[slot] = entry;
+  table->count++;
+
+  if(table->count * 2 > table->capacity) {
+    uint32_t capacity = table->capacity * 2;
+    EPUB3SearchIndexBuildTermRef * slots = EPUB3Calloc(capacity, sizeof(EPUB3SearchIndexBuildTermRef));
+    for(uint32_t i = 0; i < table->capacity; i++) {
+      if(table->slots[i] == NULL) continue;
+      uint32_t newSlot = table->slots[i]->hash & (capacity - 1);
+      while(slots[newSlot] != NULL) {
+        newSlot = (newSlot + 1) & (capacity - 1);
+      }
+      slots[newSlot] = table->slots[i];
+    }
+    EPUB3_FREE_AND_NULL(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+  }
+  return entry;
+}
+
+static void _EPUB3SearchIndexAddPosting(EPUB3SearchIndexBuildTermRef term, int32_t document, uint32_t token, uint32_t textOffset)
+{
+  _EPUB3SearchIndexPutVarint(term, (uint32_t)(document - term->lastDocument));
+  if(document != term->lastDocument) {
+    _EPUB3SearchIndexPutVarint(term, token);
+    _EPUB3SearchIndexPutVarint(term, textOffset);
+  } else {
+    _EPUB3SearchIndexPutVarint(term, token - term->lastToken);
+    _EPUB3SearchIndexPutVarint(term, textOffset - term->lastTextOffset);
+  }
+  term->lastDocument = document;
+  term->lastToken = token;
+  term->lastTextOffset = textOffset;
+  term->postingCount++;
+}
+
+static int _EPUB3SearchIndexCompareTerms(const void * a, const void * b)
+{
+  return strcmp((*(EPUB3SearchIndexBuildTermRef const *)a)->term, (*(EPUB3SearchIndexBuildTermRef const *)b)->term);
+}
+
+static EPUB3Bool _EPUB3SearchIndexWriteAll(int fd, const void * bytes, size_t length)
+{
+  const char * next = bytes;
+  while(length > 0) {
+    ssize_t count = write(fd, next, length);
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) return kEPUB3_NO;
+    next += count;
+    length -= (size_t)count;
+  }
+  return kEPUB3_YES;
+}
+
+static EPUB3Error _EPUB3SearchIndexWriteImage(EPUB3ArchiveDigest digest, struct EPUB3SearchIndexBuildDocument * documents, int32_t documentCount, EPUB3SearchIndexBuildTermRef * terms, uint32_t termCount, int fd)
+{
+  // Laid out as header, documents, terms and mappings (all 4-byte aligned), then text, term strings and
+  // postings, then the final NUL
+  uint64_t size = sizeof(EPUB3SearchIndexHeader);
+  uint64_t documentsOffset = size;
+  size += (uint64_t)documentCount * sizeof(EPUB3SearchIndexDocument);
+  uint64_t termsOffset = size;
+  size += (uint64_t)termCount * sizeof(EPUB3SearchIndexTerm);
+  uint64_t mappingsOffset = size;
+  for(int32_t i = 0; i < documentCount; i++) {
+    size += (uint64_t)documents[i].text.mappingCount * sizeof(EPUB3TextMapping);
+  }
+  uint64_t textOffset = size;
+  for(int32_t i = 0; i < documentCount; i++) {
+    size += documents[i].text.length + 1;
+  }
+  uint64_t stringsOffset = size;
+  for(uint32_t i = 0; i < termCount; i++) {
+    size += strlen(terms[i]->term) + 1;
+  }
+  uint64_t postingsOffset = size;
+  for(uint32_t i = 0; i < termCount; i++) {
+    size += terms[i]->postingsSize;
+  }
+  size += 1;
+  if(size > UINT32_MAX) return kEPUB3InvalidArgumentError;
+
+  unsigned char * image = EPUB3Calloc(1, (size_t)size);
+  EPUB3SearchIndexHeader * header = (EPUB3SearchIndexHeader *)image;
+  (void)memcpy(header->magic, SEARCH_INDEX_MAGIC, sizeof(header->magic));
+  header->formatVersion = SEARCH_INDEX_FORMAT_VERSION;
+  header->byteOrderMark = SNAPSHOT_BYTE_ORDER_MARK;
+  header->imageSize = size;
+  header->archiveDigest = digest;
+  header->documentCount = documentCount;
+  header->documents = (uint32_t)documentsOffset;
+  header->termCount = termCount;
+  header->terms = (uint32_t)termsOffset;
+
+  EPUB3SearchIndexDocument * indexDocuments = (EPUB3SearchIndexDocument *)(image + documentsOffset);
+  for(int32_t i = 0; i < documentCount; i++) {
+    EPUB3TextDocumentRef text = &documents[i].text;
+    indexDocuments[i].mappings = (uint32_t)mappingsOffset;
+    indexDocuments[i].mappingCount = (uint32_t)text->mappingCount;
+    (void)memcpy(image + mappingsOffset, text->mappings, text->mappingCount * sizeof(EPUB3TextMapping));
+    mappingsOffset += text->mappingCount * sizeof(EPUB3TextMapping);
+    indexDocuments[i].text = (uint32_t)textOffset;
+    indexDocuments[i].textLength = text->length;
+    if(text->length > 0) {
+      (void)memcpy(image + textOffset, text->text, text->length);
+    }
+    textOffset += text->length + 1;
+  }
+
+  EPUB3SearchIndexTerm * indexTerms = (EPUB3SearchIndexTerm *)(image + termsOffset);
+  for(uint32_t i = 0; i < termCount; i++) {
+    size_t termLength = strlen(terms[i]->term) + 1;
+    indexTerms[i].term = (uint32_t)stringsOffset;
+    (void)memcpy(image + stringsOffset, terms[i]->term, termLength);
+    stringsOffset += termLength;
+    indexTerms[i].postings = (uint32_t)postingsOffset;
+    indexTerms[i].postingsSize = terms[i]->postingsSize;
+    indexTerms[i].postingCount = terms[i]->postingCount;
+    (void)memcpy(image + postingsOffset, terms[i]->postings, terms[i]->postingsSize);
+    postingsOffset += terms[i]->postingsSize;
+  }
+
+  EPUB3Bool ok = _EPUB3SearchIndexWriteAll(fd, image, (size_t)size);
+  EPUB3_FREE_AND_NULL(image);
+  return ok ? kEPUB3Success : kEPUB3UnknownError;
+}
+
+EXPORT EPUB3Error EPUB3WriteSearchIndex(EPUB3Ref epub, int32_t threadCount, int fd)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(fd >= 0);
+
+  if(threadCount < 0) return kEPUB3InvalidArgumentError;
+  EPUB3ArchiveDigest digest;
+  EPUB3Error error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+  if(error != kEPUB3Success) return error;
+
+  // Reading and tokenizing happen in parallel, one task per document
+  int32_t count = epub->spine->linearItemCount;
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  struct EPUB3SearchIndexBuildDocument * documents = EPUB3Calloc(count > 0 ? count : 1, sizeof(struct EPUB3SearchIndexBuildDocument));
+  EPUB3WorkPoolRef pool = count > 0 ? EPUB3WorkPoolCreate(threadCount) : NULL;
+  int32_t index = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL && index < count; itemPtr = itemPtr->next) {
+    if(!itemPtr->item->isLinear) continue;
+    EPUB3SearchIndexBuildDocumentRef document = &documents[index++];
+    document->epub = epub;
+    if(itemPtr->item->manifestItem == NULL || itemPtr->item->manifestItem->href == NULL) {
+      document->text.error = kEPUB3FileNotFoundInArchiveError;
+      continue;
+    }
+    document->text.path = EPUB3CopyOfPathByAppendingPathComponent(root, itemPtr->item->manifestItem->href);
+    EPUB3WorkPoolSubmit(pool, _EPUB3SearchIndexTokenizeDocument, document);
+  }
+  if(pool != NULL) {
+    EPUB3WorkPoolRelease(pool);
+  }
+  for(int32_t i = 0; i < index && error == kEPUB3Success; i++) {
+    error = documents[i].text.error;
+  }
+
+  // Merging runs through the documents in order, so every term's postings come out sorted
+  _EPUB3SearchIndexTermTable table;
+  table.capacity = SEARCH_INDEX_INITIAL_TERM_CAPACITY;
+  table.count = 0;
+  table.slots = EPUB3Calloc(table.capacity, sizeof(EPUB3SearchIndexBuildTermRef));
+  for(int32_t i = 0; i < index && error == kEPUB3Success; i++) {
+    EPUB3SearchIndexBuildDocumentRef document = &documents[i];
+    for(uint32_t j = 0; j < document->tokenCount; j++) {
+      EPUB3SearchIndexBuildTermRef term = _EPUB3SearchIndexTermTableFind(&table, document->terms + document->tokens[j * 2]);
+      _EPUB3SearchIndexAddPosting(term, i, j, document->tokens[j * 2 + 1]);
+    }
+    EPUB3_FREE_AND_NULL(document->terms);
+    EPUB3_FREE_AND_NULL(document->tokens);
+  }
+
+  EPUB3SearchIndexBuildTermRef * terms = EPUB3Malloc((table.count > 0 ? table.count : 1) * sizeof(EPUB3SearchIndexBuildTermRef));
+  uint32_t termCount = 0;
+  for(uint32_t i = 0; i < table.capacity; i++) {
+    if(table.slots[i] != NULL) {
+      terms[termCount++] = table.slots[i];
+    }
+  }
+  qsort(terms, termCount, sizeof(EPUB3SearchIndexBuildTermRef), _EPUB3SearchIndexCompareTerms);
+
+  if(error == kEPUB3Success) {
+    error = _EPUB3SearchIndexWriteImage(digest, documents, index, terms, termCount, fd);
+  }
+
+  for(uint32_t i = 0; i < termCount; i++) {
+    EPUB3_FREE_AND_NULL(terms[i]->term);
+    EPUB3_FREE_AND_NULL(terms[i]->postings);
+    EPUB3_FREE_AND_NULL(terms[i]);
+  }
+  EPUB3_FREE_AND_NULL(terms);
+  EPUB3_FREE_AND_NULL(table.slots);
+  for(int32_t i = 0; i < index; i++) {
+    EPUB3TextDocumentFinalize(&documents[i].text);
+    EPUB3_FREE_AND_NULL(documents[i].terms);
+    EPUB3_FREE_AND_NULL(documents[i].tokens);
+  }
+  EPUB3_FREE_AND_NULL(documents);
+  return error;
+}
+
+#pragma mark - Opening
+
+static EPUB3Bool _EPUB3SearchIndexRangeIsValid(size_t size, uint64_t offset, uint64_t length)
+{
+  return offset <= size && length <= size - offset;
+}
+
+static EPUB3Bool _EPUB3SearchIndexIsValid(const unsigned char * image, size_t size)
+{
+  if(size < sizeof(EPUB3SearchIndexHeader) || image[size - 1] != '\0') return kEPUB3_NO;
+
+  const EPUB3SearchIndexHeader * header = (const EPUB3SearchIndexHeader *)image;
+  if(memcmp(header->magic, SEARCH_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->formatVersion != SEARCH_INDEX_FORMAT_VERSION ||
+     header->byteOrderMark != SNAPSHOT_BYTE_ORDER_MARK || header->imageSize != size || header->documentCount < 0) {
+    return kEPUB3_NO;
+  }
+  if(header->documents % 4 != 0 || header->terms % 4 != 0 ||
+     !_EPUB3SearchIndexRangeIsValid(size, header->documents, (uint64_t)header->documentCount * sizeof(EPUB3SearchIndexDocument)) ||
+     !_EPUB3SearchIndexRangeIsValid(size, header->terms, (uint64_t)header->termCount * sizeof(EPUB3SearchIndexTerm))) {
+    return kEPUB3_NO;
+  }
+
+  const EPUB3SearchIndexDocument * documents = (const EPUB3SearchIndexDocument *)(image + header->documents);
+  for(int32_t i = 0; i < header->documentCount; i++) {
+    if(documents[i].mappings % 4 != 0 ||
+       !_EPUB3SearchIndexRangeIsValid(size, documents[i].mappings, (uint64_t)documents[i].mappingCount * sizeof(EPUB3TextMapping)) ||
+       !_EPUB3SearchIndexRangeIsValid(size, documents[i].text, (uint64_t)documents[i].textLength + 1)) {
+      return kEPUB3_NO;
+    }
+  }
+  const EPUB3SearchIndexTerm * terms = (const EPUB3SearchIndexTerm *)(image + header->terms);
+  for(uint32_t i = 0; i < header->termCount; i++) {
+    if(terms[i].term >= size || !_EPUB3SearchIndexRangeIsValid(size, terms[i].postings, terms[i].postingsSize)) {
+      return kEPUB3_NO;
+    }
+  }
+  return kEPUB3_YES;
+}
+
+EXPORT EPUB3SearchIndexRef EPUB3CreateSearchIndexFromFile(EPUB3Ref epub, const char * path, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(path != NULL);
+  assert(error != NULL);
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  struct stat st;
+  void * image = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size > 0) {
+    image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  (void)close(fd);
+  if(image == MAP_FAILED) {
+    *error = kEPUB3SnapshotInvalidError;
+    return NULL;
+  }
+  size_t imageSize = (size_t)st.st_size;
+
+  *error = kEPUB3SnapshotInvalidError;
+  if(_EPUB3SearchIndexIsValid(image, imageSize)) {
+    const EPUB3SearchIndexHeader * header = image;
+    EPUB3ArchiveDigest digest;
+    *error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+    if(*error == kEPUB3Success && (memcmp(&digest, &header->archiveDigest, sizeof(digest)) != 0 || header->documentCount != epub->spine->linearItemCount)) {
+      *error = kEPUB3SnapshotStaleError;
+    }
+  }
+  if(*error != kEPUB3Success) {
+    (void)munmap(image, imageSize);
+    return NULL;
+  }
+
+  EPUB3SearchIndexRef index = EPUB3Malloc(sizeof(struct EPUB3SearchIndex));
+  index = EPUB3ObjectInitWithTypeID(index, kEPUB3SearchIndexTypeID);
+  index->image = image;
+  index->imageSize = imageSize;
+  return index;
+}
+
+EXPORT void EPUB3SearchIndexRelease(EPUB3SearchIndexRef index)
+{
+  if(index == NULL) return;
+  if(index->_type.refCount == 1) {
+    (void)munmap((void *)index->image, index->imageSize);
+    index->image = NULL;
+  }
+  EPUB3ObjectRelease(index);
+}
+
+#pragma mark - Queries
+
+static const EPUB3SearchIndexTerm * _EPUB3SearchIndexFindTerm(EPUB3SearchIndexRef index, const char * term)
+{
+  const EPUB3SearchIndexHeader * header = (const EPUB3SearchIndexHeader *)index->image;
+  const EPUB3SearchIndexTerm * terms = (const EPUB3SearchIndexTerm *)(index->image + header->terms);
+  uint32_t low = 0;
+  uint32_t high = header->termCount;
+  while(low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    int comparison = strcmp((const char *)index->image + terms[middle].term, term);
+    if(comparison == 0) return &terms[middle];
+    if(comparison < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return NULL;
+}
+
+static EPUB3Bool _EPUB3SearchIndexGetVarint(const unsigned char ** next, const unsigned char * end, uint32_t * value)
+{
+  uint32_t result = 0;
+  for(uint32_t shift = 0; *next < end && shift < 35; shift += 7) {
+    unsigned char byte = *(*next)++;
+    result |= (uint32_t)(byte & 0x7F) << shift;
+    if((byte & 0x80) == 0) {
+      *value = result;
+      return kEPUB3_YES;
+    }
+  }
+  return kEPUB3_NO;
+}
+
+// Decodes a term's postings into a new array, dropping any that don't fit the index
+static EPUB3SearchPosting * _EPUB3SearchIndexCopyPostings(EPUB3SearchIndexRef index, const EPUB3SearchIndexTerm * term, uint32_t * count)
+{
+  const EPUB3SearchIndexHeader * header = (const EPUB3SearchIndexHeader *)index->image;
+  EPUB3SearchPosting * postings = EPUB3Malloc((term->postingCount > 0 ? term->postingCount : 1) * sizeof(EPUB3SearchPosting));
+  const unsigned char * next = index->image + term->postings;
+  const unsigned char * end = next + term->postingsSize;
+  EPUB3SearchPosting previous = { -1, 0, 0 };
+  uint32_t i = 0;
+  for(; i < term->postingCount; i++) {
+    uint32_t documentDelta, token, textOffset;
+    if(!_EPUB3SearchIndexGetVarint(&next, end, &documentDelta) || !_EPUB3SearchIndexGetVarint(&next, end, &token) ||
+       !_EPUB3SearchIndexGetVarint(&next, end, &textOffset)) {
+      break;
+    }
+    // previous.document starts at -1, so a first delta of 0 lands before the documents
+    if(documentDelta > (uint32_t)(header->documentCount - 1 - previous.document)) break;
+    EPUB3SearchPosting posting;
+    posting.document = previous.document + (int32_t)documentDelta;
+    posting.token = documentDelta == 0 ? previous.token + token : token;
+    posting.textOffset = documentDelta == 0 ? previous.textOffset + textOffset : textOffset;
+    if(posting.document < 0) break;
+    postings[i] = posting;
+    previous = posting;
+  }
+  *count = i;
+  return postings;
+}
+
+static inline int _EPUB3SearchComparePostings(const EPUB3SearchPosting * a, int32_t document, uint32_t token)
+{
+  if(a->document != document) return a->document < document ? -1 : 1;
+  if(a->token != token) return a->token < token ? -1 : 1;
+  return 0;
+}
+
+static uint32_t _EPUB3SearchIndexSourceOffset(const EPUB3TextMapping * mappings, uint32_t mappingCount, uint32_t textOffset)
+{
+  if(mappingCount == 0) return 0;
+  uint32_t low = 0;
+  uint32_t high = mappingCount;
+  while(high - low > 1) {
+    uint32_t middle = low + (high - low) / 2;
+    if(mappings[middle].textOffset <= textOffset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return mappings[low].sourceOffset + (textOffset >= mappings[low].textOffset ? textOffset - mappings[low].textOffset : 0);
+}
+
+static void _EPUB3SearchIndexFillResult(EPUB3SearchIndexRef index, EPUB3SearchResult * result, int32_t document, uint32_t start, uint32_t lastTokenOffset)
+{
+  const EPUB3SearchIndexHeader * header = (const EPUB3SearchIndexHeader *)index->image;
+  const EPUB3SearchIndexDocument * indexDocument = (const EPUB3SearchIndexDocument *)(index->image + header->documents) + document;
+  const char * text = (const char *)index->image + indexDocument->text;
+  uint32_t length = indexDocument->textLength;
+  start = start < length ? start : length;
+
+  uint32_t end = lastTokenOffset < length ? lastTokenOffset : length;
+  EPUB3SearchToken token;
+  uint32_t offset = end;
+  if(EPUB3SearchNextToken(text, length, &offset, &token)) {
+    end = token.textOffset + token.textLength;
+  }
+  if(end < start) {
+    end = start;
+  }
+
+  result->spineIndex = document;
+  result->textOffset = start;
+  result->textLength = end - start;
+  result->sourceOffset = _EPUB3SearchIndexSourceOffset((const EPUB3TextMapping *)(index->image + indexDocument->mappings), indexDocument->mappingCount, start);
+
+  // Context on either side, without splitting a character
+  uint32_t snippetStart = start > SEARCH_SNIPPET_CONTEXT ? start - SEARCH_SNIPPET_CONTEXT : 0;
+  while(snippetStart < start && (text[snippetStart] & 0xC0) == 0x80) snippetStart++;
+  uint32_t snippetEnd = length - end > SEARCH_SNIPPET_CONTEXT ? end + SEARCH_SNIPPET_CONTEXT : length;
+  while(snippetEnd > end && snippetEnd < length && (text[snippetEnd] & 0xC0) == 0x80) snippetEnd--;
+  result->snippet = EPUB3Malloc(snippetEnd - snippetStart + 1);
+  for(uint32_t i = snippetStart; i < snippetEnd; i++) {
+    result->snippet[i - snippetStart] = text[i] == '\n' ? ' ' : text[i];
+  }
+  result->snippet[snippetEnd - snippetStart] = '\0';
+  result->snippetMatchOffset = start - snippetStart;
+}
+
+EXPORT EPUB3Error EPUB3SearchIndexQuery(EPUB3SearchIndexRef index, const char * query, int32_t maxResults, EPUB3SearchResult ** results, int32_t * resultCount)
+{
+  assert(index != NULL);
+  assert(query != NULL);
+  assert(results != NULL);
+  assert(resultCount != NULL);
+
+  *results = NULL;
+  *resultCount = 0;
+  if(maxResults < 0) return kEPUB3InvalidArgumentError;
+
+  EPUB3SearchToken tokens[SEARCH_QUERY_MAX_TERMS];
+  int32_t tokenCount = 0;
+  uint32_t offset = 0;
+  uint32_t queryLength = (uint32_t)strlen(query);
+  while(tokenCount < SEARCH_QUERY_MAX_TERMS && EPUB3SearchNextToken(query, queryLength, &offset, &tokens[tokenCount])) {
+    tokenCount++;
+  }
+  if(tokenCount == 0) return kEPUB3InvalidArgumentError;
+
+  // Start from every place the first word occurs and keep the ones where the rest follow, word by word
+  const EPUB3SearchIndexTerm * term = _EPUB3SearchIndexFindTerm(index, tokens[0].term);
+  if(term == NULL) return kEPUB3Success;
+  uint32_t candidateCount = 0;
+  EPUB3SearchPosting * candidates = _EPUB3SearchIndexCopyPostings(index, term, &candidateCount);
+  uint32_t * lastOffsets = EPUB3Malloc((candidateCount > 0 ? candidateCount : 1) * sizeof(uint32_t));
+  for(uint32_t i = 0; i < candidateCount; i++) {
+    lastOffsets[i] = candidates[i].textOffset;
+  }
+
+  for(int32_t k = 1; k < tokenCount && candidateCount > 0; k++) {
+    term = _EPUB3SearchIndexFindTerm(index, tokens[k].term);
+    if(term == NULL) {
+      candidateCount = 0;
+      break;
+    }
+    uint32_t postingCount = 0;
+    EPUB3SearchPosting * postings = _EPUB3SearchIndexCopyPostings(index, term, &postingCount);
+    uint32_t kept = 0;
+    uint32_t j = 0;
+    for(uint32_t i = 0; i < candidateCount; i++) {
+      uint32_t wanted = candidates[i].token + (uint32_t)k;
+      while(j < postingCount && _EPUB3SearchComparePostings(&postings[j], candidates[i].document, wanted) < 0) j++;
+      if(j < postingCount && _EPUB3SearchComparePostings(&postings[j], candidates[i].document, wanted) == 0) {
+        candidates[kept] = candidates[i];
+        lastOffsets[kept] = postings[j].textOffset;
+        kept++;
+      }
+    }
+    candidateCount = kept;
+    EPUB3_FREE_AND_NULL(postings);
+  }
+
+  if(maxResults > 0 && candidateCount > (uint32_t)maxResults) {
+    candidateCount = (uint32_t)maxResults;
+  }
+  if(candidateCount > 0) {
+    *results = EPUB3Calloc(candidateCount, sizeof(EPUB3SearchResult));
+    for(uint32_t i = 0; i < candidateCount; i++) {
+      _EPUB3SearchIndexFillResult(index, &(*results)[i], candidates[i].document, candidates[i].textOffset, lastOffsets[i]);
+    }
+    *resultCount = (int32_t)candidateCount;
+  }
+  EPUB3_FREE_AND_NULL(candidates);
+  EPUB3_FREE_AND_NULL(lastOffsets);
+  return kEPUB3Success;
+}
+
+EXPORT void EPUB3SearchResultsFree(EPUB3SearchResult * results, int32_t resultCount)
+{
+  if(results == NULL) return;
+  for(int32_t i = 0; i < resultCount; i++) {
+    EPUB3_FREE_AND_NULL(results[i].snippet);
+  }
+  EPUB3Free(results);
+}
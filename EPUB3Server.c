@@ -0,0 +1,850 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/uio.h>
+#endif
+
+const char * kEPUB3ServerTypeID = "_EPUB3Server_t";
+
+#ifdef MSG_NOSIGNAL
+#define HTTP_SERVER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define HTTP_SERVER_SEND_FLAGS 0
+#endif
+
+static void * _EPUB3ServerThreadMain(void * context);
+
+#pragma mark - Public API
+
+EXPORT EPUB3ServerRef EPUB3ServerCreate(uint16_t port, EPUB3Error *error)
+{
+  assert(error != NULL);
+
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenSocket < 0) {
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+
+  int yes = 1;
+  (void)setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  struct sockaddr_in address;
+  (void)memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  socklen_t addressLength = sizeof(address);
+
+  if(bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+     listen(listenSocket, 64) != 0 ||
+     getsockname(listenSocket, (struct sockaddr *)&address, &addressLength) != 0 ||
+     fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK) != 0) {
+    (void)close(listenSocket);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+
+  EPUB3ServerRef memory = EPUB3Malloc(sizeof(struct EPUB3Server));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3ServerTypeID);
+  memory->listenSocket = listenSocket;
+  memory->port = ntohs(address.sin_port);
+  memory->shouldStop = kEPUB3_NO;
+  memory->books = NULL;
+  memory->checkpointTasks = NULL;
+  memory->connections = NULL;
+  memory->connectionCount = 0;
+  (void)pthread_mutex_init(&memory->lock, NULL);
+
+  if(pipe(memory->wakePipe) != 0) {
+    (void)close(listenSocket);
+    (void)pthread_mutex_destroy(&memory->lock);
+    EPUB3_FREE_AND_NULL(memory);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+  (void)fcntl(memory->wakePipe[0], F_SETFL, fcntl(memory->wakePipe[0], F_GETFL) | O_NONBLOCK);
+
+  if(pthread_create(&memory->thread, NULL, _EPUB3ServerThreadMain, memory) != 0) {
+    (void)close(memory->wakePipe[0]);
+    (void)close(memory->wakePipe[1]);
+    (void)close(listenSocket);
+    (void)pthread_mutex_destroy(&memory->lock);
+    EPUB3_FREE_AND_NULL(memory);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+  memory->checkpointPool = EPUB3WorkPoolCreate(1);
+
+  *error = kEPUB3Success;
+  return memory;
+}
+
+EXPORT uint16_t EPUB3ServerGetPort(EPUB3ServerRef server)
+{
+  assert(server != NULL);
+  return server->port;
+}
+
+EXPORT EPUB3Error EPUB3ServerAddBook(EPUB3ServerRef server, const char * bookID, const char * archivePath)
+{
+  assert(server != NULL);
+  assert(bookID != NULL);
+  assert(archivePath != NULL);
+
+  if(bookID[0] == '\0' || strchr(bookID, '/') != NULL) return kEPUB3InvalidArgumentError;
+
+  // The server gets its own EPUB3Ref, so that nothing it does moves the caller's archive handle
+  EPUB3Ref epub = EPUB3Create();
+  EPUB3Error error = EPUB3PrepareArchiveAtPath(epub, archivePath);
+  if(error != kEPUB3Success) {
+    EPUB3Release(epub);
+    return kEPUB3ArchiveUnavailableError;
+  }
+
+  (void)pthread_mutex_lock(&server->lock);
+  for(EPUB3ServerBookPtr book = server->books; book != NULL; book = book->next) {
+    if(strcmp(book->bookID, bookID) == 0) {
+      error = kEPUB3InvalidArgumentError;
+      break;
+    }
+  }
+  if(error == kEPUB3Success) {
+    EPUB3ServerBookPtr book = EPUB3Malloc(sizeof(struct EPUB3ServerBook));
+    book->bookID = EPUB3Strdup(bookID);
+    book->epub = epub;
+    book->next = server->books;
+    server->books = book;
+  }
+  (void)pthread_mutex_unlock(&server->lock);
+
+  if(error != kEPUB3Success) {
+    EPUB3Release(epub);
+  }
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3ServerRemoveBook(EPUB3ServerRef server, const char * bookID)
+{
+  assert(server != NULL);
+  assert(bookID != NULL);
+
+  EPUB3Error error = kEPUB3InvalidArgumentError;
+  (void)pthread_mutex_lock(&server->lock);
+  for(EPUB3ServerBookPtr * link = &server->books; *link != NULL; link = &(*link)->next) {
+    EPUB3ServerBookPtr book = *link;
+    if(strcmp(book->bookID, bookID) == 0) {
+      *link = book->next;
+      // Responses in flight hold their own reference
+      EPUB3Release(book->epub);
+      EPUB3_FREE_AND_NULL(book->bookID);
+      EPUB3_FREE_AND_NULL(book);
+      error = kEPUB3Success;
+      break;
+    }
+  }
+  (void)pthread_mutex_unlock(&server->lock);
+  return error;
+}
+
+EXPORT void EPUB3ServerRelease(EPUB3ServerRef server)
+{
+  if(server == NULL) return;
+
+  (void)pthread_mutex_lock(&server->lock);
+  server->shouldStop = kEPUB3_YES;
+  (void)pthread_mutex_unlock(&server->lock);
+  char wake = 0;
+  (void)write(server->wakePipe[1], &wake, 1);
+  (void)pthread_join(server->thread, NULL);
+  // Waits for builds under way, which hold references to their books
+  EPUB3WorkPoolRelease(server->checkpointPool);
+
+  while(server->books != NULL) {
+    (void)EPUB3ServerRemoveBook(server, server->books->bookID);
+  }
+  (void)close(server->wakePipe[0]);
+  (void)close(server->wakePipe[1]);
+  (void)close(server->listenSocket);
+  (void)pthread_mutex_destroy(&server->lock);
+  EPUB3ObjectRelease(server);
+}
+
+#pragma mark - Checkpoint Building
+
+static void _EPUB3ServerBuildCheckpoints(void * context)
+{
+  EPUB3ServerCheckpointTaskPtr task = context;
+  EPUB3ServerRef server = task->server;
+  int fd = open(task->epub->archivePath, O_RDONLY);
+  if(fd >= 0) {
+    if(!EPUB3ArchiveEntryHasCheckpoints(task->epub, task->entry)) {
+      (void)EPUB3ArchiveEntryBuildCheckpoints(task->epub, task->entry, fd);
+    }
+    (void)close(fd);
+  }
+
+  (void)pthread_mutex_lock(&server->lock);
+  for(EPUB3ServerCheckpointTaskPtr * link = &server->checkpointTasks; *link != NULL; link = &(*link)->next) {
+    if(*link == task) {
+      *link = task->next;
+      break;
+    }
+  }
+  EPUB3Release(task->epub);
+  (void)pthread_mutex_unlock(&server->lock);
+  EPUB3_FREE_AND_NULL(task);
+}
+
+// Queues a checkpoint build for entry unless one is already queued or under way
+static void _EPUB3ServerBuildCheckpointsLater(EPUB3ServerRef server, EPUB3Ref epub, EPUB3ArchiveEntryPtr entry)
+{
+  if(server->checkpointPool == NULL) return;
+
+  (void)pthread_mutex_lock(&server->lock);
+  EPUB3ServerCheckpointTaskPtr task = server->checkpointTasks;
+  while(task != NULL && task->entry != entry) {
+    task = task->next;
+  }
+  if(task == NULL) {
+    task = EPUB3Malloc(sizeof(struct EPUB3ServerCheckpointTask));
+    task->server = server;
+    task->epub = epub;
+    EPUB3Retain(epub);
+    task->entry = entry;
+    task->next = server->checkpointTasks;
+    server->checkpointTasks = task;
+  } else {
+    task = NULL;
+  }
+  (void)pthread_mutex_unlock(&server->lock);
+
+  if(task != NULL) {
+    EPUB3WorkPoolSubmit(server->checkpointPool, _EPUB3ServerBuildCheckpoints, task);
+  }
+}
+
+#pragma mark - Connections
+
+static void _EPUB3ServerConnectionEndResponse(EPUB3ServerRef server, EPUB3ServerConnectionPtr connection)
+{
+  if(connection->stream != NULL) {
+    EPUB3ResourceStreamClose(connection->stream);
+    connection->stream = NULL;
+  }
+  connection->streamStart = 0;
+  if(connection->archiveFD >= 0) {
+    (void)close(connection->archiveFD);
+    connection->archiveFD = -1;
+  }
+  if(connection->epub != NULL) {
+    (void)pthread_mutex_lock(&server->lock);
+    EPUB3Release(connection->epub);
+    (void)pthread_mutex_unlock(&server->lock);
+    connection->epub = NULL;
+  }
+  connection->headersLength = 0;
+  connection->headersSent = 0;
+  connection->bodyRemaining = 0;
+  connection->bufferLength = 0;
+  connection->bufferSent = 0;
+  connection->trailerLength = 0;
+  connection->trailerSent = 0;
+}
+
+static void _EPUB3ServerCloseConnection(EPUB3ServerRef server, EPUB3ServerConnectionPtr connection)
+{
+  _EPUB3ServerConnectionEndResponse(server, connection);
+  (void)close(connection->socket);
+
+  for(EPUB3ServerConnectionPtr * link = &server->connections; *link != NULL; link = &(*link)->next) {
+    if(*link == connection) {
+      *link = connection->next;
+      break;
+    }
+  }
+  server->connectionCount--;
+  EPUB3_FREE_AND_NULL(connection);
+}
+
+static void _EPUB3ServerAcceptConnections(EPUB3ServerRef server)
+{
+  while(server->connectionCount < HTTP_SERVER_MAX_CONNECTIONS) {
+    int clientSocket = accept(server->listenSocket, NULL, NULL);
+    if(clientSocket < 0) return;
+
+    (void)fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) | O_NONBLOCK);
+    int yes = 1;
+    (void)setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+#ifdef SO_NOSIGPIPE
+    (void)setsockopt(clientSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+
+    EPUB3ServerConnectionPtr connection = EPUB3Calloc(1, sizeof(struct EPUB3ServerConnection));
+    connection->socket = clientSocket;
+    connection->state = kEPUB3ServerConnectionReadingRequest;
+    connection->archiveFD = -1;
+    connection->next = server->connections;
+    server->connections = connection;
+    server->connectionCount++;
+  }
+}
+
+#pragma mark - Requests
+
+static const char * _EPUB3ServerContentTypeForPath(const char * path)
+{
+  static const char * types[][2] = {
+    {".xhtml", "application/xhtml+xml"},
+    {".html", "text/html"},
+    {".htm", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".ncx", "application/x-dtbncx+xml"},
+    {".opf", "application/oebps-package+xml"},
+    {".xml", "application/xml"},
+    {".svg", "image/svg+xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".webp", "image/webp"},
+    {".mp3", "audio/mpeg"},
+    {".m4a", "audio/mp4"},
+    {".mp4", "video/mp4"},
+    {".m4v", "video/mp4"},
+    {".webm", "video/webm"},
+    {".otf", "font/otf"},
+    {".ttf", "font/ttf"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+    {".smil", "application/smil+xml"},
+  };
+
+  const char * extension = strrchr(path, '.');
+  if(extension != NULL && strchr(extension, '/') == NULL) {
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+      if(strcasecmp(extension, types[i][0]) == 0) return types[i][1];
+    }
+  }
+  if(strcmp(path, "mimetype") == 0) return "text/plain";
+  return "application/octet-stream";
+}
+
+static int _EPUB3ServerHexValue(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Percent-decodes in place; returns kEPUB3_NO for malformed escapes or embedded NULs
+static EPUB3Bool _EPUB3ServerDecodePath(char * path)
+{
+  char * out = path;
+  for(char * in = path; *in != '\0'; in++) {
+    if(*in == '%') {
+      int high = _EPUB3ServerHexValue(in[1]);
+      int low = high >= 0 ? _EPUB3ServerHexValue(in[2]) : -1;
+      if(low < 0 || (high == 0 && low == 0)) return kEPUB3_NO;
+      *out++ = (char)(high * 16 + low);
+      in += 2;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+  return kEPUB3_YES;
+}
+
+static const char * _EPUB3ServerFindHeader(const char * headers, const char * name, size_t * valueLength)
+{
+  size_t nameLength = strlen(name);
+  for(const char * line = headers; line != NULL && *line != '\0'; ) {
+    const char * lineEnd = strstr(line, "\r\n");
+    if(lineEnd == NULL || lineEnd == line) break;
+    if((size_t)(lineEnd - line) > nameLength && strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':') {
+      const char * value = line + nameLength + 1;
+      while(value < lineEnd && (*value == ' ' || *value == '\t')) value++;
+      const char * valueEnd = lineEnd;
+      while(valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) valueEnd--;
+      *valueLength = valueEnd - value;
+      return value;
+    }
+    line = lineEnd + 2;
+  }
+  return NULL;
+}
+
+static EPUB3Bool _EPUB3ServerETagMatches(const char * header, size_t headerLength, const char * etag)
+{
+  size_t etagLength = strlen(etag);
+  const char * end = header + headerLength;
+  const char * cursor = header;
+  while(cursor < end) {
+    while(cursor < end && (*cursor == ' ' || *cursor == ',')) cursor++;
+    const char * tagEnd = cursor;
+    while(tagEnd < end && *tagEnd != ',') tagEnd++;
+    const char * tag = cursor;
+    size_t tagLength = tagEnd - tag;
+    while(tagLength > 0 && tag[tagLength - 1] == ' ') tagLength--;
+    if(tagLength == 1 && *tag == '*') return kEPUB3_YES;
+    // If-None-Match uses the weak comparison
+    if(tagLength > 2 && strncmp(tag, "W/", 2) == 0) {
+      tag += 2;
+      tagLength -= 2;
+    }
+    if(tagLength == etagLength && strncmp(tag, etag, etagLength) == 0) return kEPUB3_YES;
+    cursor = tagEnd;
+  }
+  return kEPUB3_NO;
+}
+
+static EPUB3Bool _EPUB3ServerAcceptsGzip(const char * header, size_t headerLength)
+{
+  const char * end = header + headerLength;
+  const char * cursor = header;
+  while(cursor < end) {
+    while(cursor < end && (*cursor == ' ' || *cursor == ',')) cursor++;
+    const char * codingEnd = cursor;
+    while(codingEnd < end && *codingEnd != ',' && *codingEnd != ';' && *codingEnd != ' ') codingEnd++;
+    size_t codingLength = codingEnd - cursor;
+    EPUB3Bool isGzip = (codingLength == 4 && strncasecmp(cursor, "gzip", 4) == 0) ||
+                       (codingLength == 6 && strncasecmp(cursor, "x-gzip", 6) == 0) ||
+                       (codingLength == 1 && *cursor == '*');
+    const char * itemEnd = codingEnd;
+    while(itemEnd < end && *itemEnd != ',') itemEnd++;
+    if(isGzip) {
+      // q=0 (or 0.0, 0.00...) means "not acceptable"
+      const char * q = codingEnd;
+      while(q + 2 < itemEnd && !(q[0] == 'q' && q[1] == '=')) q++;
+      if(q + 2 >= itemEnd || q[0] != 'q') return kEPUB3_YES;
+      double quality = strtod(q + 2, NULL);
+      return quality > 0.0 ? kEPUB3_YES : kEPUB3_NO;
+    }
+    cursor = itemEnd;
+  }
+  return kEPUB3_NO;
+}
+
+typedef enum {
+  kEPUB3ServerRangeNone,
+  kEPUB3ServerRangeSatisfiable,
+  kEPUB3ServerRangeUnsatisfiable,
+} EPUB3ServerRangeResult;
+
+// Single byte ranges only. Anything else (including multiple ranges) is ignored, and the whole entity
+// is sent, which RFC 7233 allows.
+static EPUB3ServerRangeResult _EPUB3ServerParseRange(const char * header, size_t headerLength, uint64_t length, uint64_t * first, uint64_t * last)
+{
+  if(headerLength < 7 || strncasecmp(header, "bytes=", 6) != 0 || memchr(header, ',', headerLength) != NULL) {
+    return kEPUB3ServerRangeNone;
+  }
+
+  char spec[64];
+  size_t specLength = headerLength - 6;
+  if(specLength >= sizeof(spec)) return kEPUB3ServerRangeNone;
+  (void)memcpy(spec, header + 6, specLength);
+  spec[specLength] = '\0';
+
+  char * dash = strchr(spec, '-');
+  if(dash == NULL) return kEPUB3ServerRangeNone;
+  *dash = '\0';
+  char * firstString = spec;
+  char * lastString = dash + 1;
+  char * end = NULL;
+
+  if(*firstString == '\0') {
+    // bytes=-N, the final N bytes
+    if(*lastString == '\0') return kEPUB3ServerRangeNone;
+    unsigned long long suffix = strtoull(lastString, &end, 10);
+    if(*end != '\0') return kEPUB3ServerRangeNone;
+    if(suffix == 0 || length == 0) return kEPUB3ServerRangeUnsatisfiable;
+    *first = suffix >= length ? 0 : length - suffix;
+    *last = length - 1;
+    return kEPUB3ServerRangeSatisfiable;
+  }
+
+  unsigned long long start = strtoull(firstString, &end, 10);
+  if(*end != '\0') return kEPUB3ServerRangeNone;
+  unsigned long long stop = length > 0 ? length - 1 : 0;
+  if(*lastString != '\0') {
+    stop = strtoull(lastString, &end, 10);
+    if(*end != '\0' || stop < start) return kEPUB3ServerRangeNone;
+  }
+  if(start >= length) return kEPUB3ServerRangeUnsatisfiable;
+  *first = start;
+  *last = stop >= length ? length - 1 : stop;
+  return kEPUB3ServerRangeSatisfiable;
+}
+
+static void _EPUB3ServerSetSimpleResponse(EPUB3ServerConnectionPtr connection, const char * status, const char * extraHeaders)
+{
+  int length = snprintf(connection->headers, sizeof(connection->headers),
+                        "HTTP/1.1 %s\r\nServer: EPUB3Processor\r\nContent-Length: 0\r\n%sConnection: %s\r\n\r\n",
+                        status, extraHeaders != NULL ? extraHeaders : "", connection->keepAlive ? "keep-alive" : "close");
+  // The status lines and extra headers are all short enough, this only keeps a mistake from overreading
+  connection->headersLength = length < 0 ? 0 : (size_t)length < sizeof(connection->headers) ? (size_t)length : sizeof(connection->headers) - 1;
+  connection->headersSent = 0;
+  connection->bodyRemaining = 0;
+}
+
+static void _EPUB3ServerPrepareResponse(EPUB3ServerRef server, EPUB3ServerConnectionPtr connection, char * request)
+{
+  // Request line
+  char * lineEnd = strstr(request, "\r\n");
+  char * method = request;
+  char * target = strchr(method, ' ');
+  char * version = target != NULL ? strchr(target + 1, ' ') : NULL;
+  const char * headers = lineEnd + 2;
+
+  connection->keepAlive = kEPUB3_NO;
+  if(target == NULL || version == NULL || version > lineEnd) {
+    _EPUB3ServerSetSimpleResponse(connection, "400 Bad Request", NULL);
+    return;
+  }
+  *target++ = '\0';
+  *version++ = '\0';
+  *lineEnd = '\0';
+
+  size_t valueLength = 0;
+  const char * connectionHeader = _EPUB3ServerFindHeader(headers, "Connection", &valueLength);
+  if(strcmp(version, "HTTP/1.1") == 0) {
+    connection->keepAlive = !(connectionHeader != NULL && valueLength == 5 && strncasecmp(connectionHeader, "close", 5) == 0);
+  } else {
+    connection->keepAlive = connectionHeader != NULL && valueLength == 10 && strncasecmp(connectionHeader, "keep-alive", 10) == 0;
+  }
+
+  EPUB3Bool isHead = strcmp(method, "HEAD") == 0;
+  if(!isHead && strcmp(method, "GET") != 0) {
+    _EPUB3ServerSetSimpleResponse(connection, "405 Method Not Allowed", "Allow: GET, HEAD\r\n");
+    return;
+  }
+
+  // /book/<id>/<path inside the archive>
+  char * query = strpbrk(target, "?#");
+  if(query != NULL) *query = '\0';
+  if(strncmp(target, "/book/", 6) != 0) {
+    _EPUB3ServerSetSimpleResponse(connection, "404 Not Found", NULL);
+    return;
+  }
+  char * bookID = target + 6;
+  char * path = strchr(bookID, '/');
+  if(path == NULL || path[1] == '\0') {
+    _EPUB3ServerSetSimpleResponse(connection, "404 Not Found", NULL);
+    return;
+  }
+  *path++ = '\0';
+  if(!_EPUB3ServerDecodePath(bookID) || !_EPUB3ServerDecodePath(path)) {
+    _EPUB3ServerSetSimpleResponse(connection, "400 Bad Request", NULL);
+    return;
+  }
+
+  EPUB3Ref epub = NULL;
+  (void)pthread_mutex_lock(&server->lock);
+  for(EPUB3ServerBookPtr book = server->books; book != NULL; book = book->next) {
+    if(strcmp(book->bookID, bookID) == 0) {
+      epub = book->epub;
+      EPUB3Retain(epub);
+      break;
+    }
+  }
+  (void)pthread_mutex_unlock(&server->lock);
+  if(epub == NULL) {
+    _EPUB3ServerSetSimpleResponse(connection, "404 Not Found", NULL);
+    return;
+  }
+  connection->epub = epub;
+
+  EPUB3ArchiveEntryPtr entry = NULL;
+  EPUB3Error error = EPUB3GetArchiveEntry(epub, path, &entry);
+  if(error != kEPUB3Success) {
+    _EPUB3ServerSetSimpleResponse(connection, error == kEPUB3FileNotFoundInArchiveError ? "404 Not Found" : "500 Internal Server Error", NULL);
+    return;
+  }
+
+  // Deflated entries go to clients that accept gzip exactly as they sit in the archive. Range requests
+  // always get the identity encoding, so that offsets mean what the client expects them to.
+  size_t rangeLength = 0;
+  const char * rangeHeader = _EPUB3ServerFindHeader(headers, "Range", &rangeLength);
+  const char * acceptEncoding = _EPUB3ServerFindHeader(headers, "Accept-Encoding", &valueLength);
+  EPUB3Bool sendsGzip = entry->method == Z_DEFLATED && rangeHeader == NULL && acceptEncoding != NULL && _EPUB3ServerAcceptsGzip(acceptEncoding, valueLength);
+  const char * vary = entry->method == Z_DEFLATED ? "Vary: Accept-Encoding\r\n" : "";
+
+  // The central directory CRC and size change whenever the bytes do
+  char etag[40];
+  (void)snprintf(etag, sizeof(etag), "\"%08x-%llx%s\"", entry->crc, (unsigned long long)entry->uncompressedSize, sendsGzip ? "-gz" : "");
+
+  const char * ifNoneMatch = _EPUB3ServerFindHeader(headers, "If-None-Match", &valueLength);
+  if(ifNoneMatch != NULL && _EPUB3ServerETagMatches(ifNoneMatch, valueLength, etag)) {
+    char extraHeaders[96];
+    (void)snprintf(extraHeaders, sizeof(extraHeaders), "ETag: %s\r\n%s", etag, vary);
+    _EPUB3ServerSetSimpleResponse(connection, "304 Not Modified", extraHeaders);
+    return;
+  }
+
+  uint64_t length = entry->uncompressedSize;
+  uint64_t first = 0;
+  uint64_t last = length > 0 ? length - 1 : 0;
+  EPUB3ServerRangeResult range = rangeHeader != NULL ? _EPUB3ServerParseRange(rangeHeader, rangeLength, length, &first, &last) : kEPUB3ServerRangeNone;
+  if(range == kEPUB3ServerRangeUnsatisfiable) {
+    char extraHeaders[64];
+    (void)snprintf(extraHeaders, sizeof(extraHeaders), "Content-Range: bytes */%llu\r\n", (unsigned long long)length);
+    _EPUB3ServerSetSimpleResponse(connection, "416 Range Not Satisfiable", extraHeaders);
+    return;
+  }
+  uint64_t contentLength = length > 0 ? last - first + 1 : 0;
+  if(sendsGzip) {
+    contentLength = GZIP_HEADER_SIZE + entry->compressedSize + GZIP_TRAILER_SIZE;
+  }
+
+  if(!isHead && sendsGzip) {
+    connection->archiveFD = open(epub->archivePath, O_RDONLY);
+    connection->bodyOffset = entry->dataOffset;
+    connection->bodyRemaining = entry->compressedSize;
+    EPUB3WriteGzipTrailer(connection->trailer, entry->crc, entry->uncompressedSize);
+    connection->trailerLength = GZIP_TRAILER_SIZE;
+    if(connection->archiveFD < 0) {
+      _EPUB3ServerConnectionEndResponse(server, connection);
+      connection->keepAlive = kEPUB3_NO;
+      _EPUB3ServerSetSimpleResponse(connection, "500 Internal Server Error", NULL);
+      return;
+    }
+  }
+  else if(!isHead && contentLength > 0) {
+    if(entry->method == 0) {
+      connection->archiveFD = open(epub->archivePath, O_RDONLY);
+      connection->bodyOffset = entry->dataOffset + first;
+    } else {
+      connection->stream = EPUB3ResourceStreamOpen(epub, path, &error);
+      connection->streamStart = first;
+      if(first > 0 && !EPUB3ArchiveEntryHasCheckpoints(epub, entry)) {
+        // One full pass on the worker makes later seeks into the entry cheap; this response inflates its
+        // way to the start of the range a step at a time as it is sent
+        _EPUB3ServerBuildCheckpointsLater(server, epub, entry);
+      }
+    }
+    if((entry->method == 0 && connection->archiveFD < 0) || (entry->method != 0 && error != kEPUB3Success)) {
+      _EPUB3ServerConnectionEndResponse(server, connection);
+      connection->keepAlive = kEPUB3_NO;
+      _EPUB3ServerSetSimpleResponse(connection, "500 Internal Server Error", NULL);
+      return;
+    }
+    connection->bodyRemaining = contentLength;
+  }
+
+  char contentRange[96] = "";
+  if(range == kEPUB3ServerRangeSatisfiable) {
+    (void)snprintf(contentRange, sizeof(contentRange), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                   (unsigned long long)first, (unsigned long long)last, (unsigned long long)length);
+  }
+  int headersLength = snprintf(connection->headers, sizeof(connection->headers) - GZIP_HEADER_SIZE,
+                               "HTTP/1.1 %s\r\nServer: EPUB3Processor\r\nContent-Type: %s\r\nContent-Length: %llu\r\n%s%s"
+                               "Accept-Ranges: bytes\r\nETag: %s\r\n%sConnection: %s\r\n\r\n",
+                               range == kEPUB3ServerRangeSatisfiable ? "206 Partial Content" : "200 OK",
+                               _EPUB3ServerContentTypeForPath(path), (unsigned long long)contentLength, contentRange,
+                               sendsGzip ? "Content-Encoding: gzip\r\n" : "", etag, vary,
+                               connection->keepAlive ? "keep-alive" : "close");
+  if(headersLength < 0 || (size_t)headersLength >= sizeof(connection->headers) - GZIP_HEADER_SIZE) {
+    _EPUB3ServerConnectionEndResponse(server, connection);
+    connection->keepAlive = kEPUB3_NO;
+    _EPUB3ServerSetSimpleResponse(connection, "500 Internal Server Error", NULL);
+    return;
+  }
+  connection->headersLength = (size_t)headersLength;
+  if(sendsGzip && !isHead) {
+    // The gzip header rides along with the HTTP headers; the trailer follows the body
+    EPUB3WriteGzipHeader((unsigned char *)connection->headers + connection->headersLength);
+    connection->headersLength += GZIP_HEADER_SIZE;
+  }
+  connection->headersSent = 0;
+}
+
+#pragma mark - I/O
+
+typedef enum {
+  kEPUB3ServerIOWouldBlock,
+  kEPUB3ServerIODone,
+  kEPUB3ServerIOClose,
+} EPUB3ServerIOResult;
+
+static EPUB3ServerIOResult _EPUB3ServerSendBody(EPUB3ServerConnectionPtr connection)
+{
+  while(connection->bodyRemaining > 0 || connection->bufferSent < connection->bufferLength) {
+    if(connection->archiveFD >= 0) {
+      // Stored entries go straight from the archive to the socket
+      size_t chunk = connection->bodyRemaining > (1U << 30) ? (1U << 30) : (size_t)connection->bodyRemaining;
+#if defined(__linux__)
+      off_t offset = (off_t)connection->bodyOffset;
+      ssize_t sent = sendfile(connection->socket, connection->archiveFD, &offset, chunk);
+      if(sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+      if(sent == 0) return kEPUB3ServerIOClose;
+#elif defined(__APPLE__)
+      off_t sent = (off_t)chunk;
+      int status = sendfile(connection->archiveFD, connection->socket, (off_t)connection->bodyOffset, &sent, NULL, 0);
+      if(status != 0 && sent == 0) return (errno == EAGAIN || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+#else
+      if(chunk > sizeof(connection->buffer)) chunk = sizeof(connection->buffer);
+      ssize_t count = pread(connection->archiveFD, connection->buffer, chunk, (off_t)connection->bodyOffset);
+      if(count <= 0) return kEPUB3ServerIOClose;
+      ssize_t sent = send(connection->socket, connection->buffer, (size_t)count, HTTP_SERVER_SEND_FLAGS);
+      if(sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+#endif
+      connection->bodyOffset += (uint64_t)sent;
+      connection->bodyRemaining -= (uint64_t)sent;
+      continue;
+    }
+
+    // Without checkpoints the start of a range is reached a step at a time, so that a long way in
+    // doesn't hold up every other connection. Once the worker has attached them, seeks are short.
+    uint64_t position = EPUB3ResourceStreamGetOffset(connection->stream);
+    if(position < connection->streamStart) {
+      EPUB3Error error = kEPUB3Success;
+      if(EPUB3ArchiveEntryHasCheckpoints(connection->epub, connection->stream->entry)) {
+        error = EPUB3ResourceStreamSeek(connection->stream, connection->streamStart);
+      } else {
+        uint64_t step = connection->streamStart - position;
+        error = EPUB3ResourceStreamSkip(connection->stream, step < HTTP_SERVER_SKIP_STEP_SIZE ? step : HTTP_SERVER_SKIP_STEP_SIZE);
+      }
+      if(error != kEPUB3Success) return kEPUB3ServerIOClose;
+      if(EPUB3ResourceStreamGetOffset(connection->stream) < connection->streamStart) return kEPUB3ServerIOWouldBlock;
+    }
+
+    // Deflated entries are inflated into one bounded buffer at a time
+    if(connection->bufferSent == connection->bufferLength) {
+      uint32_t toRead = connection->bodyRemaining < sizeof(connection->buffer) ? (uint32_t)connection->bodyRemaining : (uint32_t)sizeof(connection->buffer);
+      uint32_t bytesRead = 0;
+      if(EPUB3ResourceStreamRead(connection->stream, connection->buffer, toRead, &bytesRead) != kEPUB3Success || bytesRead == 0) {
+        return kEPUB3ServerIOClose;
+      }
+      connection->bufferLength = bytesRead;
+      connection->bufferSent = 0;
+      connection->bodyRemaining -= bytesRead;
+    }
+    ssize_t sent = send(connection->socket, connection->buffer + connection->bufferSent, connection->bufferLength - connection->bufferSent, HTTP_SERVER_SEND_FLAGS);
+    if(sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+    connection->bufferSent += (size_t)sent;
+  }
+  return kEPUB3ServerIODone;
+}
+
+static EPUB3ServerIOResult _EPUB3ServerWriteResponse(EPUB3ServerConnectionPtr connection)
+{
+  while(connection->headersSent < connection->headersLength) {
+    ssize_t sent = send(connection->socket, connection->headers + connection->headersSent, connection->headersLength - connection->headersSent, HTTP_SERVER_SEND_FLAGS);
+    if(sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+    connection->headersSent += (size_t)sent;
+  }
+  EPUB3ServerIOResult result = _EPUB3ServerSendBody(connection);
+  while(result == kEPUB3ServerIODone && connection->trailerSent < connection->trailerLength) {
+    ssize_t sent = send(connection->socket, connection->trailer + connection->trailerSent, connection->trailerLength - connection->trailerSent, HTTP_SERVER_SEND_FLAGS);
+    if(sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? kEPUB3ServerIOWouldBlock : kEPUB3ServerIOClose;
+    connection->trailerSent += (size_t)sent;
+  }
+  return result;
+}
+
+// Handles everything that is ready on a connection. Returns kEPUB3_NO once the connection should be closed.
+static EPUB3Bool _EPUB3ServerServiceConnection(EPUB3ServerRef server, EPUB3ServerConnectionPtr connection)
+{
+  for(;;) {
+    if(connection->state == kEPUB3ServerConnectionWritingResponse) {
+      EPUB3ServerIOResult result = _EPUB3ServerWriteResponse(connection);
+      if(result == kEPUB3ServerIOWouldBlock) return kEPUB3_YES;
+      _EPUB3ServerConnectionEndResponse(server, connection);
+      if(result == kEPUB3ServerIOClose || !connection->keepAlive) return kEPUB3_NO;
+      connection->state = kEPUB3ServerConnectionReadingRequest;
+    }
+
+    // A pipelined request may already be buffered
+    connection->request[connection->requestLength] = '\0';
+    char * requestEnd = strstr(connection->request, "\r\n\r\n");
+    if(requestEnd == NULL) {
+      if(connection->requestLength == sizeof(connection->request) - 1) {
+        connection->keepAlive = kEPUB3_NO;
+        _EPUB3ServerSetSimpleResponse(connection, "431 Request Header Fields Too Large", NULL);
+        connection->requestLength = 0;
+        connection->state = kEPUB3ServerConnectionWritingResponse;
+        continue;
+      }
+      ssize_t received = recv(connection->socket, connection->request + connection->requestLength, sizeof(connection->request) - 1 - connection->requestLength, 0);
+      if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return kEPUB3_YES;
+      if(received <= 0) return kEPUB3_NO;
+      connection->requestLength += (size_t)received;
+      continue;
+    }
+
+    size_t requestLength = requestEnd + 4 - connection->request;
+    requestEnd[2] = '\0'; // keep the final header's CRLF for the header scanner
+    _EPUB3ServerPrepareResponse(server, connection, connection->request);
+    (void)memmove(connection->request, connection->request + requestLength, connection->requestLength - requestLength);
+    connection->requestLength -= requestLength;
+    connection->state = kEPUB3ServerConnectionWritingResponse;
+  }
+}
+
+#pragma mark - Event Loop
+
+static void * _EPUB3ServerThreadMain(void * context)
+{
+  EPUB3ServerRef server = (EPUB3ServerRef)context;
+
+  // A client hanging up mid-response must not take the process down
+  sigset_t signals;
+  (void)sigemptyset(&signals);
+  (void)sigaddset(&signals, SIGPIPE);
+  (void)pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  struct pollfd descriptors[HTTP_SERVER_MAX_CONNECTIONS + 2];
+  EPUB3ServerConnectionPtr polled[HTTP_SERVER_MAX_CONNECTIONS];
+
+  for(;;) {
+    (void)pthread_mutex_lock(&server->lock);
+    EPUB3Bool shouldStop = server->shouldStop;
+    (void)pthread_mutex_unlock(&server->lock);
+    if(shouldStop) break;
+
+    nfds_t count = 0;
+    descriptors[count++] = (struct pollfd){server->wakePipe[0], POLLIN, 0};
+    descriptors[count++] = (struct pollfd){server->listenSocket, server->connectionCount < HTTP_SERVER_MAX_CONNECTIONS ? POLLIN : 0, 0};
+    int32_t connectionCount = 0;
+    for(EPUB3ServerConnectionPtr connection = server->connections; connection != NULL; connection = connection->next) {
+      short events = connection->state == kEPUB3ServerConnectionReadingRequest ? POLLIN : POLLOUT;
+      descriptors[count++] = (struct pollfd){connection->socket, events, 0};
+      polled[connectionCount++] = connection;
+    }
+
+    if(poll(descriptors, count, -1) < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    if(descriptors[0].revents & POLLIN) {
+      char drain[16];
+      while(read(server->wakePipe[0], drain, sizeof(drain)) > 0);
+    }
+    for(int32_t i = 0; i < connectionCount; i++) {
+      if(descriptors[i + 2].revents != 0 && !_EPUB3ServerServiceConnection(server, polled[i])) {
+        _EPUB3ServerCloseConnection(server, polled[i]);
+      }
+    }
+    if(descriptors[1].revents & POLLIN) {
+      _EPUB3ServerAcceptConnections(server);
+    }
+  }
+
+  while(server->connections != NULL) {
+    _EPUB3ServerCloseConnection(server, server->connections);
+  }
+  return NULL;
+}
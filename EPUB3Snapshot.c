@@ -0,0 +1,575 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <sys/mman.h>
+#include <limits.h>
+
+typedef struct _EPUB3SnapshotBuilder {
+  unsigned char * bytes;
+  size_t length;
+  size_t capacity;
+  EPUB3Bool overflowed; // offsets are 32 bits wide
+} _EPUB3SnapshotBuilder;
+
+typedef struct _EPUB3SnapshotEntryInfo {
+  char * path;
+  int32_t method;
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t dataOffset;
+} _EPUB3SnapshotEntryInfo;
+
+#pragma mark - Archive Digest
+
+EPUB3Error EPUB3GetArchiveDigest(int fd, EPUB3ArchiveDigest * digest)
+{
+  assert(fd >= 0);
+  assert(digest != NULL);
+
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    return kEPUB3ArchiveUnavailableError;
+  }
+
+  // The end of central directory record (or the ZIP64 one it points at) says where the directory is
+  EPUB3SniffResult sniff;
+  if(EPUB3SniffCentralDirectory(fd, (uint64_t)st.st_size, &sniff) != kEPUB3SniffEPUB) {
+    return kEPUB3ArchiveUnavailableError;
+  }
+  digest->entryCount = (uint32_t)sniff.entryCount; // the low bits are enough to tell archives apart
+  digest->centralDirectorySize = sniff.centralDirectorySize;
+  digest->centralDirectoryOffset = sniff.centralDirectoryOffset;
+
+  unsigned char buffer[16384];
+  uint32_t crc = EPUB3CRC32(0, NULL, 0);
+  uint64_t offset = digest->centralDirectoryOffset;
+  uint64_t remaining = digest->centralDirectorySize;
+  while(remaining > 0) {
+    size_t count = remaining < sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+    if(pread(fd, buffer, count, (off_t)offset) != (ssize_t)count) {
+      return kEPUB3ArchiveUnavailableError;
+    }
+    crc = EPUB3CRC32(crc, buffer, count);
+    offset += count;
+    remaining -= count;
+  }
+  digest->centralDirectoryCRC = crc;
+  return kEPUB3Success;
+}
+
+EPUB3Error EPUB3GetArchiveDigestOfBook(EPUB3Ref epub, EPUB3ArchiveDigest * digest)
+{
+  if(epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+  if(epub->recoveredArchive != NULL) {
+    // The archive's own end records are damaged, but the rebuilt directory is as deterministic as they'd be
+    const struct EPUB3RecoveredArchive * recovered = epub->recoveredArchive;
+    digest->entryCount = (uint32_t)recovered->entryCount;
+    digest->centralDirectorySize = recovered->directorySize;
+    digest->centralDirectoryOffset = recovered->directoryOffset;
+    digest->centralDirectoryCRC = EPUB3CRC32(EPUB3CRC32(0, NULL, 0), recovered->directory, (size_t)recovered->directorySize);
+    return kEPUB3Success;
+  }
+  int fd = open(epub->archivePath, O_RDONLY);
+  if(fd < 0) return kEPUB3ArchiveUnavailableError;
+  EPUB3Error error = EPUB3GetArchiveDigest(fd, digest);
+  (void)close(fd);
+  return error;
+}
+
+#pragma mark - Writing
+
+static uint32_t _EPUB3SnapshotReserve(_EPUB3SnapshotBuilder * builder, size_t size)
+{
+  size_t offset = (builder->length + 7) & ~(size_t)7;
+  if(offset + size > UINT32_MAX) {
+    builder->overflowed = kEPUB3_YES;
+    return 0;
+  }
+  if(offset + size > builder->capacity) {
+    size_t capacity = builder->capacity * 2;
+    while(capacity < offset + size) capacity *= 2;
+    builder->bytes = EPUB3Realloc(builder->bytes, capacity);
+    builder->capacity = capacity;
+  }
+  (void)memset(builder->bytes + builder->length, 0, offset + size - builder->length);
+  builder->length = offset + size;
+  return (uint32_t)offset;
+}
+
+static uint32_t _EPUB3SnapshotAddString(_EPUB3SnapshotBuilder * builder, const char * string)
+{
+  if(string == NULL) return 0;
+  size_t length = strlen(string) + 1;
+  if(builder->length + length > UINT32_MAX) {
+    builder->overflowed = kEPUB3_YES;
+    return 0;
+  }
+  if(builder->length + length > builder->capacity) {
+    size_t capacity = builder->capacity * 2;
+    while(capacity < builder->length + length) capacity *= 2;
+    builder->bytes = EPUB3Realloc(builder->bytes, capacity);
+    builder->capacity = capacity;
+  }
+  uint32_t offset = (uint32_t)builder->length;
+  (void)memcpy(builder->bytes + offset, string, length);
+  builder->length += length;
+  return offset;
+}
+
+#define SNAPSHOT_AT(__builder, __type, __offset) ((__type *)((__builder)->bytes + (__offset)))
+
+static int _EPUB3SnapshotCompareEntries(const void * a, const void * b)
+{
+  return strcmp(((const _EPUB3SnapshotEntryInfo *)a)->path, ((const _EPUB3SnapshotEntryInfo *)b)->path);
+}
+
+static int32_t _EPUB3SnapshotCountTocItems(EPUB3TocItemChildListItemPtr itemPtr)
+{
+  int32_t count = 0;
+  for(; itemPtr != NULL; itemPtr = itemPtr->next) {
+    count += 1 + _EPUB3SnapshotCountTocItems(itemPtr->item->childrenHead);
+  }
+  return count;
+}
+
+static void _EPUB3SnapshotAddTocItems(_EPUB3SnapshotBuilder * builder, uint32_t items, EPUB3TocItemChildListItemPtr itemPtr, int32_t parent, int32_t * nextIndex)
+{
+  for(; itemPtr != NULL; itemPtr = itemPtr->next) {
+    int32_t index = (*nextIndex)++;
+    uint32_t title = _EPUB3SnapshotAddString(builder, itemPtr->item->title);
+    uint32_t href = _EPUB3SnapshotAddString(builder, itemPtr->item->href);
+    EPUB3SnapshotTocItem * item = SNAPSHOT_AT(builder, EPUB3SnapshotTocItem, items) + index;
+    item->title = title;
+    item->href = href;
+    item->parent = parent;
+    _EPUB3SnapshotAddTocItems(builder, items, itemPtr->item->childrenHead, index, nextIndex);
+  }
+}
+
+// Every entry in the central directory, with the offset of its data (which means a look at each local header)
+static EPUB3Error _EPUB3SnapshotCopyEntries(EPUB3Ref epub, _EPUB3SnapshotEntryInfo ** entries, uint32_t * entryCount)
+{
+  uint32_t capacity = epub->archiveFileCount > 0 ? epub->archiveFileCount : 16;
+  _EPUB3SnapshotEntryInfo * infos = EPUB3Calloc(capacity, sizeof(_EPUB3SnapshotEntryInfo));
+  uint32_t count = 0;
+  EPUB3Error error = kEPUB3Success;
+
+  // The walk moves the book's shared archive cursor, which other threads may be using
+  char name[PATH_MAX];
+  unz_file_info64 fileInfo;
+  (void)pthread_mutex_lock(&epub->entryLock);
+  for(int status = unzGoToFirstFile(epub->archive); status == UNZ_OK; status = unzGoToNextFile(epub->archive)) {
+    int method = 0;
+    int level = 0;
+    if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, name, sizeof(name), NULL, 0, NULL, 0) != UNZ_OK ||
+       unzOpenCurrentFile2(epub->archive, &method, &level, 1) != UNZ_OK) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    if(count == capacity) {
+      capacity *= 2;
+      infos = EPUB3Realloc(infos, capacity * sizeof(_EPUB3SnapshotEntryInfo));
+    }
+    infos[count].path = EPUB3Strdup(name);
+    infos[count].method = method;
+    infos[count].crc = (uint32_t)fileInfo.crc;
+    infos[count].compressedSize = fileInfo.compressed_size;
+    infos[count].uncompressedSize = fileInfo.uncompressed_size;
+    infos[count].dataOffset = unzGetCurrentFileZStreamPos64(epub->archive);
+    (void)unzCloseCurrentFile(epub->archive);
+    count++;
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+
+  if(error != kEPUB3Success) {
+    for(uint32_t i = 0; i < count; i++) {
+      EPUB3_FREE_AND_NULL(infos[i].path);
+    }
+    EPUB3_FREE_AND_NULL(infos);
+    count = 0;
+  } else {
+    qsort(infos, count, sizeof(_EPUB3SnapshotEntryInfo), _EPUB3SnapshotCompareEntries);
+  }
+  *entries = infos;
+  *entryCount = count;
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3WriteSnapshot(EPUB3Ref epub, int fd)
+{
+  assert(epub != NULL);
+  assert(fd >= 0);
+
+  if(epub->archive == NULL || epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+  if(epub->metadata == NULL || epub->manifest == NULL || epub->spine == NULL) return kEPUB3InvalidArgumentError;
+
+  // Snapshots are reopened from anywhere, so they record where the archive really is
+  char archivePath[PATH_MAX];
+  if(realpath(epub->archivePath, archivePath) == NULL) {
+    return kEPUB3ArchiveUnavailableError;
+  }
+  EPUB3ArchiveDigest digest;
+  EPUB3Error error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+  if(error != kEPUB3Success) return error;
+
+  _EPUB3SnapshotEntryInfo * entries = NULL;
+  uint32_t entryCount = 0;
+  error = _EPUB3SnapshotCopyEntries(epub, &entries, &entryCount);
+  if(error != kEPUB3Success) return error;
+
+  _EPUB3SnapshotBuilder builder;
+  builder.capacity = 64 * 1024;
+  builder.bytes = EPUB3Malloc(builder.capacity);
+  builder.length = 0;
+  builder.overflowed = kEPUB3_NO;
+
+  uint32_t header = _EPUB3SnapshotReserve(&builder, sizeof(EPUB3SnapshotHeader));
+  EPUB3MetadataRef metadata = epub->metadata;
+  uint32_t strings[8];
+  strings[0] = _EPUB3SnapshotAddString(&builder, archivePath);
+  strings[1] = _EPUB3SnapshotAddString(&builder, epub->rootFileDirectory);
+  strings[2] = _EPUB3SnapshotAddString(&builder, metadata->title);
+  strings[3] = _EPUB3SnapshotAddString(&builder, metadata->identifier);
+  strings[4] = _EPUB3SnapshotAddString(&builder, metadata->_uniqueIdentifierID);
+  strings[5] = _EPUB3SnapshotAddString(&builder, metadata->language);
+  strings[6] = _EPUB3SnapshotAddString(&builder, metadata->coverImageId);
+  strings[7] = _EPUB3SnapshotAddString(&builder, metadata->ncxItem != NULL ? metadata->ncxItem->itemId : NULL);
+
+  uint32_t manifestItems = _EPUB3SnapshotReserve(&builder, epub->manifest->itemCount * sizeof(EPUB3SnapshotManifestItem));
+  int32_t manifestIndex = 0;
+  for(int32_t i = 0; i < MANIFEST_HASH_SIZE; i++) {
+    for(EPUB3ManifestItemListItemPtr itemPtr = epub->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3SnapshotManifestItem item;
+      item.itemId = _EPUB3SnapshotAddString(&builder, itemPtr->item->itemId);
+      item.href = _EPUB3SnapshotAddString(&builder, itemPtr->item->href);
+      item.mediaType = _EPUB3SnapshotAddString(&builder, itemPtr->item->mediaType);
+      item.properties = _EPUB3SnapshotAddString(&builder, itemPtr->item->properties);
+      SNAPSHOT_AT(&builder, EPUB3SnapshotManifestItem, manifestItems)[manifestIndex++] = item;
+    }
+  }
+
+  uint32_t spineItems = _EPUB3SnapshotReserve(&builder, epub->spine->itemCount * sizeof(EPUB3SnapshotSpineItem));
+  int32_t spineIndex = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL; itemPtr = itemPtr->next) {
+    EPUB3SnapshotSpineItem item;
+    item.idref = _EPUB3SnapshotAddString(&builder, itemPtr->item->idref);
+    item.isLinear = itemPtr->item->isLinear ? 1U : 0U;
+    SNAPSHOT_AT(&builder, EPUB3SnapshotSpineItem, spineItems)[spineIndex++] = item;
+  }
+
+  int32_t tocItemCount = epub->toc != NULL ? _EPUB3SnapshotCountTocItems(epub->toc->rootItemsHead) : 0;
+  uint32_t tocItems = _EPUB3SnapshotReserve(&builder, tocItemCount * sizeof(EPUB3SnapshotTocItem));
+  int32_t tocIndex = 0;
+  if(epub->toc != NULL) {
+    _EPUB3SnapshotAddTocItems(&builder, tocItems, epub->toc->rootItemsHead, -1, &tocIndex);
+  }
+
+  uint32_t entryItems = _EPUB3SnapshotReserve(&builder, entryCount * sizeof(EPUB3SnapshotEntry));
+  for(uint32_t i = 0; i < entryCount; i++) {
+    EPUB3SnapshotEntry entry;
+    entry.path = _EPUB3SnapshotAddString(&builder, entries[i].path);
+    entry.method = entries[i].method;
+    entry.crc = entries[i].crc;
+    entry.reserved = 0;
+    entry.compressedSize = entries[i].compressedSize;
+    entry.uncompressedSize = entries[i].uncompressedSize;
+    entry.dataOffset = entries[i].dataOffset;
+    SNAPSHOT_AT(&builder, EPUB3SnapshotEntry, entryItems)[i] = entry;
+    EPUB3_FREE_AND_NULL(entries[i].path);
+  }
+  EPUB3_FREE_AND_NULL(entries);
+
+  // Ends in a NUL, so that no string in a valid image can run past its end
+  (void)_EPUB3SnapshotAddString(&builder, "");
+
+  EPUB3SnapshotHeader * snapshotHeader = SNAPSHOT_AT(&builder, EPUB3SnapshotHeader, header);
+  (void)memcpy(snapshotHeader->magic, SNAPSHOT_MAGIC, sizeof(snapshotHeader->magic));
+  snapshotHeader->formatVersion = SNAPSHOT_FORMAT_VERSION;
+  snapshotHeader->byteOrderMark = SNAPSHOT_BYTE_ORDER_MARK;
+  snapshotHeader->imageSize = builder.length;
+  snapshotHeader->archiveDigest = digest;
+  snapshotHeader->archivePath = strings[0];
+  snapshotHeader->rootFileDirectory = strings[1];
+  snapshotHeader->version = (uint32_t)metadata->version;
+  snapshotHeader->title = strings[2];
+  snapshotHeader->identifier = strings[3];
+  snapshotHeader->uniqueIdentifierID = strings[4];
+  snapshotHeader->language = strings[5];
+  snapshotHeader->coverImageId = strings[6];
+  snapshotHeader->ncxItemId = strings[7];
+  snapshotHeader->manifestItemCount = (uint32_t)manifestIndex;
+  snapshotHeader->manifestItems = manifestItems;
+  snapshotHeader->spineItemCount = (uint32_t)spineIndex;
+  snapshotHeader->spineItems = spineItems;
+  snapshotHeader->tocItemCount = (uint32_t)tocIndex;
+  snapshotHeader->tocItems = tocItems;
+  snapshotHeader->entryCount = entryCount;
+  snapshotHeader->entries = entryItems;
+  snapshotHeader->selectedRendition = epub->selectedRendition;
+  snapshotHeader->archiveWasRecovered = epub->recoveredArchive != NULL ? 1 : 0;
+
+  error = builder.overflowed ? kEPUB3InvalidArgumentError : kEPUB3Success;
+  for(size_t written = 0; error == kEPUB3Success && written < builder.length; ) {
+    ssize_t count = write(fd, builder.bytes + written, builder.length - written);
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) {
+      error = kEPUB3UnknownError;
+      break;
+    }
+    written += (size_t)count;
+  }
+  EPUB3_FREE_AND_NULL(builder.bytes);
+  return error;
+}
+
+#pragma mark - Reading
+
+static EPUB3Bool _EPUB3SnapshotArrayIsValid(const EPUB3SnapshotHeader * header, uint32_t offset, uint32_t count, size_t elementSize)
+{
+  if(count == 0) return kEPUB3_YES;
+  return offset % 8 == 0 && offset >= sizeof(EPUB3SnapshotHeader) && (uint64_t)offset + (uint64_t)count * elementSize <= header->imageSize;
+}
+
+static EPUB3Bool _EPUB3SnapshotStringIsValid(const EPUB3SnapshotHeader * header, uint32_t offset)
+{
+  return offset == 0 || (offset >= sizeof(EPUB3SnapshotHeader) && offset < header->imageSize);
+}
+
+// Checks every offset once, so that the rest of the code can follow them blindly
+static EPUB3Bool _EPUB3SnapshotIsValid(const unsigned char * image, size_t size)
+{
+  if(size < sizeof(EPUB3SnapshotHeader) || image[size - 1] != '\0') return kEPUB3_NO;
+
+  const EPUB3SnapshotHeader * header = (const EPUB3SnapshotHeader *)image;
+  if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->formatVersion != SNAPSHOT_FORMAT_VERSION ||
+     header->byteOrderMark != SNAPSHOT_BYTE_ORDER_MARK || header->imageSize != size || header->selectedRendition < 0) {
+    return kEPUB3_NO;
+  }
+  if(header->archivePath == 0) return kEPUB3_NO;
+  uint32_t strings[] = {header->archivePath, header->rootFileDirectory, header->title, header->identifier,
+    header->uniqueIdentifierID, header->language, header->coverImageId, header->ncxItemId};
+  for(size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+    if(!_EPUB3SnapshotStringIsValid(header, strings[i])) return kEPUB3_NO;
+  }
+  if(!_EPUB3SnapshotArrayIsValid(header, header->manifestItems, header->manifestItemCount, sizeof(EPUB3SnapshotManifestItem)) ||
+     !_EPUB3SnapshotArrayIsValid(header, header->spineItems, header->spineItemCount, sizeof(EPUB3SnapshotSpineItem)) ||
+     !_EPUB3SnapshotArrayIsValid(header, header->tocItems, header->tocItemCount, sizeof(EPUB3SnapshotTocItem)) ||
+     !_EPUB3SnapshotArrayIsValid(header, header->entries, header->entryCount, sizeof(EPUB3SnapshotEntry))) {
+    return kEPUB3_NO;
+  }
+
+  const EPUB3SnapshotManifestItem * manifestItems = (const EPUB3SnapshotManifestItem *)(image + header->manifestItems);
+  for(uint32_t i = 0; i < header->manifestItemCount; i++) {
+    if(manifestItems[i].itemId == 0 || !_EPUB3SnapshotStringIsValid(header, manifestItems[i].itemId) ||
+       !_EPUB3SnapshotStringIsValid(header, manifestItems[i].href) || !_EPUB3SnapshotStringIsValid(header, manifestItems[i].mediaType) ||
+       !_EPUB3SnapshotStringIsValid(header, manifestItems[i].properties)) {
+      return kEPUB3_NO;
+    }
+  }
+  const EPUB3SnapshotSpineItem * spineItems = (const EPUB3SnapshotSpineItem *)(image + header->spineItems);
+  for(uint32_t i = 0; i < header->spineItemCount; i++) {
+    if(!_EPUB3SnapshotStringIsValid(header, spineItems[i].idref)) return kEPUB3_NO;
+  }
+  const EPUB3SnapshotTocItem * tocItems = (const EPUB3SnapshotTocItem *)(image + header->tocItems);
+  for(uint32_t i = 0; i < header->tocItemCount; i++) {
+    if(!_EPUB3SnapshotStringIsValid(header, tocItems[i].title) || !_EPUB3SnapshotStringIsValid(header, tocItems[i].href) ||
+       tocItems[i].parent < -1 || tocItems[i].parent >= (int32_t)i) {
+      return kEPUB3_NO;
+    }
+  }
+  const EPUB3SnapshotEntry * entries = (const EPUB3SnapshotEntry *)(image + header->entries);
+  for(uint32_t i = 0; i < header->entryCount; i++) {
+    if(entries[i].path == 0 || !_EPUB3SnapshotStringIsValid(header, entries[i].path)) return kEPUB3_NO;
+  }
+  return kEPUB3_YES;
+}
+
+static const char * _EPUB3SnapshotString(const unsigned char * image, uint32_t offset)
+{
+  return offset != 0 ? (const char *)(image + offset) : NULL;
+}
+
+static char * _EPUB3SnapshotCopyString(const unsigned char * image, uint32_t offset)
+{
+  return offset != 0 ? EPUB3Strdup((const char *)(image + offset)) : NULL;
+}
+
+// The catalogue objects are small next to the archive index, which stays in the mapping
+static void _EPUB3SnapshotBuildCatalogue(EPUB3Ref epub)
+{
+  const unsigned char * image = epub->snapshot;
+  const EPUB3SnapshotHeader * header = (const EPUB3SnapshotHeader *)image;
+
+  epub->rootFileDirectory = _EPUB3SnapshotCopyString(image, header->rootFileDirectory);
+  epub->metadata = EPUB3MetadataCreate();
+  epub->manifest = EPUB3ManifestCreate();
+  epub->spine = EPUB3SpineCreate();
+  epub->toc = EPUB3TocCreate();
+
+  const EPUB3SnapshotManifestItem * manifestItems = (const EPUB3SnapshotManifestItem *)(image + header->manifestItems);
+  for(uint32_t i = 0; i < header->manifestItemCount; i++) {
+    EPUB3ManifestItemRef item = EPUB3ManifestItemCreate();
+    item->itemId = _EPUB3SnapshotCopyString(image, manifestItems[i].itemId);
+    item->href = _EPUB3SnapshotCopyString(image, manifestItems[i].href);
+    item->mediaType = _EPUB3SnapshotCopyString(image, manifestItems[i].mediaType);
+    item->properties = _EPUB3SnapshotCopyString(image, manifestItems[i].properties);
+    EPUB3ManifestInsertItem(epub->manifest, item);
+    EPUB3ManifestItemRelease(item);
+  }
+
+  EPUB3MetadataRef metadata = epub->metadata;
+  metadata->version = (EPUB3Version)header->version;
+  EPUB3MetadataSetTitle(metadata, _EPUB3SnapshotString(image, header->title));
+  EPUB3MetadataSetIdentifier(metadata, _EPUB3SnapshotString(image, header->identifier));
+  EPUB3MetadataSetLanguage(metadata, _EPUB3SnapshotString(image, header->language));
+  metadata->_uniqueIdentifierID = _EPUB3SnapshotCopyString(image, header->uniqueIdentifierID);
+  metadata->coverImageId = _EPUB3SnapshotCopyString(image, header->coverImageId);
+  const char * ncxItemId = _EPUB3SnapshotString(image, header->ncxItemId);
+  if(ncxItemId != NULL) {
+    EPUB3ManifestItemListItemPtr itemPtr = EPUB3ManifestFindItemWithId(epub->manifest, ncxItemId);
+    if(itemPtr != NULL) {
+      EPUB3MetadataSetNCXItem(metadata, itemPtr->item);
+    }
+  }
+
+  const EPUB3SnapshotSpineItem * spineItems = (const EPUB3SnapshotSpineItem *)(image + header->spineItems);
+  for(uint32_t i = 0; i < header->spineItemCount; i++) {
+    EPUB3SpineItemRef item = EPUB3SpineItemCreate();
+    item->idref = _EPUB3SnapshotCopyString(image, spineItems[i].idref);
+    if(spineItems[i].isLinear) {
+      item->isLinear = kEPUB3_YES;
+      epub->spine->linearItemCount++;
+    }
+    if(item->idref != NULL) {
+      EPUB3ManifestItemListItemPtr itemPtr = EPUB3ManifestFindItemWithId(epub->manifest, item->idref);
+      item->manifestItem = itemPtr != NULL ? itemPtr->item : NULL;
+    }
+    EPUB3SpineAppendItem(epub->spine, item);
+    EPUB3SpineItemRelease(item);
+  }
+
+  const EPUB3SnapshotTocItem * tocItems = (const EPUB3SnapshotTocItem *)(image + header->tocItems);
+  EPUB3TocItemRef * items = EPUB3Calloc(header->tocItemCount > 0 ? header->tocItemCount : 1, sizeof(EPUB3TocItemRef));
+  for(uint32_t i = 0; i < header->tocItemCount; i++) {
+    items[i] = EPUB3TocItemCreate();
+    items[i]->title = _EPUB3SnapshotCopyString(image, tocItems[i].title);
+    items[i]->href = _EPUB3SnapshotCopyString(image, tocItems[i].href);
+    if(tocItems[i].parent < 0) {
+      EPUB3TocAddRootItem(epub->toc, items[i]);
+    } else {
+      EPUB3TocItemAppendChild(items[tocItems[i].parent], items[i]);
+    }
+  }
+  for(uint32_t i = 0; i < header->tocItemCount; i++) {
+    EPUB3TocItemRelease(items[i]);
+  }
+  EPUB3_FREE_AND_NULL(items);
+}
+
+EXPORT EPUB3Ref EPUB3CreateFromSnapshot(const char * path, EPUB3Error *error)
+{
+  assert(path != NULL);
+  assert(error != NULL);
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  struct stat st;
+  void * image = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && st.st_size > 0) {
+    image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  (void)close(fd);
+  if(image == MAP_FAILED) {
+    *error = kEPUB3SnapshotInvalidError;
+    return NULL;
+  }
+  size_t imageSize = (size_t)st.st_size;
+
+  if(!_EPUB3SnapshotIsValid(image, imageSize)) {
+    (void)munmap(image, imageSize);
+    *error = kEPUB3SnapshotInvalidError;
+    return NULL;
+  }
+
+  const EPUB3SnapshotHeader * header = (const EPUB3SnapshotHeader *)image;
+  const char * archivePath = _EPUB3SnapshotString(image, header->archivePath);
+  EPUB3ArchiveDigest digest;
+  EPUB3Ref epub = EPUB3Create();
+  if(header->archiveWasRecovered) {
+    // Only the directory rebuilt for a damaged archive identifies it, so it has to be rebuilt again
+    *error = EPUB3PrepareArchiveAtPathRecovering(epub, archivePath);
+    if(*error == kEPUB3Success) {
+      *error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+    }
+  } else {
+    int archiveFD = open(archivePath, O_RDONLY);
+    *error = archiveFD >= 0 ? EPUB3GetArchiveDigest(archiveFD, &digest) : kEPUB3ArchiveUnavailableError;
+    if(archiveFD >= 0) {
+      (void)close(archiveFD);
+    }
+    if(*error == kEPUB3Success && memcmp(&digest, &header->archiveDigest, sizeof(digest)) == 0) {
+      *error = EPUB3PrepareArchiveAtPath(epub, archivePath);
+    }
+  }
+  if(*error == kEPUB3Success && memcmp(&digest, &header->archiveDigest, sizeof(digest)) != 0) {
+    *error = kEPUB3SnapshotStaleError;
+  }
+  if(*error != kEPUB3Success) {
+    (void)munmap(image, imageSize);
+    EPUB3Release(epub);
+    return NULL;
+  }
+  epub->snapshot = image;
+  epub->snapshotSize = imageSize;
+  _EPUB3SnapshotBuildCatalogue(epub);
+
+  // The catalogue belongs to this rendition, which the container has to agree exists. The default one always
+  // does, so its container is only read when it is needed.
+  epub->selectedRendition = header->selectedRendition;
+  if(epub->selectedRendition != 0) {
+    *error = EPUB3ParseContainer(epub);
+    if(*error != kEPUB3Success) {
+      EPUB3Release(epub);
+      return NULL;
+    }
+  }
+  return epub;
+}
+
+const EPUB3SnapshotEntry * EPUB3SnapshotFindEntry(EPUB3Ref epub, const char * path)
+{
+  assert(epub != NULL);
+  assert(path != NULL);
+
+  if(epub->snapshot == NULL) return NULL;
+
+  const EPUB3SnapshotHeader * header = (const EPUB3SnapshotHeader *)epub->snapshot;
+  const EPUB3SnapshotEntry * entries = (const EPUB3SnapshotEntry *)(epub->snapshot + header->entries);
+  uint32_t low = 0;
+  uint32_t high = header->entryCount;
+  while(low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    int comparison = strcmp(path, (const char *)(epub->snapshot + entries[middle].path));
+    if(comparison == 0) return &entries[middle];
+    if(comparison < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return NULL;
+}
+
+void EPUB3SnapshotUnmap(EPUB3Ref epub)
+{
+  assert(epub != NULL);
+
+  if(epub->snapshot != NULL) {
+    (void)munmap((void *)epub->snapshot, epub->snapshotSize);
+    epub->snapshot = NULL;
+    epub->snapshotSize = 0;
+  }
+}
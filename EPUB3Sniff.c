@@ -0,0 +1,271 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+
+static const char _EPUB3SniffMimetypeName[] = "mimetype";
+static const char _EPUB3SniffMimetype[] = "application/epub+zip";
+
+static inline uint32_t _EPUB3SniffGetUInt16(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8;
+}
+
+static inline uint32_t _EPUB3SniffGetUInt32(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline uint64_t _EPUB3SniffGetUInt64(const unsigned char * bytes)
+{
+  return (uint64_t)_EPUB3SniffGetUInt32(bytes) | (uint64_t)_EPUB3SniffGetUInt32(bytes + 4) << 32;
+}
+
+static ssize_t _EPUB3SniffReadFD(void * context, uint64_t offset, void * bytes, size_t length)
+{
+  return pread(*(int *)context, bytes, length, (off_t)offset);
+}
+
+static ssize_t _EPUB3SniffReadBuffer(void * context, uint64_t offset, void * bytes, size_t length)
+{
+  EPUB3SniffSource * source = context;
+  if(offset >= source->size) return 0;
+  if(length > source->size - offset) {
+    length = (size_t)(source->size - offset);
+  }
+  (void)memcpy(bytes, source->bytes + offset, length);
+  return (ssize_t)length;
+}
+
+// The first local header must be a stored "mimetype" entry holding exactly the EPUB media type
+static EPUB3SniffClassification _EPUB3SniffHead(EPUB3SniffSource * source)
+{
+  unsigned char head[SNIFF_HEAD_SIZE];
+  size_t headSize = source->size < sizeof(head) ? (size_t)source->size : sizeof(head);
+  if(source->read(source->context, 0, head, headSize) != (ssize_t)headSize) return kEPUB3SniffUnreadable;
+  if(headSize < 30 || _EPUB3SniffGetUInt32(head) != 0x04034b50) return kEPUB3SniffNotZip;
+
+  uint32_t nameLength = _EPUB3SniffGetUInt16(head + 26);
+  uint32_t extraLength = _EPUB3SniffGetUInt16(head + 28);
+  if(nameLength != sizeof(_EPUB3SniffMimetypeName) - 1 || 30 + nameLength > headSize ||
+     memcmp(head + 30, _EPUB3SniffMimetypeName, nameLength) != 0) {
+    return kEPUB3SniffMissingMimetype;
+  }
+  if(_EPUB3SniffGetUInt16(head + 8) != 0) return kEPUB3SniffCompressedMimetype;
+
+  // The contents follow the extra field, which is usually small enough to have come in with the header
+  uint64_t contentsOffset = 30 + nameLength + extraLength;
+  char contents[sizeof(_EPUB3SniffMimetype) - 1];
+  if(contentsOffset + sizeof(contents) <= headSize) {
+    (void)memcpy(contents, head + contentsOffset, sizeof(contents));
+  } else if(source->read(source->context, contentsOffset, contents, sizeof(contents)) != (ssize_t)sizeof(contents)) {
+    return kEPUB3SniffTruncated;
+  }
+  if(memcmp(contents, _EPUB3SniffMimetype, sizeof(contents)) != 0) {
+    return kEPUB3SniffWrongMimetype;
+  }
+  return kEPUB3SniffEPUB;
+}
+
+static EPUB3Bool _EPUB3SniffFindEndRecord(EPUB3SniffSource * source, size_t searchSize, unsigned char * tail, size_t * tailSize, ssize_t * recordIndex)
+{
+  *tailSize = source->size < searchSize ? (size_t)source->size : searchSize;
+  if(source->read(source->context, source->size - *tailSize, tail, *tailSize) != (ssize_t)*tailSize) return kEPUB3_NO;
+  for(ssize_t i = (ssize_t)*tailSize - 22; i >= 0; i--) {
+    if(tail[i] == 'P' && tail[i + 1] == 'K' && tail[i + 2] == 5 && tail[i + 3] == 6) {
+      *recordIndex = i;
+      return kEPUB3_YES;
+    }
+  }
+  return kEPUB3_NO;
+}
+
+// The end of central directory record (and its ZIP64 counterpart when there is one) has to describe a
+// single-disk archive whose central directory sits before it and can hold its entries
+static EPUB3SniffClassification _EPUB3SniffTail(EPUB3SniffSource * source, EPUB3SniffResult * result)
+{
+  if(source->size < 22) return kEPUB3SniffTruncated;
+
+  // Almost no EPUB carries an archive comment, so the last few KB nearly always hold the record
+  unsigned char smallTail[SNIFF_TAIL_SIZE];
+  unsigned char * tail = smallTail;
+  size_t tailSize = 0;
+  ssize_t index = -1;
+  if(!_EPUB3SniffFindEndRecord(source, sizeof(smallTail), tail, &tailSize, &index)) {
+    if(source->size <= sizeof(smallTail)) return kEPUB3SniffTruncated;
+    tail = EPUB3Malloc(SNAPSHOT_EOCD_SEARCH_SIZE);
+    EPUB3Bool found = _EPUB3SniffFindEndRecord(source, SNAPSHOT_EOCD_SEARCH_SIZE, tail, &tailSize, &index);
+    if(!found) {
+      EPUB3_FREE_AND_NULL(tail);
+      return kEPUB3SniffTruncated;
+    }
+  }
+
+  const unsigned char * record = tail + index;
+  uint64_t recordOffset = source->size - tailSize + (uint64_t)index;
+  uint32_t disk = _EPUB3SniffGetUInt16(record + 4);
+  uint32_t directoryDisk = _EPUB3SniffGetUInt16(record + 6);
+  uint64_t diskEntryCount = _EPUB3SniffGetUInt16(record + 8);
+  uint64_t entryCount = _EPUB3SniffGetUInt16(record + 10);
+  uint64_t directorySize = _EPUB3SniffGetUInt32(record + 12);
+  uint64_t directoryOffset = _EPUB3SniffGetUInt32(record + 16);
+  uint64_t directoryEnd = recordOffset;
+
+  EPUB3SniffClassification classification = kEPUB3SniffEPUB;
+  if(index >= 20 && _EPUB3SniffGetUInt32(record - 20) == 0x07064b50) {
+    // A ZIP64 locator points at the ZIP64 record, which has the real counts and offsets
+    unsigned char record64[56];
+    uint64_t record64Offset = _EPUB3SniffGetUInt64(record - 20 + 8);
+    if(_EPUB3SniffGetUInt32(record - 20 + 4) != 0 || record64Offset + sizeof(record64) > recordOffset - 20 ||
+       source->read(source->context, record64Offset, record64, sizeof(record64)) != (ssize_t)sizeof(record64) ||
+       _EPUB3SniffGetUInt32(record64) != 0x06064b50) {
+      classification = kEPUB3SniffBadCentralDirectory;
+    } else {
+      disk = _EPUB3SniffGetUInt32(record64 + 16);
+      directoryDisk = _EPUB3SniffGetUInt32(record64 + 20);
+      diskEntryCount = _EPUB3SniffGetUInt64(record64 + 24);
+      entryCount = _EPUB3SniffGetUInt64(record64 + 32);
+      directorySize = _EPUB3SniffGetUInt64(record64 + 40);
+      directoryOffset = _EPUB3SniffGetUInt64(record64 + 48);
+      directoryEnd = record64Offset;
+    }
+  }
+
+  if(classification == kEPUB3SniffEPUB) {
+    if(disk != 0 || directoryDisk != 0 || diskEntryCount != entryCount || entryCount == 0 ||
+       directoryOffset > directoryEnd || directorySize > directoryEnd - directoryOffset || entryCount > directorySize / 46) {
+      classification = kEPUB3SniffBadCentralDirectory;
+    }
+  }
+  if(classification == kEPUB3SniffEPUB) {
+    // The directory has to start with a file header; it is usually in the bytes already read
+    unsigned char signature[4];
+    uint64_t tailOffset = source->size - tailSize;
+    if(directoryOffset >= tailOffset && directoryOffset + 4 <= source->size) {
+      (void)memcpy(signature, tail + (directoryOffset - tailOffset), sizeof(signature));
+    } else if(source->read(source->context, directoryOffset, signature, sizeof(signature)) != (ssize_t)sizeof(signature)) {
+      (void)memset(signature, 0, sizeof(signature));
+    }
+    if(_EPUB3SniffGetUInt32(signature) != 0x02014b50) {
+      classification = kEPUB3SniffBadCentralDirectory;
+    }
+  }
+
+  if(result != NULL) {
+    result->entryCount = entryCount;
+    result->centralDirectoryOffset = directoryOffset;
+    result->centralDirectorySize = directorySize;
+  }
+  if(tail != smallTail) {
+    EPUB3_FREE_AND_NULL(tail);
+  }
+  return classification;
+}
+
+EPUB3SniffClassification EPUB3SniffSourceClassify(EPUB3SniffSource * source, EPUB3SniffResult * result)
+{
+  assert(source != NULL);
+
+  if(result != NULL) {
+    (void)memset(result, 0, sizeof(EPUB3SniffResult));
+  }
+  // Most rejects aren't ZIP files at all, so the head goes first and the tail is only read for candidates
+  EPUB3SniffClassification classification = _EPUB3SniffHead(source);
+  if(classification == kEPUB3SniffEPUB) {
+    classification = _EPUB3SniffTail(source, result);
+  }
+  if(result != NULL) {
+    result->classification = classification;
+  }
+  return classification;
+}
+
+EPUB3SniffClassification EPUB3SniffFileDescriptor(int fd, uint64_t fileSize, EPUB3SniffResult * result)
+{
+  assert(fd >= 0);
+
+  EPUB3SniffSource source;
+  source.read = _EPUB3SniffReadFD;
+  source.context = &fd;
+  source.bytes = NULL;
+  source.size = fileSize;
+  return EPUB3SniffSourceClassify(&source, result);
+}
+
+EPUB3SniffClassification EPUB3SniffCentralDirectory(int fd, uint64_t fileSize, EPUB3SniffResult * result)
+{
+  assert(fd >= 0);
+
+  EPUB3SniffSource source;
+  source.read = _EPUB3SniffReadFD;
+  source.context = &fd;
+  source.bytes = NULL;
+  source.size = fileSize;
+  if(result != NULL) {
+    (void)memset(result, 0, sizeof(EPUB3SniffResult));
+  }
+  EPUB3SniffClassification classification = _EPUB3SniffTail(&source, result);
+  if(result != NULL) {
+    result->classification = classification;
+  }
+  return classification;
+}
+
+EPUB3SniffClassification EPUB3SniffHead(int fd, uint64_t fileSize)
+{
+  assert(fd >= 0);
+
+  EPUB3SniffSource source;
+  source.read = _EPUB3SniffReadFD;
+  source.context = &fd;
+  source.bytes = NULL;
+  source.size = fileSize;
+  return _EPUB3SniffHead(&source);
+}
+
+EXPORT EPUB3SniffClassification EPUB3Sniff(const char * path, EPUB3SniffResult * result)
+{
+  assert(path != NULL);
+
+  if(result != NULL) {
+    (void)memset(result, 0, sizeof(EPUB3SniffResult));
+    result->classification = kEPUB3SniffUnreadable;
+  }
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return kEPUB3SniffUnreadable;
+  struct stat st;
+  EPUB3SniffClassification classification = kEPUB3SniffUnreadable;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    classification = EPUB3SniffFileDescriptor(fd, (uint64_t)st.st_size, result);
+  }
+  (void)close(fd);
+  return classification;
+}
+
+EXPORT EPUB3SniffClassification EPUB3SniffBuffer(const void * bytes, size_t length, EPUB3SniffResult * result)
+{
+  assert(bytes != NULL || length == 0);
+
+  EPUB3SniffSource source;
+  source.read = _EPUB3SniffReadBuffer;
+  source.context = &source;
+  source.bytes = bytes;
+  source.size = length;
+  return EPUB3SniffSourceClassify(&source, result);
+}
+
+EPUB3Error EPUB3ErrorForSniffClassification(EPUB3SniffClassification classification)
+{
+  switch(classification) {
+    case kEPUB3SniffEPUB:
+      return kEPUB3Success;
+    case kEPUB3SniffNotZip:
+    case kEPUB3SniffMissingMimetype:
+    case kEPUB3SniffCompressedMimetype:
+    case kEPUB3SniffWrongMimetype:
+      return kEPUB3InvalidMimetypeError;
+    case kEPUB3SniffUnreadable:
+    case kEPUB3SniffTruncated:
+    case kEPUB3SniffBadCentralDirectory:
+      return kEPUB3ArchiveUnavailableError;
+  }
+  return kEPUB3UnknownError;
+}
@@ -0,0 +1,949 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <ctype.h>
+
+const char * kEPUB3PositionsTypeID = "_EPUB3Positions_t";
+
+static void _EPUB3TextReaderReadByte(EPUB3TextReader * reader, char c);
+
+// Sorted for bsearch
+static const char * _EPUB3TextBlockElements[] = {
+  "address", "article", "aside", "blockquote", "body", "caption", "dd", "details", "div", "dl", "dt",
+  "fieldset", "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header",
+  "hgroup", "hr", "li", "main", "nav", "ol", "p", "pre", "section", "summary", "table", "td", "th", "tr",
+  "ul",
+};
+
+static const char * _EPUB3TextSkippedElements[] = {
+  "head", "script", "style", "template",
+};
+
+static int _EPUB3TextCompareNames(const void * name, const void * element)
+{
+  return strcmp((const char *)name, *(const char * const *)element);
+}
+
+static EPUB3Bool _EPUB3TextIsBlockElement(const char * name)
+{
+  size_t count = sizeof(_EPUB3TextBlockElements) / sizeof(_EPUB3TextBlockElements[0]);
+  return bsearch(name, _EPUB3TextBlockElements, count, sizeof(const char *), _EPUB3TextCompareNames) != NULL;
+}
+
+static EPUB3Bool _EPUB3TextIsSkippedElement(const char * name)
+{
+  size_t count = sizeof(_EPUB3TextSkippedElements) / sizeof(_EPUB3TextSkippedElements[0]);
+  return bsearch(name, _EPUB3TextSkippedElements, count, sizeof(const char *), _EPUB3TextCompareNames) != NULL;
+}
+
+static inline EPUB3Bool _EPUB3TextIsSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static inline EPUB3Bool _EPUB3TextIsNameCharacter(char c)
+{
+  return isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' || c == ':';
+}
+
+#pragma mark - Document Output
+
+static void _EPUB3TextDocumentAppend(EPUB3TextDocumentRef document, char c, uint32_t sourceOffset, EPUB3Bool startsMapping)
+{
+  if(document->length == document->capacity) {
+    document->capacity = document->capacity > 0 ? document->capacity * 2 : TEXT_READER_CHUNK_SIZE;
+    document->text = EPUB3Realloc(document->text, document->capacity);
+  }
+
+  // A new mapping only where the text stops following the source one byte for one byte
+  EPUB3TextMapping * last = document->mappingCount > 0 ? &document->mappings[document->mappingCount - 1] : NULL;
+  if(last == NULL || startsMapping || (int64_t)sourceOffset - last->sourceOffset != (int64_t)document->length - last->textOffset) {
+    if(document->mappingCount == document->mappingCapacity) {
+      document->mappingCapacity = document->mappingCapacity > 0 ? document->mappingCapacity * 2 : 64;
+      document->mappings = EPUB3Realloc(document->mappings, document->mappingCapacity * sizeof(EPUB3TextMapping));
+    }
+    document->mappings[document->mappingCount].textOffset = document->length;
+    document->mappings[document->mappingCount].sourceOffset = sourceOffset;
+    document->mappingCount++;
+  }
+  document->text[document->length++] = c;
+}
+
+// Whitespace is only written once something follows it, so no line or document ends in a space
+static void _EPUB3TextReaderWriteSeparator(EPUB3TextReader * reader, uint32_t sourceOffset)
+{
+  EPUB3TextDocumentRef document = reader->document;
+  if(document->length > 0 && (reader->pendingBreak || reader->pendingSpace)) {
+    char last = document->text[document->length - 1];
+    // Giving the separator the offset of the byte before the text keeps a single space in the source mapped
+    uint32_t separatorOffset = sourceOffset > 0 ? sourceOffset - 1 : 0;
+    if(reader->pendingBreak && last != '\n') {
+      _EPUB3TextDocumentAppend(document, '\n', separatorOffset, kEPUB3_NO);
+    } else if(!reader->pendingBreak && last != '\n' && last != ' ') {
+      _EPUB3TextDocumentAppend(document, ' ', separatorOffset, kEPUB3_NO);
+    }
+  }
+  reader->pendingBreak = kEPUB3_NO;
+  reader->pendingSpace = kEPUB3_NO;
+}
+
+// startsMapping keeps decoded bytes out of the mapping of the text before them
+static void _EPUB3TextReaderWriteCharacter(EPUB3TextReader * reader, char c, uint32_t sourceOffset, EPUB3Bool startsMapping)
+{
+  if(reader->skipDepth > 0) return;
+
+  if(reader->preDepth == 0) {
+    if(_EPUB3TextIsSpace(c)) {
+      reader->pendingSpace = kEPUB3_YES;
+      return;
+    }
+  } else if(c == '\r') {
+    return;
+  }
+  _EPUB3TextReaderWriteSeparator(reader, sourceOffset);
+  _EPUB3TextDocumentAppend(reader->document, c, sourceOffset, startsMapping);
+}
+
+static void _EPUB3TextReaderWriteLineBreak(EPUB3TextReader * reader)
+{
+  reader->pendingBreak = kEPUB3_NO;
+  reader->pendingSpace = kEPUB3_NO;
+  if(reader->document->length > 0) {
+    _EPUB3TextDocumentAppend(reader->document, '\n', reader->markupOffset, kEPUB3_NO);
+  }
+}
+
+#pragma mark - Markup
+
+static void _EPUB3TextReaderFinishTag(EPUB3TextReader * reader)
+{
+  reader->name[reader->nameLength] = '\0';
+  const char * name = reader->name;
+  EPUB3Bool isEmpty = reader->previous == '/';
+
+  if(_EPUB3TextIsSkippedElement(name)) {
+    if(reader->isEndTag) {
+      if(reader->skipDepth > 0) reader->skipDepth--;
+    } else if(!isEmpty) {
+      reader->skipDepth++;
+    }
+    return;
+  }
+  if(reader->skipDepth > 0) return;
+
+  if(strcmp(name, "br") == 0) {
+    if(!reader->isEndTag) {
+      _EPUB3TextReaderWriteLineBreak(reader);
+    }
+    return;
+  }
+  if(strcmp(name, "pre") == 0) {
+    if(reader->isEndTag) {
+      if(reader->preDepth > 0) reader->preDepth--;
+    } else if(!isEmpty) {
+      reader->preDepth++;
+    }
+  }
+  if(_EPUB3TextIsBlockElement(name)) {
+    reader->pendingBreak = kEPUB3_YES;
+  }
+}
+
+uint32_t EPUB3TextEncodeUTF8(uint32_t codePoint, char * bytes)
+{
+  if(codePoint == 0 || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+    codePoint = 0xFFFD;
+  }
+  if(codePoint < 0x80) {
+    bytes[0] = (char)codePoint;
+    return 1;
+  }
+  if(codePoint < 0x800) {
+    bytes[0] = (char)(0xC0 | (codePoint >> 6));
+    bytes[1] = (char)(0x80 | (codePoint & 0x3F));
+    return 2;
+  }
+  if(codePoint < 0x10000) {
+    bytes[0] = (char)(0xE0 | (codePoint >> 12));
+    bytes[1] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+    bytes[2] = (char)(0x80 | (codePoint & 0x3F));
+    return 3;
+  }
+  bytes[0] = (char)(0xF0 | (codePoint >> 18));
+  bytes[1] = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+  bytes[2] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+  bytes[3] = (char)(0x80 | (codePoint & 0x3F));
+  return 4;
+}
+
+// The references XHTML defines without a DTD, plus nbsp which content documents use anyway
+static uint32_t _EPUB3TextDecodeReference(const char * name, char * bytes)
+{
+  if(name[0] == '#') {
+    char * end = NULL;
+    EPUB3Bool isHex = name[1] == 'x' || name[1] == 'X';
+    const char * digits = isHex ? name + 2 : name + 1;
+    if(*digits == '\0') return 0;
+    unsigned long codePoint = strtoul(digits, &end, isHex ? 16 : 10);
+    if(*end != '\0') return 0;
+    return EPUB3TextEncodeUTF8(codePoint > 0x10FFFF ? 0xFFFD : (uint32_t)codePoint, bytes);
+  }
+
+  static const struct { const char * name; uint32_t codePoint; } references[] = {
+    { "amp", '&' }, { "apos", '\'' }, { "gt", '>' }, { "lt", '<' }, { "nbsp", 0xA0 }, { "quot", '"' },
+  };
+  for(size_t i = 0; i < sizeof(references) / sizeof(references[0]); i++) {
+    if(strcmp(name, references[i].name) == 0) {
+      return EPUB3TextEncodeUTF8(references[i].codePoint, bytes);
+    }
+  }
+  return 0;
+}
+
+// Anything that turned out not to be a reference is text after all
+static void _EPUB3TextReaderWriteHeldReference(EPUB3TextReader * reader)
+{
+  _EPUB3TextReaderWriteCharacter(reader, '&', reader->markupOffset, kEPUB3_NO);
+  for(int32_t i = 0; i < reader->nameLength; i++) {
+    _EPUB3TextReaderWriteCharacter(reader, reader->name[i], reader->markupOffset + 1 + (uint32_t)i, kEPUB3_NO);
+  }
+}
+
+static void _EPUB3TextReaderReadReference(EPUB3TextReader * reader, char c)
+{
+  if(c == ';') {
+    reader->name[reader->nameLength] = '\0';
+    char bytes[4];
+    uint32_t count = _EPUB3TextDecodeReference(reader->name, bytes);
+    reader->state = kEPUB3TextReaderText;
+    if(count == 0) {
+      _EPUB3TextReaderWriteHeldReference(reader);
+      _EPUB3TextReaderWriteCharacter(reader, ';', reader->offset, kEPUB3_NO);
+      return;
+    }
+    // Decoded bytes never outnumber the reference's, so each one can point into it
+    for(uint32_t i = 0; i < count; i++) {
+      _EPUB3TextReaderWriteCharacter(reader, bytes[i], reader->markupOffset + i, i == 0 ? kEPUB3_YES : kEPUB3_NO);
+    }
+    return;
+  }
+  if((isalnum((unsigned char)c) || (c == '#' && reader->nameLength == 0)) && reader->nameLength < TEXT_READER_NAME_LENGTH - 1) {
+    reader->name[reader->nameLength++] = c;
+    return;
+  }
+  reader->state = kEPUB3TextReaderText;
+  _EPUB3TextReaderWriteHeldReference(reader);
+  _EPUB3TextReaderReadByte(reader, c);
+}
+
+static void _EPUB3TextReaderReadDeclarationStart(EPUB3TextReader * reader, char c)
+{
+  static const char * comment = "--";
+  static const char * cdata = "[CDATA[";
+
+  reader->name[reader->nameLength++] = c;
+  reader->name[reader->nameLength] = '\0';
+  if(strcmp(reader->name, comment) == 0) {
+    reader->state = kEPUB3TextReaderComment;
+    reader->markCount = 0;
+  } else if(strcmp(reader->name, cdata) == 0) {
+    reader->state = kEPUB3TextReaderCDATA;
+    reader->markCount = 0;
+  } else if(strncmp(reader->name, comment, reader->nameLength) != 0 && strncmp(reader->name, cdata, reader->nameLength) != 0) {
+    // <!DOCTYPE ...> and the like
+    reader->state = kEPUB3TextReaderDeclaration;
+    reader->quote = '\0';
+    reader->markCount = 0;
+    _EPUB3TextReaderReadByte(reader, c);
+  }
+}
+
+static void _EPUB3TextReaderReadCDATA(EPUB3TextReader * reader, char c)
+{
+  if(c == ']') {
+    if(reader->markCount == 0) {
+      reader->markupOffset = reader->offset;
+    }
+    reader->markCount++;
+    return;
+  }
+  int32_t heldCount = reader->markCount;
+  if(c == '>' && heldCount >= 2) {
+    heldCount -= 2;
+    reader->state = kEPUB3TextReaderText;
+  }
+  for(int32_t i = 0; i < heldCount; i++) {
+    _EPUB3TextReaderWriteCharacter(reader, ']', reader->markupOffset + (uint32_t)i, kEPUB3_NO);
+  }
+  reader->markCount = 0;
+  if(reader->state == kEPUB3TextReaderCDATA) {
+    _EPUB3TextReaderWriteCharacter(reader, c, reader->offset, kEPUB3_NO);
+  }
+}
+
+static void _EPUB3TextReaderReadByte(EPUB3TextReader * reader, char c)
+{
+  switch(reader->state) {
+    case kEPUB3TextReaderText:
+      if(c == '<') {
+        reader->state = kEPUB3TextReaderMarkup;
+        reader->markupOffset = reader->offset;
+      } else if(c == '&') {
+        reader->state = kEPUB3TextReaderReference;
+        reader->markupOffset = reader->offset;
+        reader->nameLength = 0;
+      } else {
+        _EPUB3TextReaderWriteCharacter(reader, c, reader->offset, kEPUB3_NO);
+      }
+      break;
+    case kEPUB3TextReaderReference:
+      _EPUB3TextReaderReadReference(reader, c);
+      break;
+    case kEPUB3TextReaderMarkup:
+      reader->nameLength = 0;
+      reader->previous = '\0';
+      reader->quote = '\0';
+      if(c == '/') {
+        reader->state = kEPUB3TextReaderEndTagName;
+        reader->isEndTag = kEPUB3_YES;
+      } else if(c == '!') {
+        reader->state = kEPUB3TextReaderDeclarationStart;
+      } else if(c == '?') {
+        reader->state = kEPUB3TextReaderProcessingInstruction;
+      } else if(isalpha((unsigned char)c) || c == '_') {
+        reader->state = kEPUB3TextReaderStartTagName;
+        reader->isEndTag = kEPUB3_NO;
+        reader->name[reader->nameLength++] = (char)tolower((unsigned char)c);
+      } else {
+        // A stray '<' in text
+        reader->state = kEPUB3TextReaderText;
+        _EPUB3TextReaderWriteCharacter(reader, '<', reader->markupOffset, kEPUB3_NO);
+        _EPUB3TextReaderReadByte(reader, c);
+      }
+      break;
+    case kEPUB3TextReaderStartTagName:
+    case kEPUB3TextReaderEndTagName:
+      if(_EPUB3TextIsNameCharacter(c)) {
+        if(c == ':') {
+          reader->nameLength = 0; // only the local name matters
+        } else if(reader->nameLength < TEXT_READER_NAME_LENGTH - 1) {
+          reader->name[reader->nameLength++] = (char)tolower((unsigned char)c);
+        }
+        break;
+      }
+      reader->state = kEPUB3TextReaderTagAttributes;
+      _EPUB3TextReaderReadByte(reader, c);
+      break;
+    case kEPUB3TextReaderTagAttributes:
+      if(reader->quote != '\0') {
+        if(c == reader->quote) {
+          reader->quote = '\0';
+          reader->previous = c;
+        }
+      } else if(c == '>') {
+        reader->state = kEPUB3TextReaderText;
+        _EPUB3TextReaderFinishTag(reader);
+      } else if(c == '"' || c == '\'') {
+        reader->quote = c;
+      } else if(!_EPUB3TextIsSpace(c)) {
+        reader->previous = c;
+      }
+      break;
+    case kEPUB3TextReaderDeclarationStart:
+      _EPUB3TextReaderReadDeclarationStart(reader, c);
+      break;
+    case kEPUB3TextReaderDeclaration:
+      if(reader->quote != '\0') {
+        if(c == reader->quote) reader->quote = '\0';
+      } else if(c == '"' || c == '\'') {
+        reader->quote = c;
+      } else if(c == '[') {
+        reader->markCount++;
+      } else if(c == ']' && reader->markCount > 0) {
+        reader->markCount--;
+      } else if(c == '>' && reader->markCount == 0) {
+        reader->state = kEPUB3TextReaderText;
+      }
+      break;
+    case kEPUB3TextReaderComment:
+      if(c == '>' && reader->markCount >= 2) {
+        reader->state = kEPUB3TextReaderText;
+      }
+      reader->markCount = c == '-' ? reader->markCount + 1 : 0;
+      break;
+    case kEPUB3TextReaderCDATA:
+      _EPUB3TextReaderReadCDATA(reader, c);
+      break;
+    case kEPUB3TextReaderProcessingInstruction:
+      if(c == '>' && reader->previous == '?') {
+        reader->state = kEPUB3TextReaderText;
+      }
+      reader->previous = c;
+      break;
+  }
+}
+
+#pragma mark - Reader
+
+void EPUB3TextReaderInit(EPUB3TextReader * reader, EPUB3TextDocumentRef document)
+{
+  assert(reader != NULL);
+  assert(document != NULL);
+
+  (void)memset(reader, 0, sizeof(EPUB3TextReader));
+  reader->document = document;
+  reader->state = kEPUB3TextReaderText;
+}
+
+void EPUB3TextReaderConsume(EPUB3TextReader * reader, const char * bytes, uint32_t count)
+{
+  assert(reader != NULL);
+  assert(bytes != NULL || count == 0);
+
+  static const char * byteOrderMark = "\xEF\xBB\xBF";
+  for(uint32_t i = 0; i < count; i++, reader->offset++) {
+    // Bytes of a leading BOM can't have started anything else yet
+    if(reader->offset < 3 && bytes[i] == byteOrderMark[reader->offset] && reader->state == kEPUB3TextReaderText && reader->document->length == 0) {
+      continue;
+    }
+    _EPUB3TextReaderReadByte(reader, bytes[i]);
+  }
+}
+
+void EPUB3TextReaderFinish(EPUB3TextReader * reader)
+{
+  assert(reader != NULL);
+
+  if(reader->state == kEPUB3TextReaderReference) {
+    _EPUB3TextReaderWriteHeldReference(reader);
+  }
+  reader->state = kEPUB3TextReaderText;
+}
+
+void EPUB3TextDocumentFinalize(EPUB3TextDocumentRef document)
+{
+  assert(document != NULL);
+
+  EPUB3_FREE_AND_NULL(document->path);
+  EPUB3_FREE_AND_NULL(document->text);
+  EPUB3_FREE_AND_NULL(document->mappings);
+  document->length = 0;
+  document->capacity = 0;
+  document->mappingCount = 0;
+  document->mappingCapacity = 0;
+}
+
+#pragma mark - Extraction
+
+EPUB3Error EPUB3TextDocumentRead(EPUB3Ref epub, EPUB3TextDocumentRef document)
+{
+  assert(epub != NULL);
+  assert(document != NULL);
+  assert(document->path != NULL);
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(epub, document->path, &error);
+  if(stream == NULL) return error;
+
+  EPUB3TextReader reader;
+  EPUB3TextReaderInit(&reader, document);
+  char chunk[TEXT_READER_CHUNK_SIZE];
+  uint32_t bytesRead = 0;
+  while((error = EPUB3ResourceStreamRead(stream, chunk, sizeof(chunk), &bytesRead)) == kEPUB3Success && bytesRead > 0) {
+    EPUB3TextReaderConsume(&reader, chunk, bytesRead);
+  }
+  EPUB3TextReaderFinish(&reader);
+  EPUB3ResourceStreamClose(stream);
+  return error;
+}
+
+static void _EPUB3TextExtractDocument(void * context)
+{
+  EPUB3TextDocumentRef document = context;
+  EPUB3TextExtraction * extraction = document->extraction;
+  EPUB3Error error = EPUB3TextDocumentRead(extraction->epub, document);
+
+  (void)pthread_mutex_lock(&extraction->lock);
+  document->error = error;
+  document->isDone = kEPUB3_YES;
+  (void)pthread_cond_broadcast(&extraction->documentDone);
+  (void)pthread_mutex_unlock(&extraction->lock);
+}
+
+EXPORT EPUB3Error EPUB3ExtractText(EPUB3Ref epub, int32_t threadCount, EPUB3TextCallback callback, void * context)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(callback != NULL);
+
+  if(threadCount < 0) return kEPUB3InvalidArgumentError;
+
+  int32_t count = epub->spine->linearItemCount;
+  if(count <= 0) return kEPUB3Success;
+
+  EPUB3WorkPoolRef pool = EPUB3WorkPoolCreate(threadCount);
+  if(pool == NULL) return kEPUB3UnknownError;
+
+  EPUB3TextExtraction extraction;
+  extraction.epub = epub;
+  (void)pthread_mutex_init(&extraction.lock, NULL);
+  (void)pthread_cond_init(&extraction.documentDone, NULL);
+
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  struct EPUB3TextDocument * documents = EPUB3Calloc(count, sizeof(struct EPUB3TextDocument));
+  int32_t index = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL && index < count; itemPtr = itemPtr->next) {
+    if(!itemPtr->item->isLinear) continue;
+    EPUB3TextDocumentRef document = &documents[index];
+    document->extraction = &extraction;
+    document->spineIndex = index++;
+    if(itemPtr->item->manifestItem == NULL || itemPtr->item->manifestItem->href == NULL) {
+      document->error = kEPUB3FileNotFoundInArchiveError;
+      document->isDone = kEPUB3_YES;
+      continue;
+    }
+    document->path = EPUB3CopyOfPathByAppendingPathComponent(root, itemPtr->item->manifestItem->href);
+    EPUB3WorkPoolSubmit(pool, _EPUB3TextExtractDocument, document);
+  }
+
+  // Hand documents over in order as they complete, freeing each one right away
+  EPUB3Error firstError = kEPUB3Success;
+  for(int32_t i = 0; i < index; i++) {
+    EPUB3TextDocumentRef document = &documents[i];
+    (void)pthread_mutex_lock(&extraction.lock);
+    while(!document->isDone) {
+      (void)pthread_cond_wait(&extraction.documentDone, &extraction.lock);
+    }
+    (void)pthread_mutex_unlock(&extraction.lock);
+
+    if(document->error == kEPUB3Success) {
+      callback(context, document->spineIndex, document->path, document->text != NULL ? document->text : "", document->length, document->mappings, document->mappingCount);
+    } else if(firstError == kEPUB3Success) {
+      firstError = document->error;
+    }
+    EPUB3TextDocumentFinalize(document);
+  }
+
+  EPUB3WorkPoolRelease(pool);
+  (void)pthread_cond_destroy(&extraction.documentDone);
+  (void)pthread_mutex_destroy(&extraction.lock);
+  EPUB3_FREE_AND_NULL(documents);
+  return firstError;
+}
+
+#pragma mark - Positions
+
+static inline uint32_t _EPUB3PositionsIsSpace(unsigned char c)
+{
+  return (c == ' ') | (c == '\t') | (c == '\n') | (c == '\r') | (c == '\f');
+}
+
+// Length of the character reference at bytes ("&amp;" is 5), 0 when it isn't one
+static size_t _EPUB3PositionsReferenceLength(const unsigned char * bytes, size_t length)
+{
+  size_t limit = length < TEXT_READER_NAME_LENGTH ? length : TEXT_READER_NAME_LENGTH;
+  for(size_t i = 1; i < limit; i++) {
+    if(bytes[i] == ';') return i > 1 ? i + 1 : 0;
+    if(!isalnum(bytes[i]) && !(bytes[i] == '#' && i == 1)) return 0;
+  }
+  return 0;
+}
+
+// Index of the target'th counted character in a run of text
+static size_t _EPUB3PositionsLocateCharacter(const unsigned char * run, size_t length, uint64_t target)
+{
+  uint64_t count = 0;
+  for(size_t i = 0; i < length; i++) {
+    if(_EPUB3PositionsIsSpace(run[i]) || (run[i] & 0xC0) == 0x80) continue;
+    if(count == target) return i;
+    count++;
+    if(run[i] == '&') {
+      size_t referenceLength = _EPUB3PositionsReferenceLength(run + i, length - i);
+      if(referenceLength > 0) i += referenceLength - 1;
+    }
+  }
+  return length;
+}
+
+static void _EPUB3PositionsDocumentAddPosition(EPUB3PositionsDocumentRef document, uint32_t sourceOffset)
+{
+  if(document->positionCount == document->positionCapacity) {
+    document->positionCapacity = document->positionCapacity > 0 ? document->positionCapacity * 2 : 64;
+    document->sourceOffsets = EPUB3Realloc(document->sourceOffsets, document->positionCapacity * sizeof(uint32_t));
+  }
+  document->sourceOffsets[document->positionCount++] = sourceOffset;
+}
+
+static void _EPUB3PositionsCountRun(EPUB3PositionsDocumentRef document, const unsigned char * bytes, size_t start, size_t end)
+{
+  if(start >= end) return;
+  const unsigned char * run = bytes + start;
+  size_t length = end - start;
+
+  // Branch-free over the whole run so the compiler can vectorize it: a character is any byte that isn't
+  // whitespace or a UTF-8 continuation byte, a word starts wherever whitespace is followed by anything else.
+  uint64_t characters = !_EPUB3PositionsIsSpace(run[0]) & ((run[0] & 0xC0) != 0x80);
+  uint64_t words = document->afterSpace & !_EPUB3PositionsIsSpace(run[0]);
+  for(size_t i = 1; i < length; i++) {
+    uint32_t isSpace = _EPUB3PositionsIsSpace(run[i]);
+    characters += !isSpace & ((run[i] & 0xC0) != 0x80);
+    words += _EPUB3PositionsIsSpace(run[i - 1]) & !isSpace;
+  }
+  document->afterSpace = _EPUB3PositionsIsSpace(run[length - 1]) ? kEPUB3_YES : kEPUB3_NO;
+
+  // A reference like "&amp;" stands for one character
+  const unsigned char * ampersand = run;
+  while((ampersand = memchr(ampersand, '&', length - (size_t)(ampersand - run))) != NULL) {
+    size_t referenceLength = _EPUB3PositionsReferenceLength(ampersand, length - (size_t)(ampersand - run));
+    characters -= referenceLength > 0 ? referenceLength - 1 : 0;
+    ampersand += referenceLength > 0 ? referenceLength : 1;
+  }
+
+  uint64_t before = document->characterCount;
+  document->characterCount += characters;
+  document->wordCount += words;
+  for(uint64_t next = (uint64_t)document->positionCount * POSITIONS_CHARACTER_SPAN; next < document->characterCount; next += POSITIONS_CHARACTER_SPAN) {
+    size_t index = _EPUB3PositionsLocateCharacter(run, length, next - before);
+    _EPUB3PositionsDocumentAddPosition(document, (uint32_t)(start + index));
+  }
+}
+
+static size_t _EPUB3PositionsFind(const unsigned char * bytes, size_t start, size_t end, const char * needle)
+{
+  size_t needleLength = strlen(needle);
+  if(start >= end || end - start < needleLength) return end;
+  const unsigned char * cursor = bytes + start;
+  const unsigned char * last = bytes + end - needleLength;
+  while(cursor <= last && (cursor = memchr(cursor, needle[0], (size_t)(last - cursor) + 1)) != NULL) {
+    if(memcmp(cursor, needle, needleLength) == 0) return (size_t)(cursor - bytes) + needleLength;
+    cursor++;
+  }
+  return end;
+}
+
+// Returns the offset just past the markup starting at bytes[start] ('<')
+static size_t _EPUB3PositionsSkipMarkup(EPUB3PositionsDocumentRef document, const unsigned char * bytes, size_t start, size_t end)
+{
+  const unsigned char * markup = bytes + start;
+  size_t length = end - start;
+  if(length >= 4 && memcmp(markup, "<!--", 4) == 0) {
+    return _EPUB3PositionsFind(bytes, start + 4, end, "-->");
+  }
+  if(length >= 9 && memcmp(markup, "<![CDATA[", 9) == 0) {
+    return _EPUB3PositionsFind(bytes, start + 9, end, "]]>");
+  }
+  if(length >= 2 && (markup[1] == '!' || markup[1] == '?')) {
+    return _EPUB3PositionsFind(bytes, start + 2, end, ">");
+  }
+
+  EPUB3Bool isEndTag = length >= 2 && markup[1] == '/';
+  size_t i = isEndTag ? 2 : 1;
+  char name[TEXT_READER_NAME_LENGTH];
+  size_t nameLength = 0;
+  for(; i < length && _EPUB3TextIsNameCharacter((char)markup[i]); i++) {
+    if(markup[i] == ':') {
+      nameLength = 0;
+    } else if(nameLength < sizeof(name) - 1) {
+      name[nameLength++] = (char)tolower(markup[i]);
+    }
+  }
+  name[nameLength] = '\0';
+  if(nameLength == 0 && !isEndTag) {
+    return start + 1; // a stray '<', counted as nothing
+  }
+
+  unsigned char quote = '\0';
+  unsigned char previous = '\0';
+  for(; i < length; i++) {
+    if(quote != '\0') {
+      if(markup[i] == quote) quote = '\0';
+    } else if(markup[i] == '"' || markup[i] == '\'') {
+      quote = markup[i];
+    } else if(markup[i] == '>') {
+      break;
+    } else if(!_EPUB3PositionsIsSpace(markup[i])) {
+      previous = markup[i];
+    }
+  }
+  size_t next = start + (i < length ? i + 1 : length);
+
+  if(_EPUB3TextIsSkippedElement(name)) {
+    if(isEndTag || previous == '/') return next;
+    // Everything up to the matching end tag is left out, whatever it contains
+    while(next < end) {
+      next = _EPUB3PositionsFind(bytes, next, end, "</");
+      size_t nameEnd = next;
+      while(nameEnd < end && _EPUB3TextIsNameCharacter((char)bytes[nameEnd]) && bytes[nameEnd] != ':') nameEnd++;
+      if(nameEnd < end && bytes[nameEnd] == ':') continue;
+      if(nameEnd - next == nameLength && strncasecmp((const char *)bytes + next, name, nameLength) == 0) {
+        return _EPUB3PositionsFind(bytes, nameEnd, end, ">");
+      }
+    }
+    return end;
+  }
+  if(strcmp(name, "br") == 0 || _EPUB3TextIsBlockElement(name)) {
+    document->afterSpace = kEPUB3_YES;
+  }
+  return next;
+}
+
+void EPUB3PositionsDocumentScan(EPUB3PositionsDocumentRef document, const unsigned char * bytes, size_t length)
+{
+  assert(document != NULL);
+  assert(bytes != NULL || length == 0);
+
+  document->characterCount = 0;
+  document->wordCount = 0;
+  document->positionCount = 0;
+  document->afterSpace = kEPUB3_YES;
+  _EPUB3PositionsDocumentAddPosition(document, 0);
+
+  size_t offset = length >= 3 && memcmp(bytes, "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+  while(offset < length) {
+    const unsigned char * markup = memchr(bytes + offset, '<', length - offset);
+    size_t runEnd = markup != NULL ? (size_t)(markup - bytes) : length;
+    _EPUB3PositionsCountRun(document, bytes, offset, runEnd);
+    offset = runEnd < length ? _EPUB3PositionsSkipMarkup(document, bytes, runEnd, length) : length;
+  }
+}
+
+static void _EPUB3PositionsScanDocument(void * context)
+{
+  EPUB3PositionsDocumentRef document = context;
+
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(document->epub, document->path, &document->error);
+  if(stream == NULL) return;
+
+  uint64_t length = EPUB3ResourceStreamGetLength(stream);
+  unsigned char * bytes = EPUB3Malloc(length > 0 ? (size_t)length : 1);
+  uint64_t offset = 0;
+  while(document->error == kEPUB3Success && offset < length) {
+    uint32_t toRead = length - offset < UINT32_MAX ? (uint32_t)(length - offset) : UINT32_MAX;
+    uint32_t bytesRead = 0;
+    document->error = EPUB3ResourceStreamRead(stream, bytes + offset, toRead, &bytesRead);
+    if(document->error == kEPUB3Success && bytesRead == 0) {
+      document->error = kEPUB3FileReadFromArchiveError;
+    }
+    offset += bytesRead;
+  }
+  EPUB3ResourceStreamClose(stream);
+
+  if(document->error == kEPUB3Success) {
+    EPUB3PositionsDocumentScan(document, bytes, (size_t)length);
+  }
+  EPUB3_FREE_AND_NULL(bytes);
+}
+
+static EPUB3PositionsRef _EPUB3PositionsCreate(int32_t spineCount, uint32_t positionCount)
+{
+  EPUB3PositionsRef memory = EPUB3Malloc(sizeof(struct EPUB3Positions));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3PositionsTypeID);
+  (void)memset(&memory->archiveDigest, 0, sizeof(EPUB3ArchiveDigest));
+  memory->spineCount = spineCount;
+  memory->positionCount = positionCount;
+  memory->characterOffsets = EPUB3Calloc(spineCount + 1, sizeof(uint64_t));
+  memory->wordOffsets = EPUB3Calloc(spineCount + 1, sizeof(uint64_t));
+  memory->positionOffsets = EPUB3Calloc(spineCount + 1, sizeof(uint32_t));
+  memory->sourceOffsets = EPUB3Calloc(positionCount > 0 ? positionCount : 1, sizeof(uint32_t));
+  return memory;
+}
+
+EXPORT EPUB3PositionsRef EPUB3CopyPositions(EPUB3Ref epub, int32_t threadCount, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(error != NULL);
+
+  if(threadCount < 0) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  EPUB3ArchiveDigest digest;
+  *error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+  if(*error != kEPUB3Success) return NULL;
+
+  int32_t count = epub->spine->linearItemCount;
+  const char * root = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  struct EPUB3PositionsDocument * documents = EPUB3Calloc(count > 0 ? count : 1, sizeof(struct EPUB3PositionsDocument));
+  EPUB3WorkPoolRef pool = count > 0 ? EPUB3WorkPoolCreate(threadCount) : NULL;
+  int32_t index = 0;
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL && index < count; itemPtr = itemPtr->next) {
+    if(!itemPtr->item->isLinear) continue;
+    EPUB3PositionsDocumentRef document = &documents[index++];
+    document->epub = epub;
+    if(itemPtr->item->manifestItem == NULL || itemPtr->item->manifestItem->href == NULL) {
+      document->error = kEPUB3FileNotFoundInArchiveError;
+      continue;
+    }
+    document->path = EPUB3CopyOfPathByAppendingPathComponent(root, itemPtr->item->manifestItem->href);
+    EPUB3WorkPoolSubmit(pool, _EPUB3PositionsScanDocument, document);
+  }
+  if(pool != NULL) {
+    EPUB3WorkPoolRelease(pool);
+  }
+
+  uint32_t positionCount = 0;
+  for(int32_t i = 0; i < index; i++) {
+    if(documents[i].error != kEPUB3Success && *error == kEPUB3Success) {
+      *error = documents[i].error;
+    }
+    positionCount += documents[i].positionCount;
+  }
+
+  EPUB3PositionsRef positions = NULL;
+  if(*error == kEPUB3Success) {
+    positions = _EPUB3PositionsCreate(index, positionCount);
+    positions->archiveDigest = digest;
+    for(int32_t i = 0; i < index; i++) {
+      EPUB3PositionsDocumentRef document = &documents[i];
+      positions->characterOffsets[i + 1] = positions->characterOffsets[i] + document->characterCount;
+      positions->wordOffsets[i + 1] = positions->wordOffsets[i] + document->wordCount;
+      positions->positionOffsets[i + 1] = positions->positionOffsets[i] + document->positionCount;
+      (void)memcpy(positions->sourceOffsets + positions->positionOffsets[i], document->sourceOffsets, document->positionCount * sizeof(uint32_t));
+    }
+  }
+  for(int32_t i = 0; i < index; i++) {
+    EPUB3_FREE_AND_NULL(documents[i].path);
+    EPUB3_FREE_AND_NULL(documents[i].sourceOffsets);
+  }
+  EPUB3_FREE_AND_NULL(documents);
+  return positions;
+}
+
+EXPORT void EPUB3PositionsRelease(EPUB3PositionsRef positions)
+{
+  if(positions == NULL) return;
+  if(positions->_type.refCount == 1) {
+    EPUB3_FREE_AND_NULL(positions->characterOffsets);
+    EPUB3_FREE_AND_NULL(positions->wordOffsets);
+    EPUB3_FREE_AND_NULL(positions->positionOffsets);
+    EPUB3_FREE_AND_NULL(positions->sourceOffsets);
+  }
+  EPUB3ObjectRelease(positions);
+}
+
+EXPORT int32_t EPUB3PositionsGetSpineCount(EPUB3PositionsRef positions)
+{
+  assert(positions != NULL);
+  return positions->spineCount;
+}
+
+EXPORT const uint64_t * EPUB3PositionsGetCharacterOffsets(EPUB3PositionsRef positions)
+{
+  assert(positions != NULL);
+  return positions->characterOffsets;
+}
+
+EXPORT const uint64_t * EPUB3PositionsGetWordOffsets(EPUB3PositionsRef positions)
+{
+  assert(positions != NULL);
+  return positions->wordOffsets;
+}
+
+EXPORT const uint32_t * EPUB3PositionsGetPositionOffsets(EPUB3PositionsRef positions)
+{
+  assert(positions != NULL);
+  return positions->positionOffsets;
+}
+
+EXPORT const uint32_t * EPUB3PositionsGetSourceOffsets(EPUB3PositionsRef positions)
+{
+  assert(positions != NULL);
+  return positions->sourceOffsets;
+}
+
+EXPORT uint32_t EPUB3PositionsGetReadingTime(EPUB3PositionsRef positions, int32_t index, uint32_t wordsPerMinute)
+{
+  assert(positions != NULL);
+  assert(index >= -1 && index < positions->spineCount);
+
+  if(wordsPerMinute == 0) {
+    wordsPerMinute = POSITIONS_DEFAULT_WORDS_PER_MINUTE;
+  }
+  uint64_t words = index < 0 ? positions->wordOffsets[positions->spineCount] : positions->wordOffsets[index + 1] - positions->wordOffsets[index];
+  return (uint32_t)((words * 60 + wordsPerMinute - 1) / wordsPerMinute);
+}
+
+static EPUB3Bool _EPUB3PositionsWriteAll(int fd, const void * bytes, size_t length)
+{
+  const char * next = bytes;
+  while(length > 0) {
+    ssize_t count = write(fd, next, length);
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) return kEPUB3_NO;
+    next += count;
+    length -= (size_t)count;
+  }
+  return kEPUB3_YES;
+}
+
+EXPORT EPUB3Error EPUB3WritePositions(EPUB3PositionsRef positions, int fd)
+{
+  assert(positions != NULL);
+  assert(fd >= 0);
+
+  EPUB3PositionsHeader header;
+  (void)memset(&header, 0, sizeof(header));
+  (void)memcpy(header.magic, POSITIONS_MAGIC, sizeof(header.magic));
+  header.formatVersion = POSITIONS_FORMAT_VERSION;
+  header.byteOrderMark = SNAPSHOT_BYTE_ORDER_MARK;
+  header.archiveDigest = positions->archiveDigest;
+  header.spineCount = positions->spineCount;
+  header.positionCount = positions->positionCount;
+
+  size_t offsetCount = (size_t)positions->spineCount + 1;
+  EPUB3Bool ok = _EPUB3PositionsWriteAll(fd, &header, sizeof(header)) &&
+    _EPUB3PositionsWriteAll(fd, positions->characterOffsets, offsetCount * sizeof(uint64_t)) &&
+    _EPUB3PositionsWriteAll(fd, positions->wordOffsets, offsetCount * sizeof(uint64_t)) &&
+    _EPUB3PositionsWriteAll(fd, positions->positionOffsets, offsetCount * sizeof(uint32_t)) &&
+    _EPUB3PositionsWriteAll(fd, positions->sourceOffsets, positions->positionCount * sizeof(uint32_t));
+  return ok ? kEPUB3Success : kEPUB3UnknownError;
+}
+
+EXPORT EPUB3PositionsRef EPUB3CreatePositionsFromFile(EPUB3Ref epub, const char * path, EPUB3Error *error)
+{
+  assert(epub != NULL);
+  assert(epub->spine != NULL);
+  assert(path != NULL);
+  assert(error != NULL);
+
+  FILE * file = fopen(path, "rb");
+  if(file == NULL) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+
+  EPUB3PositionsHeader header;
+  EPUB3PositionsRef positions = NULL;
+  struct stat st;
+  *error = kEPUB3SnapshotInvalidError;
+  if(fstat(fileno(file), &st) == 0 && fread(&header, sizeof(header), 1, file) == 1 &&
+     memcmp(header.magic, POSITIONS_MAGIC, sizeof(header.magic)) == 0 && header.formatVersion == POSITIONS_FORMAT_VERSION &&
+     header.byteOrderMark == SNAPSHOT_BYTE_ORDER_MARK && header.spineCount >= 0 && header.spineCount < INT32_MAX &&
+     (uint64_t)st.st_size == sizeof(header) + ((uint64_t)header.spineCount + 1) * (2 * sizeof(uint64_t) + sizeof(uint32_t)) + (uint64_t)header.positionCount * sizeof(uint32_t)) {
+    EPUB3ArchiveDigest digest;
+    *error = EPUB3GetArchiveDigestOfBook(epub, &digest);
+    if(*error == kEPUB3Success && (memcmp(&digest, &header.archiveDigest, sizeof(digest)) != 0 || header.spineCount != epub->spine->linearItemCount)) {
+      *error = kEPUB3SnapshotStaleError;
+    }
+  }
+  if(*error == kEPUB3Success) {
+    positions = _EPUB3PositionsCreate(header.spineCount, header.positionCount);
+    positions->archiveDigest = header.archiveDigest;
+    size_t offsetCount = (size_t)header.spineCount + 1;
+    EPUB3Bool ok = fread(positions->characterOffsets, sizeof(uint64_t), offsetCount, file) == offsetCount &&
+      fread(positions->wordOffsets, sizeof(uint64_t), offsetCount, file) == offsetCount &&
+      fread(positions->positionOffsets, sizeof(uint32_t), offsetCount, file) == offsetCount &&
+      fread(positions->sourceOffsets, sizeof(uint32_t), header.positionCount, file) == header.positionCount &&
+      positions->positionOffsets[header.spineCount] == header.positionCount;
+    for(int32_t i = 0; ok && i < header.spineCount; i++) {
+      ok = positions->positionOffsets[i] <= positions->positionOffsets[i + 1];
+    }
+    if(!ok) {
+      EPUB3PositionsRelease(positions);
+      positions = NULL;
+      *error = kEPUB3SnapshotInvalidError;
+    }
+  }
+  (void)fclose(file);
+  return positions;
+}
@@ -0,0 +1,380 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <limits.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define EPUB3_CRC32_PCLMUL 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define EPUB3_CRC32_ARMV8 1
+#endif
+
+#pragma mark - CRC32
+
+#if EPUB3_CRC32_PCLMUL
+// Folds 16 byte lanes with carry-less multiplies, then a Barrett reduction down to 32 bits (the method in
+// Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", with the constants for the
+// bit-reflected ZIP polynomial). crc is the raw register, not inverted. length is at least 64 and a
+// multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _EPUB3CRC32FoldPCLMUL(uint32_t crc, const unsigned char * bytes, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x00000001c6e41596LL, 0x0000000154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00000000ccaa009eLL, 0x00000001751997d0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0000000163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x00000001f7011641LL, 0x00000001db710641LL);
+  const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+  __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)bytes), _mm_cvtsi32_si128((int)crc));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(bytes + 16));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(bytes + 32));
+  __m128i x4 = _mm_loadu_si128((const __m128i *)(bytes + 48));
+  bytes += 64;
+  length -= 64;
+
+  while(length >= 64) {
+    __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)bytes));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *)(bytes + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *)(bytes + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i *)(bytes + 48)));
+    bytes += 64;
+    length -= 64;
+  }
+
+  // Four lanes into one, then whatever 16 byte blocks are left
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+  while(length >= 16) {
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)),
+                       _mm_loadu_si128((const __m128i *)bytes));
+    bytes += 16;
+    length -= 16;
+  }
+
+  // 128 bits to 64, 64 to 32, then the reduction
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), x2);
+  x2 = x1;
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+#if EPUB3_CRC32_ARMV8
+static uint32_t _EPUB3CRC32ARMv8(uint32_t crc, const unsigned char * bytes, size_t length)
+{
+  crc = ~crc;
+  while(length > 0 && ((uintptr_t)bytes & 7) != 0) {
+    crc = __crc32b(crc, *bytes++);
+    length--;
+  }
+  while(length >= 8) {
+    uint64_t word;
+    (void)memcpy(&word, bytes, sizeof(word));
+    crc = __crc32d(crc, word);
+    bytes += 8;
+    length -= 8;
+  }
+  while(length > 0) {
+    crc = __crc32b(crc, *bytes++);
+    length--;
+  }
+  return ~crc;
+}
+#endif
+
+uint32_t EPUB3CRC32(uint32_t crc, const void * bytes, size_t length)
+{
+  const unsigned char * next = bytes;
+#if EPUB3_CRC32_ARMV8
+  return _EPUB3CRC32ARMv8(crc, next, length);
+#else
+#if EPUB3_CRC32_PCLMUL
+  if(length >= 64 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    size_t folded = length & ~(size_t)15;
+    crc = ~_EPUB3CRC32FoldPCLMUL(~crc, next, folded);
+    next += folded;
+    length -= folded;
+  }
+#endif
+  while(length > 0) {
+    uInt count = length < (size_t)(UINT_MAX >> 1) ? (uInt)length : (uInt)(UINT_MAX >> 1);
+    crc = (uint32_t)crc32(crc, next, count);
+    next += count;
+    length -= count;
+  }
+  return crc;
+#endif
+}
+
+#pragma mark - Archive Verification
+
+static inline uint32_t _EPUB3VerifyGetUInt16(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8;
+}
+
+static inline uint32_t _EPUB3VerifyGetUInt32(const unsigned char * bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline uint64_t _EPUB3VerifyGetUInt64(const unsigned char * bytes)
+{
+  return (uint64_t)_EPUB3VerifyGetUInt32(bytes) | (uint64_t)_EPUB3VerifyGetUInt32(bytes + 4) << 32;
+}
+
+// A ZIP64 local header has 0xFFFFFFFF for both sizes, and the real ones (uncompressed first) in its extra field
+static EPUB3Bool _EPUB3VerifyLocalZip64Sizes(EPUB3VerifyTaskRef task, const unsigned char * header, uint64_t * compressedSize, uint64_t * uncompressedSize)
+{
+  uint32_t nameLength = _EPUB3VerifyGetUInt16(header + 26);
+  uint32_t extraLength = _EPUB3VerifyGetUInt16(header + 28);
+  unsigned char * extra = EPUB3Malloc(extraLength > 0 ? extraLength : 1U);
+  EPUB3Bool found = kEPUB3_NO;
+  if(pread(task->fd, extra, extraLength, (off_t)(task->headerOffset + 30 + nameLength)) == (ssize_t)extraLength) {
+    for(uint32_t i = 0; i + 4 <= extraLength && !found; ) {
+      uint32_t headerId = _EPUB3VerifyGetUInt16(extra + i);
+      uint32_t dataSize = _EPUB3VerifyGetUInt16(extra + i + 2);
+      if(i + 4 + dataSize > extraLength) break;
+      if(headerId == 0x0001 && dataSize >= 16) {
+        *uncompressedSize = _EPUB3VerifyGetUInt64(extra + i + 4);
+        *compressedSize = _EPUB3VerifyGetUInt64(extra + i + 12);
+        found = kEPUB3_YES;
+      }
+      i += 4 + dataSize;
+    }
+  }
+  EPUB3_FREE_AND_NULL(extra);
+  return found;
+}
+
+// Reads (and inflates) the entry's data, leaving its CRC and length in the report
+static EPUB3ArchiveEntryStatus _EPUB3VerifyEntryData(EPUB3VerifyTaskRef task, uint64_t dataOffset, uint64_t * length)
+{
+  EPUB3ArchiveEntryReport * report = task->report;
+  unsigned char input[RESOURCE_STREAM_CHUNK_SIZE];
+  unsigned char output[RESOURCE_STREAM_CHUNK_SIZE];
+  uint32_t crc = EPUB3CRC32(0, NULL, 0);
+  uint64_t produced = 0;
+  uint64_t position = 0;
+  EPUB3ArchiveEntryStatus status = kEPUB3ArchiveEntryValid;
+
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(z_stream));
+  if(task->method == Z_DEFLATED && inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    return kEPUB3ArchiveEntryDataError;
+  }
+
+  int zstatus = Z_OK;
+  while(status == kEPUB3ArchiveEntryValid && zstatus != Z_STREAM_END && position < report->compressedSize) {
+    uint64_t remaining = report->compressedSize - position;
+    size_t toRead = remaining < sizeof(input) ? (size_t)remaining : sizeof(input);
+    ssize_t count = pread(task->fd, input, toRead, (off_t)(dataOffset + position));
+    if(count <= 0) {
+      status = kEPUB3ArchiveEntryDataError;
+      break;
+    }
+    position += (uint64_t)count;
+    if(task->method == 0) {
+      crc = EPUB3CRC32(crc, input, (size_t)count);
+      produced += (uint64_t)count;
+      continue;
+    }
+
+    stream.next_in = input;
+    stream.avail_in = (uInt)count;
+    do {
+      stream.next_out = output;
+      stream.avail_out = sizeof(output);
+      zstatus = inflate(&stream, Z_NO_FLUSH);
+      if(zstatus == Z_NEED_DICT || zstatus == Z_DATA_ERROR || zstatus == Z_MEM_ERROR) {
+        status = kEPUB3ArchiveEntryDataError;
+        break;
+      }
+      size_t outputCount = sizeof(output) - stream.avail_out;
+      crc = EPUB3CRC32(crc, output, outputCount);
+      produced += outputCount;
+    } while(zstatus != Z_STREAM_END && (stream.avail_in > 0 || stream.avail_out == 0));
+  }
+  if(task->method == Z_DEFLATED) {
+    if(status == kEPUB3ArchiveEntryValid && zstatus != Z_STREAM_END) {
+      status = kEPUB3ArchiveEntryDataError;
+    }
+    (void)inflateEnd(&stream);
+  }
+
+  report->computedCRC = crc;
+  *length = produced;
+  return status;
+}
+
+static void _EPUB3VerifyEntry(void * context)
+{
+  EPUB3VerifyTaskRef task = context;
+  EPUB3ArchiveEntryReport * report = task->report;
+
+  // The central directory record points at the local header, which repeats most of what it says
+  unsigned char header[30];
+  uint64_t headerOffset = task->headerOffset;
+  if(pread(task->fd, header, sizeof(header), (off_t)headerOffset) != (ssize_t)sizeof(header) ||
+     _EPUB3VerifyGetUInt32(header) != 0x04034b50) {
+    report->status = kEPUB3ArchiveEntryDataError;
+    return;
+  }
+  uint32_t flags = _EPUB3VerifyGetUInt16(header + 6);
+  uint64_t dataOffset = headerOffset + sizeof(header) + _EPUB3VerifyGetUInt16(header + 26) + _EPUB3VerifyGetUInt16(header + 28);
+  EPUB3Bool headerMatches = _EPUB3VerifyGetUInt16(header + 8) == (uint32_t)task->method;
+  report->localCRC = _EPUB3VerifyGetUInt32(header + 14);
+  if(flags & 8) {
+    // Written while streaming: the CRC and sizes follow the data, in a descriptor with an optional signature.
+    // The sizes take 8 bytes each in ZIP64 archives, though some writers use those even for small entries.
+    unsigned char descriptor[24];
+    ssize_t count = pread(task->fd, descriptor, sizeof(descriptor), (off_t)(dataOffset + report->compressedSize));
+    const unsigned char * fields = descriptor;
+    if(count >= 4 && _EPUB3VerifyGetUInt32(descriptor) == 0x08074b50) {
+      fields += 4;
+      count -= 4;
+    }
+    if(count >= 12) {
+      report->localCRC = _EPUB3VerifyGetUInt32(fields);
+      EPUB3Bool sizesMatch = _EPUB3VerifyGetUInt32(fields + 4) == report->compressedSize && _EPUB3VerifyGetUInt32(fields + 8) == report->uncompressedSize;
+      if(!sizesMatch && count >= 20) {
+        sizesMatch = _EPUB3VerifyGetUInt64(fields + 4) == report->compressedSize && _EPUB3VerifyGetUInt64(fields + 12) == report->uncompressedSize;
+      }
+      headerMatches = headerMatches && sizesMatch;
+    } else {
+      headerMatches = kEPUB3_NO;
+    }
+  } else if(_EPUB3VerifyGetUInt32(header + 18) == 0xFFFFFFFF && _EPUB3VerifyGetUInt32(header + 22) == 0xFFFFFFFF) {
+    uint64_t compressedSize = 0;
+    uint64_t uncompressedSize = 0;
+    if(!_EPUB3VerifyLocalZip64Sizes(task, header, &compressedSize, &uncompressedSize) ||
+       compressedSize != report->compressedSize || uncompressedSize != report->uncompressedSize) {
+      headerMatches = kEPUB3_NO;
+    }
+  } else if(_EPUB3VerifyGetUInt32(header + 18) != report->compressedSize ||
+            _EPUB3VerifyGetUInt32(header + 22) != report->uncompressedSize) {
+    headerMatches = kEPUB3_NO;
+  }
+
+  if((flags & 1) || (task->method != 0 && task->method != Z_DEFLATED)) {
+    report->status = kEPUB3ArchiveEntryUnsupported;
+    return;
+  }
+
+  uint64_t length = 0;
+  report->status = _EPUB3VerifyEntryData(task, dataOffset, &length);
+  if(report->status != kEPUB3ArchiveEntryValid) return;
+  if(length != report->uncompressedSize) {
+    report->status = kEPUB3ArchiveEntryDataError;
+  } else if(report->computedCRC != report->centralCRC) {
+    report->status = kEPUB3ArchiveEntryChecksumMismatch;
+  } else if(!headerMatches || report->localCRC != report->centralCRC) {
+    report->status = kEPUB3ArchiveEntryHeaderMismatch;
+  }
+}
+
+EXPORT EPUB3Error EPUB3VerifyArchive(EPUB3Ref epub, int32_t threadCount, EPUB3ArchiveEntryReport ** reports, int32_t * reportCount)
+{
+  assert(epub != NULL);
+  assert(reports != NULL);
+  assert(reportCount != NULL);
+
+  *reports = NULL;
+  *reportCount = 0;
+  if(threadCount < 0) return kEPUB3InvalidArgumentError;
+  if(epub->archive == NULL || epub->archivePath == NULL) return kEPUB3ArchiveUnavailableError;
+
+  // Reads are all positioned, so every task can share one descriptor
+  int fd = open(epub->archivePath, O_RDONLY);
+  if(fd < 0) return kEPUB3ArchiveUnavailableError;
+
+  uint32_t capacity = epub->archiveFileCount > 0 ? epub->archiveFileCount : 16;
+  EPUB3ArchiveEntryReport * entries = EPUB3Calloc(capacity, sizeof(EPUB3ArchiveEntryReport));
+  struct EPUB3VerifyTask * tasks = EPUB3Calloc(capacity, sizeof(struct EPUB3VerifyTask));
+  uint32_t count = 0;
+  EPUB3Error error = kEPUB3Success;
+
+  // The walk moves the book's shared archive cursor, which other threads may be using
+  char name[PATH_MAX];
+  unz_file_info64 fileInfo;
+  (void)pthread_mutex_lock(&epub->entryLock);
+  for(int status = unzGoToFirstFile(epub->archive); status == UNZ_OK; status = unzGoToNextFile(epub->archive)) {
+    if(unzGetCurrentFileInfo64(epub->archive, &fileInfo, name, sizeof(name), NULL, 0, NULL, 0) != UNZ_OK) {
+      error = kEPUB3FileReadFromArchiveError;
+      break;
+    }
+    if(count == capacity) {
+      capacity *= 2;
+      entries = EPUB3Realloc(entries, capacity * sizeof(EPUB3ArchiveEntryReport));
+      tasks = EPUB3Realloc(tasks, capacity * sizeof(struct EPUB3VerifyTask));
+    }
+    (void)memset(&entries[count], 0, sizeof(EPUB3ArchiveEntryReport));
+    entries[count].path = EPUB3Strdup(name);
+    entries[count].centralCRC = (uint32_t)fileInfo.crc;
+    entries[count].compressedSize = fileInfo.compressed_size;
+    entries[count].uncompressedSize = fileInfo.uncompressed_size;
+    tasks[count].fd = fd;
+    tasks[count].method = (int32_t)fileInfo.compression_method;
+    tasks[count].headerOffset = unzGetCurrentFileLocalHeaderPos64(epub->archive);
+    count++;
+  }
+  (void)pthread_mutex_unlock(&epub->entryLock);
+
+  if(error == kEPUB3Success && count > 0) {
+    EPUB3WorkPoolRef pool = EPUB3WorkPoolCreate(threadCount);
+    if(pool == NULL) {
+      error = kEPUB3UnknownError;
+    } else {
+      // The reports array only moves while it grows, so the tasks can point into it from here on
+      for(uint32_t i = 0; i < count; i++) {
+        tasks[i].report = &entries[i];
+        EPUB3WorkPoolSubmit(pool, _EPUB3VerifyEntry, &tasks[i]);
+      }
+      EPUB3WorkPoolRelease(pool);
+    }
+  }
+  (void)close(fd);
+  EPUB3_FREE_AND_NULL(tasks);
+
+  if(error != kEPUB3Success) {
+    EPUB3ArchiveEntryReportsFree(entries, (int32_t)count);
+    return error;
+  }
+  for(uint32_t i = 0; i < count && error == kEPUB3Success; i++) {
+    if(entries[i].status != kEPUB3ArchiveEntryValid) {
+      error = kEPUB3FileChecksumError;
+    }
+  }
+  *reports = entries;
+  *reportCount = (int32_t)count;
+  return error;
+}
+
+EXPORT void EPUB3ArchiveEntryReportsFree(EPUB3ArchiveEntryReport * reports, int32_t reportCount)
+{
+  if(reports == NULL) return;
+  for(int32_t i = 0; i < reportCount; i++) {
+    EPUB3_FREE_AND_NULL(reports[i].path);
+  }
+  EPUB3Free(reports);
+}
+
+EXPORT void EPUB3SetVerifiesReads(EPUB3Ref epub, EPUB3Bool verifies)
+{
+  assert(epub != NULL);
+  epub->verifiesReads = verifies;
+}
@@ -0,0 +1,427 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <inttypes.h>
+
+#pragma mark - JSON Writer
+
+void EPUB3JSONWriterInitWithBuffer(EPUB3JSONWriter * writer, char ** buffer, size_t * capacity)
+{
+  assert(writer != NULL);
+  assert(buffer != NULL);
+  assert(capacity != NULL);
+
+  writer->fd = -1;
+  writer->buffer = buffer;
+  writer->capacity = capacity;
+  if(*buffer == NULL) {
+    *capacity = 0;
+  }
+  writer->length = 0;
+  writer->byteCount = 0;
+  writer->error = kEPUB3Success;
+  writer->depth = 0;
+  writer->hasMembers[0] = kEPUB3_NO;
+  writer->afterKey = kEPUB3_NO;
+}
+
+void EPUB3JSONWriterInitWithFD(EPUB3JSONWriter * writer, int fd)
+{
+  assert(writer != NULL);
+  assert(fd >= 0);
+
+  writer->fd = fd;
+  writer->buffer = NULL;
+  writer->capacity = NULL;
+  writer->length = 0;
+  writer->byteCount = 0;
+  writer->error = kEPUB3Success;
+  writer->depth = 0;
+  writer->hasMembers[0] = kEPUB3_NO;
+  writer->afterKey = kEPUB3_NO;
+}
+
+static void _EPUB3JSONWriterFlush(EPUB3JSONWriter * writer)
+{
+  size_t written = 0;
+  while(writer->error == kEPUB3Success && written < writer->length) {
+    ssize_t count = write(writer->fd, writer->chunk + written, writer->length - written);
+    if(count < 0 && errno == EINTR) continue;
+    if(count <= 0) {
+      writer->error = kEPUB3UnknownError;
+      break;
+    }
+    written += (size_t)count;
+  }
+  writer->length = 0;
+}
+
+static void _EPUB3JSONWriterAppend(EPUB3JSONWriter * writer, const char * bytes, size_t count)
+{
+  if(writer->error != kEPUB3Success || count == 0) return;
+
+  writer->byteCount += count;
+  if(writer->fd < 0) {
+    // One spare byte for the terminating NUL
+    if(writer->length + count + 1 > *writer->capacity) {
+      size_t capacity = *writer->capacity > 0 ? *writer->capacity * 2 : 4096;
+      while(capacity < writer->length + count + 1) capacity *= 2;
+      *writer->buffer = EPUB3Realloc(*writer->buffer, capacity);
+      *writer->capacity = capacity;
+    }
+    (void)memcpy(*writer->buffer + writer->length, bytes, count);
+    writer->length += count;
+    return;
+  }
+
+  while(count > 0) {
+    if(writer->length == sizeof(writer->chunk)) {
+      _EPUB3JSONWriterFlush(writer);
+      if(writer->error != kEPUB3Success) return;
+    }
+    size_t room = sizeof(writer->chunk) - writer->length;
+    size_t part = count < room ? count : room;
+    (void)memcpy(writer->chunk + writer->length, bytes, part);
+    writer->length += part;
+    bytes += part;
+    count -= part;
+  }
+}
+
+// Commas between members; a value right after its key needs none
+static void _EPUB3JSONWriterWillWriteValue(EPUB3JSONWriter * writer)
+{
+  if(writer->afterKey) {
+    writer->afterKey = kEPUB3_NO;
+    return;
+  }
+  if(writer->hasMembers[writer->depth]) {
+    _EPUB3JSONWriterAppend(writer, ",", 1);
+  }
+  writer->hasMembers[writer->depth] = kEPUB3_YES;
+}
+
+static void _EPUB3JSONWriterOpen(EPUB3JSONWriter * writer, char bracket)
+{
+  _EPUB3JSONWriterWillWriteValue(writer);
+  if(writer->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+    writer->error = kEPUB3InvalidArgumentError;
+    return;
+  }
+  _EPUB3JSONWriterAppend(writer, &bracket, 1);
+  writer->hasMembers[++writer->depth] = kEPUB3_NO;
+}
+
+static void _EPUB3JSONWriterClose(EPUB3JSONWriter * writer, char bracket)
+{
+  if(writer->depth == 0) {
+    writer->error = kEPUB3InvalidArgumentError;
+    return;
+  }
+  writer->depth--;
+  _EPUB3JSONWriterAppend(writer, &bracket, 1);
+}
+
+void EPUB3JSONWriterBeginObject(EPUB3JSONWriter * writer)
+{
+  _EPUB3JSONWriterOpen(writer, '{');
+}
+
+void EPUB3JSONWriterEndObject(EPUB3JSONWriter * writer)
+{
+  _EPUB3JSONWriterClose(writer, '}');
+}
+
+void EPUB3JSONWriterBeginArray(EPUB3JSONWriter * writer)
+{
+  _EPUB3JSONWriterOpen(writer, '[');
+}
+
+void EPUB3JSONWriterEndArray(EPUB3JSONWriter * writer)
+{
+  _EPUB3JSONWriterClose(writer, ']');
+}
+
+// Copies runs of characters that need no escaping in one go
+static void _EPUB3JSONWriterAppendEscaped(EPUB3JSONWriter * writer, const char * string)
+{
+  const unsigned char * run = (const unsigned char *)string;
+  const unsigned char * c = run;
+  for(; *c != '\0'; c++) {
+    if(*c >= 0x20 && *c != '"' && *c != '\\') continue;
+
+    _EPUB3JSONWriterAppend(writer, (const char *)run, (size_t)(c - run));
+    char escape[8];
+    switch(*c) {
+      case '"': (void)strcpy(escape, "\\\""); break;
+      case '\\': (void)strcpy(escape, "\\\\"); break;
+      case '\n': (void)strcpy(escape, "\\n"); break;
+      case '\r': (void)strcpy(escape, "\\r"); break;
+      case '\t': (void)strcpy(escape, "\\t"); break;
+      default: (void)snprintf(escape, sizeof(escape), "\\u%04x", *c); break;
+    }
+    _EPUB3JSONWriterAppend(writer, escape, strlen(escape));
+    run = c + 1;
+  }
+  _EPUB3JSONWriterAppend(writer, (const char *)run, (size_t)(c - run));
+}
+
+void EPUB3JSONWriterKey(EPUB3JSONWriter * writer, const char * key)
+{
+  assert(key != NULL);
+
+  _EPUB3JSONWriterWillWriteValue(writer);
+  _EPUB3JSONWriterAppend(writer, "\"", 1);
+  _EPUB3JSONWriterAppendEscaped(writer, key);
+  _EPUB3JSONWriterAppend(writer, "\":", 2);
+  writer->afterKey = kEPUB3_YES;
+}
+
+void EPUB3JSONWriterString(EPUB3JSONWriter * writer, const char * prefix, const char * value)
+{
+  _EPUB3JSONWriterWillWriteValue(writer);
+  if(value == NULL) {
+    _EPUB3JSONWriterAppend(writer, "null", 4);
+    return;
+  }
+  _EPUB3JSONWriterAppend(writer, "\"", 1);
+  if(prefix != NULL) {
+    _EPUB3JSONWriterAppendEscaped(writer, prefix);
+  }
+  _EPUB3JSONWriterAppendEscaped(writer, value);
+  _EPUB3JSONWriterAppend(writer, "\"", 1);
+}
+
+void EPUB3JSONWriterInteger(EPUB3JSONWriter * writer, int64_t value)
+{
+  _EPUB3JSONWriterWillWriteValue(writer);
+  char digits[24];
+  int count = snprintf(digits, sizeof(digits), "%" PRId64, value);
+  _EPUB3JSONWriterAppend(writer, digits, (size_t)count);
+}
+
+void EPUB3JSONWriterBool(EPUB3JSONWriter * writer, EPUB3Bool value)
+{
+  _EPUB3JSONWriterWillWriteValue(writer);
+  _EPUB3JSONWriterAppend(writer, value ? "true" : "false", value ? 4 : 5);
+}
+
+EPUB3Error EPUB3JSONWriterFinish(EPUB3JSONWriter * writer, size_t * length)
+{
+  assert(writer != NULL);
+
+  if(writer->error == kEPUB3Success && writer->depth != 0) {
+    writer->error = kEPUB3InvalidArgumentError;
+  }
+  if(writer->fd >= 0) {
+    _EPUB3JSONWriterFlush(writer);
+  } else if(writer->error == kEPUB3Success) {
+    _EPUB3JSONWriterAppend(writer, "", 0);
+    if(*writer->buffer == NULL) {
+      *writer->buffer = EPUB3Malloc(1);
+      *writer->capacity = 1;
+    }
+    (*writer->buffer)[writer->length] = '\0';
+  }
+  if(length != NULL) {
+    *length = (size_t)writer->byteCount;
+  }
+  return writer->error;
+}
+
+#pragma mark - Web Publication Manifest
+
+static void _EPUB3WebPublicationWriteLink(EPUB3JSONWriter * writer, const char * rootDirectory, EPUB3ManifestItemRef item, const char * rel)
+{
+  EPUB3JSONWriterBeginObject(writer);
+  EPUB3JSONWriterKey(writer, "href");
+  EPUB3JSONWriterString(writer, *item->href != '/' ? rootDirectory : NULL, *item->href != '/' ? item->href : item->href + 1);
+  if(item->mediaType != NULL) {
+    EPUB3JSONWriterKey(writer, "type");
+    EPUB3JSONWriterString(writer, NULL, item->mediaType);
+  }
+  if(rel != NULL) {
+    EPUB3JSONWriterKey(writer, "rel");
+    EPUB3JSONWriterString(writer, NULL, rel);
+  }
+  EPUB3JSONWriterEndObject(writer);
+}
+
+// TOC hrefs are relative to the document the TOC was read from and may step out of its directory
+static void _EPUB3WebPublicationWriteTocHref(EPUB3JSONWriter * writer, const char * tocDirectory, const char * href)
+{
+  if(*href == '/') {
+    EPUB3JSONWriterString(writer, NULL, href + 1);
+    return;
+  }
+  const char * fragment = strpbrk(href, "#?");
+  size_t pathLength = fragment != NULL ? (size_t)(fragment - href) : strlen(href);
+  // Absolute URLs and references within the TOC document itself are left alone
+  if(pathLength == 0 || memchr(href, ':', pathLength) != NULL) {
+    EPUB3JSONWriterString(writer, NULL, href);
+    return;
+  }
+  char path[pathLength + 1];
+  (void)memcpy(path, href, pathLength);
+  path[pathLength] = '\0';
+  char * joined = EPUB3CopyOfPathByAppendingPathComponent(tocDirectory, path);
+  char * normalized = EPUB3CopyOfPathByNormalizingPath(joined);
+  EPUB3JSONWriterString(writer, normalized, fragment != NULL ? fragment : "");
+  EPUB3_FREE_AND_NULL(normalized);
+  EPUB3_FREE_AND_NULL(joined);
+}
+
+static void _EPUB3WebPublicationWriteTocItems(EPUB3JSONWriter * writer, const char * tocDirectory, EPUB3TocItemChildListItemPtr itemPtr)
+{
+  EPUB3JSONWriterBeginArray(writer);
+  for(; itemPtr != NULL; itemPtr = itemPtr->next) {
+    EPUB3TocItemRef item = itemPtr->item;
+    EPUB3JSONWriterBeginObject(writer);
+    if(item->href != NULL) {
+      EPUB3JSONWriterKey(writer, "href");
+      _EPUB3WebPublicationWriteTocHref(writer, tocDirectory, item->href);
+    }
+    if(item->title != NULL) {
+      EPUB3JSONWriterKey(writer, "title");
+      EPUB3JSONWriterString(writer, NULL, item->title);
+    }
+    if(item->childrenHead != NULL) {
+      EPUB3JSONWriterKey(writer, "children");
+      _EPUB3WebPublicationWriteTocItems(writer, tocDirectory, item->childrenHead);
+    }
+    EPUB3JSONWriterEndObject(writer);
+  }
+  EPUB3JSONWriterEndArray(writer);
+}
+
+static int _EPUB3WebPublicationCompareItems(const void * a, const void * b)
+{
+  uintptr_t left = (uintptr_t)*(const EPUB3ManifestItemRef *)a;
+  uintptr_t right = (uintptr_t)*(const EPUB3ManifestItemRef *)b;
+  return left < right ? -1 : left > right ? 1 : 0;
+}
+
+static void _EPUB3WebPublicationWrite(EPUB3Ref epub, const char * selfHref, EPUB3JSONWriter * writer)
+{
+  // Manifest hrefs are relative to the OPF, the publication's are relative to the archive root
+  const char * rootDirectory = epub->rootFileDirectory != NULL ? epub->rootFileDirectory : "";
+  EPUB3MetadataRef metadata = epub->metadata;
+
+  EPUB3JSONWriterBeginObject(writer);
+  EPUB3JSONWriterKey(writer, "@context");
+  EPUB3JSONWriterString(writer, NULL, "https://readium.org/webpub-manifest/context.jsonld");
+
+  EPUB3JSONWriterKey(writer, "metadata");
+  EPUB3JSONWriterBeginObject(writer);
+  EPUB3JSONWriterKey(writer, "@type");
+  EPUB3JSONWriterString(writer, NULL, "http://schema.org/Book");
+  if(metadata->identifier != NULL) {
+    EPUB3JSONWriterKey(writer, "identifier");
+    EPUB3JSONWriterString(writer, NULL, metadata->identifier);
+  }
+  EPUB3JSONWriterKey(writer, "title");
+  EPUB3JSONWriterString(writer, NULL, metadata->title != NULL ? metadata->title : "");
+  if(metadata->language != NULL) {
+    EPUB3JSONWriterKey(writer, "language");
+    EPUB3JSONWriterString(writer, NULL, metadata->language);
+  }
+  EPUB3JSONWriterKey(writer, "conformsTo");
+  EPUB3JSONWriterString(writer, NULL, "https://readium.org/webpub-manifest/profiles/epub");
+  EPUB3JSONWriterEndObject(writer);
+
+  EPUB3JSONWriterKey(writer, "links");
+  EPUB3JSONWriterBeginArray(writer);
+  if(selfHref != NULL) {
+    EPUB3JSONWriterBeginObject(writer);
+    EPUB3JSONWriterKey(writer, "rel");
+    EPUB3JSONWriterString(writer, NULL, "self");
+    EPUB3JSONWriterKey(writer, "href");
+    EPUB3JSONWriterString(writer, NULL, selfHref);
+    EPUB3JSONWriterKey(writer, "type");
+    EPUB3JSONWriterString(writer, NULL, "application/webpub+json");
+    EPUB3JSONWriterEndObject(writer);
+  }
+  EPUB3JSONWriterEndArray(writer);
+
+  // The items written here are collected, sorted by address, so resources can leave them out with a binary search
+  EPUB3ManifestItemRef * readingOrder = EPUB3Malloc((epub->spine->itemCount > 0 ? (size_t)epub->spine->itemCount : 1U) * sizeof(EPUB3ManifestItemRef));
+  size_t readingOrderCount = 0;
+  EPUB3JSONWriterKey(writer, "readingOrder");
+  EPUB3JSONWriterBeginArray(writer);
+  for(EPUB3SpineItemListItemPtr itemPtr = epub->spine->head; itemPtr != NULL; itemPtr = itemPtr->next) {
+    EPUB3SpineItemRef item = itemPtr->item;
+    if(item->isLinear && item->manifestItem != NULL && item->manifestItem->href != NULL) {
+      _EPUB3WebPublicationWriteLink(writer, rootDirectory, item->manifestItem, NULL);
+      if(readingOrderCount < (size_t)epub->spine->itemCount) {
+        readingOrder[readingOrderCount++] = item->manifestItem;
+      }
+    }
+  }
+  EPUB3JSONWriterEndArray(writer);
+  qsort(readingOrder, readingOrderCount, sizeof(EPUB3ManifestItemRef), _EPUB3WebPublicationCompareItems);
+
+  EPUB3JSONWriterKey(writer, "resources");
+  EPUB3JSONWriterBeginArray(writer);
+  for(int32_t i = 0; i < MANIFEST_HASH_SIZE; i++) {
+    for(EPUB3ManifestItemListItemPtr itemPtr = epub->manifest->itemTable[i]; itemPtr != NULL; itemPtr = itemPtr->next) {
+      EPUB3ManifestItemRef item = itemPtr->item;
+      if(item->href == NULL || bsearch(&item, readingOrder, readingOrderCount, sizeof(EPUB3ManifestItemRef), _EPUB3WebPublicationCompareItems) != NULL) continue;
+      const char * rel = NULL;
+      if(metadata->coverImageId != NULL && item->itemId != NULL && strcmp(item->itemId, metadata->coverImageId) == 0) {
+        rel = "cover";
+      } else if(EPUB3ManifestItemHasProperty(item, "nav")) {
+        rel = "contents";
+      }
+      _EPUB3WebPublicationWriteLink(writer, rootDirectory, item, rel);
+    }
+  }
+  EPUB3JSONWriterEndArray(writer);
+  EPUB3_FREE_AND_NULL(readingOrder);
+
+  if(epub->toc != NULL && epub->toc->rootItemsHead != NULL) {
+    // The TOC comes from the NCX, which needn't sit next to the OPF
+    char * tocDirectory = NULL;
+    EPUB3ManifestItemRef ncxItem = metadata->ncxItem;
+    if(ncxItem != NULL && ncxItem->href != NULL) {
+      char * ncxPath = *ncxItem->href != '/' ? EPUB3CopyOfPathByAppendingPathComponent(rootDirectory, ncxItem->href) : EPUB3Strdup(ncxItem->href + 1);
+      tocDirectory = EPUB3CopyOfPathByDeletingLastPathComponent(ncxPath);
+      EPUB3_FREE_AND_NULL(ncxPath);
+    } else {
+      tocDirectory = EPUB3Strdup(rootDirectory);
+    }
+    EPUB3JSONWriterKey(writer, "toc");
+    _EPUB3WebPublicationWriteTocItems(writer, tocDirectory, epub->toc->rootItemsHead);
+    EPUB3_FREE_AND_NULL(tocDirectory);
+  }
+  EPUB3JSONWriterEndObject(writer);
+}
+
+EXPORT EPUB3Error EPUB3WriteWebPublicationManifest(EPUB3Ref epub, const char * selfHref, char ** buffer, size_t * capacity, size_t * length)
+{
+  assert(epub != NULL);
+  assert(buffer != NULL);
+  assert(capacity != NULL);
+
+  if(epub->metadata == NULL || epub->manifest == NULL || epub->spine == NULL) return kEPUB3InvalidArgumentError;
+
+  EPUB3JSONWriter * writer = EPUB3Malloc(sizeof(EPUB3JSONWriter));
+  EPUB3JSONWriterInitWithBuffer(writer, buffer, capacity);
+  _EPUB3WebPublicationWrite(epub, selfHref, writer);
+  EPUB3Error error = EPUB3JSONWriterFinish(writer, length);
+  EPUB3_FREE_AND_NULL(writer);
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3WriteWebPublicationManifestToFD(EPUB3Ref epub, const char * selfHref, int fd)
+{
+  assert(epub != NULL);
+  assert(fd >= 0);
+
+  if(epub->metadata == NULL || epub->manifest == NULL || epub->spine == NULL) return kEPUB3InvalidArgumentError;
+
+  EPUB3JSONWriter * writer = EPUB3Malloc(sizeof(EPUB3JSONWriter));
+  EPUB3JSONWriterInitWithFD(writer, fd);
+  _EPUB3WebPublicationWrite(epub, selfHref, writer);
+  EPUB3Error error = EPUB3JSONWriterFinish(writer, NULL);
+  EPUB3_FREE_AND_NULL(writer);
+  return error;
+}
@@ -0,0 +1,376 @@
+#include "EPUB3.h"
+#include "EPUB3_private.h"
+#include <time.h>
+
+const char * kEPUB3WriterTypeID = "_EPUB3Writer_t";
+
+static const char _EPUB3WriterMimetypeName[] = "mimetype";
+static const char _EPUB3WriterMimetype[] = "application/epub+zip";
+
+typedef struct _EPUB3WriterBufferSource {
+  const unsigned char * bytes;
+  uint64_t length;
+  uint64_t offset;
+} _EPUB3WriterBufferSource;
+
+#pragma mark - Compression
+
+static EPUB3Error _EPUB3WriterDeflateChunk(EPUB3WriterChunkPtr chunk)
+{
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(stream));
+  if(deflateInit2(&stream, chunk->writer->level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return kEPUB3UnknownError;
+  }
+  // Priming with the end of the previous chunk keeps the ratio close to one stream's without any waiting,
+  // since that input is known up front
+  if(chunk->dictionaryLength > 0) {
+    (void)deflateSetDictionary(&stream, chunk->input, chunk->dictionaryLength);
+  }
+
+  // All but the last chunk end on a byte boundary (an empty stored block) without a final block, so the
+  // chunks can simply be written one after another
+  uint32_t capacity = (uint32_t)deflateBound(&stream, chunk->inputLength) + 16;
+  chunk->output = EPUB3Malloc(capacity);
+  stream.next_in = chunk->input + chunk->dictionaryLength;
+  stream.avail_in = chunk->inputLength;
+  stream.next_out = chunk->output;
+  stream.avail_out = capacity;
+  int flush = chunk->isLast ? Z_FINISH : Z_SYNC_FLUSH;
+  int status = deflate(&stream, flush);
+  while(status == Z_OK && stream.avail_out == 0) {
+    uint32_t used = capacity;
+    capacity += capacity / 2;
+    chunk->output = EPUB3Realloc(chunk->output, capacity);
+    stream.next_out = chunk->output + used;
+    stream.avail_out = capacity - used;
+    status = deflate(&stream, flush);
+  }
+  chunk->outputLength = capacity - stream.avail_out;
+  (void)deflateEnd(&stream);
+  if(chunk->isLast ? status != Z_STREAM_END : (status != Z_OK || stream.avail_in != 0)) {
+    return kEPUB3UnknownError;
+  }
+  return kEPUB3Success;
+}
+
+static void _EPUB3WriterChunkFree(EPUB3WriterChunkPtr chunk)
+{
+  if(chunk->output != chunk->input + chunk->dictionaryLength) {
+    EPUB3_FREE_AND_NULL(chunk->output);
+  }
+  EPUB3_FREE_AND_NULL(chunk->input);
+  if(chunk->isLast) {
+    EPUB3_FREE_AND_NULL(chunk->entry->path);
+    EPUB3_FREE_AND_NULL(chunk->entry);
+  }
+  EPUB3_FREE_AND_NULL(chunk);
+}
+
+#pragma mark - Output Assembly
+
+static EPUB3Error _EPUB3WriterWriteChunk(EPUB3WriterRef writer, EPUB3WriterChunkPtr chunk)
+{
+  EPUB3WriterEntryPtr entry = chunk->entry;
+  if(!entry->isOpen) {
+    if(writer->archiveSize > WRITER_ZIP_LIMIT) return kEPUB3FileTooLargeError;
+    // Raw, since the data is deflated already; zip.c only writes it out and fills in the sizes
+    int method = entry->compresses ? Z_DEFLATED : 0;
+    if(zipOpenNewFileInZip2(writer->zip, entry->path, &writer->fileInfo, NULL, 0, NULL, 0, NULL, method, writer->level, 1) != ZIP_OK) {
+      return kEPUB3FileWriteError;
+    }
+    entry->isOpen = kEPUB3_YES;
+    entry->crc = EPUB3CRC32(0, NULL, 0);
+    writer->archiveSize += 30 + strlen(entry->path);
+  }
+  if(chunk->outputLength > 0 && zipWriteInFileInZip(writer->zip, chunk->output, chunk->outputLength) != ZIP_OK) {
+    return kEPUB3FileWriteError;
+  }
+  entry->crc = (uint32_t)crc32_combine(entry->crc, chunk->crc, chunk->inputLength);
+  entry->uncompressedSize += chunk->inputLength;
+  entry->compressedSize += chunk->outputLength;
+  writer->archiveSize += chunk->outputLength;
+  if(chunk->isLast) {
+    if(entry->uncompressedSize > WRITER_ZIP_LIMIT || entry->compressedSize > WRITER_ZIP_LIMIT) return kEPUB3FileTooLargeError;
+    if(zipCloseFileInZipRaw(writer->zip, (uLong)entry->uncompressedSize, entry->crc) != ZIP_OK) {
+      return kEPUB3FileWriteError;
+    }
+    writer->archiveSize += 46 + strlen(entry->path); // its central directory record
+  }
+  return kEPUB3Success;
+}
+
+// Chunks finish in any order but are written in the order they were queued. Whichever thread finishes
+// the oldest one takes over writing and keeps going while the next in line is done, with the lock
+// released, so compression never waits on the file.
+static void _EPUB3WriterChunkFinished(EPUB3WriterRef writer, EPUB3WriterChunkPtr chunk)
+{
+  (void)pthread_mutex_lock(&writer->lock);
+  chunk->isDone = kEPUB3_YES;
+  if(chunk->error != kEPUB3Success && writer->error == kEPUB3Success) {
+    writer->error = chunk->error;
+  }
+  if(!writer->isWriting) {
+    writer->isWriting = kEPUB3_YES;
+    while(writer->firstChunk != NULL && writer->firstChunk->isDone) {
+      EPUB3WriterChunkPtr first = writer->firstChunk;
+      writer->firstChunk = first->next;
+      if(writer->firstChunk == NULL) {
+        writer->lastChunk = NULL;
+      }
+      EPUB3Bool writes = writer->error == kEPUB3Success;
+      (void)pthread_mutex_unlock(&writer->lock);
+
+      EPUB3Error error = writes ? _EPUB3WriterWriteChunk(writer, first) : kEPUB3Success;
+      _EPUB3WriterChunkFree(first);
+
+      (void)pthread_mutex_lock(&writer->lock);
+      if(error != kEPUB3Success && writer->error == kEPUB3Success) {
+        writer->error = error;
+      }
+      writer->chunksInFlight--;
+      (void)pthread_cond_broadcast(&writer->chunkWritten);
+    }
+    writer->isWriting = kEPUB3_NO;
+    (void)pthread_cond_broadcast(&writer->chunkWritten);
+  }
+  (void)pthread_mutex_unlock(&writer->lock);
+}
+
+static void _EPUB3WriterCompressTask(void * context)
+{
+  EPUB3WriterChunkPtr chunk = (EPUB3WriterChunkPtr)context;
+  const unsigned char * bytes = chunk->input + chunk->dictionaryLength;
+  chunk->crc = EPUB3CRC32(0, bytes, chunk->inputLength);
+  if(chunk->entry->compresses) {
+    chunk->error = _EPUB3WriterDeflateChunk(chunk);
+  } else {
+    chunk->output = (unsigned char *)bytes;
+    chunk->outputLength = chunk->inputLength;
+  }
+  _EPUB3WriterChunkFinished(chunk->writer, chunk);
+}
+
+// Takes its place in the queue first, so it is written after every chunk submitted before it
+static void _EPUB3WriterSubmitChunk(EPUB3WriterRef writer, EPUB3WriterChunkPtr chunk)
+{
+  (void)pthread_mutex_lock(&writer->lock);
+  if(writer->lastChunk != NULL) {
+    writer->lastChunk->next = chunk;
+  } else {
+    writer->firstChunk = chunk;
+  }
+  writer->lastChunk = chunk;
+  (void)pthread_mutex_unlock(&writer->lock);
+  EPUB3WorkPoolSubmit(writer->pool, _EPUB3WriterCompressTask, chunk);
+}
+
+// Blocks until there is room for another chunk, then counts it in
+static EPUB3Error _EPUB3WriterReserveChunk(EPUB3WriterRef writer)
+{
+  (void)pthread_mutex_lock(&writer->lock);
+  while(writer->chunksInFlight >= writer->maxChunksInFlight && writer->error == kEPUB3Success) {
+    (void)pthread_cond_wait(&writer->chunkWritten, &writer->lock);
+  }
+  EPUB3Error error = writer->error;
+  if(error == kEPUB3Success) {
+    writer->chunksInFlight++;
+  }
+  (void)pthread_mutex_unlock(&writer->lock);
+  return error;
+}
+
+#pragma mark - Public API
+
+EXPORT EPUB3WriterRef EPUB3WriterCreate(const char * path, int32_t threadCount, int32_t level, EPUB3Error *error)
+{
+  assert(path != NULL);
+  assert(error != NULL);
+
+  if(threadCount < 0 || level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    *error = kEPUB3InvalidArgumentError;
+    return NULL;
+  }
+  zipFile zip = zipOpen(path, APPEND_STATUS_CREATE);
+  if(zip == NULL) {
+    *error = kEPUB3FileWriteError;
+    return NULL;
+  }
+  EPUB3WorkPoolRef pool = EPUB3WorkPoolCreate(threadCount);
+  if(pool == NULL) {
+    (void)zipClose(zip, NULL);
+    (void)unlink(path);
+    *error = kEPUB3UnknownError;
+    return NULL;
+  }
+
+  EPUB3WriterRef memory = EPUB3Malloc(sizeof(struct EPUB3Writer));
+  memory = EPUB3ObjectInitWithTypeID(memory, kEPUB3WriterTypeID);
+  memory->path = EPUB3Strdup(path);
+  memory->zip = zip;
+  (void)memset(&memory->fileInfo, 0, sizeof(zip_fileinfo));
+  time_t now = time(NULL);
+  struct tm local;
+  if(localtime_r(&now, &local) != NULL) {
+    memory->fileInfo.tmz_date.tm_sec = (uInt)local.tm_sec;
+    memory->fileInfo.tmz_date.tm_min = (uInt)local.tm_min;
+    memory->fileInfo.tmz_date.tm_hour = (uInt)local.tm_hour;
+    memory->fileInfo.tmz_date.tm_mday = (uInt)local.tm_mday;
+    memory->fileInfo.tmz_date.tm_mon = (uInt)local.tm_mon;
+    memory->fileInfo.tmz_date.tm_year = (uInt)local.tm_year + 1900;
+  }
+  memory->level = level;
+  memory->pool = pool;
+  (void)pthread_mutex_init(&memory->lock, NULL);
+  (void)pthread_cond_init(&memory->chunkWritten, NULL);
+  memory->firstChunk = NULL;
+  memory->lastChunk = NULL;
+  memory->chunksInFlight = 0;
+  memory->maxChunksInFlight = pool->threadCount * WRITER_CHUNKS_IN_FLIGHT_PER_THREAD;
+  memory->isWriting = kEPUB3_NO;
+  memory->archiveSize = 0;
+  memory->error = kEPUB3Success;
+
+  // Stored, with no extra field, so the media type sits at a fixed offset from the start of the file
+  if(zipOpenNewFileInZip(zip, _EPUB3WriterMimetypeName, &memory->fileInfo, NULL, 0, NULL, 0, NULL, 0, 0) != ZIP_OK ||
+     zipWriteInFileInZip(zip, _EPUB3WriterMimetype, sizeof(_EPUB3WriterMimetype) - 1) != ZIP_OK ||
+     zipCloseFileInZip(zip) != ZIP_OK) {
+    memory->error = kEPUB3FileWriteError;
+    *error = EPUB3WriterFinish(memory);
+    return NULL;
+  }
+  memory->archiveSize = 30 + 46 + 2 * (sizeof(_EPUB3WriterMimetypeName) - 1) + sizeof(_EPUB3WriterMimetype) - 1;
+  *error = kEPUB3Success;
+  return memory;
+}
+
+static int64_t _EPUB3WriterReadBuffer(void * context, void * buffer, uint32_t length)
+{
+  _EPUB3WriterBufferSource * source = context;
+  uint64_t left = source->length - source->offset;
+  if(length > left) {
+    length = (uint32_t)left;
+  }
+  (void)memcpy(buffer, source->bytes + source->offset, length);
+  source->offset += length;
+  return length;
+}
+
+EXPORT EPUB3Error EPUB3WriterAddBuffer(EPUB3WriterRef writer, const char * path, const void * bytes, uint64_t length, EPUB3Bool compress)
+{
+  assert(bytes != NULL || length == 0);
+
+  _EPUB3WriterBufferSource source;
+  source.bytes = bytes;
+  source.length = length;
+  source.offset = 0;
+  return EPUB3WriterAddStream(writer, path, _EPUB3WriterReadBuffer, &source, compress);
+}
+
+EXPORT EPUB3Error EPUB3WriterAddStream(EPUB3WriterRef writer, const char * path, EPUB3WriterReadFunction read, void * context, EPUB3Bool compress)
+{
+  assert(writer != NULL);
+  assert(path != NULL);
+  assert(read != NULL);
+
+  if(path[0] == '\0' || strcmp(path, _EPUB3WriterMimetypeName) == 0) return kEPUB3InvalidArgumentError;
+
+  EPUB3WriterEntryPtr entry = EPUB3Malloc(sizeof(struct EPUB3WriterEntry));
+  entry->path = EPUB3Strdup(path);
+  entry->compresses = compress;
+  entry->isOpen = kEPUB3_NO;
+  entry->crc = 0;
+  entry->uncompressedSize = 0;
+  entry->compressedSize = 0;
+
+  // A chunk is only submitted once the next read tells whether it was the entry's last one, which decides
+  // how its deflate stream ends
+  EPUB3WriterChunkPtr pending = NULL;
+  EPUB3Error error = kEPUB3Success;
+  while(error == kEPUB3Success) {
+    error = _EPUB3WriterReserveChunk(writer);
+    if(error != kEPUB3Success) break;
+
+    EPUB3WriterChunkPtr chunk = EPUB3Calloc(1, sizeof(struct EPUB3WriterChunk));
+    chunk->writer = writer;
+    chunk->entry = entry;
+    chunk->error = kEPUB3Success;
+    if(pending != NULL && compress) {
+      chunk->dictionaryLength = pending->inputLength < WRITER_DICTIONARY_SIZE ? pending->inputLength : WRITER_DICTIONARY_SIZE;
+    }
+    chunk->input = EPUB3Malloc(chunk->dictionaryLength + WRITER_CHUNK_SIZE);
+    if(chunk->dictionaryLength > 0) {
+      (void)memcpy(chunk->input, pending->input + pending->dictionaryLength + pending->inputLength - chunk->dictionaryLength, chunk->dictionaryLength);
+    }
+    while(chunk->inputLength < WRITER_CHUNK_SIZE) {
+      int64_t count = read(context, chunk->input + chunk->dictionaryLength + chunk->inputLength, WRITER_CHUNK_SIZE - chunk->inputLength);
+      if(count < 0) {
+        error = kEPUB3FileReadFromArchiveError;
+        break;
+      }
+      if(count == 0) break;
+      chunk->inputLength += (uint32_t)count;
+    }
+
+    if(error != kEPUB3Success || (chunk->inputLength == 0 && pending != NULL)) {
+      // Nothing more to read: the pending chunk was the last one
+      EPUB3_FREE_AND_NULL(chunk->input);
+      EPUB3_FREE_AND_NULL(chunk);
+      (void)pthread_mutex_lock(&writer->lock);
+      writer->chunksInFlight--;
+      (void)pthread_mutex_unlock(&writer->lock);
+      break;
+    }
+    if(pending != NULL) {
+      _EPUB3WriterSubmitChunk(writer, pending);
+    }
+    pending = chunk;
+    if(chunk->inputLength < WRITER_CHUNK_SIZE) break;
+  }
+
+  if(error != kEPUB3Success) {
+    // Part of the entry may be queued already, so the archive can't be finished without it
+    (void)pthread_mutex_lock(&writer->lock);
+    if(writer->error == kEPUB3Success) {
+      writer->error = error;
+    }
+    (void)pthread_mutex_unlock(&writer->lock);
+  }
+  if(pending != NULL) {
+    // Even after a failure it goes through the queue, which frees it (and the entry) without writing
+    pending->isLast = kEPUB3_YES;
+    _EPUB3WriterSubmitChunk(writer, pending);
+  } else {
+    EPUB3_FREE_AND_NULL(entry->path);
+    EPUB3_FREE_AND_NULL(entry);
+  }
+  return error;
+}
+
+EXPORT EPUB3Error EPUB3WriterFinish(EPUB3WriterRef writer)
+{
+  assert(writer != NULL);
+
+  (void)pthread_mutex_lock(&writer->lock);
+  while(writer->firstChunk != NULL || writer->isWriting) {
+    (void)pthread_cond_wait(&writer->chunkWritten, &writer->lock);
+  }
+  (void)pthread_mutex_unlock(&writer->lock);
+  EPUB3WorkPoolRelease(writer->pool);
+
+  EPUB3Error error = writer->error;
+  if(error == kEPUB3Success && writer->archiveSize + 22 > WRITER_ZIP_LIMIT) {
+    error = kEPUB3FileTooLargeError;
+  }
+  if(zipClose(writer->zip, NULL) != ZIP_OK && error == kEPUB3Success) {
+    error = kEPUB3FileWriteError;
+  }
+  if(error != kEPUB3Success) {
+    (void)unlink(writer->path);
+  }
+  (void)pthread_cond_destroy(&writer->chunkWritten);
+  (void)pthread_mutex_destroy(&writer->lock);
+  EPUB3_FREE_AND_NULL(writer->path);
+  EPUB3ObjectRelease(writer);
+  return error;
+}
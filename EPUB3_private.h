@@ -12,7 +12,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "unzip.h"
+#include "zip.h"
 #include "EPUB3.h"
 
 #ifndef EPUB3_private_h
@@ -37,6 +42,16 @@ const char * kEPUB3SpineTypeID;
 const char * kEPUB3SpineItemTypeID;
 const char * kEPUB3TocTypeID;
 const char * kEPUB3TocItemTypeID;
+const char * kEPUB3ResourceTypeID;
+const char * kEPUB3PrefetcherTypeID;
+const char * kEPUB3ResourceStreamTypeID;
+const char * kEPUB3ServerTypeID;
+const char * kEPUB3WorkPoolTypeID;
+const char * kEPUB3BatchTypeID;
+const char * kEPUB3PositionsTypeID;
+const char * kEPUB3SearchIndexTypeID;
+const char * kEPUB3WriterTypeID;
+const char * kEPUB3AsyncReaderTypeID;
 
 
 #pragma mark - Internal XML Parsing State
@@ -79,6 +94,39 @@ typedef enum {
   kEPUB3Version_3 = 300,
 } EPUB3Version;
 
+// Identifies the archive file itself (rather than the path it was opened from), so that cached data is
+// never served for a book that has been replaced on disk.
+typedef struct EPUB3ArchiveIdentity {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t modificationTime;
+} EPUB3ArchiveIdentity;
+
+#define ARCHIVE_ENTRY_HASH_SIZE 64
+#define RANGE_CHECKPOINT_DEFAULT_SPAN (1024U * 1024U)
+#define RANGE_CHECKPOINT_WINDOW_SIZE 32768U
+
+// Enough inflate state to resume decompression of a deflated entry somewhere other than its start
+typedef struct EPUB3RangeCheckpoint {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset; // relative to the start of the entry's data
+  int32_t bitCount; // bits of the byte before compressedOffset that still belong to the next block
+  unsigned char * window; // last 32K of output; NULL for the checkpoint at the start of the entry
+} EPUB3RangeCheckpoint;
+
+typedef struct EPUB3ArchiveEntry {
+  char * path;
+  int32_t method;
+  uint32_t crc;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t dataOffset; // position of the entry's data in the archive file
+  int32_t checkpointCount; // 0 until the first full pass over a deflated entry; set once, under the entry lock
+  EPUB3RangeCheckpoint * checkpoints;
+  struct EPUB3ArchiveEntry * next;
+} * EPUB3ArchiveEntryPtr;
+
 struct EPUB3 {
   EPUB3Type _type;
   EPUB3MetadataRef metadata;
@@ -88,6 +136,21 @@ struct EPUB3 {
   char * archivePath;
   unzFile archive;
   uint32_t archiveFileCount;
+  EPUB3ArchiveIdentity archiveIdentity;
+  char * rootFileDirectory; // directory of the OPF inside the archive, manifest hrefs are relative to it
+  EPUB3PrefetcherRef prefetcher; //weak ref
+  pthread_mutex_t entryLock; // guards entryTable, attaching checkpoints and whole-file reads through archive
+  EPUB3ArchiveEntryPtr entryTable[ARCHIVE_ENTRY_HASH_SIZE];
+  uint32_t rangeCheckpointSpan;
+  char * rangeIndexDirectory;
+  const unsigned char * snapshot; // read-only mapping this book was opened from, owned
+  size_t snapshotSize;
+  EPUB3Bool verifiesReads;
+  struct EPUB3RecoveredArchive * recoveredArchive; // owned, NULL unless the archive's central directory was rebuilt
+  struct EPUB3Rendition * renditions; // one per rootfile in the container, NULL until it has been parsed
+  int32_t renditionCount;
+  int32_t selectedRendition; // the one metadata, manifest, spine, toc and rootFileDirectory belong to
+  struct EPUB3CacheEntry * cacheEntry; // set on books shared through the archive cache, which counts their references
 };
 
 struct EPUB3Metadata {
@@ -166,6 +229,905 @@ struct EPUB3TocItem {
 //  EPUB3ManifestItemRef manifestItem; //weak ref
 };
 
+#pragma mark - Memory Management
+
+void * EPUB3Malloc(size_t size);
+void * EPUB3Calloc(size_t count, size_t size);
+void * EPUB3Realloc(void * ptr, size_t size);
+char * EPUB3Strdup(const char * string);
+char * EPUB3CopyXMLAttribute(xmlTextReaderPtr reader, const char * name);
+
+#pragma mark - Resource Cache
+
+#ifndef RESOURCE_CACHE_SHARD_COUNT
+#define RESOURCE_CACHE_SHARD_COUNT 16
+#endif
+
+#ifndef RESOURCE_CACHE_SHARD_HASH_SIZE
+#define RESOURCE_CACHE_SHARD_HASH_SIZE 256
+#endif
+
+struct EPUB3Resource {
+  EPUB3Type _type;
+  void * bytes;
+  uint32_t byteCount;
+};
+
+typedef struct EPUB3ResourceCacheEntry {
+  uint32_t hash;
+  EPUB3ArchiveIdentity identity;
+  char * path;
+  EPUB3ResourceRef resource; // inflated bytes, or the raw deflate stream when isCompressed
+  EPUB3Bool isCompressed;
+  uint32_t uncompressedSize;
+  uint32_t storedByteCount;
+  EPUB3Bool isVerified; // the inflated bytes were checked against the entry's CRC
+  struct EPUB3ResourceCacheEntry * hashNext;
+  struct EPUB3ResourceCacheEntry * lruPrev;
+  struct EPUB3ResourceCacheEntry * lruNext;
+} * EPUB3ResourceCacheEntryPtr;
+
+typedef struct EPUB3ResourceCacheShard {
+  pthread_mutex_t lock;
+  EPUB3ResourceCacheEntryPtr table[RESOURCE_CACHE_SHARD_HASH_SIZE];
+  EPUB3ResourceCacheEntryPtr lruHead; // most recently used
+  EPUB3ResourceCacheEntryPtr lruTail;
+  uint64_t byteCount;
+} EPUB3ResourceCacheShard;
+
+#define WHOLE_FILE_MAX_SIZE INT32_MAX // largest entry copied into one buffer, unzReadCurrentFile counts in an int
+
+EPUB3ResourceRef EPUB3ResourceCreateWithBytes(void * bytes, uint32_t byteCount);
+uint32_t EPUB3ResourceCacheHashForKey(const EPUB3ArchiveIdentity * identity, const char * path);
+// With verifiesCRC, an entry not yet verified is checked against crc first, and dropped if it doesn't match
+EPUB3ResourceRef EPUB3ResourceCacheCopyResource(const EPUB3ArchiveIdentity * identity, const char * path, EPUB3Bool verifiesCRC, uint32_t crc);
+void EPUB3ResourceCacheInsertResource(const EPUB3ArchiveIdentity * identity, const char * path, EPUB3ResourceRef resource, EPUB3Bool isCompressed, uint32_t uncompressedSize, EPUB3Bool isVerified);
+EPUB3Error EPUB3CopyRawFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *compressedSize, uint32_t *uncompressedSize, int *method, const char * filename);
+// One-shot inflate of a raw deflate stream that must fill destination exactly, with the selected backend
+EPUB3Error EPUB3InflateRawBuffer(const void * source, uint32_t sourceSize, void * destination, uint32_t destinationSize);
+// The whole of archive's current file, followed by extraBytes zero bytes. Read raw, then inflated in one call.
+EPUB3Error EPUB3CopyCurrentArchiveFileIntoBuffer(unzFile archive, EPUB3Bool verifiesCRC, uint32_t extraBytes, void **buffer, uint32_t *bytesCopied);
+
+#pragma mark - Compressed Passthrough
+
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8
+
+void EPUB3WriteGzipHeader(unsigned char * header);
+void EPUB3WriteGzipTrailer(unsigned char * trailer, uint32_t crc, uint64_t uncompressedSize);
+
+#pragma mark - Prefetching
+
+typedef struct EPUB3PrefetchPoolItem {
+  char * path;
+  EPUB3ResourceRef resource;
+  struct EPUB3PrefetchPoolItem * next;
+} * EPUB3PrefetchPoolItemPtr;
+
+struct EPUB3Prefetcher {
+  EPUB3Type _type;
+  EPUB3Ref epub;
+  unzFile archive; // private handle, the epub's own one belongs to the request thread
+  int32_t depth;
+  uint64_t byteBudget;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t condition;
+  EPUB3Bool shouldStop;
+  uint32_t generation; // bumped every time the wanted set changes
+  int32_t targetCount;
+  int32_t targetCapacity;
+  char ** targets; // archive paths wanted in the pool, in priority order
+  EPUB3PrefetchPoolItemPtr pool;
+  uint64_t poolByteCount;
+};
+
+EPUB3ResourceRef EPUB3PrefetcherCopyPooledResource(EPUB3PrefetcherRef prefetcher, const char * path);
+void EPUB3PrefetcherAddTarget(EPUB3PrefetcherRef prefetcher, const char * path);
+void EPUB3PrefetcherCollectStylesheetPaths(EPUB3PrefetcherRef prefetcher, const char * documentPath, const char * bytes, uint32_t byteCount);
+EPUB3Error EPUB3CopyFileFromArchiveIntoBuffer(unzFile archive, void **buffer, uint32_t *bytesCopied, const char * filename);
+char * EPUB3CopyOfPathByNormalizingPath(const char * path);
+
+#pragma mark - Archive Entries and Range Reads
+
+EPUB3Error EPUB3GetArchiveEntry(EPUB3Ref epub, const char * path, EPUB3ArchiveEntryPtr *entry);
+void EPUB3ArchiveEntryFree(EPUB3ArchiveEntryPtr entry);
+void EPUB3ReleaseArchiveEntries(EPUB3Ref epub);
+EPUB3Bool EPUB3ArchiveEntryHasCheckpoints(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+EPUB3Error EPUB3ArchiveEntryBuildCheckpoints(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd);
+EPUB3Error EPUB3ArchiveEntryReadRange(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd, uint64_t offset, uint32_t length, void * buffer);
+char * EPUB3CopyRangeIndexPathForEntry(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry);
+EPUB3Error EPUB3ArchiveEntryReadCheckpointsFromFile(EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, const char * path);
+
+#pragma mark - Resource Streams
+
+#define RESOURCE_STREAM_CHUNK_SIZE 16384U
+
+struct EPUB3ResourceStream {
+  EPUB3Type _type;
+  EPUB3Ref epub; // not retained, outlives the stream
+  EPUB3ArchiveEntryPtr entry; // owned by epub
+  int fd;
+  uint64_t position; // uncompressed offset of the next byte handed out
+  uint64_t compressedPosition; // offset into the entry's data of the next byte fed to inflate
+  EPUB3Bool isInflating;
+  z_stream inflateStream;
+  unsigned char input[RESOURCE_STREAM_CHUNK_SIZE];
+  EPUB3Bool verifiesCRC;
+  uint32_t crc; // of the bytes handed out so far, while they have been read in order from the start
+  uint64_t crcPosition;
+};
+
+void EPUB3ResourceStreamInit(EPUB3ResourceStreamRef stream, EPUB3Ref epub, EPUB3ArchiveEntryPtr entry, int fd);
+void EPUB3ResourceStreamFinalize(EPUB3ResourceStreamRef stream);
+EPUB3Error EPUB3ResourceStreamResumeAtCheckpoint(EPUB3ResourceStreamRef stream, const EPUB3RangeCheckpoint * checkpoint);
+
+#pragma mark - Sniffing
+
+#define SNIFF_HEAD_SIZE 512 // the first local header, its name and extra field, and the mimetype contents
+#define SNIFF_TAIL_SIZE 4096 // searched for the end of central directory record before trying the largest comment
+
+typedef struct EPUB3SniffSource {
+  ssize_t (*read)(void * context, uint64_t offset, void * bytes, size_t length); // pread-like
+  void * context;
+  const unsigned char * bytes; // for buffers
+  uint64_t size;
+} EPUB3SniffSource;
+
+EPUB3SniffClassification EPUB3SniffSourceClassify(EPUB3SniffSource * source, EPUB3SniffResult * result);
+EPUB3SniffClassification EPUB3SniffFileDescriptor(int fd, uint64_t fileSize, EPUB3SniffResult * result);
+// Only the end records: any ZIP archive whose central directory looks sound is kEPUB3SniffEPUB
+EPUB3SniffClassification EPUB3SniffCentralDirectory(int fd, uint64_t fileSize, EPUB3SniffResult * result);
+// Only the mimetype entry's local header, for archives whose end records can't be trusted
+EPUB3SniffClassification EPUB3SniffHead(int fd, uint64_t fileSize);
+// kEPUB3InvalidMimetypeError for files that aren't EPUBs, kEPUB3ArchiveUnavailableError for damaged ones
+EPUB3Error EPUB3ErrorForSniffClassification(EPUB3SniffClassification classification);
+
+#pragma mark - Archive Verification
+
+// zlib's crc32, with carry-less multiplies (x86-64) or the CRC32 instructions (ARMv8) when available
+uint32_t EPUB3CRC32(uint32_t crc, const void * bytes, size_t length);
+
+typedef struct EPUB3VerifyTask {
+  EPUB3ArchiveEntryReport * report;
+  int fd;
+  int32_t method;
+  uint64_t headerOffset; // of the entry's local header, from the central directory (or its ZIP64 extra field)
+} * EPUB3VerifyTaskRef;
+
+#pragma mark - Archive Recovery
+
+#define RECOVERY_INFLATE_BUFFER_SIZE 65536
+
+// A central directory rebuilt from the local file headers, for archives whose own is missing or damaged.
+// MiniZip reads the archive through a view that ends the file's bytes at directoryOffset and continues
+// with the rebuilt records, so entries keep their real offsets and nothing is written anywhere.
+typedef struct EPUB3RecoveredArchive {
+  uint64_t directoryOffset;
+  unsigned char * directory; // central directory records followed by the end records
+  uint64_t directorySize;
+  uint64_t entryCount;
+} * EPUB3RecoveredArchiveRef;
+
+// kEPUB3ArchiveUnavailableError when no intact entry is found
+EPUB3Error EPUB3RecoverArchive(const char * path, EPUB3RecoveredArchiveRef * recovered);
+void EPUB3RecoveredArchiveFree(EPUB3RecoveredArchiveRef recovered);
+// The archive at path through the rebuilt directory, which has to outlive the handle
+unzFile EPUB3RecoveredArchiveOpen(EPUB3RecoveredArchiveRef recovered, const char * path);
+
+#pragma mark - HTTP Server
+
+#define HTTP_SERVER_MAX_CONNECTIONS 64
+#define HTTP_SERVER_REQUEST_BUFFER_SIZE 8192
+#define HTTP_SERVER_BODY_BUFFER_SIZE 32768
+#define HTTP_SERVER_SKIP_STEP_SIZE 65536U // inflated per turn while a range start is sought without checkpoints
+
+typedef struct EPUB3ServerBook {
+  char * bookID;
+  EPUB3Ref epub;
+  struct EPUB3ServerBook * next;
+} * EPUB3ServerBookPtr;
+
+// A checkpoint index being built on the server's worker for a deflated entry that got a range request
+typedef struct EPUB3ServerCheckpointTask {
+  struct EPUB3Server * server;
+  EPUB3Ref epub; // retained until the build is done
+  EPUB3ArchiveEntryPtr entry;
+  struct EPUB3ServerCheckpointTask * next;
+} * EPUB3ServerCheckpointTaskPtr;
+
+typedef enum {
+  kEPUB3ServerConnectionReadingRequest,
+  kEPUB3ServerConnectionWritingResponse,
+} EPUB3ServerConnectionState;
+
+typedef struct EPUB3ServerConnection {
+  int socket;
+  EPUB3ServerConnectionState state;
+  EPUB3Bool keepAlive;
+  char request[HTTP_SERVER_REQUEST_BUFFER_SIZE];
+  size_t requestLength;
+  char headers[512 + GZIP_HEADER_SIZE];
+  size_t headersLength;
+  size_t headersSent;
+  EPUB3Ref epub; // retained for the duration of a response
+  uint64_t bodyRemaining;
+  int archiveFD; // stored entries are sent from here
+  uint64_t bodyOffset; // position in the archive file of the next stored byte
+  EPUB3ResourceStreamRef stream; // deflated entries are inflated through buffer
+  uint64_t streamStart; // where the body starts in stream, which may still have to be inflated up to
+  unsigned char buffer[HTTP_SERVER_BODY_BUFFER_SIZE];
+  size_t bufferLength;
+  size_t bufferSent;
+  unsigned char trailer[GZIP_TRAILER_SIZE]; // gzip-encoded responses end with this
+  size_t trailerLength;
+  size_t trailerSent;
+  struct EPUB3ServerConnection * next;
+} * EPUB3ServerConnectionPtr;
+
+struct EPUB3Server {
+  EPUB3Type _type;
+  int listenSocket;
+  uint16_t port;
+  int wakePipe[2];
+  pthread_t thread;
+  pthread_mutex_t lock; // guards books, shouldStop and book reference counts
+  EPUB3Bool shouldStop;
+  EPUB3ServerBookPtr books;
+  struct EPUB3WorkPool * checkpointPool; // builds checkpoint indexes off the server thread
+  EPUB3ServerCheckpointTaskPtr checkpointTasks; // guarded by lock
+  EPUB3ServerConnectionPtr connections; // only touched by the server thread
+  int32_t connectionCount;
+};
+
+#pragma mark - Snapshots
+
+#define SNAPSHOT_MAGIC "EPUB3SNP"
+#define SNAPSHOT_FORMAT_VERSION 3 // 2: selectedRendition, 3: archiveWasRecovered
+#define SNAPSHOT_BYTE_ORDER_MARK 0x01020304U
+#define SNAPSHOT_EOCD_SEARCH_SIZE (65535 + 22) // largest comment plus the end of central directory record
+
+// Identifies an archive by its central directory, which changes whenever any entry does
+typedef struct EPUB3ArchiveDigest {
+  uint64_t centralDirectoryOffset;
+  uint64_t centralDirectorySize;
+  uint32_t centralDirectoryCRC;
+  uint32_t entryCount;
+} EPUB3ArchiveDigest;
+
+// A snapshot image is used in place: every reference in it is a byte offset from the start of the image
+// (0 for a NULL string), so it can be mapped at any address. Numbers are in the writer's byte order,
+// which is checked on open. Entries are sorted by path so lookups can binary search the mapping.
+typedef struct EPUB3SnapshotHeader {
+  char magic[8];
+  uint32_t formatVersion;
+  uint32_t byteOrderMark;
+  uint64_t imageSize;
+  EPUB3ArchiveDigest archiveDigest;
+  uint32_t archivePath;
+  uint32_t rootFileDirectory;
+  uint32_t version;
+  uint32_t title;
+  uint32_t identifier;
+  uint32_t uniqueIdentifierID;
+  uint32_t language;
+  uint32_t coverImageId;
+  uint32_t ncxItemId;
+  uint32_t manifestItemCount;
+  uint32_t manifestItems;
+  uint32_t spineItemCount;
+  uint32_t spineItems;
+  uint32_t tocItemCount;
+  uint32_t tocItems; // in document order, each item after its parent
+  uint32_t entryCount;
+  uint32_t entries;
+  int32_t selectedRendition; // the rootfile the catalogue was built from
+  uint32_t archiveWasRecovered; // archiveDigest is of the rebuilt central directory
+} EPUB3SnapshotHeader;
+
+typedef struct EPUB3SnapshotManifestItem {
+  uint32_t itemId;
+  uint32_t href;
+  uint32_t mediaType;
+  uint32_t properties;
+} EPUB3SnapshotManifestItem;
+
+typedef struct EPUB3SnapshotSpineItem {
+  uint32_t idref;
+  uint32_t isLinear;
+} EPUB3SnapshotSpineItem;
+
+typedef struct EPUB3SnapshotTocItem {
+  uint32_t title;
+  uint32_t href;
+  int32_t parent; // index into the TOC items, -1 for root items
+} EPUB3SnapshotTocItem;
+
+typedef struct EPUB3SnapshotEntry {
+  uint32_t path;
+  int32_t method;
+  uint32_t crc;
+  uint32_t reserved;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  uint64_t dataOffset;
+} EPUB3SnapshotEntry;
+
+EPUB3Error EPUB3GetArchiveDigest(int fd, EPUB3ArchiveDigest * digest);
+// Of epub->archivePath, or of the directory rebuilt for it when the book was recovered
+EPUB3Error EPUB3GetArchiveDigestOfBook(EPUB3Ref epub, EPUB3ArchiveDigest * digest);
+const EPUB3SnapshotEntry * EPUB3SnapshotFindEntry(EPUB3Ref epub, const char * path);
+void EPUB3SnapshotUnmap(EPUB3Ref epub);
+
+#pragma mark - JSON Writer
+
+#define JSON_WRITER_MAX_DEPTH 64
+#define JSON_WRITER_CHUNK_SIZE 16384
+
+// Streaming JSON output without building a tree. Output goes either to a caller-owned buffer that is
+// grown with EPUB3Realloc (getline style), or through a fixed chunk to a file descriptor. The first error
+// sticks and is returned by EPUB3JSONWriterFinish; every other call is a no-op after it.
+typedef struct EPUB3JSONWriter {
+  int fd; // -1 when writing to memory
+  char ** buffer;
+  size_t * capacity;
+  size_t length; // bytes in *buffer, or in chunk when writing to fd
+  uint64_t byteCount; // total written
+  EPUB3Error error;
+  int32_t depth;
+  EPUB3Bool hasMembers[JSON_WRITER_MAX_DEPTH]; // per open container, whether a comma is due
+  EPUB3Bool afterKey;
+  char chunk[JSON_WRITER_CHUNK_SIZE];
+} EPUB3JSONWriter;
+
+void EPUB3JSONWriterInitWithBuffer(EPUB3JSONWriter * writer, char ** buffer, size_t * capacity);
+void EPUB3JSONWriterInitWithFD(EPUB3JSONWriter * writer, int fd);
+void EPUB3JSONWriterBeginObject(EPUB3JSONWriter * writer);
+void EPUB3JSONWriterEndObject(EPUB3JSONWriter * writer);
+void EPUB3JSONWriterBeginArray(EPUB3JSONWriter * writer);
+void EPUB3JSONWriterEndArray(EPUB3JSONWriter * writer);
+void EPUB3JSONWriterKey(EPUB3JSONWriter * writer, const char * key);
+// Writes prefix and value as one string, NULL value writes null
+void EPUB3JSONWriterString(EPUB3JSONWriter * writer, const char * prefix, const char * value);
+void EPUB3JSONWriterInteger(EPUB3JSONWriter * writer, int64_t value);
+void EPUB3JSONWriterBool(EPUB3JSONWriter * writer, EPUB3Bool value);
+// Flushes, NUL-terminates buffer output (not counted in length) and returns the first error
+EPUB3Error EPUB3JSONWriterFinish(EPUB3JSONWriter * writer, size_t * length);
+
+#pragma mark - Work Pool
+
+// A fixed set of worker threads, each with its own deque of tasks. Workers run their own tasks newest
+// first and, when they run dry, steal the oldest task from another worker.
+typedef void (*EPUB3WorkFunction)(void * context);
+
+typedef struct EPUB3WorkItem {
+  EPUB3WorkFunction function;
+  void * context;
+} EPUB3WorkItem;
+
+typedef struct EPUB3WorkDeque {
+  pthread_mutex_t lock;
+  EPUB3WorkItem * items; // ring buffer
+  int32_t capacity;
+  int32_t head; // oldest item, where thieves take from
+  int32_t count;
+} EPUB3WorkDeque;
+
+typedef struct EPUB3WorkPool * EPUB3WorkPoolRef;
+
+struct EPUB3WorkPool {
+  EPUB3Type _type;
+  int32_t threadCount;
+  pthread_t * threads;
+  EPUB3WorkDeque * deques; // one per worker
+  pthread_mutex_t lock; // only for sleeping and waking
+  pthread_cond_t workAvailable;
+  pthread_cond_t allDone;
+  volatile int64_t queuedCount; // sitting in a deque
+  volatile int64_t pendingCount; // submitted and not yet finished
+  volatile uint32_t nextDeque; // round robin for submissions from outside the pool
+  EPUB3Bool shouldStop;
+};
+
+int32_t EPUB3GetProcessorCount(void);
+EPUB3WorkPoolRef EPUB3WorkPoolCreate(int32_t threadCount);
+void EPUB3WorkPoolRelease(EPUB3WorkPoolRef pool);
+void EPUB3WorkPoolSubmit(EPUB3WorkPoolRef pool, EPUB3WorkFunction function, void * context);
+void EPUB3WorkPoolWait(EPUB3WorkPoolRef pool);
+
+#pragma mark - Batch Ingestion
+
+#define BATCH_FILES_IN_FLIGHT_PER_THREAD 4
+
+#define SCAN_INDEX_MAGIC "EPUB3SCAN 2"
+#define SCAN_INDEX_INITIAL_BUCKET_COUNT 1024
+#define SCAN_INDEX_FIELD_COUNT 14
+
+// What the last scan learned about one file. contentDigest covers every central directory entry except
+// the OPF and NCX, whose CRCs are kept apart so that a change to only those re-parses the book and reuses
+// everything else. recordBody is the part of the JSON record that depends only on the file's contents;
+// the cover and extraction fields depend on the batch's options and are added to it on each run.
+typedef struct EPUB3ScanIndexEntry {
+  char * path;
+  EPUB3ArchiveIdentity identity;
+  uint64_t contentDigest;
+  uint32_t opfCRC;
+  uint32_t ncxCRC;
+  char * opfPath; // NULL when the file could not be parsed
+  char * ncxPath;
+  char * coverPath;
+  uint32_t coverByteCount;
+  EPUB3Bool coverIsKnown; // the scan looked the cover up, so a NULL coverPath means there is none
+  char * recordBody;
+  EPUB3Bool seen; // scanned again during this batch
+  struct EPUB3ScanIndexEntry * next;
+} * EPUB3ScanIndexEntryPtr;
+
+typedef enum {
+  kEPUB3BatchScanFull = 0,
+  kEPUB3BatchScanSkipped, // same identity, only a stat
+  kEPUB3BatchScanVerified, // new identity but the same central directory
+  kEPUB3BatchScanReparsed, // only the OPF or NCX changed
+} EPUB3BatchScanKind;
+
+// One input file on its way through the stages. Each stage runs as its own pool task and submits the
+// next one, so a file's stages stay on the worker that picked it up unless another worker steals them.
+typedef struct EPUB3BatchJob {
+  struct EPUB3Batch * batch;
+  char * path;
+  uint64_t index; // order in which the file was added
+  uint64_t fileSize;
+  EPUB3Ref epub;
+  EPUB3Error error;
+  const char * failedStage;
+  char * coverPath;
+  uint32_t coverByteCount;
+  char * extractedPath;
+  EPUB3BatchScanKind scanKind;
+  EPUB3Bool hasIdentity;
+  EPUB3ArchiveIdentity identity;
+  EPUB3ScanIndexEntryPtr previous; // a private copy of the index entry for this path, if any
+  uint64_t contentDigest;
+  uint32_t opfCRC;
+  uint32_t ncxCRC;
+  char * opfPath;
+  char * ncxPath;
+  char * record;
+  size_t recordLength;
+  size_t recordCapacity;
+} * EPUB3BatchJobRef;
+
+struct EPUB3Batch {
+  EPUB3Type _type;
+  EPUB3WorkPoolRef pool;
+  EPUB3BatchRecordCallback recordCallback;
+  void * callbackContext;
+  EPUB3Bool includeCover;
+  char * extractDirectory;
+  pthread_mutex_t lock; // guards filesInFlight and nextIndex
+  pthread_cond_t slotAvailable;
+  int32_t maxFilesInFlight;
+  int32_t filesInFlight;
+  uint64_t nextIndex;
+  pthread_mutex_t outputLock; // serializes the record callback and guards statistics and the scan index
+  EPUB3BatchStatistics statistics;
+  char * indexPath;
+  EPUB3ScanIndexEntryPtr * indexTable;
+  uint32_t indexBucketCount;
+  uint64_t indexEntryCount;
+};
+
+EPUB3Error EPUB3BatchLoadScanIndex(EPUB3BatchRef batch);
+EPUB3Error EPUB3BatchWriteScanIndex(EPUB3BatchRef batch);
+void EPUB3ScanIndexEntryFree(EPUB3ScanIndexEntryPtr entry);
+
+#pragma mark - Text Extraction
+
+#define TEXT_READER_NAME_LENGTH 16 // longer element names can't be block-level or skipped anyway
+#define TEXT_READER_CHUNK_SIZE 16384
+
+typedef enum {
+  kEPUB3TextReaderText = 0,
+  kEPUB3TextReaderReference, // after '&'
+  kEPUB3TextReaderMarkup, // after '<'
+  kEPUB3TextReaderStartTagName,
+  kEPUB3TextReaderEndTagName,
+  kEPUB3TextReaderTagAttributes,
+  kEPUB3TextReaderDeclarationStart, // after "<!", until it's clear whether a comment or CDATA follows
+  kEPUB3TextReaderDeclaration,
+  kEPUB3TextReaderComment,
+  kEPUB3TextReaderCDATA,
+  kEPUB3TextReaderProcessingInstruction,
+} EPUB3TextReaderState;
+
+// The text of one spine document, built by a reader on a pool thread and handed over once isDone is set
+typedef struct EPUB3TextDocument {
+  struct EPUB3TextExtraction * extraction;
+  int32_t spineIndex;
+  char * path;
+  char * text;
+  uint32_t length;
+  uint32_t capacity;
+  EPUB3TextMapping * mappings;
+  int32_t mappingCount;
+  int32_t mappingCapacity;
+  EPUB3Error error;
+  EPUB3Bool isDone;
+} * EPUB3TextDocumentRef;
+
+typedef struct EPUB3TextExtraction {
+  EPUB3Ref epub;
+  pthread_mutex_t lock;
+  pthread_cond_t documentDone;
+} EPUB3TextExtraction;
+
+// A push parser for XHTML that appends the text it finds to a document. Bytes can be fed in chunks of any
+// size; everything it needs to carry over between chunks is in here.
+typedef struct EPUB3TextReader {
+  EPUB3TextDocumentRef document;
+  EPUB3TextReaderState state;
+  uint32_t offset; // of the byte being read
+  uint32_t markupOffset; // where the current reference, tag or held back "]]" started
+  char name[TEXT_READER_NAME_LENGTH]; // element name, reference or declaration start
+  int32_t nameLength;
+  EPUB3Bool isEndTag;
+  char quote; // inside a quoted attribute value
+  char previous; // last byte of markup, for "/>" and "?>"
+  int32_t markCount; // "-" closing a comment, "]" closing a CDATA section, "[" in a declaration
+  int32_t skipDepth; // inside head, script, style or template
+  int32_t preDepth;
+  EPUB3Bool pendingSpace;
+  EPUB3Bool pendingBreak;
+} EPUB3TextReader;
+
+#define POSITIONS_MAGIC "EPUB3POS"
+#define POSITIONS_FORMAT_VERSION 1
+#define POSITIONS_CHARACTER_SPAN 1024
+#define POSITIONS_DEFAULT_WORDS_PER_MINUTE 250
+
+struct EPUB3Positions {
+  EPUB3Type _type;
+  EPUB3ArchiveDigest archiveDigest;
+  int32_t spineCount;
+  uint32_t positionCount;
+  uint64_t * characterOffsets; // spineCount + 1 of each
+  uint64_t * wordOffsets;
+  uint32_t * positionOffsets;
+  uint32_t * sourceOffsets; // positionCount
+};
+
+// A positions file is the header followed by the four arrays, in the order above and the writer's byte order
+typedef struct EPUB3PositionsHeader {
+  char magic[8];
+  uint32_t formatVersion;
+  uint32_t byteOrderMark;
+  EPUB3ArchiveDigest archiveDigest;
+  int32_t spineCount;
+  uint32_t positionCount;
+} EPUB3PositionsHeader;
+
+// What scanning one spine document found
+typedef struct EPUB3PositionsDocument {
+  EPUB3Ref epub;
+  char * path;
+  uint64_t characterCount;
+  uint64_t wordCount;
+  uint32_t * sourceOffsets;
+  uint32_t positionCount;
+  uint32_t positionCapacity;
+  EPUB3Bool afterSpace; // the last byte counted ended a word
+  EPUB3Error error;
+} * EPUB3PositionsDocumentRef;
+
+void EPUB3PositionsDocumentScan(EPUB3PositionsDocumentRef document, const unsigned char * bytes, size_t length);
+
+void EPUB3TextReaderInit(EPUB3TextReader * reader, EPUB3TextDocumentRef document);
+void EPUB3TextReaderConsume(EPUB3TextReader * reader, const char * bytes, uint32_t count);
+void EPUB3TextReaderFinish(EPUB3TextReader * reader);
+// Streams document->path through a reader into the document
+EPUB3Error EPUB3TextDocumentRead(EPUB3Ref epub, EPUB3TextDocumentRef document);
+void EPUB3TextDocumentFinalize(EPUB3TextDocumentRef document);
+// Writes up to 4 bytes; invalid code points become U+FFFD
+uint32_t EPUB3TextEncodeUTF8(uint32_t codePoint, char * bytes);
+
+#pragma mark - Search Index
+
+#define SEARCH_INDEX_MAGIC "EPUB3IDX"
+#define SEARCH_INDEX_FORMAT_VERSION 2 // 2: U+0178 folds to U+00FF
+#define SEARCH_INDEX_INITIAL_TERM_CAPACITY 4096
+#define SEARCH_TERM_MAX_LENGTH 64 // bytes of a folded term, longer words are cut short
+#define SEARCH_QUERY_MAX_TERMS 16
+#define SEARCH_SNIPPET_CONTEXT 40 // bytes of text either side of a match
+
+// Like a snapshot, an index image is used in place through a read-only mapping: references are byte offsets
+// from the start of the image, numbers are in the writer's byte order and the image ends in a NUL. Terms are
+// sorted with strcmp for binary search. A term's postings are varint triples in book order: the document,
+// as a delta from the previous posting's, then the token number and text offset, as deltas from the previous
+// posting's in the same document or absolute for the first one in a document.
+typedef struct EPUB3SearchIndexHeader {
+  char magic[8];
+  uint32_t formatVersion;
+  uint32_t byteOrderMark;
+  uint64_t imageSize;
+  EPUB3ArchiveDigest archiveDigest;
+  int32_t documentCount;
+  uint32_t documents;
+  uint32_t termCount;
+  uint32_t terms;
+} EPUB3SearchIndexHeader;
+
+typedef struct EPUB3SearchIndexDocument {
+  uint32_t text; // as EPUB3ExtractText produces it, kept for snippets
+  uint32_t textLength;
+  uint32_t mappings; // EPUB3TextMapping array
+  uint32_t mappingCount;
+} EPUB3SearchIndexDocument;
+
+typedef struct EPUB3SearchIndexTerm {
+  uint32_t term;
+  uint32_t postings;
+  uint32_t postingsSize; // bytes
+  uint32_t postingCount;
+} EPUB3SearchIndexTerm;
+
+struct EPUB3SearchIndex {
+  EPUB3Type _type;
+  const unsigned char * image;
+  size_t imageSize;
+};
+
+typedef struct EPUB3SearchPosting {
+  int32_t document;
+  uint32_t token;
+  uint32_t textOffset;
+} EPUB3SearchPosting;
+
+typedef struct EPUB3SearchToken {
+  uint32_t textOffset;
+  uint32_t textLength;
+  char term[SEARCH_TERM_MAX_LENGTH + 1]; // case-folded
+} EPUB3SearchToken;
+
+// One spine document's text and tokens, gathered on a pool thread
+typedef struct EPUB3SearchIndexBuildDocument {
+  struct EPUB3TextDocument text;
+  EPUB3Ref epub;
+  char * terms; // the folded terms, each NUL-terminated
+  uint32_t termsLength;
+  uint32_t termsCapacity;
+  uint32_t * tokens; // pairs of (offset in terms, text offset)
+  uint32_t tokenCount;
+  uint32_t tokenCapacity;
+} * EPUB3SearchIndexBuildDocumentRef;
+
+// A term and its postings so far, while all documents' tokens are merged
+typedef struct EPUB3SearchIndexBuildTerm {
+  char * term;
+  uint32_t hash;
+  unsigned char * postings;
+  uint32_t postingsSize;
+  uint32_t postingsCapacity;
+  uint32_t postingCount;
+  int32_t lastDocument;
+  uint32_t lastToken;
+  uint32_t lastTextOffset;
+} * EPUB3SearchIndexBuildTermRef;
+
+// Words are runs of letters and digits (anything outside the ASCII, Latin-1 and Unicode punctuation and
+// space blocks counts as a letter); CJK ideographs and kana are words of their own. Terms are folded to
+// lower case for ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic. Finds the next word at or after
+// *offset and moves *offset past it, NO once there are none left.
+EPUB3Bool EPUB3SearchNextToken(const char * text, uint32_t length, uint32_t * offset, EPUB3SearchToken * token);
+
+#pragma mark - Writer
+
+#define WRITER_CHUNK_SIZE (1U << 20) // of input per deflate task; larger entries are split
+#define WRITER_DICTIONARY_SIZE 32768 // the tail of the previous chunk, which each chunk is primed with
+#define WRITER_CHUNKS_IN_FLIGHT_PER_THREAD 4
+#define WRITER_ZIP_LIMIT 0xFFFFFFFFULL // zip.c writes 32 bit sizes and offsets
+
+typedef struct EPUB3WriterEntry {
+  char * path;
+  EPUB3Bool compresses;
+  EPUB3Bool isOpen; // in the zip file
+  uint32_t crc;
+  uint64_t uncompressedSize; // of the chunks written so far
+  uint64_t compressedSize;
+} * EPUB3WriterEntryPtr;
+
+typedef struct EPUB3WriterChunk {
+  struct EPUB3Writer * writer;
+  EPUB3WriterEntryPtr entry; // freed with the entry's last chunk
+  unsigned char * input; // dictionaryLength bytes of the previous chunk, then inputLength bytes of this one
+  uint32_t dictionaryLength;
+  uint32_t inputLength;
+  unsigned char * output; // points into input for stored entries
+  uint32_t outputLength;
+  uint32_t crc;
+  EPUB3Bool isLast;
+  EPUB3Bool isDone;
+  EPUB3Error error;
+  struct EPUB3WriterChunk * next; // in archive order
+} * EPUB3WriterChunkPtr;
+
+struct EPUB3Writer {
+  EPUB3Type _type;
+  char * path;
+  zipFile zip;
+  zip_fileinfo fileInfo; // the time the writer was created, for every entry
+  int32_t level;
+  EPUB3WorkPoolRef pool;
+  pthread_mutex_t lock; // guards the chunk queue, chunksInFlight, isWriting and error
+  pthread_cond_t chunkWritten;
+  EPUB3WriterChunkPtr firstChunk; // the oldest chunk not written yet
+  EPUB3WriterChunkPtr lastChunk;
+  int32_t chunksInFlight;
+  int32_t maxChunksInFlight;
+  EPUB3Bool isWriting; // some thread is appending finished chunks to the zip file
+  uint64_t archiveSize; // written so far
+  EPUB3Error error; // the first failure, which every later call returns
+};
+
+#pragma mark - Renditions
+
+#define RENDITION_PACKAGE_MEDIA_TYPE "application/oebps-package+xml"
+
+typedef struct EPUB3Rendition {
+  char * path; // full-path of the rootfile
+  char * mediaType;
+  char * rootFileDirectory;
+  char * media; // rendition:media and the other selection attributes, NULL when absent
+  char * layout;
+  char * language;
+  char * accessMode;
+  char * label;
+  // Built the first time the rendition is selected and parked here while another one is. A parked
+  // rendition holds a single reference to each; the selected one's are on struct EPUB3.
+  EPUB3MetadataRef metadata;
+  EPUB3ManifestRef manifest;
+  EPUB3SpineRef spine;
+  EPUB3TocRef toc;
+} EPUB3Rendition;
+
+EPUB3Error EPUB3ParseContainer(EPUB3Ref epub);
+void EPUB3RenditionsFree(EPUB3Ref epub);
+
+#pragma mark - Repack
+
+typedef struct EPUB3RepackEntry {
+  char * path;
+  const char * mediaType; // from the manifest, NULL for files it doesn't list
+  EPUB3Bool isManifestItem;
+  EPUB3Bool isSpineItem;
+  EPUB3Bool isPlaced; // handed to the writer (or being handed), so it is never written twice
+} EPUB3RepackEntry;
+
+// A rendition's package and its parsed objects, whose hrefs are relative to rootFileDirectory. The objects
+// are NULL for a rootfile that isn't a package document or whose package is missing.
+typedef struct EPUB3RepackRendition {
+  const char * path;
+  const char * rootFileDirectory;
+  EPUB3MetadataRef metadata;
+  EPUB3ManifestRef manifest;
+  EPUB3SpineRef spine;
+} EPUB3RepackRendition;
+
+typedef struct EPUB3RepackState {
+  EPUB3Ref epub;
+  EPUB3Ref renditionBook; // private copy the renditions epub hasn't loaded are loaded into, NULL if none
+  EPUB3RepackRendition * renditions; // the selected one first, then the others in container order
+  int32_t renditionCount;
+  EPUB3WriterRef writer;
+  EPUB3RepackEntry * entries; // in archive order
+  EPUB3RepackEntry ** sortedEntries; // by path, for lookups
+  int32_t entryCount;
+  EPUB3Error error;
+} EPUB3RepackState;
+
+#pragma mark - Image Probing
+
+#define IMAGE_PROBE_READ_SIZE 512U
+#define IMAGE_PROBE_BUFFER_SIZE 4096U
+
+// One image being probed. The stream only moves forward: buffer holds the bytes just before its position.
+typedef struct EPUB3ImageProbe {
+  EPUB3Ref epub;
+  EPUB3ImageInfo * info;
+  EPUB3ResourceStreamRef stream;
+  uint64_t bufferOffset; // of buffer[0] in the entry
+  uint32_t bufferLength;
+  EPUB3Bool isAtEnd;
+  unsigned char buffer[IMAGE_PROBE_BUFFER_SIZE];
+} EPUB3ImageProbe;
+
+#pragma mark - Archive Cache
+
+#ifndef ARCHIVE_CACHE_HASH_SIZE
+#define ARCHIVE_CACHE_HASH_SIZE 256
+#endif
+
+typedef struct EPUB3CacheEntry {
+  EPUB3ArchiveIdentity identity;
+  char * path; // the one the book was opened with
+  EPUB3Ref epub; // NULL until it has been loaded, and after a failed load
+  EPUB3Error error;
+  uint64_t byteCount;
+  int32_t referenceCount; // callers holding the book, plus the thread loading it and any waiting on the load
+  EPUB3Bool isLoading;
+  EPUB3Bool isLinked; // findable and counted against the limits; otherwise freed with its last reference
+  struct EPUB3CacheEntry * hashNext;
+  struct EPUB3CacheEntry * lruPrev;
+  struct EPUB3CacheEntry * lruNext;
+} * EPUB3CacheEntryPtr;
+
+// EPUB3Retain and EPUB3Release hand books with a cacheEntry over to these
+void EPUB3CacheRetainBook(EPUB3Ref epub);
+void EPUB3CacheReleaseBook(EPUB3Ref epub);
+
+#pragma mark - Asynchronous Reads
+
+#ifndef ASYNC_RING_ENTRY_COUNT
+#define ASYNC_RING_ENTRY_COUNT 256U
+#endif
+
+typedef struct EPUB3AsyncRead {
+  EPUB3AsyncReaderRef reader;
+  EPUB3Ref epub;
+  char * path;
+  EPUB3Bool isRange;
+  uint64_t offset; // in the uncompressed entry, for ranges
+  uint32_t length;
+  EPUB3AsyncReadCallback callback;
+  void * context;
+  EPUB3ArchiveEntryPtr entry;
+  int fd;
+  void * buffer; // bytes of the archive file, still deflated for whole deflated entries
+  uint32_t bufferSize;
+  uint32_t transferred;
+  uint64_t fileOffset; // of buffer[0] in the archive file
+  struct iovec ioVector; // what is left to read, for the ring
+  EPUB3ResourceRef resource;
+  EPUB3Error error;
+  struct EPUB3AsyncRead * next; // in the completion queue
+} * EPUB3AsyncReadPtr;
+
+// An io_uring driven through its system calls. Only the archive reads go through it; a reaper thread hands
+// what it reads back to the pool.
+typedef struct EPUB3AsyncRing {
+  int fd; // -1 when reads are made on the pool
+  pthread_mutex_t lock; // guards the submission queue and inFlight
+  pthread_cond_t roomAvailable;
+  uint32_t entryCount;
+  uint32_t inFlight; // never more than entryCount, so completions can't overflow
+  pthread_t reaper;
+  void * submissionMapping;
+  size_t submissionMappingSize;
+  void * completionMapping; // the same as submissionMapping when the kernel maps both rings at once
+  size_t completionMappingSize;
+  struct io_uring_sqe * submissionEntries;
+  size_t submissionEntriesSize;
+  volatile unsigned * submissionHead;
+  volatile unsigned * submissionTail;
+  unsigned submissionMask;
+  unsigned * submissionArray;
+  volatile unsigned * completionHead;
+  volatile unsigned * completionTail;
+  unsigned completionMask;
+  struct io_uring_cqe * completions;
+} EPUB3AsyncRing;
+
+struct EPUB3AsyncReader {
+  EPUB3Type _type;
+  EPUB3WorkPoolRef pool;
+  EPUB3AsyncRing ring;
+  pthread_mutex_t lock; // guards the completion queue and outstandingCount
+  pthread_cond_t allFinished;
+  EPUB3AsyncReadPtr firstCompletion;
+  EPUB3AsyncReadPtr lastCompletion;
+  int32_t outstandingCount; // submitted and not in the completion queue yet
+  int wakePipe[2]; // a byte is written when the completion queue stops being empty
+};
+
 #pragma mark - Base Object
 
 void EPUB3ObjectRelease(void *object);
@@ -176,6 +1138,8 @@ void * EPUB3ObjectInitWithTypeID(void *object, const char *typeID);
 
 EPUB3Ref EPUB3Create();
 EPUB3Error EPUB3PrepareArchiveAtPath(EPUB3Ref epub, const char * path);
+// Falls back to EPUB3RecoverArchive when the central directory can't be read
+EPUB3Error EPUB3PrepareArchiveAtPathRecovering(EPUB3Ref epub, const char * path);
 EPUB3Error EPUB3InitAndValidate(EPUB3Ref epub);
 void EPUB3SetStringValue(char ** location, const char *value);
 char * EPUB3CopyStringValue(char ** location);
@@ -206,6 +1170,8 @@ void EPUB3ManifestItemRelease(EPUB3ManifestItemRef item);
 void EPUB3ManifestInsertItem(EPUB3ManifestRef manifest, EPUB3ManifestItemRef item);
 EPUB3ManifestItemRef EPUB3ManifestCopyItemWithId(EPUB3ManifestRef manifest, const char * itemId);
 EPUB3ManifestItemListItemPtr EPUB3ManifestFindItemWithId(EPUB3ManifestRef manifest, const char * itemId);
+// Whether property is one of the space separated tokens of the item's properties attribute
+EPUB3Bool EPUB3ManifestItemHasProperty(EPUB3ManifestItemRef item, const char * property);
 
 #pragma mark - Spine
 
@@ -255,7 +1221,7 @@ EPUB3Error EPUB3ValidateFileExistsAndSeekInArchive(EPUB3Ref epub, const char * f
 
 EPUB3Error EPUB3CopyFileIntoBuffer(EPUB3Ref epub, void **buffer, uint32_t *bufferSize, uint32_t *bytesCopied, const char * filename);
 uint32_t EPUB3GetFileCountInArchive(EPUB3Ref epub);
-EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint32_t *uncompressedSize, const char *filename);
+EPUB3Error EPUB3GetUncompressedSizeOfFileInArchive(EPUB3Ref epub, uint64_t *uncompressedSize, const char *filename);
 EPUB3Error EPUB3WriteCurrentArchiveFileToPath(EPUB3Ref epub, const char * path);
 EPUB3Error EPUB3CreateNestedDirectoriesForFileAtPath(const char * path);
 char * EPUB3CopyOfPathByAppendingPathComponent(const char * path, const char * componentToAppend);
@@ -264,7 +1230,7 @@ char * EPUB3CopyOfPathByDeletingLastPathComponent(const char * path);
 
 #define EPUB3_FREE_AND_NULL(__epub3_ptr_to_null) do { \
   if(__epub3_ptr_to_null != NULL) { \
-    free(__epub3_ptr_to_null); \
+    EPUB3Free(__epub3_ptr_to_null); \
     __epub3_ptr_to_null = NULL; \
   } \
 } while(0);
@@ -1,6 +1,11 @@
 #include <config.h>
 #include <check.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <poll.h>
 #include "test_common.h"
 #include "EPUB3.h"
 #include "EPUB3_private.h"
@@ -504,6 +509,2294 @@ START_TEST(test_epub3_extract_archive)
 }
 END_TEST
 
+#pragma mark test_epub3_custom_allocator
+typedef struct {
+  int32_t allocations;
+  int32_t deallocations;
+} _TestAllocatorStats;
+
+static void * _TestAllocate(void * context, size_t size)
+{
+  ((_TestAllocatorStats *)context)->allocations++;
+  return malloc(size);
+}
+
+static void * _TestReallocate(void * context, void * ptr, size_t size)
+{
+  if(ptr == NULL) ((_TestAllocatorStats *)context)->allocations++;
+  return realloc(ptr, size);
+}
+
+static void _TestDeallocate(void * context, void * ptr)
+{
+  ((_TestAllocatorStats *)context)->deallocations++;
+  free(ptr);
+}
+
+START_TEST(test_epub3_custom_allocator)
+{
+  _TestAllocatorStats stats = {0, 0};
+  EPUB3Allocator allocator = {&stats, _TestAllocate, _TestReallocate, _TestDeallocate, NULL};
+  fail_unless(EPUB3SetAllocator(&allocator) == kEPUB3Success);
+
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref anEpub = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_if(anEpub == NULL);
+  fail_unless(stats.allocations > 0, "Library allocations should go through the installed allocator.");
+
+  int32_t allocationsBefore = stats.allocations;
+  int32_t deallocationsBefore = stats.deallocations;
+  char * title = EPUB3CopyTitle(anEpub);
+  fail_if(title == NULL);
+  ck_assert_int_eq(stats.allocations, allocationsBefore + 1);
+  EPUB3Free(title);
+  ck_assert_int_eq(stats.deallocations, deallocationsBefore + 1);
+
+  EPUB3Release(anEpub);
+  fail_unless(stats.deallocations > deallocationsBefore + 1);
+
+  allocator.deallocate = NULL;
+  fail_unless(EPUB3SetAllocator(&allocator) == kEPUB3InvalidArgumentError);
+  fail_unless(EPUB3SetAllocator(NULL) == kEPUB3Success);
+}
+END_TEST
+
+#pragma mark test_epub3_prefetcher
+START_TEST(test_epub3_prefetcher)
+{
+  EPUB3Error error = EPUB3InitAndValidate(epub);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_str_eq(epub->rootFileDirectory, "100/");
+
+  EPUB3PrefetcherRef prefetcher = EPUB3PrefetcherCreate(epub, 0, 1024 * 1024, &error);
+  fail_unless(prefetcher == NULL);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+
+  prefetcher = EPUB3PrefetcherCreate(epub, 2, 4 * 1024 * 1024, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_if(prefetcher == NULL);
+  ck_assert_int_eq(epub->_type.refCount, 2);
+
+  const char * nextChapter = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-1.txt.html";
+  const char * stylesheet = "100/pgepub.css";
+  EPUB3PrefetcherSetCurrentSpineIndex(prefetcher, 0);
+
+  EPUB3ResourceRef pooled = NULL;
+  for(int i = 0; i < 500 && pooled == NULL; i++) {
+    pooled = EPUB3PrefetcherCopyPooledResource(prefetcher, nextChapter);
+    if(pooled == NULL) usleep(10000);
+  }
+  fail_if(pooled == NULL, "The next chapter should have been prefetched.");
+
+  void * expected = NULL;
+  uint32_t expectedSize = 0;
+  error = EPUB3CopyFileIntoBuffer(epub, &expected, NULL, &expectedSize, nextChapter);
+  fail_unless(error == kEPUB3Success);
+
+  EPUB3ResourceRef resource = EPUB3CopyResource(epub, nextChapter, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(resource == pooled, "Reads should be served from the prefetch pool.");
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(resource), expectedSize);
+  fail_unless(memcmp(EPUB3ResourceGetBytes(resource), expected, expectedSize) == 0);
+  EPUB3ResourceRelease(resource);
+  EPUB3ResourceRelease(pooled);
+  EPUB3Free(expected);
+
+  EPUB3ResourceRef css = NULL;
+  for(int i = 0; i < 500 && css == NULL; i++) {
+    css = EPUB3PrefetcherCopyPooledResource(prefetcher, stylesheet);
+    if(css == NULL) usleep(10000);
+  }
+  fail_if(css == NULL, "Stylesheets linked from prefetched chapters should be prefetched too.");
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(css), 462);
+  EPUB3ResourceRelease(css);
+
+  // Moving onto the prefetched chapter keeps it and its stylesheet pooled for the read that follows
+  EPUB3PrefetcherSetCurrentSpineIndex(prefetcher, 1);
+  pooled = EPUB3PrefetcherCopyPooledResource(prefetcher, nextChapter);
+  fail_if(pooled == NULL, "The current chapter should stay in the pool.");
+  resource = EPUB3CopyResource(epub, nextChapter, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(resource == pooled, "Reads after advancing should be served from the prefetch pool.");
+  EPUB3ResourceRelease(resource);
+  EPUB3ResourceRelease(pooled);
+  css = EPUB3PrefetcherCopyPooledResource(prefetcher, stylesheet);
+  fail_if(css == NULL, "The current chapter's stylesheet should stay in the pool.");
+  EPUB3ResourceRelease(css);
+
+  // Past the end of the spine no chapter links the stylesheet any more, so it leaves the pool too
+  EPUB3PrefetcherSetCurrentSpineIndex(prefetcher, 1000);
+  fail_unless(EPUB3PrefetcherCopyPooledResource(prefetcher, stylesheet) == NULL);
+  ck_assert_int_eq(prefetcher->poolByteCount, 0);
+
+  EPUB3PrefetcherRelease(prefetcher);
+  fail_unless(epub->prefetcher == NULL);
+  ck_assert_int_eq(epub->_type.refCount, 1);
+}
+END_TEST
+
+#pragma mark test_epub3_server
+
+// Sends raw request bytes and collects everything until the server closes the connection
+static size_t _TestServerExchange(uint16_t port, const char * request, char * response, size_t responseSize)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address;
+  (void)memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  fail_unless(connect(s, (struct sockaddr *)&address, sizeof(address)) == 0);
+  fail_unless(send(s, request, strlen(request), 0) == (ssize_t)strlen(request));
+
+  size_t total = 0;
+  ssize_t count = 0;
+  while(total < responseSize - 1 && (count = recv(s, response + total, responseSize - 1 - total, 0)) > 0) {
+    total += (size_t)count;
+  }
+  response[total] = '\0';
+  (void)close(s);
+  return total;
+}
+
+static const char * _TestServerBody(const char * response)
+{
+  const char * body = strstr(response, "\r\n\r\n");
+  return body != NULL ? body + 4 : NULL;
+}
+
+START_TEST(test_epub3_server)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3Success;
+  EPUB3ServerRef server = EPUB3ServerCreate(0, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_if(server == NULL);
+  uint16_t port = EPUB3ServerGetPort(server);
+  fail_unless(port > 0);
+
+  fail_unless(EPUB3ServerAddBook(server, "pg100", path) == kEPUB3Success);
+  fail_unless(EPUB3ServerAddBook(server, "pg100", path) == kEPUB3InvalidArgumentError);
+  fail_unless(EPUB3ServerAddBook(server, "a/b", path) == kEPUB3InvalidArgumentError);
+
+  void * expected = NULL;
+  uint32_t bufferSize = 0;
+  uint32_t expectedSize = 0;
+  error = EPUB3CopyFileIntoBuffer(epub, &expected, &bufferSize, &expectedSize, "100/toc.ncx");
+  fail_unless(error == kEPUB3Success);
+  EPUB3ArchiveEntryPtr entry = NULL;
+  fail_unless(EPUB3GetArchiveEntry(epub, "100/toc.ncx", &entry) == kEPUB3Success);
+  char etag[40];
+  (void)snprintf(etag, sizeof(etag), "\"%08x-%x\"", entry->crc, expectedSize);
+
+  size_t responseSize = 256 * 1024;
+  char * response = malloc(responseSize);
+
+  // Stored entry
+  (void)_TestServerExchange(port, "GET /book/pg100/mimetype HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0, "Unexpected response: %s", response);
+  fail_unless(strstr(response, "Content-Length: 20\r\n") != NULL);
+  ck_assert_str_eq(_TestServerBody(response), "application/epub+zip");
+
+  // Deflated entry, whole
+  size_t length = _TestServerExchange(port, "GET /book/pg100/100%2Ftoc.ncx HTTP/1.1\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 200 OK\r\n", 17) == 0, "Unexpected response: %.200s", response);
+  fail_unless(strstr(response, etag) != NULL);
+  fail_unless(strstr(response, "Content-Type: application/x-dtbncx+xml\r\n") != NULL);
+  const char * body = _TestServerBody(response);
+  ck_assert_int_eq(length - (body - response), expectedSize);
+  fail_unless(memcmp(body, expected, expectedSize) == 0);
+
+  // Deflated entry, passed through as gzip
+  length = _TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nAccept-Encoding: deflate, gzip\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strstr(response, "Content-Encoding: gzip\r\n") != NULL, "Unexpected response: %.300s", response);
+  fail_unless(strstr(response, "Vary: Accept-Encoding\r\n") != NULL);
+  body = _TestServerBody(response);
+  ck_assert_int_eq(length - (body - response), entry->compressedSize + 18);
+  z_stream gunzip;
+  (void)memset(&gunzip, 0, sizeof(z_stream));
+  fail_unless(inflateInit2(&gunzip, 16 + MAX_WBITS) == Z_OK);
+  char * inflated = malloc(expectedSize);
+  gunzip.next_in = (Bytef *)body;
+  gunzip.avail_in = (uInt)(length - (body - response));
+  gunzip.next_out = (Bytef *)inflated;
+  gunzip.avail_out = expectedSize;
+  ck_assert_int_eq(inflate(&gunzip, Z_FINISH), Z_STREAM_END);
+  (void)inflateEnd(&gunzip);
+  fail_unless(memcmp(inflated, expected, expectedSize) == 0);
+  free(inflated);
+  (void)_TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nAccept-Encoding: gzip;q=0\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strstr(response, "Content-Encoding") == NULL);
+
+  // Ranges
+  (void)_TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nRange: bytes=150000-150099\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 206 Partial Content\r\n", 30) == 0, "Unexpected response: %.200s", response);
+  fail_unless(strstr(response, "Content-Range: bytes 150000-150099/199337\r\n") != NULL);
+  fail_unless(memcmp(_TestServerBody(response), (char *)expected + 150000, 100) == 0);
+  // That first range into the entry has its checkpoints built off the server thread
+  EPUB3ArchiveEntryPtr servedEntry = NULL;
+  fail_unless(EPUB3GetArchiveEntry(server->books->epub, "100/toc.ncx", &servedEntry) == kEPUB3Success);
+  for(int i = 0; i < 500 && !EPUB3ArchiveEntryHasCheckpoints(server->books->epub, servedEntry); i++) {
+    usleep(10000);
+  }
+  fail_unless(EPUB3ArchiveEntryHasCheckpoints(server->books->epub, servedEntry));
+  (void)_TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nRange: bytes=120000-120099\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(memcmp(_TestServerBody(response), (char *)expected + 120000, 100) == 0);
+  (void)_TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nRange: bytes=-10\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strstr(response, "Content-Range: bytes 199327-199336/199337\r\n") != NULL);
+  fail_unless(memcmp(_TestServerBody(response), (char *)expected + 199327, 10) == 0);
+  (void)_TestServerExchange(port, "GET /book/pg100/mimetype HTTP/1.1\r\nRange: bytes=12-\r\nConnection: close\r\n\r\n", response, responseSize);
+  ck_assert_str_eq(_TestServerBody(response), "epub+zip");
+  (void)_TestServerExchange(port, "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nRange: bytes=199337-\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 416 ", 13) == 0, "Unexpected response: %.200s", response);
+
+  // Conditional requests
+  char request[512];
+  (void)snprintf(request, sizeof(request), "GET /book/pg100/100/toc.ncx HTTP/1.1\r\nIf-None-Match: \"nope\", %s\r\nConnection: close\r\n\r\n", etag);
+  length = _TestServerExchange(port, request, response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 304 Not Modified\r\n", 27) == 0, "Unexpected response: %.200s", response);
+  ck_assert_int_eq(strlen(_TestServerBody(response)), 0);
+
+  // Errors
+  (void)_TestServerExchange(port, "GET /book/nope/mimetype HTTP/1.1\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 404 ", 13) == 0);
+  (void)_TestServerExchange(port, "GET /book/pg100/nope HTTP/1.1\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 404 ", 13) == 0);
+  (void)_TestServerExchange(port, "POST /book/pg100/mimetype HTTP/1.1\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 405 ", 13) == 0);
+
+  // Pipelined keep-alive requests on one connection; HTTP/1.0 closes after the second
+  (void)_TestServerExchange(port, "HEAD /book/pg100/mimetype HTTP/1.1\r\n\r\nGET /book/pg100/mimetype HTTP/1.0\r\n\r\n", response, responseSize);
+  const char * second = strstr(response + 1, "HTTP/1.1 200 OK");
+  fail_if(second == NULL, "Expected two responses: %s", response);
+  ck_assert_str_eq(_TestServerBody(second), "application/epub+zip");
+
+  fail_unless(EPUB3ServerRemoveBook(server, "pg100") == kEPUB3Success);
+  fail_unless(EPUB3ServerRemoveBook(server, "pg100") == kEPUB3InvalidArgumentError);
+  (void)_TestServerExchange(port, "GET /book/pg100/mimetype HTTP/1.1\r\nConnection: close\r\n\r\n", response, responseSize);
+  fail_unless(strncmp(response, "HTTP/1.1 404 ", 13) == 0);
+
+  EPUB3ServerRelease(server);
+  free(response);
+  EPUB3Free(expected);
+}
+END_TEST
+
+typedef struct _EPUB3TestBatchOutput {
+  char records[8192];
+  size_t length;
+  int32_t recordCount;
+} _EPUB3TestBatchOutput;
+
+static void _EPUB3TestBatchRecord(void * context, const char * record, size_t length)
+{
+  _EPUB3TestBatchOutput * output = (_EPUB3TestBatchOutput *)context;
+  fail_unless(length > 0 && record[length - 1] == '\n', "Each record should be one line.");
+  fail_unless(memchr(record, '\n', length - 1) == NULL, "Each record should be one line.");
+  fail_unless(output->length + length < sizeof(output->records));
+  memcpy(output->records + output->length, record, length);
+  output->length += length;
+  output->records[output->length] = '\0';
+  output->recordCount++;
+}
+
+START_TEST(test_epub3_batch)
+{
+  TEST_PATH_VAR_FOR_FILENAME(epubPath, "pg100.epub");
+  TEST_PATH_VAR_FOR_FILENAME(badPath, "bad_metadata.epub");
+  TEST_PATH_VAR_FOR_FILENAME(imagePath, "pg100_cover.jpg");
+
+  _EPUB3TestBatchOutput output;
+  output.length = 0;
+  output.recordCount = 0;
+
+  EPUB3BatchOptions options;
+  memset(&options, 0, sizeof(options));
+  options.threadCount = 3;
+  options.maxFilesInFlight = 1; // every add waits for the previous file
+  options.includeCover = kEPUB3_YES;
+  options.recordCallback = _EPUB3TestBatchRecord;
+  options.callbackContext = &output;
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3BatchRef batch = EPUB3BatchCreate(&options, &error);
+  fail_unless(batch != NULL && error == kEPUB3Success);
+
+  fail_unless(EPUB3BatchAddPath(batch, epubPath) == kEPUB3Success);
+  fail_unless(EPUB3BatchAddPath(batch, badPath) == kEPUB3Success);
+  fail_unless(EPUB3BatchAddPath(batch, imagePath) == kEPUB3Success);
+  fail_unless(EPUB3BatchAddPath(batch, "/this/file/does/not/exist.epub") == kEPUB3Success);
+  fail_unless(EPUB3BatchAddPath(batch, epubPath) == kEPUB3Success);
+  fail_unless(EPUB3BatchAddDirectory(batch, "/this/directory/does/not/exist") == kEPUB3InvalidArgumentError);
+
+  EPUB3BatchStatistics statistics;
+  EPUB3BatchFinish(batch, &statistics);
+  fail_unless(statistics.fileCount == 5);
+  fail_unless(statistics.succeededCount == 2);
+  fail_unless(statistics.failedCount == 3);
+  fail_unless(output.recordCount == 5);
+
+  // maxFilesInFlight of 1 keeps the records in the order the files were added
+  const char * record = output.records;
+  fail_unless(strncmp(record, "{\"index\":0,", 11) == 0);
+  fail_unless(strstr(record, "\"status\":\"ok\"") != NULL);
+  fail_unless(strstr(record, "\"title\":\"The Complete Works of William Shakespeare\"") != NULL);
+  fail_unless(strstr(record, "\"identifier\":\"http://www.gutenberg.org/ebooks/100\"") != NULL);
+  fail_unless(strstr(record, "\"spineItems\":109") != NULL);
+  fail_unless(strstr(record, "\"coverBytes\":19263") != NULL);
+
+  record = strchr(record, '\n') + 1;
+  fail_unless(strncmp(record, "{\"index\":1,", 11) == 0);
+  fail_unless(strstr(record, "\"status\":\"error\",\"stage\":\"sniff\",\"error\":1003}") != NULL);
+  record = strchr(record, '\n') + 1;
+  fail_unless(strstr(record, "\"stage\":\"sniff\",\"error\":1003}") != NULL);
+  record = strchr(record, '\n') + 1;
+  fail_unless(strstr(record, "\"stage\":\"sniff\",\"error\":1006}") != NULL);
+  record = strchr(record, '\n') + 1;
+  fail_unless(strncmp(record, "{\"index\":4,", 11) == 0);
+  fail_unless(strstr(record, "\"status\":\"ok\"") != NULL);
+}
+END_TEST
+
+static void _EPUB3TestCopyFile(const char * from, const char * to)
+{
+  FILE * source = fopen(from, "r");
+  FILE * destination = fopen(to, "w");
+  fail_unless(source != NULL && destination != NULL);
+  char buffer[16384];
+  size_t count;
+  while((count = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+    fail_unless(fwrite(buffer, 1, count, destination) == count);
+  }
+  fclose(source);
+  fclose(destination);
+}
+
+static EPUB3BatchStatistics _EPUB3TestRunIndexedBatchWithOptions(const char * directory, const char * indexPath, EPUB3Bool includeCover,
+                                                                  const char * extractDirectory, _EPUB3TestBatchOutput * output)
+{
+  output->length = 0;
+  output->recordCount = 0;
+  EPUB3BatchOptions options;
+  memset(&options, 0, sizeof(options));
+  options.threadCount = 2;
+  options.maxFilesInFlight = 1;
+  options.includeCover = includeCover;
+  options.extractDirectory = extractDirectory;
+  options.indexPath = indexPath;
+  options.recordCallback = _EPUB3TestBatchRecord;
+  options.callbackContext = output;
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3BatchRef batch = EPUB3BatchCreate(&options, &error);
+  fail_unless(batch != NULL && error == kEPUB3Success);
+  fail_unless(EPUB3BatchAddDirectory(batch, directory) == kEPUB3Success);
+  EPUB3BatchStatistics statistics;
+  EPUB3BatchFinish(batch, &statistics);
+  return statistics;
+}
+
+static EPUB3BatchStatistics _EPUB3TestRunIndexedBatch(const char * directory, const char * indexPath, _EPUB3TestBatchOutput * output)
+{
+  return _EPUB3TestRunIndexedBatchWithOptions(directory, indexPath, kEPUB3_YES, NULL, output);
+}
+
+START_TEST(test_epub3_batch_scan_index)
+{
+  TEST_PATH_VAR_FOR_FILENAME(epubPath, "pg100.epub");
+  char directory[] = "/tmp/epub3_batch_scan_XXXXXX";
+  fail_unless(mkdtemp(directory) != NULL);
+  char bookPath[sizeof(directory) + 16];
+  char indexPath[sizeof(directory) + 16];
+  (void)sprintf(bookPath, "%s/book.epub", directory);
+  (void)sprintf(indexPath, "%s/scan.index", directory);
+  _EPUB3TestCopyFile(epubPath, bookPath);
+
+  _EPUB3TestBatchOutput output;
+  EPUB3BatchStatistics statistics = _EPUB3TestRunIndexedBatch(directory, indexPath, &output);
+  fail_unless(statistics.fileCount == 1 && statistics.succeededCount == 1 && statistics.unchangedCount == 0);
+  fail_unless(strstr(output.records, "\"scan\":\"full\"}\n") != NULL);
+  fail_unless(access(indexPath, R_OK) == 0, "The scan index should have been written.");
+  char fullRecord[sizeof(output.records)];
+  (void)strcpy(fullRecord, output.records);
+
+  // Nothing changed: answered from the index, with the same record
+  statistics = _EPUB3TestRunIndexedBatch(directory, indexPath, &output);
+  fail_unless(statistics.fileCount == 1 && statistics.succeededCount == 1 && statistics.unchangedCount == 1);
+  fail_unless(strstr(output.records, "\"scan\":\"skipped\"}\n") != NULL);
+  size_t bodyLength = strlen(fullRecord) - strlen("\"scan\":\"full\"}\n");
+  fail_unless(strncmp(output.records, fullRecord, bodyLength) == 0);
+
+  // Same bytes in a new file: the central directory shows nothing changed
+  (void)unlink(bookPath);
+  _EPUB3TestCopyFile(epubPath, bookPath);
+  struct stat st;
+  fail_unless(stat(bookPath, &st) == 0);
+  struct timeval times[2] = {{st.st_mtime - 60, 0}, {st.st_mtime - 60, 0}};
+  fail_unless(utimes(bookPath, times) == 0);
+  statistics = _EPUB3TestRunIndexedBatch(directory, indexPath, &output);
+  fail_unless(statistics.fileCount == 1 && statistics.unchangedCount == 1);
+  fail_unless(strstr(output.records, "\"scan\":\"verified\"}\n") != NULL);
+  fail_unless(strstr(output.records, "\"title\":\"The Complete Works of William Shakespeare\"") != NULL);
+
+  // The fields that depend on the options aren't replayed from the index: without covers there are none,
+  // extraction still happens, and covers come back from the index once it has them
+  statistics = _EPUB3TestRunIndexedBatchWithOptions(directory, indexPath, kEPUB3_NO, NULL, &output);
+  fail_unless(statistics.unchangedCount == 1);
+  fail_unless(strstr(output.records, "\"scan\":\"skipped\"}\n") != NULL);
+  fail_unless(strstr(output.records, "\"cover") == NULL);
+  char extractDirectory[sizeof(tmpDirname) + 16];
+  char extractedPath[sizeof(tmpDirname) + 48];
+  (void)sprintf(extractDirectory, "%s/extracted", tmpDirname);
+  (void)sprintf(extractedPath, "%s/0/META-INF/container.xml", extractDirectory);
+  statistics = _EPUB3TestRunIndexedBatchWithOptions(directory, indexPath, kEPUB3_NO, extractDirectory, &output);
+  fail_unless(statistics.fileCount == 1 && statistics.unchangedCount == 1);
+  fail_unless(strstr(output.records, "\"scan\":\"verified\"}\n") != NULL);
+  fail_unless(strstr(output.records, "\"extractedTo\":\"") != NULL);
+  fail_unless(access(extractedPath, R_OK) == 0, "Books answered from the index should still be extracted.");
+  statistics = _EPUB3TestRunIndexedBatch(directory, indexPath, &output);
+  fail_unless(statistics.unchangedCount == 1);
+  fail_unless(strstr(output.records, "\"scan\":\"skipped\"}\n") != NULL);
+  fail_unless(strstr(output.records, "\"coverBytes\":19263") != NULL);
+  fail_unless(strstr(output.records, "\"extractedTo") == NULL);
+
+  // Gone from the library: dropped from the index
+  (void)unlink(bookPath);
+  statistics = _EPUB3TestRunIndexedBatch(directory, indexPath, &output);
+  fail_unless(statistics.fileCount == 0);
+  FILE * index = fopen(indexPath, "r");
+  char line[64];
+  fail_unless(fgets(line, sizeof(line), index) != NULL && strcmp(line, "EPUB3SCAN 2\n") == 0);
+  fail_unless(fgets(line, sizeof(line), index) == NULL);
+  fclose(index);
+
+  (void)unlink(indexPath);
+  (void)rmdir(directory);
+}
+END_TEST
+
+START_TEST(test_epub3_snapshot)
+{
+  EPUB3Error error = EPUB3InitAndValidate(epub);
+  fail_unless(error == kEPUB3Success);
+
+  char snapshotPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(snapshotPath, "%s/book.snapshot", tmpDirname);
+  int fd = open(snapshotPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(fd >= 0);
+  fail_unless(EPUB3WriteSnapshot(epub, fd) == kEPUB3Success);
+  close(fd);
+
+  EPUB3Ref reopened = EPUB3CreateFromSnapshot(snapshotPath, &error);
+  fail_unless(reopened != NULL && error == kEPUB3Success, "Reopening from the snapshot failed with %d.", error);
+  fail_unless(reopened->snapshot != NULL);
+
+  char * title = EPUB3CopyTitle(reopened);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  free(title);
+  char * identifier = EPUB3CopyIdentifier(reopened);
+  ck_assert_str_eq(identifier, "http://www.gutenberg.org/ebooks/100");
+  free(identifier);
+  char * coverPath = EPUB3CopyCoverImagePath(reopened);
+  char * expectedCoverPath = EPUB3CopyCoverImagePath(epub);
+  ck_assert_str_eq(coverPath, expectedCoverPath);
+  free(coverPath);
+  free(expectedCoverPath);
+  ck_assert_str_eq(reopened->rootFileDirectory, epub->rootFileDirectory);
+  ck_assert_int_eq(reopened->manifest->itemCount, epub->manifest->itemCount);
+  fail_unless(reopened->metadata->ncxItem != NULL);
+  ck_assert_str_eq(reopened->metadata->ncxItem->href, epub->metadata->ncxItem->href);
+
+  int32_t count = EPUB3CountOfSequentialResources(reopened);
+  ck_assert_int_eq(count, EPUB3CountOfSequentialResources(epub));
+  const char * resources[count];
+  const char * expectedResources[count];
+  fail_unless(EPUB3GetPathsOfSequentialResources(reopened, resources) == kEPUB3Success);
+  fail_unless(EPUB3GetPathsOfSequentialResources(epub, expectedResources) == kEPUB3Success);
+  for(int32_t i = 0; i < count; i++) {
+    ck_assert_str_eq(resources[i], expectedResources[i]);
+  }
+
+  int32_t tocCount = EPUB3CountOfTocRootItems(reopened);
+  ck_assert_int_eq(tocCount, EPUB3CountOfTocRootItems(epub));
+  EPUB3TocItemRef tocItems[tocCount];
+  EPUB3TocItemRef expectedTocItems[tocCount];
+  fail_unless(EPUB3GetTocRootItems(reopened, tocItems) == kEPUB3Success);
+  fail_unless(EPUB3GetTocRootItems(epub, expectedTocItems) == kEPUB3Success);
+  for(int32_t i = 0; i < tocCount; i++) {
+    ck_assert_str_eq(tocItems[i]->title, expectedTocItems[i]->title);
+    ck_assert_str_eq(tocItems[i]->href, expectedTocItems[i]->href);
+  }
+
+  // Entry lookups come from the mapped index
+  const EPUB3SnapshotEntry * entry = EPUB3SnapshotFindEntry(reopened, "100/toc.ncx");
+  fail_unless(entry != NULL);
+  ck_assert_int_eq(entry->crc, 0x70bfadbc);
+  ck_assert_int_eq(entry->uncompressedSize, 199337);
+  fail_unless(EPUB3SnapshotFindEntry(reopened, "100/nothing.html") == NULL);
+  char bytes[32];
+  uint32_t bytesRead = 0;
+  fail_unless(EPUB3ReadResourceRange(reopened, "mimetype", 12, 8, bytes, &bytesRead) == kEPUB3Success);
+  fail_unless(bytesRead == 8 && memcmp(bytes, "epub+zip", 8) == 0);
+  EPUB3ResourceRef resource = EPUB3CopyResource(reopened, "100/pgepub.css", &error);
+  fail_unless(resource != NULL && EPUB3ResourceGetByteCount(resource) == 462);
+  EPUB3ResourceRelease(resource);
+  EPUB3Release(reopened);
+
+  // A damaged image is refused
+  fd = open(snapshotPath, O_RDWR);
+  fail_unless(fd >= 0);
+  fail_unless(pwrite(fd, "X", 1, 0) == 1);
+  close(fd);
+  fail_unless(EPUB3CreateFromSnapshot(snapshotPath, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3SnapshotInvalidError);
+}
+END_TEST
+
+START_TEST(test_epub3_snapshot_stale)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  TEST_PATH_VAR_FOR_FILENAME(otherPath, "broken_medallion2.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  char snapshotPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/book.epub", tmpDirname);
+  (void)sprintf(snapshotPath, "%s/book.snapshot", tmpDirname);
+  _EPUB3TestCopyFile(path, archivePath);
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  int fd = open(snapshotPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(EPUB3WriteSnapshot(book, fd) == kEPUB3Success);
+  close(fd);
+  EPUB3Release(book);
+
+  _EPUB3TestCopyFile(otherPath, archivePath);
+  fail_unless(EPUB3CreateFromSnapshot(snapshotPath, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3SnapshotStaleError);
+}
+END_TEST
+
+START_TEST(test_epub3_web_publication_manifest)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(book != NULL);
+
+  char * buffer = NULL;
+  size_t capacity = 0;
+  size_t length = 0;
+  fail_unless(EPUB3WriteWebPublicationManifest(book, "manifest.json", &buffer, &capacity, &length) == kEPUB3Success);
+  fail_unless(buffer != NULL && length == strlen(buffer) && capacity > length);
+  fail_unless(buffer[0] == '{' && buffer[length - 1] == '}');
+  fail_unless(strstr(buffer, "\"title\":\"The Complete Works of William Shakespeare\"") != NULL);
+  fail_unless(strstr(buffer, "\"identifier\":\"http://www.gutenberg.org/ebooks/100\"") != NULL);
+  fail_unless(strstr(buffer, "{\"rel\":\"self\",\"href\":\"manifest.json\",\"type\":\"application/webpub+json\"}") != NULL);
+  fail_unless(strstr(buffer, "{\"href\":\"100/cover.jpg\",\"type\":\"image/jpeg\",\"rel\":\"cover\"}") != NULL);
+  fail_unless(strstr(buffer, "\"readingOrder\":[{\"href\":\"100/") != NULL);
+  fail_unless(strstr(buffer, "\"toc\":[{\"href\":\"100/") != NULL);
+
+  // Reusing the buffer gives the same bytes, and so does streaming to a file
+  size_t firstLength = length;
+  fail_unless(EPUB3WriteWebPublicationManifest(book, "manifest.json", &buffer, &capacity, &length) == kEPUB3Success);
+  ck_assert_int_eq(length, firstLength);
+
+  char manifestPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(manifestPath, "%s/manifest.json", tmpDirname);
+  int fd = open(manifestPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(EPUB3WriteWebPublicationManifestToFD(book, "manifest.json", fd) == kEPUB3Success);
+  close(fd);
+  FILE * file = fopen(manifestPath, "r");
+  fail_unless(file != NULL);
+  char * written = EPUB3Malloc(length + 1);
+  size_t writtenLength = fread(written, 1, length + 1, file);
+  ck_assert_int_eq(writtenLength, length);
+  fclose(file);
+  fail_unless(memcmp(written, buffer, length) == 0);
+  EPUB3Free(written);
+  EPUB3Release(book);
+
+  // TOC hrefs are resolved against the NCX, which can sit in a directory of its own, and only a whole "nav"
+  // property makes a navigation document
+  const char * container = "<?xml version=\"1.0\"?><container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">"
+    "<rootfiles><rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/></rootfiles></container>";
+  const char * package = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">toc</dc:identifier><dc:title>TOC</dc:title></metadata>"
+    "<manifest><item id=\"ncx\" href=\"toc/toc.ncx\" media-type=\"application/x-dtbncx+xml\"/>"
+    "<item id=\"one\" href=\"text/one.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"nav\" href=\"nav.xhtml\" media-type=\"application/xhtml+xml\" properties=\"scripted nav\"/>"
+    "<item id=\"menu\" href=\"menu.xhtml\" media-type=\"application/xhtml+xml\" properties=\"x-navigation\"/></manifest>"
+    "<spine toc=\"ncx\"><itemref idref=\"one\"/></spine></package>";
+  const char * ncx = "<?xml version=\"1.0\"?><ncx xmlns=\"http://www.daisy.org/z3986/2005/ncx/\" version=\"2005-1\"><navMap>"
+    "<navPoint id=\"a\"><navLabel><text>One</text></navLabel><content src=\"../text/one.xhtml#start\"/></navPoint>"
+    "<navPoint id=\"b\"><navLabel><text>Two</text></navLabel><content src=\"./../text/./two.xhtml\"/></navPoint>"
+    "<navPoint id=\"c\"><navLabel><text>Web</text></navLabel><content src=\"http://example.com/a/../b\"/></navPoint>"
+    "</navMap></ncx>";
+  const char * fixturePaths[] = { "META-INF/container.xml", "OEBPS/content.opf", "OEBPS/toc/toc.ncx", "OEBPS/text/one.xhtml" };
+  const char * fixtureBytes[] = { container, package, ncx, "<html/>" };
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/toc.epub", tmpDirname);
+  EPUB3WriterRef writer = EPUB3WriterCreate(archivePath, 1, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  for(size_t i = 0; i < sizeof(fixturePaths) / sizeof(fixturePaths[0]); i++) {
+    error = EPUB3WriterAddBuffer(writer, fixturePaths[i], fixtureBytes[i], strlen(fixtureBytes[i]), kEPUB3_YES);
+    ck_assert_int_eq(error, kEPUB3Success);
+  }
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+  book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  error = EPUB3WriteWebPublicationManifest(book, NULL, &buffer, &capacity, &length);
+  ck_assert_int_eq(error, kEPUB3Success);
+  fail_unless(strstr(buffer, "\"toc\":[{\"href\":\"OEBPS/text/one.xhtml#start\",\"title\":\"One\"},"
+                     "{\"href\":\"OEBPS/text/two.xhtml\",\"title\":\"Two\"},{\"href\":\"http://example.com/a/../b\",\"title\":\"Web\"}]") != NULL);
+  fail_unless(strstr(buffer, "{\"href\":\"OEBPS/nav.xhtml\",\"type\":\"application/xhtml+xml\",\"rel\":\"contents\"}") != NULL);
+  fail_unless(strstr(buffer, "{\"href\":\"OEBPS/menu.xhtml\",\"type\":\"application/xhtml+xml\"}") != NULL);
+  EPUB3Free(buffer);
+  EPUB3Release(book);
+}
+END_TEST
+
+START_TEST(test_epub3_text_reader)
+{
+  const char * source = "\xEF\xBB\xBF<?xml version=\"1.0\"?><!DOCTYPE html [ <!ENTITY x \"y\"> ]>"
+    "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><title>Skipped</title><style>p { }</style></head>"
+    "<body><h1 class=\"a>b\">Act  I</h1><!-- a -- comment --><p>Fair &amp; <i>square</i>&#x2014;\n done&unknown;"
+    "<br/>next<![CDATA[ a]]b ]]></p><script type=\"text/javascript\">if(a &lt; b) {}</script>"
+    "<pre>  two\n  lines</pre><html:div>x&#233;</html:div></body></html>";
+  const char * expected = "Act I\nFair & square\xE2\x80\x94 done&unknown;\nnext a]]b\n  two\n  lines\nx\xC3\xA9";
+
+  // Any split of the source into chunks gives the same text
+  uint32_t sourceLength = (uint32_t)strlen(source);
+  for(uint32_t chunkSize = 1; chunkSize <= sourceLength; chunkSize += 7) {
+    struct EPUB3TextDocument document = {0};
+    EPUB3TextReader reader;
+    EPUB3TextReaderInit(&reader, &document);
+    for(uint32_t offset = 0; offset < sourceLength; offset += chunkSize) {
+      uint32_t count = sourceLength - offset < chunkSize ? sourceLength - offset : chunkSize;
+      EPUB3TextReaderConsume(&reader, source + offset, count);
+    }
+    EPUB3TextReaderFinish(&reader);
+    ck_assert_int_eq(document.length, strlen(expected));
+    fail_unless(memcmp(document.text, expected, document.length) == 0);
+
+    // Text that wasn't decoded or inserted is found at its mapped offset
+    const char * act = strstr(source, "Act");
+    const char * square = strstr(source, "square");
+    for(int32_t i = 0; i < document.mappingCount; i++) {
+      EPUB3TextMapping mapping = document.mappings[i];
+      uint32_t end = i + 1 < document.mappingCount ? document.mappings[i + 1].textOffset : document.length;
+      fail_unless(mapping.sourceOffset < sourceLength && mapping.textOffset < end);
+      if(memcmp(document.text + mapping.textOffset, "Act", 3) == 0) {
+        ck_assert_int_eq(mapping.sourceOffset, act - source);
+      }
+      if(mapping.textOffset <= 13 && end > 13) {
+        ck_assert_int_eq(mapping.sourceOffset + 13 - mapping.textOffset, square - source);
+      }
+    }
+    fail_unless(memcmp(document.text + 13, "square", 6) == 0);
+    EPUB3TextDocumentFinalize(&document);
+  }
+}
+END_TEST
+
+typedef struct _EPUB3TestTextOutput {
+  EPUB3Ref epub;
+  int32_t documentCount;
+  uint64_t byteCount;
+  EPUB3Bool inOrder;
+  EPUB3Bool mappingsMatch;
+} _EPUB3TestTextOutput;
+
+static void _EPUB3TestTextDocument(void * context, int32_t spineIndex, const char * path, const char * text, uint32_t length, const EPUB3TextMapping * mappings, int32_t mappingCount)
+{
+  _EPUB3TestTextOutput * output = context;
+  if(spineIndex != output->documentCount) {
+    output->inOrder = kEPUB3_NO;
+  }
+  output->documentCount++;
+  output->byteCount += length;
+
+  // Everything but whitespace and decoded references (runs that start at a '&') is where the mapping says
+  EPUB3Error error = kEPUB3Success;
+  EPUB3ResourceRef resource = EPUB3CopyResource(output->epub, path, &error);
+  if(resource == NULL || mappingCount == 0) {
+    output->mappingsMatch = kEPUB3_NO;
+  }
+  for(int32_t i = 0; resource != NULL && i < mappingCount; i++) {
+    uint32_t end = i + 1 < mappingCount ? mappings[i + 1].textOffset : length;
+    const char * source = (const char *)EPUB3ResourceGetBytes(resource) + mappings[i].sourceOffset;
+    if(*source == '&') continue;
+    for(uint32_t j = mappings[i].textOffset; j < end; j++, source++) {
+      if(text[j] != ' ' && text[j] != '\n' && text[j] != *source) {
+        output->mappingsMatch = kEPUB3_NO;
+      }
+    }
+  }
+  EPUB3ResourceRelease(resource);
+}
+
+START_TEST(test_epub3_extract_text)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(book != NULL);
+
+  _EPUB3TestTextOutput output = { book, 0, 0, kEPUB3_YES, kEPUB3_YES };
+  fail_unless(EPUB3ExtractText(book, 4, _EPUB3TestTextDocument, &output) == kEPUB3Success);
+  ck_assert_int_eq(output.documentCount, EPUB3CountOfSequentialResources(book));
+  fail_unless(output.inOrder);
+  fail_unless(output.mappingsMatch);
+  fail_unless(output.byteCount > 5000000);
+
+  _EPUB3TestTextOutput serialOutput = { book, 0, 0, kEPUB3_YES, kEPUB3_YES };
+  fail_unless(EPUB3ExtractText(book, 1, _EPUB3TestTextDocument, &serialOutput) == kEPUB3Success);
+  ck_assert_int_eq(serialOutput.byteCount, output.byteCount);
+  EPUB3Release(book);
+}
+END_TEST
+
+typedef struct _EPUB3TestTextCounts {
+  uint64_t characters[256];
+  uint64_t words[256];
+} _EPUB3TestTextCounts;
+
+static void _EPUB3TestCountText(void * context, int32_t spineIndex, const char * path, const char * text, uint32_t length, const EPUB3TextMapping * mappings, int32_t mappingCount)
+{
+  _EPUB3TestTextCounts * counts = context;
+  EPUB3Bool afterSpace = kEPUB3_YES;
+  for(uint32_t i = 0; i < length && spineIndex < 256; i++) {
+    EPUB3Bool isSpace = text[i] == ' ' || text[i] == '\n' || text[i] == '\t';
+    if(!isSpace && (text[i] & 0xC0) != 0x80) counts->characters[spineIndex]++;
+    if(afterSpace && !isSpace) counts->words[spineIndex]++;
+    afterSpace = isSpace;
+  }
+}
+
+START_TEST(test_epub3_positions)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  TEST_PATH_VAR_FOR_FILENAME(otherPath, "broken_medallion2.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  char positionsPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/book.epub", tmpDirname);
+  (void)sprintf(positionsPath, "%s/book.positions", tmpDirname);
+  _EPUB3TestCopyFile(path, archivePath);
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  EPUB3PositionsRef positions = EPUB3CopyPositions(book, 4, &error);
+  fail_unless(positions != NULL && error == kEPUB3Success);
+  int32_t count = EPUB3PositionsGetSpineCount(positions);
+  ck_assert_int_eq(count, 108);
+  const uint64_t * characterOffsets = EPUB3PositionsGetCharacterOffsets(positions);
+  const uint64_t * wordOffsets = EPUB3PositionsGetWordOffsets(positions);
+  const uint32_t * positionOffsets = EPUB3PositionsGetPositionOffsets(positions);
+  const uint32_t * sourceOffsets = EPUB3PositionsGetSourceOffsets(positions);
+
+  // The scanner agrees with the text EPUB3ExtractText produces
+  _EPUB3TestTextCounts * counts = calloc(1, sizeof(_EPUB3TestTextCounts));
+  fail_unless(EPUB3ExtractText(book, 1, _EPUB3TestCountText, counts) == kEPUB3Success);
+  for(int32_t i = 0; i < count; i++) {
+    ck_assert_int_eq(characterOffsets[i + 1] - characterOffsets[i], counts->characters[i]);
+    ck_assert_int_eq(wordOffsets[i + 1] - wordOffsets[i], counts->words[i]);
+    uint64_t characters = characterOffsets[i + 1] - characterOffsets[i];
+    ck_assert_int_eq(positionOffsets[i + 1] - positionOffsets[i], characters > 0 ? (characters + 1023) / 1024 : 1);
+  }
+  free(counts);
+
+  // Positions after the first start on text
+  const char * spinePaths[count];
+  fail_unless(EPUB3GetPathsOfSequentialResources(book, spinePaths) == kEPUB3Success);
+  char * documentPath = EPUB3CopyOfPathByAppendingPathComponent(book->rootFileDirectory, spinePaths[0]);
+  EPUB3ResourceRef document = EPUB3CopyResource(book, documentPath, &error);
+  fail_unless(document != NULL);
+  ck_assert_int_eq(sourceOffsets[0], 0);
+  for(uint32_t i = 1; i < positionOffsets[1]; i++) {
+    char c = ((const char *)EPUB3ResourceGetBytes(document))[sourceOffsets[i]];
+    fail_unless(c != '<' && c != '>' && c != ' ' && c != '\n');
+    fail_unless(sourceOffsets[i] > sourceOffsets[i - 1]);
+  }
+  EPUB3ResourceRelease(document);
+  EPUB3_FREE_AND_NULL(documentPath);
+  ck_assert_int_eq(EPUB3PositionsGetReadingTime(positions, -1, 0), (wordOffsets[count] * 60 + 249) / 250);
+  ck_assert_int_eq(EPUB3PositionsGetReadingTime(positions, 0, 60), wordOffsets[1]);
+
+  // Saved and reloaded, then refused once the archive changes
+  int fd = open(positionsPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(EPUB3WritePositions(positions, fd) == kEPUB3Success);
+  close(fd);
+  EPUB3PositionsRef reloaded = EPUB3CreatePositionsFromFile(book, positionsPath, &error);
+  fail_unless(reloaded != NULL && error == kEPUB3Success);
+  ck_assert_int_eq(EPUB3PositionsGetSpineCount(reloaded), count);
+  fail_unless(memcmp(EPUB3PositionsGetCharacterOffsets(reloaded), characterOffsets, (count + 1) * sizeof(uint64_t)) == 0);
+  fail_unless(memcmp(EPUB3PositionsGetWordOffsets(reloaded), wordOffsets, (count + 1) * sizeof(uint64_t)) == 0);
+  fail_unless(memcmp(EPUB3PositionsGetSourceOffsets(reloaded), sourceOffsets, positionOffsets[count] * sizeof(uint32_t)) == 0);
+  EPUB3PositionsRelease(reloaded);
+  EPUB3PositionsRelease(positions);
+
+  _EPUB3TestCopyFile(otherPath, archivePath);
+  fail_unless(EPUB3CreatePositionsFromFile(book, positionsPath, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3SnapshotStaleError);
+  EPUB3Release(book);
+}
+END_TEST
+
+START_TEST(test_epub3_search_index)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  TEST_PATH_VAR_FOR_FILENAME(otherPath, "broken_medallion2.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  char indexPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/book.epub", tmpDirname);
+  (void)sprintf(indexPath, "%s/book.index", tmpDirname);
+  _EPUB3TestCopyFile(path, archivePath);
+
+  // Words are folded and split on punctuation
+  EPUB3SearchToken token;
+  uint32_t offset = 0;
+  const char * text = "\xC3\x89t\xC3\xA9, O'Brien\xE2\x80\x94\xE6\x97\xA5\xE6\x9C\xAC";
+  uint32_t length = (uint32_t)strlen(text);
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "\xC3\xA9t\xC3\xA9");
+  ck_assert_int_eq(token.textOffset, 0);
+  ck_assert_int_eq(token.textLength, 5);
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "o");
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "brien");
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "\xE6\x97\xA5");
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "\xE6\x9C\xAC");
+  fail_if(EPUB3SearchNextToken(text, length, &offset, &token));
+  offset = 0;
+  text = "\xC5\xB8 \xC5\xB9";
+  length = (uint32_t)strlen(text);
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "\xC3\xBF");
+  fail_unless(EPUB3SearchNextToken(text, length, &offset, &token));
+  ck_assert_str_eq(token.term, "\xC5\xBA");
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  int fd = open(indexPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  error = EPUB3WriteSearchIndex(book, 4, fd);
+  ck_assert_int_eq(error, kEPUB3Success);
+  close(fd);
+  EPUB3SearchIndexRef index = EPUB3CreateSearchIndexFromFile(book, indexPath, &error);
+  fail_unless(index != NULL && error == kEPUB3Success);
+
+  // A phrase is found across case and punctuation, in book order, with its place in the source
+  EPUB3SearchResult * results = NULL;
+  int32_t resultCount = 0;
+  fail_unless(EPUB3SearchIndexQuery(index, "TO BE, or not to be", 0, &results, &resultCount) == kEPUB3Success);
+  fail_unless(resultCount > 0);
+  const char * spinePaths[108];
+  fail_unless(EPUB3GetPathsOfSequentialResources(book, spinePaths) == kEPUB3Success);
+  for(int32_t i = 0; i < resultCount; i++) {
+    fail_unless(i == 0 || results[i].spineIndex > results[i - 1].spineIndex ||
+                (results[i].spineIndex == results[i - 1].spineIndex && results[i].textOffset > results[i - 1].textOffset));
+    const char * match = results[i].snippet + results[i].snippetMatchOffset;
+    fail_unless(strncasecmp(match, "to be", 5) == 0);
+    fail_unless(strncasecmp(match + results[i].textLength - 2, "be", 2) == 0);
+
+    char * documentPath = EPUB3CopyOfPathByAppendingPathComponent(book->rootFileDirectory, spinePaths[results[i].spineIndex]);
+    EPUB3ResourceRef document = EPUB3CopyResource(book, documentPath, &error);
+    fail_unless(document != NULL);
+    fail_unless(strncasecmp((const char *)EPUB3ResourceGetBytes(document) + results[i].sourceOffset, "to be", 5) == 0);
+    EPUB3ResourceRelease(document);
+    EPUB3_FREE_AND_NULL(documentPath);
+  }
+  EPUB3SearchResultsFree(results, resultCount);
+
+  fail_unless(EPUB3SearchIndexQuery(index, "Hamlet", 3, &results, &resultCount) == kEPUB3Success);
+  ck_assert_int_eq(resultCount, 3);
+  EPUB3SearchResultsFree(results, resultCount);
+  fail_unless(EPUB3SearchIndexQuery(index, "zzyzzyxq", 0, &results, &resultCount) == kEPUB3Success);
+  ck_assert_int_eq(resultCount, 0);
+  fail_unless(results == NULL);
+  ck_assert_int_eq(EPUB3SearchIndexQuery(index, " -- ", 0, &results, &resultCount), kEPUB3InvalidArgumentError);
+  EPUB3SearchIndexRelease(index);
+
+  // Postings whose document falls outside the index are dropped instead of followed: a first delta of 0
+  // (document -1), and deltas of 2^32 - 1 and 2^31
+  FILE * file = fopen(indexPath, "r+b");
+  fail_unless(file != NULL);
+  fseek(file, 0, SEEK_END);
+  long indexSize = ftell(file);
+  unsigned char * indexBytes = malloc(indexSize);
+  unsigned char * corrupted = malloc(indexSize);
+  fseek(file, 0, SEEK_SET);
+  fail_unless(fread(indexBytes, 1, indexSize, file) == (size_t)indexSize);
+  const EPUB3SearchIndexHeader * indexHeader = (const EPUB3SearchIndexHeader *)indexBytes;
+  const EPUB3SearchIndexTerm * terms = (const EPUB3SearchIndexTerm *)(indexBytes + indexHeader->terms);
+  const EPUB3SearchIndexTerm * hamlet = NULL;
+  for(uint32_t i = 0; i < indexHeader->termCount && hamlet == NULL; i++) {
+    if(strcmp((const char *)indexBytes + terms[i].term, "hamlet") == 0) hamlet = &terms[i];
+  }
+  fail_unless(hamlet != NULL && hamlet->postingsSize >= 5);
+  const unsigned char deltas[][5] = { { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0xFF, 0xFF, 0xFF, 0xFF, 0x0F }, { 0x80, 0x80, 0x80, 0x80, 0x08 } };
+  for(size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+    memcpy(corrupted, indexBytes, indexSize);
+    memcpy(corrupted + hamlet->postings, deltas[i], sizeof(deltas[i]));
+    fseek(file, 0, SEEK_SET);
+    fail_unless(fwrite(corrupted, 1, indexSize, file) == (size_t)indexSize);
+    fflush(file);
+    index = EPUB3CreateSearchIndexFromFile(book, indexPath, &error);
+    fail_unless(index != NULL && error == kEPUB3Success);
+    fail_unless(EPUB3SearchIndexQuery(index, "Hamlet", 0, &results, &resultCount) == kEPUB3Success);
+    ck_assert_int_eq(resultCount, 0);
+    EPUB3SearchIndexRelease(index);
+  }
+  fclose(file);
+  free(corrupted);
+  free(indexBytes);
+
+  // Refused once the archive changes
+  _EPUB3TestCopyFile(otherPath, archivePath);
+  fail_unless(EPUB3CreateSearchIndexFromFile(book, indexPath, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3SnapshotStaleError);
+  EPUB3Release(book);
+}
+END_TEST
+
+// Overwrites the CRC an archive records for path, in its central directory record and/or its local header
+static void _EPUB3TestPatchCRC(const char * archivePath, const char * path, EPUB3Bool central, EPUB3Bool local)
+{
+  FILE * file = fopen(archivePath, "r+");
+  fail_unless(file != NULL);
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  unsigned char * bytes = malloc(size);
+  fseek(file, 0, SEEK_SET);
+  size_t count = fread(bytes, 1, size, file);
+  fail_unless(count == (size_t)size);
+
+  size_t pathLength = strlen(path);
+  EPUB3Bool found = kEPUB3_NO;
+  for(long i = size - 46; i >= 0 && !found; i--) {
+    if(memcmp(bytes + i, "PK\1\2", 4) != 0 || (size_t)(bytes[i + 28] | bytes[i + 29] << 8) != pathLength ||
+       memcmp(bytes + i + 46, path, pathLength) != 0) {
+      continue;
+    }
+    long headerOffset = bytes[i + 42] | bytes[i + 43] << 8 | bytes[i + 44] << 16 | (long)bytes[i + 45] << 24;
+    if(central) {
+      bytes[i + 16] ^= 0xFF;
+    }
+    if(local) {
+      bytes[headerOffset + 14] ^= 0xFF;
+    }
+    found = kEPUB3_YES;
+  }
+  fail_unless(found);
+  fseek(file, 0, SEEK_SET);
+  fail_unless(fwrite(bytes, 1, size, file) == (size_t)size);
+  fclose(file);
+  free(bytes);
+}
+
+START_TEST(test_epub3_verify_archive)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/book.epub", tmpDirname);
+  _EPUB3TestCopyFile(path, archivePath);
+
+  // The accelerated CRC agrees with zlib's, at any length and alignment
+  unsigned char noise[1024];
+  for(size_t i = 0; i < sizeof(noise); i++) {
+    noise[i] = (unsigned char)(i * 7919 >> 3);
+  }
+  for(size_t length = 0; length < 300; length += 7) {
+    for(size_t offset = 0; offset < 16; offset += 3) {
+      ck_assert_int_eq(EPUB3CRC32(0x12345678, noise + offset, length), (uint32_t)crc32(0x12345678, noise + offset, (uInt)length));
+    }
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  EPUB3ArchiveEntryReport * reports = NULL;
+  int32_t reportCount = 0;
+  error = EPUB3VerifyArchive(book, 4, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(reportCount, book->archiveFileCount);
+  for(int32_t i = 0; i < reportCount; i++) {
+    ck_assert_int_eq(reports[i].status, kEPUB3ArchiveEntryValid);
+    ck_assert_int_eq(reports[i].computedCRC, reports[i].centralCRC);
+  }
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+  EPUB3Release(book);
+
+  // One entry whose recorded CRC doesn't match its data, another whose local header disagrees
+  const char * corruptPath = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-5.txt.html";
+  const char * mismatchPath = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-6.txt.html";
+  _EPUB3TestPatchCRC(archivePath, corruptPath, kEPUB3_YES, kEPUB3_YES);
+  _EPUB3TestPatchCRC(archivePath, mismatchPath, kEPUB3_NO, kEPUB3_YES);
+  book = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(book != NULL);
+  error = EPUB3VerifyArchive(book, 0, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3FileChecksumError);
+  int32_t invalidCount = 0;
+  for(int32_t i = 0; i < reportCount; i++) {
+    if(strcmp(reports[i].path, corruptPath) == 0) {
+      ck_assert_int_eq(reports[i].status, kEPUB3ArchiveEntryChecksumMismatch);
+    } else if(strcmp(reports[i].path, mismatchPath) == 0) {
+      ck_assert_int_eq(reports[i].status, kEPUB3ArchiveEntryHeaderMismatch);
+      ck_assert_int_eq(reports[i].localCRC, reports[i].centralCRC ^ 0xFF);
+    } else {
+      ck_assert_int_eq(reports[i].status, kEPUB3ArchiveEntryValid);
+    }
+    invalidCount += reports[i].status != kEPUB3ArchiveEntryValid;
+  }
+  ck_assert_int_eq(invalidCount, 2);
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+
+  // Served as is by default, refused when reads are verified
+  EPUB3SetVerifiesReads(book, kEPUB3_YES);
+  fail_unless(EPUB3CopyResource(book, corruptPath, &error) == NULL);
+  ck_assert_int_eq(error, kEPUB3FileChecksumError);
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(book, corruptPath, &error);
+  fail_unless(stream != NULL);
+  char buffer[4096];
+  uint32_t bytesRead = 0;
+  do {
+    error = EPUB3ResourceStreamRead(stream, buffer, sizeof(buffer), &bytesRead);
+  } while(error == kEPUB3Success && bytesRead > 0);
+  ck_assert_int_eq(error, kEPUB3FileChecksumError);
+  EPUB3ResourceStreamClose(stream);
+  EPUB3ResourceRef resource = EPUB3CopyResource(book, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-7.txt.html", &error);
+  fail_unless(resource != NULL && error == kEPUB3Success);
+  EPUB3ResourceRelease(resource);
+
+  EPUB3SetVerifiesReads(book, kEPUB3_NO);
+  resource = EPUB3CopyResource(book, corruptPath, &error);
+  fail_unless(resource != NULL && error == kEPUB3Success);
+  EPUB3ResourceRelease(resource);
+
+  // Bytes cached by a read that didn't verify them are checked before a verifying read is served them
+  EPUB3ResourceCacheStorage modes[] = { kEPUB3ResourceCacheStoreInflated, kEPUB3ResourceCacheStoreCompressed };
+  for(size_t m = 0; m < 2; m++) {
+    ck_assert_int_eq(EPUB3ResourceCacheConfigure(16 * 1024 * 1024, modes[m]), kEPUB3Success);
+    EPUB3SetVerifiesReads(book, kEPUB3_NO);
+    resource = EPUB3CopyResource(book, corruptPath, &error);
+    fail_unless(resource != NULL && error == kEPUB3Success);
+    EPUB3ResourceRelease(resource);
+    fail_unless(EPUB3ResourceCacheGetByteCount() > 0);
+    EPUB3SetVerifiesReads(book, kEPUB3_YES);
+    fail_unless(EPUB3CopyResource(book, corruptPath, &error) == NULL);
+    ck_assert_int_eq(error, kEPUB3FileChecksumError);
+    ck_assert_int_eq(EPUB3ResourceCacheGetByteCount(), 0);
+  }
+  ck_assert_int_eq(EPUB3ResourceCacheConfigure(0, kEPUB3ResourceCacheStoreInflated), kEPUB3Success);
+  EPUB3Release(book);
+}
+END_TEST
+
+START_TEST(test_epub3_inflate_backends)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref book = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(book != NULL);
+  ck_assert_int_eq(EPUB3GetInflateBackend(), kEPUB3InflateBackendZlib);
+  fail_unless(EPUB3InflateBackendIsAvailable(kEPUB3InflateBackendZlib));
+  if(!EPUB3InflateBackendIsAvailable(kEPUB3InflateBackendLibdeflate)) {
+    ck_assert_int_eq(EPUB3SetInflateBackend(kEPUB3InflateBackendLibdeflate), kEPUB3InvalidArgumentError);
+  }
+
+  // Whole-entry reads agree with streamed ones (which always inflate with zlib), whatever the backend
+  const char * spinePaths[108];
+  fail_unless(EPUB3GetPathsOfSequentialResources(book, spinePaths) == kEPUB3Success);
+  EPUB3InflateBackend backends[] = { kEPUB3InflateBackendZlib, kEPUB3InflateBackendLibdeflate };
+  for(size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+    if(!EPUB3InflateBackendIsAvailable(backends[b])) continue;
+    ck_assert_int_eq(EPUB3SetInflateBackend(backends[b]), kEPUB3Success);
+    for(int32_t i = 0; i < 108; i += 9) {
+      char * documentPath = EPUB3CopyOfPathByAppendingPathComponent(book->rootFileDirectory, spinePaths[i]);
+      EPUB3ResourceRef resource = EPUB3CopyResource(book, documentPath, &error);
+      fail_unless(resource != NULL && error == kEPUB3Success);
+      EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(book, documentPath, &error);
+      fail_unless(stream != NULL);
+      ck_assert_int_eq(EPUB3ResourceStreamGetLength(stream), EPUB3ResourceGetByteCount(resource));
+      char * streamed = malloc(EPUB3ResourceGetByteCount(resource));
+      uint32_t bytesRead = 0;
+      error = EPUB3ResourceStreamRead(stream, streamed, EPUB3ResourceGetByteCount(resource), &bytesRead);
+      ck_assert_int_eq(error, kEPUB3Success);
+      ck_assert_int_eq(bytesRead, EPUB3ResourceGetByteCount(resource));
+      fail_unless(memcmp(streamed, EPUB3ResourceGetBytes(resource), bytesRead) == 0);
+      free(streamed);
+      EPUB3ResourceStreamClose(stream);
+      EPUB3ResourceRelease(resource);
+      EPUB3_FREE_AND_NULL(documentPath);
+    }
+  }
+  ck_assert_int_eq(EPUB3SetInflateBackend(kEPUB3InflateBackendZlib), kEPUB3Success);
+  EPUB3Release(book);
+}
+END_TEST
+
+START_TEST(test_epub3_sniff)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  TEST_PATH_VAR_FOR_FILENAME(badPath, "bad_metadata.epub");
+  TEST_PATH_VAR_FOR_FILENAME(imagePath, "pg100_cover.jpg");
+
+  EPUB3SniffResult result;
+  ck_assert_int_eq(EPUB3Sniff(path, &result), kEPUB3SniffEPUB);
+  ck_assert_int_eq(result.classification, kEPUB3SniffEPUB);
+  ck_assert_int_eq(result.entryCount, 117);
+  fail_unless(result.centralDirectoryOffset > 0 && result.centralDirectorySize >= 117 * 46);
+  ck_assert_int_eq(EPUB3Sniff(badPath, NULL), kEPUB3SniffWrongMimetype);
+  ck_assert_int_eq(EPUB3Sniff(imagePath, NULL), kEPUB3SniffNotZip);
+  ck_assert_int_eq(EPUB3Sniff("/this/file/does/not/exist.epub", &result), kEPUB3SniffUnreadable);
+  ck_assert_int_eq(EPUB3Sniff(tmpDirname, NULL), kEPUB3SniffUnreadable);
+
+  FILE * file = fopen(path, "r");
+  fail_unless(file != NULL);
+  fseek(file, 0, SEEK_END);
+  size_t size = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+  unsigned char * bytes = malloc(size);
+  size_t count = fread(bytes, 1, size, file);
+  fail_unless(count == size);
+  fclose(file);
+
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, size, &result), kEPUB3SniffEPUB);
+  ck_assert_int_eq(result.entryCount, 117);
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, size / 2, NULL), kEPUB3SniffTruncated);
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, 12, NULL), kEPUB3SniffNotZip);
+
+  // The end of central directory record claims a directory that runs into it
+  unsigned char * record = bytes + size - 22;
+  fail_unless(memcmp(record, "PK\5\6", 4) == 0);
+  record[16] ^= 0x01;
+  record[17] ^= 0x10;
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, size, NULL), kEPUB3SniffBadCentralDirectory);
+  record[16] ^= 0x01;
+  record[17] ^= 0x10;
+  bytes[8] = 8;
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, size, NULL), kEPUB3SniffCompressedMimetype);
+  bytes[8] = 0;
+  bytes[30] = 'M';
+  ck_assert_int_eq(EPUB3SniffBuffer(bytes, size, NULL), kEPUB3SniffMissingMimetype);
+  free(bytes);
+
+  ck_assert_int_eq(EPUB3ValidateMimetype(epub), kEPUB3Success);
+}
+END_TEST
+
+static unsigned char * _EPUB3TestPutZipValue(unsigned char * cursor, uint64_t value, int byteCount)
+{
+  for(int i = 0; i < byteCount; i++) {
+    *cursor++ = (unsigned char)(value >> (8 * i));
+  }
+  return cursor;
+}
+
+// A stored mimetype, then a stored ZIP64 entry past a (sparse) 4 GB hole, with ZIP64 end records
+static void _EPUB3TestWriteZip64Archive(const char * archivePath, const unsigned char * data, uint32_t dataSize, uint64_t * entryOffset)
+{
+  static const char mimetype[] = "application/epub+zip";
+  static const char name[] = "OEBPS/audio.bin";
+  uint32_t mimetypeCRC = EPUB3CRC32(0, mimetype, sizeof(mimetype) - 1);
+  uint32_t dataCRC = EPUB3CRC32(0, data, dataSize);
+  unsigned char bytes[1024];
+  unsigned char * cursor = bytes;
+
+  int fd = open(archivePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(fd >= 0);
+  cursor = _EPUB3TestPutZipValue(cursor, 0x04034b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 20, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, mimetypeCRC, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(mimetype) - 1, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(mimetype) - 1, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 8, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2);
+  cursor = (unsigned char *)stpcpy((char *)cursor, "mimetype");
+  cursor = (unsigned char *)stpcpy((char *)cursor, mimetype);
+  fail_unless(pwrite(fd, bytes, cursor - bytes, 0) == cursor - bytes);
+
+  *entryOffset = 0x100000000ULL + 4096;
+  cursor = bytes;
+  cursor = _EPUB3TestPutZipValue(cursor, 0x04034b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 45, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, dataCRC, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(name) - 1, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 20, 2);
+  cursor = (unsigned char *)stpcpy((char *)cursor, name);
+  cursor = _EPUB3TestPutZipValue(cursor, 0x0001, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 16, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, dataSize, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, dataSize, 8);
+  fail_unless(pwrite(fd, bytes, cursor - bytes, (off_t)*entryOffset) == cursor - bytes);
+  uint64_t directoryOffset = *entryOffset + (cursor - bytes);
+  fail_unless(pwrite(fd, data, dataSize, (off_t)directoryOffset) == (ssize_t)dataSize);
+  directoryOffset += dataSize;
+
+  cursor = bytes;
+  cursor = _EPUB3TestPutZipValue(cursor, 0x02014b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 20, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 20, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, mimetypeCRC, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(mimetype) - 1, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(mimetype) - 1, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 8, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 2 + 2 + 4 + 4);
+  cursor = (unsigned char *)stpcpy((char *)cursor, "mimetype");
+  cursor = _EPUB3TestPutZipValue(cursor, 0x02014b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 45, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 45, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, dataCRC, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, sizeof(name) - 1, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 28, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2 + 2 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = (unsigned char *)stpcpy((char *)cursor, name);
+  cursor = _EPUB3TestPutZipValue(cursor, 0x0001, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 24, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, dataSize, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, dataSize, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, *entryOffset, 8);
+  uint64_t directorySize = cursor - bytes;
+  uint64_t record64Offset = directoryOffset + directorySize;
+
+  cursor = _EPUB3TestPutZipValue(cursor, 0x06064b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 44, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, 45, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 45, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 4 + 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 2, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, 2, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, directorySize, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, directoryOffset, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, 0x07064b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, record64Offset, 8);
+  cursor = _EPUB3TestPutZipValue(cursor, 1, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0x06054b50, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2 + 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFF, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFF, 2);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0xFFFFFFFF, 4);
+  cursor = _EPUB3TestPutZipValue(cursor, 0, 2);
+  fail_unless(pwrite(fd, bytes, cursor - bytes, (off_t)directoryOffset) == cursor - bytes);
+  close(fd);
+}
+
+START_TEST(test_epub3_zip64)
+{
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/large.epub", tmpDirname);
+  const char * name = "OEBPS/audio.bin";
+  uint32_t dataSize = 70000;
+  unsigned char * data = malloc(dataSize);
+  for(uint32_t i = 0; i < dataSize; i++) {
+    data[i] = (unsigned char)(i * 7 + (i >> 8));
+  }
+  uint64_t entryOffset = 0;
+  _EPUB3TestWriteZip64Archive(archivePath, data, dataSize, &entryOffset);
+
+  // MiniZip finds the entry count, sizes and offsets in the ZIP64 records
+  unzFile archive = unzOpen64(archivePath);
+  fail_unless(archive != NULL);
+  unz_global_info64 globalInfo;
+  int status = unzGetGlobalInfo64(archive, &globalInfo);
+  ck_assert_int_eq(status, UNZ_OK);
+  ck_assert_int_eq(globalInfo.number_entry, 2);
+  status = unzLocateFile(archive, name, 1);
+  ck_assert_int_eq(status, UNZ_OK);
+  unz_file_info64 fileInfo;
+  status = unzGetCurrentFileInfo64(archive, &fileInfo, NULL, 0, NULL, 0, NULL, 0);
+  ck_assert_int_eq(status, UNZ_OK);
+  ck_assert_int_eq(fileInfo.uncompressed_size, dataSize);
+  ck_assert_int_eq(fileInfo.compressed_size, dataSize);
+  fail_unless(unzGetCurrentFileLocalHeaderPos64(archive) == entryOffset);
+  status = unzOpenCurrentFile(archive);
+  ck_assert_int_eq(status, UNZ_OK);
+  unsigned char * copy = malloc(dataSize + 1);
+  int copied = unzReadCurrentFile(archive, copy, dataSize + 1);
+  ck_assert_int_eq(copied, dataSize);
+  fail_unless(memcmp(copy, data, dataSize) == 0);
+  fail_unless(unztell64(archive) == dataSize);
+  status = unzCloseCurrentFile(archive);
+  ck_assert_int_eq(status, UNZ_OK);
+  unzClose(archive);
+
+  EPUB3SniffResult sniff;
+  EPUB3SniffClassification classification = EPUB3Sniff(archivePath, &sniff);
+  ck_assert_int_eq(classification, kEPUB3SniffEPUB);
+  ck_assert_int_eq(sniff.entryCount, 2);
+  fail_unless(sniff.centralDirectoryOffset > entryOffset);
+  int fd = open(archivePath, O_RDONLY);
+  EPUB3ArchiveDigest digest;
+  EPUB3Error error = EPUB3GetArchiveDigest(fd, &digest);
+  ck_assert_int_eq(error, kEPUB3Success);
+  close(fd);
+  ck_assert_int_eq(digest.entryCount, 2);
+  fail_unless(digest.centralDirectoryOffset == sniff.centralDirectoryOffset);
+
+  EPUB3Ref book = EPUB3Create();
+  error = EPUB3PrepareArchiveAtPath(book, archivePath);
+  ck_assert_int_eq(error, kEPUB3Success);
+  uint64_t size = 0;
+  error = EPUB3GetUncompressedSizeOfFileInArchive(book, &size, name);
+  ck_assert_int_eq(error, kEPUB3Success);
+  fail_unless(size == dataSize);
+
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(book, name, &error);
+  fail_unless(stream != NULL);
+  fail_unless(EPUB3ResourceStreamGetLength(stream) == dataSize);
+  uint32_t total = 0;
+  uint32_t bytesRead = 0;
+  (void)memset(copy, 0, dataSize);
+  while(EPUB3ResourceStreamRead(stream, copy + total, 4096, &bytesRead) == kEPUB3Success && bytesRead > 0) {
+    total += bytesRead;
+  }
+  ck_assert_int_eq(total, dataSize);
+  fail_unless(memcmp(copy, data, dataSize) == 0);
+  EPUB3ResourceStreamClose(stream);
+
+  EPUB3ArchiveEntryReport * reports = NULL;
+  int32_t reportCount = 0;
+  error = EPUB3VerifyArchive(book, 2, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(reportCount, 2);
+  ck_assert_int_eq(reports[1].status, kEPUB3ArchiveEntryValid);
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+  EPUB3Release(book);
+  free(copy);
+  free(data);
+}
+END_TEST
+
+// Deflated entries that put their CRC and sizes in data descriptors (the first one signed, the second one
+// not), then an entry cut off by the end of the file and no central directory at all
+static void _EPUB3TestWriteArchiveWithoutDirectory(const char * archivePath, const char * text)
+{
+  static const char * names[] = { "OEBPS/signed.txt", "OEBPS/unsigned.txt", "OEBPS/truncated.txt" };
+  uint32_t textLength = (uint32_t)strlen(text);
+  unsigned char compressed[4096];
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  fail_unless(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  stream.next_in = (Bytef *)text;
+  stream.avail_in = textLength;
+  stream.next_out = compressed;
+  stream.avail_out = sizeof(compressed);
+  int status = deflate(&stream, Z_FINISH);
+  ck_assert_int_eq(status, Z_STREAM_END);
+  uint32_t compressedLength = (uint32_t)stream.total_out;
+  deflateEnd(&stream);
+
+  FILE * file = fopen(archivePath, "w");
+  fail_unless(file != NULL);
+  for(int i = 0; i < 3; i++) {
+    unsigned char header[64];
+    unsigned char * cursor = header;
+    cursor = _EPUB3TestPutZipValue(cursor, 0x04034b50, 4);
+    cursor = _EPUB3TestPutZipValue(cursor, 20, 2);
+    cursor = _EPUB3TestPutZipValue(cursor, i < 2 ? 8 : 0, 2);
+    cursor = _EPUB3TestPutZipValue(cursor, Z_DEFLATED, 2);
+    cursor = _EPUB3TestPutZipValue(cursor, 0, 4);
+    cursor = _EPUB3TestPutZipValue(cursor, i < 2 ? 0 : EPUB3CRC32(0, text, textLength), 4);
+    cursor = _EPUB3TestPutZipValue(cursor, i < 2 ? 0 : compressedLength + 100, 4);
+    cursor = _EPUB3TestPutZipValue(cursor, i < 2 ? 0 : textLength, 4);
+    cursor = _EPUB3TestPutZipValue(cursor, strlen(names[i]), 2);
+    cursor = _EPUB3TestPutZipValue(cursor, 0, 2);
+    cursor = (unsigned char *)stpcpy((char *)cursor, names[i]);
+    fail_unless(fwrite(header, 1, cursor - header, file) == (size_t)(cursor - header));
+    fail_unless(fwrite(compressed, 1, compressedLength, file) == compressedLength);
+    if(i < 2) {
+      cursor = header;
+      if(i == 0) {
+        cursor = _EPUB3TestPutZipValue(cursor, 0x08074b50, 4);
+      }
+      cursor = _EPUB3TestPutZipValue(cursor, EPUB3CRC32(0, text, textLength), 4);
+      cursor = _EPUB3TestPutZipValue(cursor, compressedLength, 4);
+      cursor = _EPUB3TestPutZipValue(cursor, textLength, 4);
+      fail_unless(fwrite(header, 1, cursor - header, file) == (size_t)(cursor - header));
+    }
+  }
+  fclose(file);
+}
+
+START_TEST(test_epub3_recover_damaged_archive)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  char derivedPath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/damaged.epub", tmpDirname);
+  (void)sprintf(derivedPath, "%s/damaged.data", tmpDirname);
+  EPUB3Error error = kEPUB3Success;
+
+  // Intact archives open the usual way
+  EPUB3Ref intact = EPUB3CreateWithArchiveAtPathRecovering(path, &error);
+  fail_unless(intact != NULL);
+  fail_if(EPUB3ArchiveWasRecovered(intact));
+  char * title = EPUB3CopyTitle(intact);
+  char * coverPath = EPUB3CopyCoverImagePath(intact);
+  void * cover = NULL;
+  uint32_t coverByteCount = 0;
+  error = EPUB3CopyCoverImage(intact, &cover, &coverByteCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  uint32_t fileCount = EPUB3GetFileCountInArchive(intact);
+
+  // Without its end records, and with a central directory that doesn't start where they say it does
+  EPUB3SniffResult sniff;
+  EPUB3SniffClassification classification = EPUB3Sniff(path, &sniff);
+  ck_assert_int_eq(classification, kEPUB3SniffEPUB);
+  struct stat st;
+  fail_unless(stat(path, &st) == 0);
+  for(int damage = 0; damage < 2; damage++) {
+    _EPUB3TestCopyFile(path, archivePath);
+    if(damage == 0) {
+      fail_unless(truncate(archivePath, st.st_size - 100) == 0);
+    } else {
+      int fd = open(archivePath, O_WRONLY);
+      fail_unless(pwrite(fd, "XXXX", 4, (off_t)sniff.centralDirectoryOffset) == 4);
+      close(fd);
+    }
+    EPUB3Ref epub = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+    fail_unless(epub == NULL);
+    epub = EPUB3CreateWithArchiveAtPathRecovering(archivePath, &error);
+    ck_assert_int_eq(error, kEPUB3Success);
+    fail_unless(EPUB3ArchiveWasRecovered(epub));
+    ck_assert_int_eq(EPUB3GetFileCountInArchive(epub), fileCount);
+    char * recoveredTitle = EPUB3CopyTitle(epub);
+    ck_assert_str_eq(recoveredTitle, title);
+    EPUB3Free(recoveredTitle);
+    void * recoveredCover = NULL;
+    uint32_t recoveredByteCount = 0;
+    error = EPUB3CopyCoverImage(epub, &recoveredCover, &recoveredByteCount);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(recoveredByteCount, coverByteCount);
+    fail_unless(memcmp(recoveredCover, cover, coverByteCount) == 0);
+    EPUB3Free(recoveredCover);
+    EPUB3ArchiveEntryReport * reports = NULL;
+    int32_t reportCount = 0;
+    error = EPUB3VerifyArchive(epub, 2, &reports, &reportCount);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(reportCount, fileCount);
+    EPUB3ArchiveEntryReportsFree(reports, reportCount);
+
+    // Only the head is left to say it's an EPUB, and the rebuilt directory identifies the archive
+    error = EPUB3ValidateMimetype(epub);
+    ck_assert_int_eq(error, kEPUB3Success);
+    EPUB3PositionsRef positions = EPUB3CopyPositions(epub, 4, &error);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(EPUB3PositionsGetSpineCount(positions), 108);
+    int fd = open(derivedPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    error = EPUB3WritePositions(positions, fd);
+    ck_assert_int_eq(error, kEPUB3Success);
+    close(fd);
+    EPUB3PositionsRelease(positions);
+    positions = EPUB3CreatePositionsFromFile(epub, derivedPath, &error);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(EPUB3PositionsGetSpineCount(positions), 108);
+    EPUB3PositionsRelease(positions);
+
+    fd = open(derivedPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    error = EPUB3WriteSearchIndex(epub, 4, fd);
+    ck_assert_int_eq(error, kEPUB3Success);
+    close(fd);
+    EPUB3SearchIndexRef index = EPUB3CreateSearchIndexFromFile(epub, derivedPath, &error);
+    ck_assert_int_eq(error, kEPUB3Success);
+    EPUB3SearchResult * results = NULL;
+    int32_t resultCount = 0;
+    error = EPUB3SearchIndexQuery(index, "Hamlet", 1, &results, &resultCount);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(resultCount, 1);
+    EPUB3SearchResultsFree(results, resultCount);
+    EPUB3SearchIndexRelease(index);
+
+    fd = open(derivedPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    error = EPUB3WriteSnapshot(epub, fd);
+    ck_assert_int_eq(error, kEPUB3Success);
+    close(fd);
+    EPUB3Ref reopened = EPUB3CreateFromSnapshot(derivedPath, &error);
+    ck_assert_int_eq(error, kEPUB3Success);
+    fail_unless(EPUB3ArchiveWasRecovered(reopened));
+    recoveredTitle = EPUB3CopyTitle(reopened);
+    ck_assert_str_eq(recoveredTitle, title);
+    EPUB3Free(recoveredTitle);
+    EPUB3Release(reopened);
+    EPUB3Release(epub);
+  }
+  EPUB3Free(cover);
+  EPUB3Free(coverPath);
+  EPUB3Free(title);
+  EPUB3Release(intact);
+
+  // Sizes found through data descriptors, signed or not; the cut off entry is left out
+  const char * text = "Now is the winter of our discontent made glorious summer by this sun of York; "
+                      "and all the clouds that lour'd upon our house in the deep bosom of the ocean buried.";
+  _EPUB3TestWriteArchiveWithoutDirectory(archivePath, text);
+  EPUB3Ref epub = EPUB3Create();
+  error = EPUB3PrepareArchiveAtPath(epub, archivePath);
+  fail_unless(error != kEPUB3Success);
+  error = EPUB3PrepareArchiveAtPathRecovering(epub, archivePath);
+  ck_assert_int_eq(error, kEPUB3Success);
+  fail_unless(EPUB3ArchiveWasRecovered(epub));
+  ck_assert_int_eq(EPUB3GetFileCountInArchive(epub), 2);
+  const char * names[] = { "OEBPS/signed.txt", "OEBPS/unsigned.txt" };
+  for(int i = 0; i < 2; i++) {
+    uint64_t size = 0;
+    error = EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, names[i]);
+    ck_assert_int_eq(error, kEPUB3Success);
+    fail_unless(size == strlen(text));
+    void * buffer = NULL;
+    uint32_t bufferSize = 0;
+    uint32_t bytesCopied = 0;
+    error = EPUB3CopyFileIntoBuffer(epub, &buffer, &bufferSize, &bytesCopied, names[i]);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(bytesCopied, strlen(text));
+    fail_unless(memcmp(buffer, text, bytesCopied) == 0);
+    EPUB3Free(buffer);
+  }
+  error = EPUB3ValidateFileExistsAndSeekInArchive(epub, "OEBPS/truncated.txt");
+  ck_assert_int_eq(error, kEPUB3FileNotFoundInArchiveError);
+  EPUB3ArchiveEntryReport * reports = NULL;
+  int32_t reportCount = 0;
+  error = EPUB3VerifyArchive(epub, 1, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(reportCount, 2);
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+  EPUB3Release(epub);
+}
+END_TEST
+
+typedef struct _EPUB3TestPatternSource {
+  uint64_t length;
+  uint64_t offset;
+} _EPUB3TestPatternSource;
+
+// Text-like bytes that compress, but not to nothing
+static unsigned char _EPUB3TestPatternByte(uint64_t offset)
+{
+  static const char words[] = "the quick brown fox jumps over a lazy dog while seven zebras quietly watch ";
+  uint64_t word = (offset / 61) * 2654435761ULL;
+  return (unsigned char)words[(offset + (word >> 7)) % (sizeof(words) - 1)];
+}
+
+static int64_t _EPUB3TestReadPattern(void * context, void * buffer, uint32_t length)
+{
+  _EPUB3TestPatternSource * source = context;
+  uint64_t left = source->length - source->offset;
+  // Short reads, like a pipe's
+  if(length > 100000) length = 100000;
+  if(length > left) length = (uint32_t)left;
+  for(uint32_t i = 0; i < length; i++) {
+    ((unsigned char *)buffer)[i] = _EPUB3TestPatternByte(source->offset + i);
+  }
+  source->offset += length;
+  return length;
+}
+
+START_TEST(test_epub3_writer)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/written.epub", tmpDirname);
+  EPUB3Error error = kEPUB3Success;
+
+  EPUB3Ref source = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(source != NULL);
+  EPUB3ArchiveEntryReport * entries = NULL;
+  int32_t entryCount = 0;
+  error = EPUB3VerifyArchive(source, 1, &entries, &entryCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+
+  // Every entry of the book, then one large enough to be split into several chunks
+  EPUB3WriterRef writer = EPUB3WriterCreate(archivePath, 4, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  error = EPUB3WriterAddBuffer(writer, "mimetype", "application/epub+zip", 20, kEPUB3_NO);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+  for(int32_t i = 0; i < entryCount; i++) {
+    if(strcmp(entries[i].path, "mimetype") == 0) continue;
+    EPUB3ResourceRef resource = EPUB3CopyResource(source, entries[i].path, &error);
+    fail_unless(resource != NULL);
+    EPUB3Bool compress = strstr(entries[i].path, ".jpg") == NULL ? kEPUB3_YES : kEPUB3_NO;
+    error = EPUB3WriterAddBuffer(writer, entries[i].path, EPUB3ResourceGetBytes(resource), EPUB3ResourceGetByteCount(resource), compress);
+    ck_assert_int_eq(error, kEPUB3Success);
+    EPUB3ResourceRelease(resource);
+  }
+  _EPUB3TestPatternSource pattern = { 5 * 1024 * 1024 + 12345, 0 };
+  error = EPUB3WriterAddStream(writer, "OEBPS/large.txt", _EPUB3TestReadPattern, &pattern, kEPUB3_YES);
+  ck_assert_int_eq(error, kEPUB3Success);
+  error = EPUB3WriterAddBuffer(writer, "OEBPS/empty.txt", NULL, 0, kEPUB3_YES);
+  ck_assert_int_eq(error, kEPUB3Success);
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+
+  EPUB3SniffClassification classification = EPUB3Sniff(archivePath, NULL);
+  ck_assert_int_eq(classification, kEPUB3SniffEPUB);
+  EPUB3Ref written = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(written != NULL);
+  ck_assert_int_eq(EPUB3GetFileCountInArchive(written), entryCount + 2);
+  char * title = EPUB3CopyTitle(source);
+  char * writtenTitle = EPUB3CopyTitle(written);
+  ck_assert_str_eq(writtenTitle, title);
+  EPUB3Free(title);
+  EPUB3Free(writtenTitle);
+
+  EPUB3ArchiveEntryReport * reports = NULL;
+  int32_t reportCount = 0;
+  error = EPUB3VerifyArchive(written, 0, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(reportCount, entryCount + 2);
+  // Written in the order they were added, the mimetype first
+  ck_assert_str_eq(reports[0].path, "mimetype");
+  ck_assert_int_eq(reports[0].compressedSize, 20);
+  ck_assert_str_eq(reports[reportCount - 2].path, "OEBPS/large.txt");
+  fail_unless(reports[reportCount - 2].compressedSize < pattern.length / 2);
+  for(int32_t i = 0; i < entryCount; i++) {
+    ck_assert_str_eq(reports[i].path, entries[i].path);
+    ck_assert_int_eq(reports[i].computedCRC, entries[i].computedCRC);
+  }
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+
+  EPUB3ResourceRef large = EPUB3CopyResource(written, "OEBPS/large.txt", &error);
+  fail_unless(large != NULL);
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(large), pattern.length);
+  const unsigned char * bytes = EPUB3ResourceGetBytes(large);
+  uint64_t mismatches = 0;
+  for(uint64_t i = 0; i < pattern.length; i++) {
+    mismatches += bytes[i] != _EPUB3TestPatternByte(i);
+  }
+  ck_assert_int_eq(mismatches, 0);
+  EPUB3ResourceRelease(large);
+
+  EPUB3ArchiveEntryReportsFree(entries, entryCount);
+  EPUB3Release(written);
+  EPUB3Release(source);
+}
+END_TEST
+
+START_TEST(test_epub3_repack)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char straysPath[sizeof(tmpDirname) + 16];
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(straysPath, "%s/strays.epub", tmpDirname);
+  (void)sprintf(archivePath, "%s/repacked.epub", tmpDirname);
+  EPUB3Error error = kEPUB3Success;
+
+  // The book in archive order, plus a file its package doesn't list
+  EPUB3Ref source = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(source != NULL);
+  EPUB3ArchiveEntryReport * entries = NULL;
+  int32_t entryCount = 0;
+  error = EPUB3VerifyArchive(source, 1, &entries, &entryCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  EPUB3WriterRef writer = EPUB3WriterCreate(straysPath, 1, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  int32_t fileCount = 0;
+  for(int32_t i = 0; i < entryCount; i++) {
+    size_t length = strlen(entries[i].path);
+    if(strcmp(entries[i].path, "mimetype") == 0 || entries[i].path[length - 1] == '/') continue;
+    EPUB3ResourceRef resource = EPUB3CopyResource(source, entries[i].path, &error);
+    fail_unless(resource != NULL);
+    error = EPUB3WriterAddBuffer(writer, entries[i].path, EPUB3ResourceGetBytes(resource), EPUB3ResourceGetByteCount(resource), kEPUB3_YES);
+    ck_assert_int_eq(error, kEPUB3Success);
+    EPUB3ResourceRelease(resource);
+    fileCount++;
+  }
+  error = EPUB3WriterAddBuffer(writer, "100/stray.txt", "stray", 5, kEPUB3_YES);
+  ck_assert_int_eq(error, kEPUB3Success);
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+  EPUB3ArchiveEntryReportsFree(entries, entryCount);
+  EPUB3Release(source);
+
+  EPUB3Ref strays = EPUB3CreateWithArchiveAtPath(straysPath, &error);
+  fail_unless(strays != NULL);
+  EPUB3RepackOptions options = { 2, 6, kEPUB3_NO };
+  options.level = 10;
+  error = EPUB3Repack(strays, archivePath, &options);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+  options.level = 6;
+  error = EPUB3Repack(strays, archivePath, &options);
+  ck_assert_int_eq(error, kEPUB3Success);
+
+  EPUB3Ref repacked = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(repacked != NULL);
+  char * title = EPUB3CopyTitle(strays);
+  char * repackedTitle = EPUB3CopyTitle(repacked);
+  ck_assert_str_eq(repackedTitle, title);
+  EPUB3Free(title);
+  EPUB3Free(repackedTitle);
+
+  EPUB3ArchiveEntryReport * reports = NULL;
+  int32_t reportCount = 0;
+  error = EPUB3VerifyArchive(repacked, 0, &reports, &reportCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  // Every listed file and the mimetype, without the stray
+  ck_assert_int_eq(reportCount, fileCount + 1);
+  ck_assert_str_eq(reports[0].path, "mimetype");
+  ck_assert_str_eq(reports[1].path, "META-INF/container.xml");
+  ck_assert_str_eq(reports[2].path, "100/content.opf");
+  ck_assert_str_eq(reports[3].path, "100/toc.ncx");
+  // The cover page (the first spine item) and its image, stored, then the first chapter and its stylesheet
+  ck_assert_str_eq(reports[4].path, "100/wrap0000.html");
+  ck_assert_str_eq(reports[5].path, "100/cover.jpg");
+  ck_assert_int_eq(reports[5].compressedSize, reports[5].uncompressedSize);
+  ck_assert_str_eq(reports[6].path, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-0.txt.html");
+  fail_unless(reports[6].compressedSize < reports[6].uncompressedSize);
+  ck_assert_str_eq(reports[7].path, "100/pgepub.css");
+  ck_assert_str_eq(reports[8].path, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-1.txt.html");
+  ck_assert_str_eq(reports[reportCount - 1].path, "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-107.txt.html");
+  EPUB3ArchiveEntryReportsFree(reports, reportCount);
+  EPUB3Release(repacked);
+
+  options.keepsUnreferencedEntries = kEPUB3_YES;
+  error = EPUB3Repack(strays, archivePath, &options);
+  ck_assert_int_eq(error, kEPUB3Success);
+  repacked = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(repacked != NULL);
+  ck_assert_int_eq(EPUB3GetFileCountInArchive(repacked), fileCount + 2);
+  EPUB3ResourceRef stray = EPUB3CopyResource(repacked, "100/stray.txt", &error);
+  fail_unless(stray != NULL);
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(stray), 5);
+  EPUB3ResourceRelease(stray);
+  EPUB3Release(repacked);
+  EPUB3Release(strays);
+
+  // Two renditions: the container lists both, so both packages and their content have to be kept
+  const char * container = "<?xml version=\"1.0\"?><container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\"><rootfiles>"
+    "<rootfile full-path=\"a/package.opf\" media-type=\"application/oebps-package+xml\"/>"
+    "<rootfile full-path=\"b/package.opf\" media-type=\"application/oebps-package+xml\"/></rootfiles></container>";
+  const char * first = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">a</dc:identifier><dc:title>A</dc:title></metadata>"
+    "<manifest><item id=\"nav\" href=\"nav.xhtml\" media-type=\"application/xhtml+xml\" properties=\"nav\"/>"
+    "<item id=\"one\" href=\"one.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"css\" href=\"style.css\" media-type=\"text/css\"/></manifest><spine><itemref idref=\"one\"/></spine></package>";
+  const char * second = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">b</dc:identifier><dc:title>B</dc:title></metadata>"
+    "<manifest><item id=\"two\" href=\"text/two.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"image\" href=\"image.png\" media-type=\"image/png\"/></manifest><spine><itemref idref=\"two\"/></spine></package>";
+  const char * one = "<html><head><link rel=\"stylesheet\" href=\"style.css\"/></head><body/></html>";
+  const char * two = "<html><body><img src=\"../image.png\"/></body></html>";
+  const char * fixturePaths[] = { "META-INF/container.xml", "b/package.opf", "b/text/two.xhtml", "b/image.png", "a/package.opf",
+    "a/nav.xhtml", "a/one.xhtml", "a/style.css", "a/stray.txt" };
+  const char * fixtureBytes[] = { container, second, two, "png", first, "<html/>", one, "p {}", "stray" };
+  writer = EPUB3WriterCreate(straysPath, 1, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  for(size_t i = 0; i < sizeof(fixturePaths) / sizeof(fixturePaths[0]); i++) {
+    error = EPUB3WriterAddBuffer(writer, fixturePaths[i], fixtureBytes[i], strlen(fixtureBytes[i]), kEPUB3_YES);
+    ck_assert_int_eq(error, kEPUB3Success);
+  }
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+
+  const char * firstSelected[] = { "mimetype", "META-INF/container.xml", "a/package.opf", "a/nav.xhtml", "b/package.opf",
+    "a/one.xhtml", "a/style.css", "b/text/two.xhtml", "b/image.png" };
+  const char * secondSelected[] = { "mimetype", "META-INF/container.xml", "b/package.opf", "a/package.opf", "a/nav.xhtml",
+    "b/text/two.xhtml", "b/image.png", "a/one.xhtml", "a/style.css" };
+  const int32_t pathCount = sizeof(firstSelected) / sizeof(firstSelected[0]);
+  EPUB3Ref renditions = EPUB3CreateWithArchiveAtPath(straysPath, &error);
+  fail_unless(renditions != NULL);
+  for(int32_t selected = 0; selected < 2; selected++) {
+    // The other rendition is loaded privately the first time, and was parked by the selection the second
+    error = EPUB3SelectRendition(renditions, selected);
+    ck_assert_int_eq(error, kEPUB3Success);
+    error = EPUB3Repack(renditions, archivePath, NULL);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(EPUB3GetSelectedRendition(renditions), selected);
+
+    repacked = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+    fail_unless(repacked != NULL);
+    error = EPUB3VerifyArchive(repacked, 0, &reports, &reportCount);
+    ck_assert_int_eq(error, kEPUB3Success);
+    ck_assert_int_eq(reportCount, pathCount);
+    for(int32_t i = 0; i < reportCount; i++) {
+      ck_assert_str_eq(reports[i].path, selected == 0 ? firstSelected[i] : secondSelected[i]);
+    }
+    EPUB3ArchiveEntryReportsFree(reports, reportCount);
+    error = EPUB3SelectRendition(repacked, 1);
+    ck_assert_int_eq(error, kEPUB3Success);
+    title = EPUB3CopyTitle(repacked);
+    ck_assert_str_eq(title, "B");
+    EPUB3Free(title);
+    EPUB3Release(repacked);
+  }
+  EPUB3Release(renditions);
+}
+END_TEST
+
+START_TEST(test_epub3_image_infos)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char archivePath[sizeof(tmpDirname) + 16];
+  (void)sprintf(archivePath, "%s/images.epub", tmpDirname);
+  EPUB3Error error = kEPUB3Success;
+
+  EPUB3Ref epub = EPUB3CreateWithArchiveAtPath(path, &error);
+  fail_unless(epub != NULL);
+  EPUB3ImageInfo * infos = NULL;
+  int32_t infoCount = 0;
+  error = EPUB3CopyImageInfos(epub, 2, &infos, &infoCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(infoCount, 1);
+  ck_assert_str_eq(infos[0].path, "100/cover.jpg");
+  ck_assert_int_eq(infos[0].format, kEPUB3ImageFormatJPEG);
+  ck_assert_int_eq(infos[0].width, 600);
+  ck_assert_int_eq(infos[0].height, 800);
+  EPUB3ImageInfosFree(infos, infoCount);
+  EPUB3Release(epub);
+
+  // One of each format, each with only enough of a file to hold its header
+  const char * container = "<?xml version=\"1.0\"?><container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">"
+    "<rootfiles><rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/></rootfiles></container>";
+  const char * package = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">images</dc:identifier><dc:title>Images</dc:title>"
+    "<dc:language>en</dc:language></metadata><manifest>"
+    "<item id=\"page\" href=\"page.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"f\" href=\"images/f.jpg\" media-type=\"image/jpeg\"/>"
+    "<item id=\"a\" href=\"images/a.png\" media-type=\"image/png\"/>"
+    "<item id=\"b\" href=\"images/b.gif\" media-type=\"image/gif\"/>"
+    "<item id=\"c\" href=\"images/c.webp\" media-type=\"image/webp\"/>"
+    "<item id=\"d\" href=\"images/d.svg\" media-type=\"image/svg+xml\"/>"
+    "<item id=\"e\" href=\"./images/e.svg\" media-type=\"image/svg+xml\"/>"
+    "<item id=\"missing\" href=\"images/missing.png\" media-type=\"image/png\"/>"
+    "<item id=\"z\" href=\"images/z.bmp\" media-type=\"image/bmp\"/>"
+    "</manifest><spine><itemref idref=\"page\"/></spine></package>";
+  const unsigned char png[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n', 0, 0, 0, 13, 'I', 'H', 'D', 'R', 0, 0, 0x01, 0x40, 0, 0, 0, 0xF0, 8, 6, 0, 0, 0 };
+  const unsigned char gif[] = { 'G', 'I', 'F', '8', '9', 'a', 0x2C, 0x01, 0x64, 0x00, 0xF7, 0, 0 };
+  const unsigned char webp[] = { 'R', 'I', 'F', 'F', 22, 0, 0, 0, 'W', 'E', 'B', 'P', 'V', 'P', '8', 'X', 10, 0, 0, 0, 0x10, 0, 0, 0, 0xE7, 0x03, 0x00, 0xF3, 0x01, 0x00 };
+  const char * svg = "\xEF\xBB\xBF<?xml version=\"1.0\"?>\n<!-- width=\"1\" -->\n<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"2in\" height=\"150px\" viewBox=\"0 0 10 10\"><rect/></svg>";
+  const char * prefixedSVG = "<svg:svg xmlns:svg=\"http://www.w3.org/2000/svg\" width=\"100%\"\n viewBox=\"0,0,400.4,300\"></svg:svg>";
+  // Two APP1 segments, together well past what a probe buffers, before the frame header
+  uint32_t jpegLength = 2 + 2 * (2 + 0xFFFF) + 19 + 2;
+  unsigned char * jpeg = calloc(jpegLength, 1);
+  unsigned char * cursor = jpeg;
+  *cursor++ = 0xFF;
+  *cursor++ = 0xD8;
+  for(int i = 0; i < 2; i++) {
+    *cursor++ = 0xFF;
+    *cursor++ = 0xE1;
+    *cursor++ = 0xFF;
+    *cursor++ = 0xFF;
+    cursor += 0xFFFF - 2;
+  }
+  const unsigned char frame[] = { 0xFF, 0xC0, 0, 17, 8, 0x01, 0xE0, 0x02, 0x80, 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1 };
+  (void)memcpy(cursor, frame, sizeof(frame));
+  cursor += sizeof(frame);
+  *cursor++ = 0xFF;
+  *cursor++ = 0xD9;
+
+  EPUB3WriterRef writer = EPUB3WriterCreate(archivePath, 1, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "META-INF/container.xml", container, strlen(container), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/content.opf", package, strlen(package), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/page.xhtml", "<html/>", 7, kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/a.png", png, sizeof(png), kEPUB3_NO), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/b.gif", gif, sizeof(gif), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/c.webp", webp, sizeof(webp), kEPUB3_NO), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/d.svg", svg, strlen(svg), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/e.svg", prefixedSVG, strlen(prefixedSVG), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/f.jpg", jpeg, jpegLength, kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "OEBPS/images/z.bmp", "BM\0\0\0\0", 6, kEPUB3_YES), kEPUB3Success);
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+  free(jpeg);
+
+  epub = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(epub != NULL);
+  error = EPUB3CopyImageInfos(epub, 0, &infos, &infoCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(infoCount, 8);
+  const char * paths[] = { "OEBPS/images/a.png", "OEBPS/images/b.gif", "OEBPS/images/c.webp", "OEBPS/images/d.svg",
+    "OEBPS/images/e.svg", "OEBPS/images/f.jpg", "OEBPS/images/missing.png", "OEBPS/images/z.bmp" };
+  const EPUB3ImageFormat formats[] = { kEPUB3ImageFormatPNG, kEPUB3ImageFormatGIF, kEPUB3ImageFormatWebP, kEPUB3ImageFormatSVG,
+    kEPUB3ImageFormatSVG, kEPUB3ImageFormatJPEG, kEPUB3ImageFormatUnknown, kEPUB3ImageFormatUnknown };
+  const uint32_t widths[] = { 320, 300, 1000, 192, 400, 640, 0, 0 };
+  const uint32_t heights[] = { 240, 100, 500, 150, 300, 480, 0, 0 };
+  for(int32_t i = 0; i < infoCount; i++) {
+    ck_assert_str_eq(infos[i].path, paths[i]);
+    ck_assert_int_eq(infos[i].format, formats[i]);
+    ck_assert_int_eq(infos[i].width, widths[i]);
+    ck_assert_int_eq(infos[i].height, heights[i]);
+  }
+  ck_assert_int_eq(infos[5].error, kEPUB3Success);
+  ck_assert_int_eq(infos[6].error, kEPUB3FileNotFoundInArchiveError);
+  EPUB3ImageInfosFree(infos, infoCount);
+  EPUB3Release(epub);
+}
+END_TEST
+
+START_TEST(test_epub3_renditions)
+{
+  char archivePath[sizeof(tmpDirname) + 24];
+  (void)sprintf(archivePath, "%s/renditions.epub", tmpDirname);
+  EPUB3Error error = kEPUB3Success;
+
+  // A fixed layout rendition, a reflowable one in another directory, a PDF and one whose package is missing
+  const char * container = "<?xml version=\"1.0\"?><container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\""
+    " xmlns:rendition=\"http://www.idpf.org/2013/rendition\"><rootfiles>"
+    "<rootfile full-path=\"fixed/package.opf\" media-type=\"application/oebps-package+xml\" rendition:layout=\"pre-paginated\" rendition:label=\"Pages\"/>"
+    "<rootfile full-path=\"reflow/text/package.opf\" media-type=\"application/oebps-package+xml\" rendition:media=\"(max-width: 600px)\""
+    " rendition:language=\"fr\" rendition:accessMode=\"textual\"/>"
+    "<rootfile full-path=\"book.pdf\" media-type=\"application/pdf\"/>"
+    "<rootfile full-path=\"missing/package.opf\" media-type=\"application/oebps-package+xml\"/>"
+    "</rootfiles></container>";
+  const char * fixed = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">fixed</dc:identifier><dc:title>Fixed</dc:title>"
+    "<dc:language>en</dc:language></metadata><manifest><item id=\"p1\" href=\"p1.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"p2\" href=\"p2.xhtml\" media-type=\"application/xhtml+xml\"/></manifest>"
+    "<spine><itemref idref=\"p1\"/><itemref idref=\"p2\"/></spine></package>";
+  const char * reflow = "<?xml version=\"1.0\"?><package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">"
+    "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:identifier id=\"id\">reflow</dc:identifier><dc:title>Reflowable</dc:title>"
+    "<dc:language>fr</dc:language></metadata><manifest>"
+    "<item id=\"text\" href=\"text.xhtml\" media-type=\"application/xhtml+xml\"/>"
+    "<item id=\"cover\" href=\"cover.jpg\" media-type=\"image/jpeg\" properties=\"cover-image\"/></manifest><spine><itemref idref=\"text\"/></spine></package>";
+  EPUB3WriterRef writer = EPUB3WriterCreate(archivePath, 1, Z_DEFAULT_COMPRESSION, &error);
+  fail_unless(writer != NULL);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "META-INF/container.xml", container, strlen(container), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "fixed/package.opf", fixed, strlen(fixed), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "reflow/text/package.opf", reflow, strlen(reflow), kEPUB3_YES), kEPUB3Success);
+  ck_assert_int_eq(EPUB3WriterAddBuffer(writer, "reflow/text/cover.jpg", "cover", 5, kEPUB3_NO), kEPUB3Success);
+  error = EPUB3WriterFinish(writer);
+  ck_assert_int_eq(error, kEPUB3Success);
+
+  EPUB3Ref epub = EPUB3CreateWithArchiveAtPath(archivePath, &error);
+  fail_unless(epub != NULL);
+  ck_assert_int_eq(EPUB3CountOfRenditions(epub), 4);
+  ck_assert_int_eq(EPUB3GetSelectedRendition(epub), 0);
+  EPUB3RenditionInfo info;
+  error = EPUB3GetRenditionInfo(epub, 0, &info);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_str_eq(info.path, "fixed/package.opf");
+  ck_assert_str_eq(info.layout, "pre-paginated");
+  ck_assert_str_eq(info.label, "Pages");
+  fail_unless(info.media == NULL);
+  error = EPUB3GetRenditionInfo(epub, 1, &info);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_str_eq(info.path, "reflow/text/package.opf");
+  ck_assert_str_eq(info.mediaType, "application/oebps-package+xml");
+  ck_assert_str_eq(info.media, "(max-width: 600px)");
+  ck_assert_str_eq(info.language, "fr");
+  ck_assert_str_eq(info.accessMode, "textual");
+  fail_unless(info.layout == NULL);
+  ck_assert_int_eq(EPUB3GetRenditionInfo(epub, 4, &info), kEPUB3InvalidArgumentError);
+
+  char * title = EPUB3CopyTitle(epub);
+  ck_assert_str_eq(title, "Fixed");
+  EPUB3Free(title);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(epub), 2);
+  void * cover = NULL;
+  uint32_t coverByteCount = 0;
+  error = EPUB3CopyCoverImage(epub, &cover, &coverByteCount);
+  ck_assert_int_eq(error, kEPUB3FileNotFoundInArchiveError);
+
+  // With a second reference, which the selected rendition's objects have to follow
+  EPUB3Retain(epub);
+  error = EPUB3SelectRendition(epub, 2);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+  error = EPUB3SelectRendition(epub, 3);
+  ck_assert_int_eq(error, kEPUB3FileNotFoundInArchiveError);
+  ck_assert_int_eq(EPUB3GetSelectedRendition(epub), 0);
+  title = EPUB3CopyTitle(epub);
+  ck_assert_str_eq(title, "Fixed");
+  EPUB3Free(title);
+
+  error = EPUB3SelectRendition(epub, 1);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(EPUB3GetSelectedRendition(epub), 1);
+  title = EPUB3CopyTitle(epub);
+  ck_assert_str_eq(title, "Reflowable");
+  EPUB3Free(title);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(epub), 1);
+  char * rootPath = NULL;
+  error = EPUB3CopyRootFilePathFromContainer(epub, &rootPath);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_str_eq(rootPath, "reflow/text/package.opf");
+  EPUB3Free(rootPath);
+  // Found relative to the selected package, without reading the container again
+  error = EPUB3CopyCoverImage(epub, &cover, &coverByteCount);
+  ck_assert_int_eq(error, kEPUB3Success);
+  ck_assert_int_eq(coverByteCount, 5);
+  fail_unless(memcmp(cover, "cover", 5) == 0);
+  EPUB3Free(cover);
+
+  // A snapshot remembers the selection, so the catalogue it holds isn't taken for the default rendition's
+  char snapshotPath[sizeof(tmpDirname) + 24];
+  (void)sprintf(snapshotPath, "%s/renditions.snapshot", tmpDirname);
+  int fd = open(snapshotPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  fail_unless(fd >= 0);
+  error = EPUB3WriteSnapshot(epub, fd);
+  ck_assert_int_eq(error, kEPUB3Success);
+  close(fd);
+  EPUB3Ref reopened = EPUB3CreateFromSnapshot(snapshotPath, &error);
+  fail_unless(reopened != NULL, "Reopening from the snapshot failed with %d.", error);
+  ck_assert_int_eq(EPUB3GetSelectedRendition(reopened), 1);
+  title = EPUB3CopyTitle(reopened);
+  ck_assert_str_eq(title, "Reflowable");
+  EPUB3Free(title);
+  error = EPUB3SelectRendition(reopened, 0);
+  ck_assert_int_eq(error, kEPUB3Success);
+  title = EPUB3CopyTitle(reopened);
+  ck_assert_str_eq(title, "Fixed");
+  EPUB3Free(title);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(reopened), 2);
+  error = EPUB3SelectRendition(reopened, 1);
+  ck_assert_int_eq(error, kEPUB3Success);
+  title = EPUB3CopyTitle(reopened);
+  ck_assert_str_eq(title, "Reflowable");
+  EPUB3Free(title);
+  EPUB3Release(reopened);
+
+  EPUB3Release(epub);
+  error = EPUB3SelectRendition(epub, 0);
+  ck_assert_int_eq(error, kEPUB3Success);
+  title = EPUB3CopyTitle(epub);
+  ck_assert_str_eq(title, "Fixed");
+  EPUB3Free(title);
+  ck_assert_int_eq(EPUB3CountOfSequentialResources(epub), 2);
+  EPUB3Release(epub);
+}
+END_TEST
+
+#pragma mark test_epub3_archive_cache
+typedef struct _TestCacheJob {
+  const char * path;
+  EPUB3Ref book;
+  EPUB3Error error;
+  uint32_t byteCount;
+} _TestCacheJob;
+
+static void * _TestCacheCopyBook(void * context)
+{
+  _TestCacheJob * job = context;
+  job->book = EPUB3CacheCopyArchiveAtPath(job->path, &job->error);
+  if(job->book != NULL) {
+    EPUB3ResourceRef resource = EPUB3CopyResource(job->book, "100/toc.ncx", &job->error);
+    if(resource != NULL) {
+      job->byteCount = EPUB3ResourceGetByteCount(resource);
+      EPUB3ResourceRelease(resource);
+    }
+  }
+  return NULL;
+}
+
+START_TEST(test_epub3_archive_cache)
+{
+  TEST_PATH_VAR_FOR_FILENAME(path, "pg100.epub");
+  char paths[3][sizeof(tmpDirname) + 16];
+  for(int i = 0; i < 3; i++) {
+    (void)sprintf(paths[i], "%s/book%d.epub", tmpDirname, i);
+    _EPUB3TestCopyFile(path, paths[i]);
+  }
+  EPUB3Error error = kEPUB3Success;
+
+  // Disabled: every call opens a book of its own
+  EPUB3Ref first = EPUB3CacheCopyArchiveAtPath(paths[0], &error);
+  EPUB3Ref second = EPUB3CacheCopyArchiveAtPath(paths[0], &error);
+  fail_unless(first != NULL && second != NULL && first != second);
+  ck_assert_int_eq(EPUB3CacheGetCount(), 0);
+  EPUB3Release(first);
+  EPUB3Release(second);
+
+  fail_unless(EPUB3CacheConfigure(-1, 0) == kEPUB3InvalidArgumentError);
+  fail_unless(EPUB3CacheConfigure(2, 0) == kEPUB3Success);
+
+  // Threads asking for the same book at once all get the one that was opened, and can read it together
+  _TestCacheJob jobs[8];
+  pthread_t threads[8];
+  for(int i = 0; i < 8; i++) {
+    jobs[i] = (_TestCacheJob){paths[0], NULL, kEPUB3UnknownError, 0};
+    fail_unless(pthread_create(&threads[i], NULL, _TestCacheCopyBook, &jobs[i]) == 0);
+  }
+  for(int i = 0; i < 8; i++) {
+    (void)pthread_join(threads[i], NULL);
+    fail_unless(jobs[i].error == kEPUB3Success);
+    fail_unless(jobs[i].book == jobs[0].book);
+    fail_unless(jobs[i].byteCount > 0 && jobs[i].byteCount == jobs[0].byteCount);
+  }
+  ck_assert_int_eq(EPUB3CacheGetCount(), 1);
+  fail_unless(EPUB3CacheGetByteCount() > 0);
+  EPUB3Ref book = jobs[0].book;
+  EPUB3Retain(book);
+  for(int i = 0; i < 8; i++) {
+    EPUB3Release(jobs[i].book);
+  }
+
+  // Shared books keep what they show
+  EPUB3PrefetcherRef prefetcher = EPUB3PrefetcherCreate(book, 2, 1024 * 1024, &error);
+  fail_unless(prefetcher == NULL);
+  ck_assert_int_eq(error, kEPUB3InvalidArgumentError);
+
+  // Released books stay cached until they're evicted
+  EPUB3Release(book);
+  book = EPUB3CacheCopyArchiveAtPath(paths[0], &error);
+  fail_unless(book == jobs[0].book);
+
+  // A file that has been written to is opened again, while the old book stays usable until released
+  struct timeval times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+  fail_unless(utimes(paths[0], times) == 0);
+  EPUB3Ref reopened = EPUB3CacheCopyArchiveAtPath(paths[0], &error);
+  fail_unless(reopened != NULL && reopened != book);
+  ck_assert_int_eq(EPUB3CacheGetCount(), 1);
+  char * title = EPUB3CopyTitle(book);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  EPUB3Free(title);
+  EPUB3Release(book);
+
+  // Least recently used first
+  EPUB3Ref books[2];
+  for(int i = 0; i < 2; i++) {
+    books[i] = EPUB3CacheCopyArchiveAtPath(paths[i + 1], &error);
+    fail_unless(books[i] != NULL);
+  }
+  ck_assert_int_eq(EPUB3CacheGetCount(), 2);
+  EPUB3Ref again = EPUB3CacheCopyArchiveAtPath(paths[0], &error);
+  fail_unless(again != NULL && again != reopened);
+  EPUB3Release(again);
+  EPUB3Release(reopened);
+
+  // A byte budget no book fits in leaves nothing cached, without taking books from their holders
+  fail_unless(EPUB3CacheConfigure(2, 1) == kEPUB3Success);
+  ck_assert_int_eq(EPUB3CacheGetCount(), 0);
+  ck_assert_int_eq(EPUB3CacheGetByteCount(), 0);
+  title = EPUB3CopyTitle(books[1]);
+  ck_assert_str_eq(title, "The Complete Works of William Shakespeare");
+  EPUB3Free(title);
+
+  fail_unless(EPUB3CacheConfigure(2, 0) == kEPUB3Success);
+  again = EPUB3CacheCopyArchiveAtPath(paths[1], &error);
+  fail_unless(again != NULL && again != books[0]);
+  EPUB3Release(again);
+  ck_assert_int_eq(EPUB3CacheGetCount(), 1);
+  EPUB3CachePurge();
+  ck_assert_int_eq(EPUB3CacheGetCount(), 0);
+  for(int i = 0; i < 2; i++) {
+    EPUB3Release(books[i]);
+  }
+  fail_unless(EPUB3CacheCopyArchiveAtPath("/nonexistent/book.epub", &error) == NULL);
+  fail_unless(EPUB3CacheConfigure(0, 0) == kEPUB3Success);
+}
+END_TEST
+
+#pragma mark test_epub3_async_reads
+typedef struct _TestAsyncRead {
+  const char * path;
+  EPUB3Bool isRange;
+  uint64_t offset;
+  uint32_t length;
+  EPUB3Error error;
+  EPUB3ResourceRef resource;
+  int32_t callCount;
+} _TestAsyncRead;
+
+static void _TestAsyncReadCallback(void * context, EPUB3ResourceRef resource, EPUB3Error error)
+{
+  _TestAsyncRead * job = context;
+  job->callCount++;
+  job->error = error;
+  job->resource = resource;
+  EPUB3ResourceRetain(resource);
+}
+
+START_TEST(test_epub3_async_reads)
+{
+  const char * html = "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-79.txt.html";
+  _TestAsyncRead reads[] = {
+    {"100/toc.ncx", kEPUB3_NO},
+    {"mimetype", kEPUB3_NO},
+    {html, kEPUB3_NO},
+    {"100/missing.html", kEPUB3_NO},
+    {"mimetype", kEPUB3_YES, 12, 100}, // stored, runs past the end
+    {html, kEPUB3_YES, 60000, 5000}, // deflated
+    {html, kEPUB3_YES, UINT32_MAX, 10},
+  };
+  const int32_t readCount = (int32_t)(sizeof(reads) / sizeof(reads[0]));
+  // Enough of the same entry to keep the reader busy
+  _TestAsyncRead repeated[300];
+
+  EPUB3Error error = kEPUB3UnknownError;
+  EPUB3AsyncReaderRef reader = EPUB3AsyncReaderCreate(2, &error);
+  fail_unless(reader != NULL && error == kEPUB3Success);
+  fail_unless(EPUB3AsyncReaderGetBackend(reader) == kEPUB3AsyncBackendThreadPool || EPUB3AsyncReaderGetBackend(reader) == kEPUB3AsyncBackendIOUring);
+  for(int32_t i = 0; i < readCount; i++) {
+    if(reads[i].isRange) {
+      error = EPUB3AsyncReadResourceRange(reader, epub, reads[i].path, reads[i].offset, reads[i].length, _TestAsyncReadCallback, &reads[i]);
+    } else {
+      error = EPUB3AsyncReadResource(reader, epub, reads[i].path, _TestAsyncReadCallback, &reads[i]);
+    }
+    fail_unless(error == kEPUB3Success);
+  }
+  for(int32_t i = 0; i < 300; i++) {
+    repeated[i] = (_TestAsyncRead){"100/toc.ncx", kEPUB3_YES, (uint64_t)i * 10, 64};
+    error = EPUB3AsyncReadResourceRange(reader, epub, repeated[i].path, repeated[i].offset, repeated[i].length, _TestAsyncReadCallback, &repeated[i]);
+    fail_unless(error == kEPUB3Success);
+  }
+
+  // Callbacks only run when dispatched, on this thread, after the descriptor says so
+  int32_t dispatched = 0;
+  while(dispatched < readCount + 300) {
+    struct pollfd descriptor = {EPUB3AsyncReaderGetFileDescriptor(reader), POLLIN, 0};
+    fail_unless(poll(&descriptor, 1, 10000) == 1);
+    dispatched += EPUB3AsyncReaderDispatch(reader);
+  }
+  ck_assert_int_eq(dispatched, readCount + 300);
+
+  for(int32_t i = 0; i < readCount; i++) {
+    ck_assert_int_eq(reads[i].callCount, 1);
+  }
+  for(int32_t i = 0; i < 3; i++) {
+    fail_unless(reads[i].error == kEPUB3Success);
+    EPUB3ResourceRef expected = EPUB3CopyResource(epub, reads[i].path, &error);
+    fail_unless(expected != NULL);
+    ck_assert_int_eq(EPUB3ResourceGetByteCount(reads[i].resource), EPUB3ResourceGetByteCount(expected));
+    fail_unless(memcmp(EPUB3ResourceGetBytes(reads[i].resource), EPUB3ResourceGetBytes(expected), EPUB3ResourceGetByteCount(expected)) == 0);
+    EPUB3ResourceRelease(expected);
+  }
+  ck_assert_int_eq(reads[3].error, kEPUB3FileNotFoundInArchiveError);
+  fail_unless(reads[3].resource == NULL);
+
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(reads[4].resource), 8);
+  fail_unless(memcmp(EPUB3ResourceGetBytes(reads[4].resource), "epub+zip", 8) == 0);
+  char expected[5000];
+  uint32_t bytesRead = 0;
+  fail_unless(EPUB3ReadResourceRange(epub, html, 60000, 5000, expected, &bytesRead) == kEPUB3Success);
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(reads[5].resource), 5000);
+  fail_unless(memcmp(EPUB3ResourceGetBytes(reads[5].resource), expected, 5000) == 0);
+  ck_assert_int_eq(reads[6].error, kEPUB3InvalidArgumentError);
+
+  for(int32_t i = 0; i < 300; i++) {
+    ck_assert_int_eq(repeated[i].callCount, 1);
+    fail_unless(repeated[i].error == kEPUB3Success);
+    fail_unless(memcmp(EPUB3ResourceGetBytes(repeated[i].resource), (const char *)EPUB3ResourceGetBytes(reads[0].resource) + i * 10, 64) == 0);
+    EPUB3ResourceRelease(repeated[i].resource);
+  }
+  for(int32_t i = 0; i < readCount; i++) {
+    EPUB3ResourceRelease(reads[i].resource);
+  }
+
+  // Reads still waiting to be dispatched are dropped with the reader
+  _TestAsyncRead dropped = {"100/toc.ncx", kEPUB3_NO};
+  fail_unless(EPUB3AsyncReadResource(reader, epub, dropped.path, _TestAsyncReadCallback, &dropped) == kEPUB3Success);
+  EPUB3AsyncReaderRelease(reader);
+  ck_assert_int_eq(dropped.callCount, 0);
+}
+END_TEST
+
 #pragma mark -
 TEST_EXPORT TCase * check_EPUB3_make_tcase(void)
 {
@@ -525,5 +2818,28 @@ TEST_EXPORT TCase * check_EPUB3_make_tcase(void)
   tcase_add_test(test_case, test_epub3_write_current_archive_file_to_path);
   tcase_add_test(test_case, test_epub3_create_nested_directories);
   tcase_add_test(test_case, test_epub3_extract_archive);
+  tcase_add_test(test_case, test_epub3_custom_allocator);
+  tcase_add_test(test_case, test_epub3_prefetcher);
+  tcase_add_test(test_case, test_epub3_server);
+  tcase_add_test(test_case, test_epub3_batch);
+  tcase_add_test(test_case, test_epub3_batch_scan_index);
+  tcase_add_test(test_case, test_epub3_snapshot);
+  tcase_add_test(test_case, test_epub3_snapshot_stale);
+  tcase_add_test(test_case, test_epub3_web_publication_manifest);
+  tcase_add_test(test_case, test_epub3_text_reader);
+  tcase_add_test(test_case, test_epub3_extract_text);
+  tcase_add_test(test_case, test_epub3_positions);
+  tcase_add_test(test_case, test_epub3_search_index);
+  tcase_add_test(test_case, test_epub3_verify_archive);
+  tcase_add_test(test_case, test_epub3_inflate_backends);
+  tcase_add_test(test_case, test_epub3_sniff);
+  tcase_add_test(test_case, test_epub3_zip64);
+  tcase_add_test(test_case, test_epub3_recover_damaged_archive);
+  tcase_add_test(test_case, test_epub3_writer);
+  tcase_add_test(test_case, test_epub3_repack);
+  tcase_add_test(test_case, test_epub3_image_infos);
+  tcase_add_test(test_case, test_epub3_renditions);
+  tcase_add_test(test_case, test_epub3_archive_cache);
+  tcase_add_test(test_case, test_epub3_async_reads);
   return test_case;
 }
@@ -42,12 +42,12 @@ END_TEST
 START_TEST(test_epub3_get_file_size_in_archive)
 {
   const char * filename = "META-INF/container.xml";
-  uint32_t expectedSize = 250U;
-  uint32_t size;
+  uint64_t expectedSize = 250U;
+  uint64_t size;
   EPUB3Error error = EPUB3GetUncompressedSizeOfFileInArchive(epub, &size, filename);
   fail_if(error == kEPUB3FileNotFoundInArchiveError, "Expected, but couldn't find %s in %s.", filename, epub->archivePath);
   fail_unless(error == kEPUB3Success, "Something went wrong when looking for %s in %s.", filename, epub->archivePath);
-  fail_unless(size == expectedSize, "Expected size of %u, but got %u for %s.", expectedSize, size, filename);
+  fail_unless(size == expectedSize, "Expected size of %llu, but got %llu for %s.", (unsigned long long)expectedSize, (unsigned long long)size, filename);
 
   TEST_PATH_VAR_FOR_FILENAME(path, "bad_metadata.epub");
   TEST_DATA_FILE_SIZE_SANITY_CHECK(path, 182);
@@ -59,7 +59,7 @@ START_TEST(test_epub3_get_file_size_in_archive)
   error = EPUB3GetUncompressedSizeOfFileInArchive(badMetadataEpub, &size, filename);
   fail_if(error == kEPUB3FileNotFoundInArchiveError, "Expected, but couldn't find %s in %s.", filename, badMetadataEpub->archivePath);
   fail_unless(error == kEPUB3Success, "Something went wrong when looking for %s in %s.", filename, badMetadataEpub->archivePath);
-  fail_unless(size == expectedSize, "Expected size of %u, but got %u for %s.", expectedSize, size, badMetadataEpub);
+  fail_unless(size == expectedSize, "Expected size of %llu, but got %llu for %s.", (unsigned long long)expectedSize, (unsigned long long)size, filename);
   EPUB3Release(badMetadataEpub);
 
   EPUB3Ref archiveless = EPUB3Create();
@@ -696,6 +696,279 @@ START_TEST(test_epub3_validate_mimetype)
 END_TEST
 
 
+#pragma mark test_epub3_resource_cache
+START_TEST(test_epub3_resource_cache)
+{
+  const char * filename = "100/pgepub.css";
+  uint32_t expectedSize = 462U;
+  EPUB3Error error = kEPUB3Success;
+
+  // Uncached reads hand out fresh buffers
+  EPUB3ResourceRef first = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(error == kEPUB3Success);
+  EPUB3ResourceRef second = EPUB3CopyResource(epub, filename, &error);
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(first), expectedSize);
+  fail_if(EPUB3ResourceGetBytes(first) == EPUB3ResourceGetBytes(second));
+  fail_unless(memcmp(EPUB3ResourceGetBytes(first), EPUB3ResourceGetBytes(second), expectedSize) == 0);
+  EPUB3ResourceRelease(second);
+  fail_unless(EPUB3ResourceCacheGetByteCount() == 0);
+
+  // Cached reads share one immutable buffer
+  fail_unless(EPUB3ResourceCacheConfigure(1024 * 1024, kEPUB3ResourceCacheStoreInflated) == kEPUB3Success);
+  EPUB3ResourceRef cached = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(error == kEPUB3Success);
+  EPUB3ResourceRef hit = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(EPUB3ResourceGetBytes(cached) == EPUB3ResourceGetBytes(hit));
+  fail_unless(memcmp(EPUB3ResourceGetBytes(first), EPUB3ResourceGetBytes(hit), expectedSize) == 0);
+  fail_unless(EPUB3ResourceCacheGetByteCount() == expectedSize);
+  EPUB3ResourceRelease(hit);
+
+  // Purging drops the cache's reference, but outstanding handles stay valid
+  EPUB3ResourceCachePurge();
+  fail_unless(EPUB3ResourceCacheGetByteCount() == 0);
+  fail_unless(memcmp(EPUB3ResourceGetBytes(first), EPUB3ResourceGetBytes(cached), expectedSize) == 0);
+  EPUB3ResourceRelease(cached);
+
+  // Entries larger than a shard's slice of the budget are not cached
+  fail_unless(EPUB3ResourceCacheConfigure(RESOURCE_CACHE_SHARD_COUNT * 100, kEPUB3ResourceCacheStoreInflated) == kEPUB3Success);
+  cached = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(EPUB3ResourceCacheGetByteCount() == 0);
+  EPUB3ResourceRelease(cached);
+
+  // Compressed storage keeps the deflated bytes and inflates on every hit
+  fail_unless(EPUB3ResourceCacheConfigure(1024 * 1024, kEPUB3ResourceCacheStoreCompressed) == kEPUB3Success);
+  cached = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(error == kEPUB3Success);
+  hit = EPUB3CopyResource(epub, filename, &error);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(EPUB3ResourceCacheGetByteCount(), 251);
+  fail_if(EPUB3ResourceGetBytes(cached) == EPUB3ResourceGetBytes(hit));
+  ck_assert_int_eq(EPUB3ResourceGetByteCount(hit), expectedSize);
+  fail_unless(memcmp(EPUB3ResourceGetBytes(first), EPUB3ResourceGetBytes(hit), expectedSize) == 0);
+  EPUB3ResourceRelease(cached);
+  EPUB3ResourceRelease(hit);
+  EPUB3ResourceRelease(first);
+
+  fail_unless(EPUB3CopyResource(epub, "not/in/the/archive.css", &error) == NULL);
+  fail_unless(error == kEPUB3FileNotFoundInArchiveError);
+
+  fail_unless(EPUB3ResourceCacheConfigure(0, kEPUB3ResourceCacheStoreInflated) == kEPUB3Success);
+  fail_unless(EPUB3ResourceCacheGetByteCount() == 0);
+}
+END_TEST
+
+#pragma mark test_epub3_read_resource_range
+START_TEST(test_epub3_read_resource_range)
+{
+  const char * deflatedPath = "100/toc.ncx";
+  const char * storedPath = "mimetype";
+  char indexDirectory[] = "/tmp/epub3idx-XXXXXX";
+  fail_if(mkdtemp(indexDirectory) == NULL);
+
+  void * expected = NULL;
+  uint32_t bufferSize = 0;
+  uint32_t expectedSize = 0;
+  EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &expected, &bufferSize, &expectedSize, deflatedPath);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(expectedSize, 199337);
+
+  fail_unless(EPUB3SetRangeReadOptions(epub, 1024, NULL) == kEPUB3InvalidArgumentError);
+  fail_unless(EPUB3SetRangeReadOptions(epub, 32 * 1024, indexDirectory) == kEPUB3Success);
+
+  char buffer[4096];
+  uint32_t bytesRead = 0;
+  uint64_t offsets[] = {150000, 0, 199337 - 4096, 65536, 98765};
+  for(int i = 0; i < 5; i++) {
+    error = EPUB3ReadResourceRange(epub, deflatedPath, offsets[i], sizeof(buffer), buffer, &bytesRead);
+    fail_unless(error == kEPUB3Success);
+    ck_assert_int_eq(bytesRead, sizeof(buffer));
+    fail_unless(memcmp(buffer, (char *)expected + offsets[i], sizeof(buffer)) == 0, "Range at %llu doesn't match.", offsets[i]);
+  }
+
+  EPUB3ArchiveEntryPtr entry = NULL;
+  fail_unless(EPUB3GetArchiveEntry(epub, deflatedPath, &entry) == kEPUB3Success);
+  fail_unless(entry->checkpointCount > 1, "A 195K entry should get more than one 32K checkpoint.");
+
+  // Ranges running off the end are cut short; ranges starting past it are refused
+  error = EPUB3ReadResourceRange(epub, deflatedPath, expectedSize - 10, sizeof(buffer), buffer, &bytesRead);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(bytesRead, 10);
+  fail_unless(memcmp(buffer, (char *)expected + expectedSize - 10, 10) == 0);
+  fail_unless(EPUB3ReadResourceRange(epub, deflatedPath, expectedSize + 1, 1, buffer, &bytesRead) == kEPUB3InvalidArgumentError);
+
+  error = EPUB3ReadResourceRange(epub, storedPath, 11, 100, buffer, &bytesRead);
+  fail_unless(error == kEPUB3Success);
+  ck_assert_int_eq(bytesRead, 9);
+  fail_unless(memcmp(buffer, "/epub+zip", 9) == 0);
+
+  fail_unless(EPUB3ReadResourceRange(epub, "not/in/the/archive", 0, 1, buffer, &bytesRead) == kEPUB3FileNotFoundInArchiveError);
+
+  // A second EPUB3Ref on the same file picks the persisted checkpoints up instead of making a full pass
+  char * indexPath = EPUB3CopyRangeIndexPathForEntry(epub, entry);
+  fail_unless(access(indexPath, R_OK) == 0, "Expected a checkpoint index at %s.", indexPath);
+  EPUB3Ref anotherEpub = EPUB3Create();
+  (void)EPUB3PrepareArchiveAtPath(anotherEpub, epub->archivePath);
+  fail_unless(EPUB3SetRangeReadOptions(anotherEpub, 0, indexDirectory) == kEPUB3Success);
+  EPUB3ArchiveEntryPtr anotherEntry = NULL;
+  fail_unless(EPUB3GetArchiveEntry(anotherEpub, deflatedPath, &anotherEntry) == kEPUB3Success);
+  fail_unless(EPUB3ArchiveEntryReadCheckpointsFromFile(anotherEpub, anotherEntry, indexPath) == kEPUB3Success);
+  ck_assert_int_eq(anotherEntry->checkpointCount, entry->checkpointCount);
+  error = EPUB3ReadResourceRange(anotherEpub, deflatedPath, 123456, sizeof(buffer), buffer, &bytesRead);
+  fail_unless(error == kEPUB3Success);
+  fail_unless(memcmp(buffer, (char *)expected + 123456, sizeof(buffer)) == 0);
+  EPUB3Release(anotherEpub);
+
+  EPUB3Free(indexPath);
+  EPUB3Free(expected);
+  fail_if(EPUB3RemoveDirectoryNamed(indexDirectory) < 0);
+}
+END_TEST
+
+#pragma mark test_epub3_resource_stream
+typedef struct _TestStreamJob {
+  EPUB3Ref epub;
+  const char * path;
+  uint32_t expectedCRC;
+  uint32_t crc;
+  EPUB3Error error;
+} _TestStreamJob;
+
+static void * _TestStreamReadWholeResource(void * context)
+{
+  _TestStreamJob * job = (_TestStreamJob *)context;
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(job->epub, job->path, &job->error);
+  if(stream == NULL) return NULL;
+
+  char buffer[777];
+  uint32_t bytesRead = 0;
+  job->crc = crc32(0L, Z_NULL, 0);
+  do {
+    job->error = EPUB3ResourceStreamRead(stream, buffer, sizeof(buffer), &bytesRead);
+    job->crc = crc32(job->crc, (Bytef *)buffer, bytesRead);
+  } while(job->error == kEPUB3Success && bytesRead > 0);
+  EPUB3ResourceStreamClose(stream);
+  return NULL;
+}
+
+START_TEST(test_epub3_resource_stream)
+{
+  const char * path = "100/toc.ncx";
+  void * expected = NULL;
+  uint32_t bufferSize = 0;
+  uint32_t expectedSize = 0;
+  EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &expected, &bufferSize, &expectedSize, path);
+  fail_unless(error == kEPUB3Success);
+
+  EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(epub, path, &error);
+  fail_unless(error == kEPUB3Success);
+  fail_if(stream == NULL);
+  ck_assert_int_eq(EPUB3ResourceStreamGetLength(stream), expectedSize);
+
+  char buffer[5000];
+  uint32_t bytesRead = 0;
+  uint64_t offset = 0;
+  do {
+    error = EPUB3ResourceStreamRead(stream, buffer, sizeof(buffer), &bytesRead);
+    fail_unless(error == kEPUB3Success);
+    fail_unless(memcmp(buffer, (char *)expected + offset, bytesRead) == 0, "Mismatch at %llu.", offset);
+    offset += bytesRead;
+  } while(bytesRead > 0);
+  ck_assert_int_eq(offset, expectedSize);
+  ck_assert_int_eq(EPUB3ResourceStreamGetOffset(stream), expectedSize);
+
+  // Backwards, then forwards again
+  fail_unless(EPUB3ResourceStreamSeek(stream, 12345) == kEPUB3Success);
+  fail_unless(EPUB3ResourceStreamRead(stream, buffer, 100, &bytesRead) == kEPUB3Success);
+  ck_assert_int_eq(bytesRead, 100);
+  fail_unless(memcmp(buffer, (char *)expected + 12345, 100) == 0);
+  fail_unless(EPUB3ResourceStreamSkip(stream, 100000) == kEPUB3Success);
+  ck_assert_int_eq(EPUB3ResourceStreamGetOffset(stream), 112445);
+  fail_unless(EPUB3ResourceStreamRead(stream, buffer, 100, &bytesRead) == kEPUB3Success);
+  fail_unless(memcmp(buffer, (char *)expected + 112445, 100) == 0);
+  fail_unless(EPUB3ResourceStreamSkip(stream, expectedSize) == kEPUB3InvalidArgumentError);
+  EPUB3ResourceStreamClose(stream);
+
+  fail_unless(EPUB3ResourceStreamOpen(epub, "not/in/the/archive", &error) == NULL);
+  fail_unless(error == kEPUB3FileNotFoundInArchiveError);
+
+  // Independent streams on one EPUB3Ref, read at the same time
+  const char * paths[] = {
+    "100/toc.ncx",
+    "mimetype",
+    "100/@public@vhost@g@gutenberg@html@dirs@etext94@shaks12-79.txt.html",
+    "100/toc.ncx",
+  };
+  _TestStreamJob jobs[4];
+  pthread_t threads[4];
+  for(int i = 0; i < 4; i++) {
+    EPUB3ArchiveEntryPtr entry = NULL;
+    fail_unless(EPUB3GetArchiveEntry(epub, paths[i], &entry) == kEPUB3Success);
+    jobs[i] = (_TestStreamJob){epub, paths[i], entry->crc, 0, kEPUB3UnknownError};
+  }
+  for(int i = 0; i < 4; i++) {
+    fail_unless(pthread_create(&threads[i], NULL, _TestStreamReadWholeResource, &jobs[i]) == 0);
+  }
+  for(int i = 0; i < 4; i++) {
+    (void)pthread_join(threads[i], NULL);
+    fail_unless(jobs[i].error == kEPUB3Success);
+    ck_assert_int_eq(jobs[i].crc, jobs[i].expectedCRC);
+  }
+  EPUB3Free(expected);
+}
+END_TEST
+
+#pragma mark test_epub3_copy_resource_as_gzip
+static uLong _TestGunzip(const void * source, uint32_t sourceSize, void * destination, uint32_t destinationSize)
+{
+  z_stream stream;
+  (void)memset(&stream, 0, sizeof(z_stream));
+  fail_unless(inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK);
+  stream.next_in = (Bytef *)source;
+  stream.avail_in = sourceSize;
+  stream.next_out = destination;
+  stream.avail_out = destinationSize;
+  int status = inflate(&stream, Z_FINISH);
+  uLong produced = stream.total_out;
+  (void)inflateEnd(&stream);
+  // Z_STREAM_END means the gzip trailer (CRC and size) checked out
+  return status == Z_STREAM_END ? produced : 0;
+}
+
+START_TEST(test_epub3_copy_resource_as_gzip)
+{
+  const char * paths[] = {"100/toc.ncx", "mimetype", "100/pgepub.css"};
+  for(int i = 0; i < 3; i++) {
+    void * expected = NULL;
+    uint32_t bufferSize = 0;
+    uint32_t expectedSize = 0;
+    EPUB3Error error = EPUB3CopyFileIntoBuffer(epub, &expected, &bufferSize, &expectedSize, paths[i]);
+    fail_unless(error == kEPUB3Success);
+
+    void * gzipped = NULL;
+    uint32_t gzippedSize = 0;
+    error = EPUB3CopyResourceAsGzip(epub, paths[i], &gzipped, &gzippedSize);
+    fail_unless(error == kEPUB3Success);
+    EPUB3ArchiveEntryPtr entry = NULL;
+    fail_unless(EPUB3GetArchiveEntry(epub, paths[i], &entry) == kEPUB3Success);
+    if(entry->method == Z_DEFLATED) {
+      ck_assert_int_eq(gzippedSize, GZIP_HEADER_SIZE + entry->compressedSize + GZIP_TRAILER_SIZE);
+    }
+
+    char * inflated = malloc(expectedSize + 1);
+    ck_assert_int_eq(_TestGunzip(gzipped, gzippedSize, inflated, expectedSize + 1), expectedSize);
+    fail_unless(memcmp(inflated, expected, expectedSize) == 0, "%s didn't survive the round trip.", paths[i]);
+    free(inflated);
+    EPUB3Free(gzipped);
+    EPUB3Free(expected);
+  }
+
+  void * gzipped = NULL;
+  uint32_t gzippedSize = 0;
+  fail_unless(EPUB3CopyResourceAsGzip(epub, "not/in/the/archive", &gzipped, &gzippedSize) == kEPUB3FileNotFoundInArchiveError);
+  fail_unless(gzipped == NULL);
+}
+END_TEST
+
 TEST_EXPORT TCase * check_EPUB3_parsing_make_tcase(void)
 {
   TCase *test_case = tcase_create("EPUB3 Parsing");
@@ -714,5 +987,9 @@ TEST_EXPORT TCase * check_EPUB3_parsing_make_tcase(void)
   tcase_add_test(test_case, test_epub3_parse_manifest_from_moby_dick_opf_data);
   tcase_add_test(test_case, test_epub3_copy_root_file_path_from_container);
   tcase_add_test(test_case, test_epub3_validate_mimetype);
+  tcase_add_test(test_case, test_epub3_resource_cache);
+  tcase_add_test(test_case, test_epub3_read_resource_range);
+  tcase_add_test(test_case, test_epub3_resource_stream);
+  tcase_add_test(test_case, test_epub3_copy_resource_as_gzip);
   return test_case;
 }
@@ -0,0 +1,144 @@
+//
+//  main.c
+//  epub3batch
+//
+//  Runs a directory tree (or a list of files) of EPUBs through EPUB3Batch and prints one JSON record per
+//  book on stdout. Paths come from the command line or, for libraries too large for one, from a path list
+//  with one path per line. Build it against the EPUB3Processor library.
+//
+//  usage: epub3batch [-j threads] [-q max in flight] [-c] [-x extract directory] [-i scan index] [-l path list] [path...]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "EPUB3.h"
+
+static void usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-j threads] [-q max in flight] [-c] [-x extract directory] [-i scan index] [-l path list] [path...]\n", name);
+  fprintf(stderr, "  -j  worker threads (default: one per processor)\n");
+  fprintf(stderr, "  -q  files queued or in progress before adding blocks (default: 4 per thread)\n");
+  fprintf(stderr, "  -c  read each book's cover image\n");
+  fprintf(stderr, "  -x  extract each book to <directory>/<index>\n");
+  fprintf(stderr, "  -i  skip books that haven't changed since the scan that wrote this index\n");
+  fprintf(stderr, "  -l  read paths from this file, one per line (- for stdin)\n");
+  fprintf(stderr, "Directories are searched recursively for .epub files. A path of - reads a path list from stdin.\n");
+}
+
+static void addPath(EPUB3BatchRef batch, const char * name, const char * path)
+{
+  struct stat st;
+  EPUB3Error error = kEPUB3Success;
+  if(stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    error = EPUB3BatchAddDirectory(batch, path);
+  } else {
+    error = EPUB3BatchAddPath(batch, path);
+  }
+  if(error != kEPUB3Success) {
+    fprintf(stderr, "%s: could not read %s (error %d)\n", name, path, error);
+  }
+}
+
+// Adds every non-empty line of listPath (stdin for "-"). Returns 0 if the list could not be read.
+static int addPathList(EPUB3BatchRef batch, const char * name, const char * listPath)
+{
+  FILE * list = strcmp(listPath, "-") == 0 ? stdin : fopen(listPath, "r");
+  if(list == NULL) {
+    fprintf(stderr, "%s: could not open path list %s\n", name, listPath);
+    return 0;
+  }
+  char * line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while((length = getline(&line, &capacity, list)) != -1) {
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    if(length > 0) {
+      addPath(batch, name, line);
+    }
+  }
+  int ok = !ferror(list);
+  if(!ok) {
+    fprintf(stderr, "%s: could not read path list %s\n", name, listPath);
+  }
+  free(line);
+  if(list != stdin) {
+    (void)fclose(list);
+  }
+  return ok;
+}
+
+static void writeRecord(void * context, const char * record, size_t length)
+{
+  (void)fwrite(record, 1, length, (FILE *)context);
+}
+
+int main(int argc, char * argv[])
+{
+  EPUB3BatchOptions options = {0};
+  options.recordCallback = writeRecord;
+  options.callbackContext = stdout;
+
+  const char * listPath = NULL;
+  int option;
+  while((option = getopt(argc, argv, "j:q:cx:i:l:h")) != -1) {
+    switch(option) {
+      case 'j':
+        options.threadCount = atoi(optarg);
+        break;
+      case 'q':
+        options.maxFilesInFlight = atoi(optarg);
+        break;
+      case 'c':
+        options.includeCover = kEPUB3_YES;
+        break;
+      case 'x':
+        options.extractDirectory = optarg;
+        break;
+      case 'i':
+        options.indexPath = optarg;
+        break;
+      case 'l':
+        listPath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(optind >= argc && listPath == NULL) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3BatchRef batch = EPUB3BatchCreate(&options, &error);
+  if(batch == NULL) {
+    fprintf(stderr, "%s: could not start the batch (error %d)\n", argv[0], error);
+    return EXIT_FAILURE;
+  }
+
+  int listsOK = 1;
+  if(listPath != NULL) {
+    listsOK &= addPathList(batch, argv[0], listPath);
+  }
+  for(int i = optind; i < argc; i++) {
+    if(strcmp(argv[i], "-") == 0) {
+      listsOK &= addPathList(batch, argv[0], argv[i]);
+    } else {
+      addPath(batch, argv[0], argv[i]);
+    }
+  }
+
+  EPUB3BatchStatistics statistics;
+  EPUB3BatchFinish(batch, &statistics);
+  fflush(stdout);
+  fprintf(stderr, "%llu files, %llu ok, %llu failed, %llu unchanged\n", (unsigned long long)statistics.fileCount,
+          (unsigned long long)statistics.succeededCount, (unsigned long long)statistics.failedCount,
+          (unsigned long long)statistics.unchangedCount);
+  return statistics.failedCount == 0 && listsOK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
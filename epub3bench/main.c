@@ -0,0 +1,156 @@
+//
+//  main.c
+//  epub3bench
+//
+//  Reads every entry of the given EPUBs, whole with each inflate backend built into the library and
+//  incrementally through resource streams, and prints the throughput of each. Build it against the
+//  EPUB3Processor library (with EPUB3_USE_LIBDEFLATE=1 to compare libdeflate as well).
+//
+//  usage: epub3bench [-n rounds] file.epub...
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "EPUB3.h"
+
+typedef struct Book {
+  EPUB3Ref epub;
+  EPUB3ArchiveEntryReport * entries;
+  int32_t entryCount;
+} Book;
+
+static void usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-n rounds] file.epub...\n", name);
+  fprintf(stderr, "  -n  passes over every book for each way of reading (default: 5)\n");
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static EPUB3Bool isDirectory(const EPUB3ArchiveEntryReport * entry)
+{
+  size_t length = strlen(entry->path);
+  return length > 0 && entry->path[length - 1] == '/';
+}
+
+static uint64_t readWhole(Book * books, int bookCount)
+{
+  uint64_t byteCount = 0;
+  for(int i = 0; i < bookCount; i++) {
+    for(int32_t j = 0; j < books[i].entryCount; j++) {
+      if(isDirectory(&books[i].entries[j])) continue;
+      EPUB3Error error = kEPUB3Success;
+      EPUB3ResourceRef resource = EPUB3CopyResource(books[i].epub, books[i].entries[j].path, &error);
+      if(resource == NULL) {
+        fprintf(stderr, "%s: error %d\n", books[i].entries[j].path, error);
+        continue;
+      }
+      byteCount += EPUB3ResourceGetByteCount(resource);
+      EPUB3ResourceRelease(resource);
+    }
+  }
+  return byteCount;
+}
+
+static uint64_t readStreamed(Book * books, int bookCount)
+{
+  static char buffer[65536];
+  uint64_t byteCount = 0;
+  for(int i = 0; i < bookCount; i++) {
+    for(int32_t j = 0; j < books[i].entryCount; j++) {
+      if(isDirectory(&books[i].entries[j])) continue;
+      EPUB3Error error = kEPUB3Success;
+      EPUB3ResourceStreamRef stream = EPUB3ResourceStreamOpen(books[i].epub, books[i].entries[j].path, &error);
+      if(stream == NULL) {
+        fprintf(stderr, "%s: error %d\n", books[i].entries[j].path, error);
+        continue;
+      }
+      uint32_t bytesRead = 0;
+      while(EPUB3ResourceStreamRead(stream, buffer, sizeof(buffer), &bytesRead) == kEPUB3Success && bytesRead > 0) {
+        byteCount += bytesRead;
+      }
+      EPUB3ResourceStreamClose(stream);
+    }
+  }
+  return byteCount;
+}
+
+static void report(const char * name, uint64_t byteCount, double seconds)
+{
+  printf("%-22s %12llu bytes %9.3f s %9.1f MB/s\n", name, (unsigned long long)byteCount, seconds, seconds > 0 ? byteCount / seconds / 1e6 : 0.0);
+}
+
+int main(int argc, char * argv[])
+{
+  int rounds = 5;
+  int option;
+  while((option = getopt(argc, argv, "n:h")) != -1) {
+    switch(option) {
+      case 'n':
+        rounds = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(optind >= argc || rounds <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int bookCount = 0;
+  Book * books = calloc(argc - optind, sizeof(Book));
+  for(int i = optind; i < argc; i++) {
+    EPUB3Error error = kEPUB3Success;
+    EPUB3Ref epub = EPUB3CreateWithArchiveAtPath(argv[i], &error);
+    if(epub == NULL) {
+      fprintf(stderr, "%s: error %d\n", argv[i], error);
+      continue;
+    }
+    // The verification report doubles as the list of entries (and warms the page cache)
+    books[bookCount].epub = epub;
+    (void)EPUB3VerifyArchive(epub, 0, &books[bookCount].entries, &books[bookCount].entryCount);
+    bookCount++;
+  }
+
+  static const struct { EPUB3InflateBackend backend; const char * name; } backends[] = {
+    { kEPUB3InflateBackendZlib, "whole (zlib)" },
+    { kEPUB3InflateBackendLibdeflate, "whole (libdeflate)" },
+  };
+  for(size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+    if(EPUB3SetInflateBackend(backends[b].backend) != kEPUB3Success) {
+      printf("%-22s not built in\n", backends[b].name);
+      continue;
+    }
+    uint64_t byteCount = 0;
+    double start = now();
+    for(int round = 0; round < rounds; round++) {
+      byteCount += readWhole(books, bookCount);
+    }
+    report(backends[b].name, byteCount, now() - start);
+  }
+  (void)EPUB3SetInflateBackend(kEPUB3InflateBackendZlib);
+
+  uint64_t byteCount = 0;
+  double start = now();
+  for(int round = 0; round < rounds; round++) {
+    byteCount += readStreamed(books, bookCount);
+  }
+  report("streamed (zlib)", byteCount, now() - start);
+
+  for(int i = 0; i < bookCount; i++) {
+    EPUB3ArchiveEntryReportsFree(books[i].entries, books[i].entryCount);
+    EPUB3Release(books[i].epub);
+  }
+  free(books);
+  return EXIT_SUCCESS;
+}
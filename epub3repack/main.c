@@ -0,0 +1,64 @@
+//
+//  main.c
+//  epub3repack
+//
+//  Rewrites an EPUB with EPUB3Repack so that it reads quickly: entries in the order a reading system
+//  opens them, media that is compressed already stored, and files the package doesn't list dropped.
+//  Build it against the EPUB3Processor library.
+//
+//  usage: epub3repack [-j threads] [-l level] [-k] in.epub out.epub
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "EPUB3.h"
+
+static void usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-j threads] [-l level] [-k] in.epub out.epub\n", name);
+  fprintf(stderr, "  -j  compression threads (default: one per processor)\n");
+  fprintf(stderr, "  -l  deflate level for text, 0-9 (default: 9)\n");
+  fprintf(stderr, "  -k  keep files the package doesn't list\n");
+}
+
+int main(int argc, char * argv[])
+{
+  EPUB3RepackOptions options = { 0, 9, kEPUB3_NO };
+
+  int option;
+  while((option = getopt(argc, argv, "j:l:kh")) != -1) {
+    switch(option) {
+      case 'j':
+        options.threadCount = atoi(optarg);
+        break;
+      case 'l':
+        options.level = atoi(optarg);
+        break;
+      case 'k':
+        options.keepsUnreferencedEntries = kEPUB3_YES;
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(argc - optind != 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  EPUB3Error error = kEPUB3Success;
+  EPUB3Ref epub = EPUB3CreateWithArchiveAtPath(argv[optind], &error);
+  if(epub == NULL) {
+    fprintf(stderr, "%s: could not open %s (error %d)\n", argv[0], argv[optind], error);
+    return EXIT_FAILURE;
+  }
+  error = EPUB3Repack(epub, argv[optind + 1], &options);
+  EPUB3Release(epub);
+  if(error != kEPUB3Success) {
+    fprintf(stderr, "%s: could not write %s (error %d)\n", argv[0], argv[optind + 1], error);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
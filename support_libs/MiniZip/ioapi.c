@@ -6,6 +6,11 @@
    Copyright (C) 1998-2009 Gilles Vollant
 */
 
+/* fseeko and ftello take a 64 bit off_t on 32 bit systems too */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +34,63 @@
 #define SEEK_SET    0
 #endif
 
+voidpf call_zopen64 (pfilefunc,filename,mode)
+   const zlib_filefunc64_32_def* pfilefunc;
+   const void* filename;
+   int mode;
+{
+    if (pfilefunc->zfile_func64.zopen64_file != NULL)
+        return (*(pfilefunc->zfile_func64.zopen64_file)) (pfilefunc->zfile_func64.opaque,filename,mode);
+    else
+        return (*(pfilefunc->zopen32_file))(pfilefunc->zfile_func64.opaque,(const char*)filename,mode);
+}
+
+long call_zseek64 (pfilefunc,filestream,offset,origin)
+   const zlib_filefunc64_32_def* pfilefunc;
+   voidpf filestream;
+   ZPOS64_T offset;
+   int origin;
+{
+    uLong offsetTruncated;
+    if (pfilefunc->zfile_func64.zseek64_file != NULL)
+        return (*(pfilefunc->zfile_func64.zseek64_file)) (pfilefunc->zfile_func64.opaque,filestream,offset,origin);
+    offsetTruncated = (uLong)offset;
+    if (offsetTruncated != offset)
+        return -1;
+    return (*(pfilefunc->zseek32_file))(pfilefunc->zfile_func64.opaque,filestream,offsetTruncated,origin);
+}
+
+ZPOS64_T call_ztell64 (pfilefunc,filestream)
+   const zlib_filefunc64_32_def* pfilefunc;
+   voidpf filestream;
+{
+    long tell_uLong;
+    if (pfilefunc->zfile_func64.ztell64_file != NULL)
+        return (*(pfilefunc->zfile_func64.ztell64_file)) (pfilefunc->zfile_func64.opaque,filestream);
+    tell_uLong = (*(pfilefunc->ztell32_file))(pfilefunc->zfile_func64.opaque,filestream);
+    if (tell_uLong == -1)
+        return (ZPOS64_T)-1;
+    return (ZPOS64_T)tell_uLong;
+}
+
+void fill_zlib_filefunc64_32_def_from_filefunc32 (p_filefunc64_32,p_filefunc32)
+   zlib_filefunc64_32_def* p_filefunc64_32;
+   const zlib_filefunc_def* p_filefunc32;
+{
+    p_filefunc64_32->zfile_func64.zopen64_file = NULL;
+    p_filefunc64_32->zopen32_file = p_filefunc32->zopen_file;
+    p_filefunc64_32->zfile_func64.zread_file = p_filefunc32->zread_file;
+    p_filefunc64_32->zfile_func64.zwrite_file = p_filefunc32->zwrite_file;
+    p_filefunc64_32->zfile_func64.ztell64_file = NULL;
+    p_filefunc64_32->zfile_func64.zseek64_file = NULL;
+    p_filefunc64_32->zfile_func64.zclose_file = p_filefunc32->zclose_file;
+    p_filefunc64_32->zfile_func64.zerror_file = p_filefunc32->zerror_file;
+    p_filefunc64_32->zfile_func64.opaque = p_filefunc32->opaque;
+    p_filefunc64_32->zseek32_file = p_filefunc32->zseek_file;
+    p_filefunc64_32->ztell32_file = p_filefunc32->ztell_file;
+}
+
+
 voidpf ZCALLBACK fopen_file_func OF((
    voidpf opaque,
    const char* filename,
@@ -56,6 +118,21 @@ long ZCALLBACK fseek_file_func OF((
    uLong offset,
    int origin));
 
+voidpf ZCALLBACK fopen64_file_func OF((
+   voidpf opaque,
+   const void* filename,
+   int mode));
+
+ZPOS64_T ZCALLBACK ftell64_file_func OF((
+   voidpf opaque,
+   voidpf stream));
+
+long ZCALLBACK fseek64_file_func OF((
+   voidpf opaque,
+   voidpf stream,
+   ZPOS64_T offset,
+   int origin));
+
 int ZCALLBACK fclose_file_func OF((
    voidpf opaque,
    voidpf stream));
@@ -86,6 +163,14 @@ voidpf ZCALLBACK fopen_file_func (opaque, filename, mode)
     return file;
 }
 
+voidpf ZCALLBACK fopen64_file_func (opaque, filename, mode)
+   voidpf opaque;
+   const void* filename;
+   int mode;
+{
+    return fopen_file_func(opaque, (const char*)filename, mode);
+}
+
 
 uLong ZCALLBACK fread_file_func (opaque, stream, buf, size)
    voidpf opaque;
@@ -146,6 +231,44 @@ long ZCALLBACK fseek_file_func (opaque, stream, offset, origin)
     return ret;
 }
 
+ZPOS64_T ZCALLBACK ftell64_file_func (opaque, stream)
+   voidpf opaque;
+   voidpf stream;
+{
+    off_t ret;
+    ret = ftello((FILE *)stream);
+    if (ret == -1)
+        return (ZPOS64_T)-1;
+    return (ZPOS64_T)ret;
+}
+
+long ZCALLBACK fseek64_file_func (opaque, stream, offset, origin)
+   voidpf opaque;
+   voidpf stream;
+   ZPOS64_T offset;
+   int origin;
+{
+    int fseek_origin=0;
+    long ret;
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR :
+        fseek_origin = SEEK_CUR;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END :
+        fseek_origin = SEEK_END;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET :
+        fseek_origin = SEEK_SET;
+        break;
+    default: return -1;
+    }
+    ret = 0;
+    if (fseeko((FILE *)stream, (off_t)offset, fseek_origin) != 0)
+        ret = -1;
+    return ret;
+}
+
 int ZCALLBACK fclose_file_func (opaque, stream)
    voidpf opaque;
    voidpf stream;
@@ -176,3 +299,16 @@ void fill_fopen_filefunc (pzlib_filefunc_def)
     pzlib_filefunc_def->zerror_file = ferror_file_func;
     pzlib_filefunc_def->opaque = NULL;
 }
+
+void fill_fopen64_filefunc (pzlib_filefunc_def)
+  zlib_filefunc64_def* pzlib_filefunc_def;
+{
+    pzlib_filefunc_def->zopen64_file = fopen64_file_func;
+    pzlib_filefunc_def->zread_file = fread_file_func;
+    pzlib_filefunc_def->zwrite_file = fwrite_file_func;
+    pzlib_filefunc_def->ztell64_file = ftell64_file_func;
+    pzlib_filefunc_def->zseek64_file = fseek64_file_func;
+    pzlib_filefunc_def->zclose_file = fclose_file_func;
+    pzlib_filefunc_def->zerror_file = ferror_file_func;
+    pzlib_filefunc_def->opaque = NULL;
+}
@@ -93,7 +93,7 @@ const char unz_copyright[] =
 /* unz_file_info_interntal contain internal info about a file in zipfile*/
 typedef struct unz_file_info_internal_s
 {
-    uLong offset_curfile;/* relative offset of local header 4 bytes */
+    ZPOS64_T offset_curfile;/* relative offset of local header 8 bytes */
 } unz_file_info_internal;
 
 
@@ -107,21 +107,22 @@ typedef struct
     bz_stream bstream;          /* bzLib stream structure for bziped */
 #endif
 
-    uLong pos_in_zipfile;       /* position in byte on the zipfile, for fseek*/
+    ZPOS64_T pos_in_zipfile;    /* position in byte on the zipfile, for fseek*/
     uLong stream_initialised;   /* flag set if stream structure is initialised*/
 
-    uLong offset_local_extrafield;/* offset of the local extra field */
+    ZPOS64_T offset_local_extrafield;/* offset of the local extra field */
     uInt  size_local_extrafield;/* size of the local extra field */
-    uLong pos_local_extrafield;   /* position in the local extra field in read*/
+    ZPOS64_T pos_local_extrafield;   /* position in the local extra field in read*/
+    ZPOS64_T total_out_64;      /* stream.total_out, without its 32 bit limit */
 
     uLong crc32;                /* crc32 of all data uncompressed */
     uLong crc32_wait;           /* crc32 we must obtain after decompress all */
-    uLong rest_read_compressed; /* number of byte to be decompressed */
-    uLong rest_read_uncompressed;/*number of byte to be obtained after decomp*/
-    zlib_filefunc_def z_filefunc;
+    ZPOS64_T rest_read_compressed; /* number of byte to be decompressed */
+    ZPOS64_T rest_read_uncompressed;/*number of byte to be obtained after decomp*/
+    zlib_filefunc64_32_def z_filefunc;
     voidpf filestream;        /* io structore of the zipfile */
     uLong compression_method;   /* compression method (0==store) */
-    uLong byte_before_the_zipfile;/* byte before the zipfile, (>0 for sfx)*/
+    ZPOS64_T byte_before_the_zipfile;/* byte before the zipfile, (>0 for sfx)*/
     int   raw;
 } file_in_zip_read_info_s;
 
@@ -130,24 +131,27 @@ typedef struct
 */
 typedef struct
 {
-    zlib_filefunc_def z_filefunc;
+    zlib_filefunc64_32_def z_filefunc;
+    int is64bitOpenFunction;
     voidpf filestream;        /* io structore of the zipfile */
-    unz_global_info gi;       /* public global information */
-    uLong byte_before_the_zipfile;/* byte before the zipfile, (>0 for sfx)*/
-    uLong num_file;             /* number of the current file in the zipfile*/
-    uLong pos_in_central_dir;   /* pos of the current file in the central dir*/
-    uLong current_file_ok;      /* flag about the usability of the current file*/
-    uLong central_pos;          /* position of the beginning of the central dir*/
-
-    uLong size_central_dir;     /* size of the central directory  */
-    uLong offset_central_dir;   /* offset of start of central directory with
+    unz_global_info64 gi;       /* public global information */
+    ZPOS64_T byte_before_the_zipfile;/* byte before the zipfile, (>0 for sfx)*/
+    ZPOS64_T num_file;             /* number of the current file in the zipfile*/
+    ZPOS64_T pos_in_central_dir;   /* pos of the current file in the central dir*/
+    ZPOS64_T current_file_ok;      /* flag about the usability of the current file*/
+    ZPOS64_T central_pos;          /* position of the end of central dir record*/
+    ZPOS64_T comment_pos;          /* position of the global comment */
+
+    ZPOS64_T size_central_dir;     /* size of the central directory  */
+    ZPOS64_T offset_central_dir;   /* offset of start of central directory with
                                    respect to the starting disk number */
 
-    unz_file_info cur_file_info; /* public info about the current file in zip*/
+    unz_file_info64 cur_file_info; /* public info about the current file in zip*/
     unz_file_info_internal cur_file_info_internal; /* private info about it*/
     file_in_zip_read_info_s* pfile_in_zip_read; /* structure about the current
                                         file if we are decompressing it */
     int encrypted;
+    int isZip64;               /* the end of central dir has a ZIP64 record */
 #    ifndef NOUNCRYPT
     unsigned long keys[3];     /* keys defining the pseudo-random sequence */
     const unsigned long* pcrc_32_tab;
@@ -167,17 +171,17 @@ typedef struct
 
 
 local int unzlocal_getByte OF((
-    const zlib_filefunc_def* pzlib_filefunc_def,
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
     voidpf filestream,
     int *pi));
 
 local int unzlocal_getByte(pzlib_filefunc_def,filestream,pi)
-    const zlib_filefunc_def* pzlib_filefunc_def;
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
     voidpf filestream;
     int *pi;
 {
     unsigned char c;
-    int err = (int)ZREAD(*pzlib_filefunc_def,filestream,&c,1);
+    int err = (int)ZREAD64(*pzlib_filefunc_def,filestream,&c,1);
     if (err==1)
     {
         *pi = (int)c;
@@ -185,7 +189,7 @@ local int unzlocal_getByte(pzlib_filefunc_def,filestream,pi)
     }
     else
     {
-        if (ZERROR(*pzlib_filefunc_def,filestream))
+        if (ZERROR64(*pzlib_filefunc_def,filestream))
             return UNZ_ERRNO;
         else
             return UNZ_EOF;
@@ -197,12 +201,12 @@ local int unzlocal_getByte(pzlib_filefunc_def,filestream,pi)
    Reads a long in LSB order from the given gz_stream. Sets
 */
 local int unzlocal_getShort OF((
-    const zlib_filefunc_def* pzlib_filefunc_def,
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
     voidpf filestream,
     uLong *pX));
 
 local int unzlocal_getShort (pzlib_filefunc_def,filestream,pX)
-    const zlib_filefunc_def* pzlib_filefunc_def;
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
     voidpf filestream;
     uLong *pX;
 {
@@ -225,12 +229,12 @@ local int unzlocal_getShort (pzlib_filefunc_def,filestream,pX)
 }
 
 local int unzlocal_getLong OF((
-    const zlib_filefunc_def* pzlib_filefunc_def,
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
     voidpf filestream,
     uLong *pX));
 
 local int unzlocal_getLong (pzlib_filefunc_def,filestream,pX)
-    const zlib_filefunc_def* pzlib_filefunc_def;
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
     voidpf filestream;
     uLong *pX;
 {
@@ -260,6 +264,30 @@ local int unzlocal_getLong (pzlib_filefunc_def,filestream,pX)
     return err;
 }
 
+local int unzlocal_getLong64 OF((
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
+    voidpf filestream,
+    ZPOS64_T *pX));
+
+local int unzlocal_getLong64 (pzlib_filefunc_def,filestream,pX)
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
+    voidpf filestream;
+    ZPOS64_T *pX;
+{
+    uLong low, high;
+    int err;
+
+    err = unzlocal_getLong(pzlib_filefunc_def,filestream,&low);
+    if (err==UNZ_OK)
+        err = unzlocal_getLong(pzlib_filefunc_def,filestream,&high);
+
+    if (err==UNZ_OK)
+        *pX = (ZPOS64_T)low | ((ZPOS64_T)high)<<32;
+    else
+        *pX = 0;
+    return err;
+}
+
 
 /* My own strcmpi / strcasecmp */
 local int strcmpcasenosensitive_internal (fileName1,fileName2)
@@ -327,25 +355,25 @@ extern int ZEXPORT unzStringFileNameCompare (fileName1,fileName2,iCaseSensitivit
   Locate the Central directory of a zipfile (at the end, just before
     the global comment)
 */
-local uLong unzlocal_SearchCentralDir OF((
-    const zlib_filefunc_def* pzlib_filefunc_def,
+local ZPOS64_T unzlocal_SearchCentralDir OF((
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
     voidpf filestream));
 
-local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
-    const zlib_filefunc_def* pzlib_filefunc_def;
+local ZPOS64_T unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
     voidpf filestream;
 {
     unsigned char* buf;
-    uLong uSizeFile;
-    uLong uBackRead;
-    uLong uMaxBack=0xffff; /* maximum size of global comment */
-    uLong uPosFound=0;
+    ZPOS64_T uSizeFile;
+    ZPOS64_T uBackRead;
+    ZPOS64_T uMaxBack=0xffff; /* maximum size of global comment */
+    ZPOS64_T uPosFound=0;
 
-    if (ZSEEK(*pzlib_filefunc_def,filestream,0,ZLIB_FILEFUNC_SEEK_END) != 0)
+    if (ZSEEK64(*pzlib_filefunc_def,filestream,0,ZLIB_FILEFUNC_SEEK_END) != 0)
         return 0;
 
 
-    uSizeFile = ZTELL(*pzlib_filefunc_def,filestream);
+    uSizeFile = ZTELL64(*pzlib_filefunc_def,filestream);
 
     if (uMaxBack>uSizeFile)
         uMaxBack = uSizeFile;
@@ -357,7 +385,8 @@ local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
     uBackRead = 4;
     while (uBackRead<uMaxBack)
     {
-        uLong uReadSize,uReadPos ;
+        uLong uReadSize;
+        ZPOS64_T uReadPos ;
         int i;
         if (uBackRead+BUFREADCOMMENT>uMaxBack)
             uBackRead = uMaxBack;
@@ -366,11 +395,11 @@ local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
         uReadPos = uSizeFile-uBackRead ;
 
         uReadSize = ((BUFREADCOMMENT+4) < (uSizeFile-uReadPos)) ?
-                     (BUFREADCOMMENT+4) : (uSizeFile-uReadPos);
-        if (ZSEEK(*pzlib_filefunc_def,filestream,uReadPos,ZLIB_FILEFUNC_SEEK_SET)!=0)
+                     (BUFREADCOMMENT+4) : (uLong)(uSizeFile-uReadPos);
+        if (ZSEEK64(*pzlib_filefunc_def,filestream,uReadPos,ZLIB_FILEFUNC_SEEK_SET)!=0)
             break;
 
-        if (ZREAD(*pzlib_filefunc_def,filestream,buf,uReadSize)!=uReadSize)
+        if (ZREAD64(*pzlib_filefunc_def,filestream,buf,uReadSize)!=uReadSize)
             break;
 
         for (i=(int)uReadSize-3; (i--)>0;)
@@ -388,6 +417,63 @@ local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
     return uPosFound;
 }
 
+/*
+  Locate the ZIP64 end of central dir record, through the locator written
+    just before the end of central dir record. Returns 0 when there is none.
+*/
+local ZPOS64_T unzlocal_SearchCentralDir64 OF((
+    const zlib_filefunc64_32_def* pzlib_filefunc_def,
+    voidpf filestream,
+    ZPOS64_T central_pos));
+
+local ZPOS64_T unzlocal_SearchCentralDir64(pzlib_filefunc_def,filestream,central_pos)
+    const zlib_filefunc64_32_def* pzlib_filefunc_def;
+    voidpf filestream;
+    ZPOS64_T central_pos;
+{
+    uLong uL;
+    ZPOS64_T relativeOffset;
+
+    if (central_pos<20)
+        return 0;
+    if (ZSEEK64(*pzlib_filefunc_def,filestream,central_pos-20,ZLIB_FILEFUNC_SEEK_SET)!=0)
+        return 0;
+
+    /* the signature of the locator */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0x07064b50)
+        return 0;
+
+    /* number of the disk with the start of the zip64 end of central dir */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0)
+        return 0;
+
+    /* relative offset of the zip64 end of central dir record */
+    if (unzlocal_getLong64(pzlib_filefunc_def,filestream,&relativeOffset)!=UNZ_OK)
+        return 0;
+
+    /* total number of disks */
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=1)
+        return 0;
+
+    /* the record itself has to be before the locator */
+    if (relativeOffset+56>central_pos-20)
+        return 0;
+    if (ZSEEK64(*pzlib_filefunc_def,filestream,relativeOffset,ZLIB_FILEFUNC_SEEK_SET)!=0)
+        return 0;
+    if (unzlocal_getLong(pzlib_filefunc_def,filestream,&uL)!=UNZ_OK)
+        return 0;
+    if (uL!=0x06064b50)
+        return 0;
+
+    return relativeOffset;
+}
+
 /*
   Open a Zip file. path contain the full pathname (by example,
      on a Windows NT computer "c:\\test\\zlib114.zip" or on an Unix computer
@@ -397,19 +483,28 @@ local uLong unzlocal_SearchCentralDir(pzlib_filefunc_def,filestream)
      Else, the return value is a unzFile Handle, usable with other function
        of this unzip package.
 */
-extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
-    const char *path;
-    zlib_filefunc_def* pzlib_filefunc_def;
+local unzFile unzOpenInternal OF((
+    const void *path,
+    zlib_filefunc64_32_def* pzlib_filefunc64_32_def,
+    int is64bitOpenFunction));
+
+local unzFile unzOpenInternal (path, pzlib_filefunc64_32_def, is64bitOpenFunction)
+    const void *path;
+    zlib_filefunc64_32_def* pzlib_filefunc64_32_def;
+    int is64bitOpenFunction;
 {
     unz_s us;
     unz_s *s;
-    uLong central_pos,uL;
+    ZPOS64_T central_pos;
+    ZPOS64_T central_pos64;
+    uLong uL;
+    uLong uS;
 
     uLong number_disk;          /* number of the current dist, used for
                                    spaning ZIP, unsupported, always 0*/
     uLong number_disk_with_CD;  /* number the the disk with central dir, used
                                    for spaning ZIP, unsupported, always 0*/
-    uLong number_entry_CD;      /* total number of entries in
+    ZPOS64_T number_entry_CD;   /* total number of entries in
                                    the central dir
                                    (same than number_entry on nospan) */
 
@@ -418,15 +513,18 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
     if (unz_copyright[0]!=' ')
         return NULL;
 
-    if (pzlib_filefunc_def==NULL)
-        fill_fopen_filefunc(&us.z_filefunc);
+    us.z_filefunc.zseek32_file = NULL;
+    us.z_filefunc.ztell32_file = NULL;
+    if (pzlib_filefunc64_32_def==NULL)
+        fill_fopen64_filefunc(&us.z_filefunc.zfile_func64);
     else
-        us.z_filefunc = *pzlib_filefunc_def;
+        us.z_filefunc = *pzlib_filefunc64_32_def;
+    us.is64bitOpenFunction = is64bitOpenFunction;
 
-    us.filestream= (*(us.z_filefunc.zopen_file))(us.z_filefunc.opaque,
-                                                 path,
-                                                 ZLIB_FILEFUNC_MODE_READ |
-                                                 ZLIB_FILEFUNC_MODE_EXISTING);
+    us.filestream= ZOPEN64(us.z_filefunc,
+                           path,
+                           ZLIB_FILEFUNC_MODE_READ |
+                           ZLIB_FILEFUNC_MODE_EXISTING);
     if (us.filestream==NULL)
         return NULL;
 
@@ -434,55 +532,135 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
     if (central_pos==0)
         err=UNZ_ERRNO;
 
-    if (ZSEEK(us.z_filefunc, us.filestream,
-                                      central_pos,ZLIB_FILEFUNC_SEEK_SET)!=0)
-        err=UNZ_ERRNO;
+    us.comment_pos = central_pos+22;
+    central_pos64 = 0;
+    if (err==UNZ_OK)
+        central_pos64 = unzlocal_SearchCentralDir64(&us.z_filefunc,us.filestream,central_pos);
 
-    /* the signature, already checked */
-    if (unzlocal_getLong(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
-        err=UNZ_ERRNO;
+    if (central_pos64!=0)
+    {
+        /* a ZIP64 archive: the counts, size and offset of the central dir
+           are in the zip64 end of central dir record */
+        ZPOS64_T uL64;
+        us.isZip64 = 1;
 
-    /* number of this disk */
-    if (unzlocal_getShort(&us.z_filefunc, us.filestream,&number_disk)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        if (ZSEEK64(us.z_filefunc, us.filestream,
+                    central_pos64+4,ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
 
-    /* number of the disk with the start of the central directory */
-    if (unzlocal_getShort(&us.z_filefunc, us.filestream,&number_disk_with_CD)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        /* size of zip64 end of central directory record */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&uL64)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    /* total number of entries in the central dir on this disk */
-    if (unzlocal_getShort(&us.z_filefunc, us.filestream,&us.gi.number_entry)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        /* version made by */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&uS)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    /* total number of entries in the central dir */
-    if (unzlocal_getShort(&us.z_filefunc, us.filestream,&number_entry_CD)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        /* version needed to extract */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&uS)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    if ((number_entry_CD!=us.gi.number_entry) ||
-        (number_disk_with_CD!=0) ||
-        (number_disk!=0))
-        err=UNZ_BADZIPFILE;
+        /* number of this disk */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&number_disk)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    /* size of the central directory */
-    if (unzlocal_getLong(&us.z_filefunc, us.filestream,&us.size_central_dir)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        /* number of the disk with the start of the central directory */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&number_disk_with_CD)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    /* offset of start of central directory with respect to the
+        /* total number of entries in the central directory on this disk */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.gi.number_entry)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* total number of entries in the central directory */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&number_entry_CD)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        if ((number_entry_CD!=us.gi.number_entry) ||
+            (number_disk_with_CD!=0) ||
+            (number_disk!=0))
+            err=UNZ_BADZIPFILE;
+
+        /* size of the central directory */
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.size_central_dir)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* offset of start of central directory with respect to the
           starting disk number */
-    if (unzlocal_getLong(&us.z_filefunc, us.filestream,&us.offset_central_dir)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        if (unzlocal_getLong64(&us.z_filefunc, us.filestream,&us.offset_central_dir)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    /* zipfile comment length */
-    if (unzlocal_getShort(&us.z_filefunc, us.filestream,&us.gi.size_comment)!=UNZ_OK)
-        err=UNZ_ERRNO;
+        /* the comment length is only in the end of central dir record */
+        if (ZSEEK64(us.z_filefunc, us.filestream,
+                    central_pos+20,ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&us.gi.size_comment)!=UNZ_OK)
+            err=UNZ_ERRNO;
 
-    if ((central_pos<us.offset_central_dir+us.size_central_dir) &&
-        (err==UNZ_OK))
-        err=UNZ_BADZIPFILE;
+        /* byte_before_the_zipfile is measured from the zip64 record */
+        if ((central_pos64<us.offset_central_dir+us.size_central_dir) &&
+            (err==UNZ_OK))
+            err=UNZ_BADZIPFILE;
+        central_pos = central_pos64;
+    }
+    else
+    {
+        us.isZip64 = 0;
+
+        if (ZSEEK64(us.z_filefunc, us.filestream,
+                                          central_pos,ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
+
+        /* the signature, already checked */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* number of this disk */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&number_disk)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* number of the disk with the start of the central directory */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&number_disk_with_CD)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        /* total number of entries in the central dir on this disk */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        us.gi.number_entry = uL;
+
+        /* total number of entries in the central dir */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        number_entry_CD = uL;
+
+        if ((number_entry_CD!=us.gi.number_entry) ||
+            (number_disk_with_CD!=0) ||
+            (number_disk!=0))
+            err=UNZ_BADZIPFILE;
+
+        /* size of the central directory */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        us.size_central_dir = uL;
+
+        /* offset of start of central directory with respect to the
+              starting disk number */
+        if (unzlocal_getLong(&us.z_filefunc, us.filestream,&uL)!=UNZ_OK)
+            err=UNZ_ERRNO;
+        us.offset_central_dir = uL;
+
+        /* zipfile comment length */
+        if (unzlocal_getShort(&us.z_filefunc, us.filestream,&us.gi.size_comment)!=UNZ_OK)
+            err=UNZ_ERRNO;
+
+        if ((central_pos<us.offset_central_dir+us.size_central_dir) &&
+            (err==UNZ_OK))
+            err=UNZ_BADZIPFILE;
+    }
 
     if (err!=UNZ_OK)
     {
-        ZCLOSE(us.z_filefunc, us.filestream);
+        ZCLOSE64(us.z_filefunc, us.filestream);
         return NULL;
     }
 
@@ -503,10 +681,46 @@ extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
 }
 
 
+extern unzFile ZEXPORT unzOpen2 (path, pzlib_filefunc_def)
+    const char *path;
+    zlib_filefunc_def* pzlib_filefunc_def;
+{
+    if (pzlib_filefunc_def != NULL)
+    {
+        zlib_filefunc64_32_def zlib_filefunc64_32_def_fill;
+        fill_zlib_filefunc64_32_def_from_filefunc32(&zlib_filefunc64_32_def_fill,pzlib_filefunc_def);
+        return unzOpenInternal(path, &zlib_filefunc64_32_def_fill, 0);
+    }
+    else
+        return unzOpenInternal(path, NULL, 0);
+}
+
+extern unzFile ZEXPORT unzOpen2_64 (path, pzlib_filefunc_def)
+    const void *path;
+    zlib_filefunc64_def* pzlib_filefunc_def;
+{
+    if (pzlib_filefunc_def != NULL)
+    {
+        zlib_filefunc64_32_def zlib_filefunc64_32_def_fill;
+        zlib_filefunc64_32_def_fill.zfile_func64 = *pzlib_filefunc_def;
+        zlib_filefunc64_32_def_fill.ztell32_file = NULL;
+        zlib_filefunc64_32_def_fill.zseek32_file = NULL;
+        return unzOpenInternal(path, &zlib_filefunc64_32_def_fill, 1);
+    }
+    else
+        return unzOpenInternal(path, NULL, 1);
+}
+
 extern unzFile ZEXPORT unzOpen (path)
     const char *path;
 {
-    return unzOpen2(path, NULL);
+    return unzOpenInternal(path, NULL, 0);
+}
+
+extern unzFile ZEXPORT unzOpen64 (path)
+    const void *path;
+{
+    return unzOpenInternal(path, NULL, 1);
 }
 
 /*
@@ -525,7 +739,7 @@ extern int ZEXPORT unzClose (file)
     if (s->pfile_in_zip_read!=NULL)
         unzCloseCurrentFile(file);
 
-    ZCLOSE(s->z_filefunc, s->filestream);
+    ZCLOSE64(s->z_filefunc, s->filestream);
     TRYFREE(s);
     return UNZ_OK;
 }
@@ -543,7 +757,20 @@ extern int ZEXPORT unzGetGlobalInfo (file,pglobal_info)
     if (file==NULL)
         return UNZ_PARAMERROR;
     s=(unz_s*)file;
-    memcpy(pglobal_info, &(s->gi), sizeof(unz_global_info));
+    pglobal_info->number_entry = (uLong)s->gi.number_entry;
+    pglobal_info->size_comment = s->gi.size_comment;
+    return UNZ_OK;
+}
+
+extern int ZEXPORT unzGetGlobalInfo64 (file,pglobal_info)
+    unzFile file;
+    unz_global_info64 *pglobal_info;
+{
+    unz_s* s;
+    if (file==NULL)
+        return UNZ_PARAMERROR;
+    s=(unz_s*)file;
+    *pglobal_info=s->gi;
     return UNZ_OK;
 }
 
@@ -570,7 +797,7 @@ local void unzlocal_DosDateToTmuDate (ulDosDate, ptm)
   Get Info about the current file in the zipfile, with internal only info
 */
 local int unzlocal_GetCurrentFileInfoInternal OF((unzFile file,
-                                                  unz_file_info *pfile_info,
+                                                  unz_file_info64 *pfile_info,
                                                   unz_file_info_internal
                                                   *pfile_info_internal,
                                                   char *szFileName,
@@ -587,7 +814,7 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
                                               extraField, extraFieldBufferSize,
                                               szComment,  commentBufferSize)
     unzFile file;
-    unz_file_info *pfile_info;
+    unz_file_info64 *pfile_info;
     unz_file_info_internal *pfile_info_internal;
     char *szFileName;
     uLong fileNameBufferSize;
@@ -597,16 +824,17 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
     uLong commentBufferSize;
 {
     unz_s* s;
-    unz_file_info file_info;
+    unz_file_info64 file_info;
     unz_file_info_internal file_info_internal;
     int err=UNZ_OK;
     uLong uMagic;
+    uLong uL;
     long lSeek=0;
 
     if (file==NULL)
         return UNZ_PARAMERROR;
     s=(unz_s*)file;
-    if (ZSEEK(s->z_filefunc, s->filestream,
+    if (ZSEEK64(s->z_filefunc, s->filestream,
               s->pos_in_central_dir+s->byte_before_the_zipfile,
               ZLIB_FILEFUNC_SEEK_SET)!=0)
         err=UNZ_ERRNO;
@@ -641,11 +869,13 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&file_info.crc) != UNZ_OK)
         err=UNZ_ERRNO;
 
-    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&file_info.compressed_size) != UNZ_OK)
+    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uL) != UNZ_OK)
         err=UNZ_ERRNO;
+    file_info.compressed_size = uL;
 
-    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&file_info.uncompressed_size) != UNZ_OK)
+    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uL) != UNZ_OK)
         err=UNZ_ERRNO;
+    file_info.uncompressed_size = uL;
 
     if (unzlocal_getShort(&s->z_filefunc, s->filestream,&file_info.size_filename) != UNZ_OK)
         err=UNZ_ERRNO;
@@ -665,8 +895,9 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&file_info.external_fa) != UNZ_OK)
         err=UNZ_ERRNO;
 
-    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&file_info_internal.offset_curfile) != UNZ_OK)
+    if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uL) != UNZ_OK)
         err=UNZ_ERRNO;
+    file_info_internal.offset_curfile = uL;
 
     lSeek+=file_info.size_filename;
     if ((err==UNZ_OK) && (szFileName!=NULL))
@@ -681,7 +912,7 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
             uSizeRead = fileNameBufferSize;
 
         if ((file_info.size_filename>0) && (fileNameBufferSize>0))
-            if (ZREAD(s->z_filefunc, s->filestream,szFileName,uSizeRead)!=uSizeRead)
+            if (ZREAD64(s->z_filefunc, s->filestream,szFileName,uSizeRead)!=uSizeRead)
                 err=UNZ_ERRNO;
         lSeek -= uSizeRead;
     }
@@ -697,14 +928,14 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
 
         if (lSeek!=0)
         {
-            if (ZSEEK(s->z_filefunc, s->filestream,lSeek,ZLIB_FILEFUNC_SEEK_CUR)==0)
+            if (ZSEEK64(s->z_filefunc, s->filestream,(ZPOS64_T)lSeek,ZLIB_FILEFUNC_SEEK_CUR)==0)
                 lSeek=0;
             else
                 err=UNZ_ERRNO;
         }
 
         if ((file_info.size_file_extra>0) && (extraFieldBufferSize>0))
-            if (ZREAD(s->z_filefunc, s->filestream,extraField,uSizeRead)!=uSizeRead)
+            if (ZREAD64(s->z_filefunc, s->filestream,extraField,uSizeRead)!=uSizeRead)
                 err=UNZ_ERRNO;
         lSeek += file_info.size_file_extra - uSizeRead;
     }
@@ -725,20 +956,79 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
 
         if (lSeek!=0)
         {
-            if (ZSEEK(s->z_filefunc, s->filestream,lSeek,ZLIB_FILEFUNC_SEEK_CUR)==0)
+            if (ZSEEK64(s->z_filefunc, s->filestream,(ZPOS64_T)lSeek,ZLIB_FILEFUNC_SEEK_CUR)==0)
                 lSeek=0;
             else
                 err=UNZ_ERRNO;
         }
 
         if ((file_info.size_file_comment>0) && (commentBufferSize>0))
-            if (ZREAD(s->z_filefunc, s->filestream,szComment,uSizeRead)!=uSizeRead)
+            if (ZREAD64(s->z_filefunc, s->filestream,szComment,uSizeRead)!=uSizeRead)
                 err=UNZ_ERRNO;
         lSeek+=file_info.size_file_comment - uSizeRead;
     }
     else
         lSeek+=file_info.size_file_comment;
 
+    /* Sizes and the offset that don't fit in 32 bits are in the ZIP64 extra
+       field, in that order, for the ones set to 0xFFFFFFFF */
+    if ((err==UNZ_OK) && (file_info.size_file_extra>0) &&
+        ((file_info.uncompressed_size==0xFFFFFFFF) ||
+         (file_info.compressed_size==0xFFFFFFFF) ||
+         (file_info_internal.offset_curfile==0xFFFFFFFF)))
+    {
+        ZPOS64_T extra_pos = s->pos_in_central_dir+s->byte_before_the_zipfile +
+                             SIZECENTRALDIRITEM + file_info.size_filename;
+        uLong acc = 0;
+
+        if (ZSEEK64(s->z_filefunc, s->filestream,extra_pos,ZLIB_FILEFUNC_SEEK_SET)!=0)
+            err=UNZ_ERRNO;
+
+        while ((err==UNZ_OK) && (acc+4<=file_info.size_file_extra))
+        {
+            uLong headerId;
+            uLong dataSize;
+
+            if (unzlocal_getShort(&s->z_filefunc, s->filestream,&headerId) != UNZ_OK)
+                err=UNZ_ERRNO;
+            if (unzlocal_getShort(&s->z_filefunc, s->filestream,&dataSize) != UNZ_OK)
+                err=UNZ_ERRNO;
+            acc += 4;
+            if ((err==UNZ_OK) && (acc+dataSize>file_info.size_file_extra))
+                err=UNZ_BADZIPFILE;
+            if (err!=UNZ_OK)
+                break;
+
+            if (headerId == 0x0001)
+            {
+                uLong used = 0;
+                if ((file_info.uncompressed_size==0xFFFFFFFF) && (used+8<=dataSize))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info.uncompressed_size) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                if ((file_info.compressed_size==0xFFFFFFFF) && (used+8<=dataSize))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info.compressed_size) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                if ((file_info_internal.offset_curfile==0xFFFFFFFF) && (used+8<=dataSize))
+                {
+                    if (unzlocal_getLong64(&s->z_filefunc, s->filestream,&file_info_internal.offset_curfile) != UNZ_OK)
+                        err=UNZ_ERRNO;
+                    used += 8;
+                }
+                break;
+            }
+
+            if (ZSEEK64(s->z_filefunc, s->filestream,dataSize,ZLIB_FILEFUNC_SEEK_CUR)!=0)
+                err=UNZ_ERRNO;
+            acc += dataSize;
+        }
+    }
+
     if ((err==UNZ_OK) && (pfile_info!=NULL))
         *pfile_info=file_info;
 
@@ -755,6 +1045,26 @@ local int unzlocal_GetCurrentFileInfoInternal (file,
   No preparation of the structure is needed
   return UNZ_OK if there is no problem.
 */
+extern int ZEXPORT unzGetCurrentFileInfo64 (file,
+                                            pfile_info,
+                                            szFileName, fileNameBufferSize,
+                                            extraField, extraFieldBufferSize,
+                                            szComment,  commentBufferSize)
+    unzFile file;
+    unz_file_info64 *pfile_info;
+    char *szFileName;
+    uLong fileNameBufferSize;
+    void *extraField;
+    uLong extraFieldBufferSize;
+    char *szComment;
+    uLong commentBufferSize;
+{
+    return unzlocal_GetCurrentFileInfoInternal(file,pfile_info,NULL,
+                                                szFileName,fileNameBufferSize,
+                                                extraField,extraFieldBufferSize,
+                                                szComment,commentBufferSize);
+}
+
 extern int ZEXPORT unzGetCurrentFileInfo (file,
                                           pfile_info,
                                           szFileName, fileNameBufferSize,
@@ -769,10 +1079,37 @@ extern int ZEXPORT unzGetCurrentFileInfo (file,
     char *szComment;
     uLong commentBufferSize;
 {
-    return unzlocal_GetCurrentFileInfoInternal(file,pfile_info,NULL,
+    int err;
+    unz_file_info64 file_info64;
+    err = unzlocal_GetCurrentFileInfoInternal(file,&file_info64,NULL,
                                                 szFileName,fileNameBufferSize,
                                                 extraField,extraFieldBufferSize,
                                                 szComment,commentBufferSize);
+    if ((err==UNZ_OK) && (pfile_info != NULL))
+    {
+        pfile_info->version = file_info64.version;
+        pfile_info->version_needed = file_info64.version_needed;
+        pfile_info->flag = file_info64.flag;
+        pfile_info->compression_method = file_info64.compression_method;
+        pfile_info->dosDate = file_info64.dosDate;
+        pfile_info->crc = file_info64.crc;
+
+        pfile_info->size_filename = file_info64.size_filename;
+        pfile_info->size_file_extra = file_info64.size_file_extra;
+        pfile_info->size_file_comment = file_info64.size_file_comment;
+
+        pfile_info->disk_num_start = file_info64.disk_num_start;
+        pfile_info->internal_fa = file_info64.internal_fa;
+        pfile_info->external_fa = file_info64.external_fa;
+
+        pfile_info->tmu_date = file_info64.tmu_date;
+
+        pfile_info->compressed_size = file_info64.compressed_size > 0xFFFFFFFF ?
+                                      0xFFFFFFFF : (uLong)file_info64.compressed_size;
+        pfile_info->uncompressed_size = file_info64.uncompressed_size > 0xFFFFFFFF ?
+                                        0xFFFFFFFF : (uLong)file_info64.uncompressed_size;
+    }
+    return err;
 }
 
 /*
@@ -846,10 +1183,10 @@ extern int ZEXPORT unzLocateFile (file, szFileName, iCaseSensitivity)
     /* We remember the 'current' position in the file so that we can jump
      * back there if we fail.
      */
-    unz_file_info cur_file_infoSaved;
+    unz_file_info64 cur_file_infoSaved;
     unz_file_info_internal cur_file_info_internalSaved;
-    uLong num_fileSaved;
-    uLong pos_in_central_dirSaved;
+    ZPOS64_T num_fileSaved;
+    ZPOS64_T pos_in_central_dirSaved;
 
 
     if (file==NULL)
@@ -873,7 +1210,7 @@ extern int ZEXPORT unzLocateFile (file, szFileName, iCaseSensitivity)
     while (err == UNZ_OK)
     {
         char szCurrentFileName[UNZ_MAXFILENAMEINZIP+1];
-        err = unzGetCurrentFileInfo(file,NULL,
+        err = unzGetCurrentFileInfo64(file,NULL,
                                     szCurrentFileName,sizeof(szCurrentFileName)-1,
                                     NULL,0,NULL,0);
         if (err == UNZ_OK)
@@ -914,9 +1251,9 @@ typedef struct unz_file_pos_s
 } unz_file_pos;
 */
 
-extern int ZEXPORT unzGetFilePos(file, file_pos)
+extern int ZEXPORT unzGetFilePos64(file, file_pos)
     unzFile file;
-    unz_file_pos* file_pos;
+    unz64_file_pos* file_pos;
 {
     unz_s* s;
 
@@ -932,9 +1269,36 @@ extern int ZEXPORT unzGetFilePos(file, file_pos)
     return UNZ_OK;
 }
 
+extern int ZEXPORT unzGetFilePos(file, file_pos)
+    unzFile file;
+    unz_file_pos* file_pos;
+{
+    unz64_file_pos file_pos64;
+    int err = unzGetFilePos64(file,&file_pos64);
+    if (err==UNZ_OK)
+    {
+        file_pos->pos_in_zip_directory = (uLong)file_pos64.pos_in_zip_directory;
+        file_pos->num_of_file = (uLong)file_pos64.num_of_file;
+    }
+    return err;
+}
+
 extern int ZEXPORT unzGoToFilePos(file, file_pos)
     unzFile file;
     unz_file_pos* file_pos;
+{
+    unz64_file_pos file_pos64;
+    if (file_pos == NULL)
+        return UNZ_PARAMERROR;
+
+    file_pos64.pos_in_zip_directory = file_pos->pos_in_zip_directory;
+    file_pos64.num_of_file = file_pos->num_of_file;
+    return unzGoToFilePos64(file,&file_pos64);
+}
+
+extern int ZEXPORT unzGoToFilePos64(file, file_pos)
+    unzFile file;
+    const unz64_file_pos* file_pos;
 {
     unz_s* s;
     int err;
@@ -973,7 +1337,7 @@ local int unzlocal_CheckCurrentFileCoherencyHeader (s,piSizeVar,
                                                     psize_local_extrafield)
     unz_s* s;
     uInt* piSizeVar;
-    uLong *poffset_local_extrafield;
+    ZPOS64_T *poffset_local_extrafield;
     uInt  *psize_local_extrafield;
 {
     uLong uMagic,uData,uFlags;
@@ -985,7 +1349,7 @@ local int unzlocal_CheckCurrentFileCoherencyHeader (s,piSizeVar,
     *poffset_local_extrafield = 0;
     *psize_local_extrafield = 0;
 
-    if (ZSEEK(s->z_filefunc, s->filestream,s->cur_file_info_internal.offset_curfile +
+    if (ZSEEK64(s->z_filefunc, s->filestream,s->cur_file_info_internal.offset_curfile +
                                 s->byte_before_the_zipfile,ZLIB_FILEFUNC_SEEK_SET)!=0)
         return UNZ_ERRNO;
 
@@ -1028,16 +1392,17 @@ local int unzlocal_CheckCurrentFileCoherencyHeader (s,piSizeVar,
                               ((uFlags & 8)==0))
         err=UNZ_BADZIPFILE;
 
+    /* a ZIP64 entry has 0xFFFFFFFF here and its sizes in the local extra field */
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uData) != UNZ_OK) /* size compr */
         err=UNZ_ERRNO;
     else if ((err==UNZ_OK) && (uData!=s->cur_file_info.compressed_size) &&
-                              ((uFlags & 8)==0))
+                              (uData!=0xFFFFFFFF) && ((uFlags & 8)==0))
         err=UNZ_BADZIPFILE;
 
     if (unzlocal_getLong(&s->z_filefunc, s->filestream,&uData) != UNZ_OK) /* size uncompr */
         err=UNZ_ERRNO;
     else if ((err==UNZ_OK) && (uData!=s->cur_file_info.uncompressed_size) &&
-                              ((uFlags & 8)==0))
+                              (uData!=0xFFFFFFFF) && ((uFlags & 8)==0))
         err=UNZ_BADZIPFILE;
 
 
@@ -1074,7 +1439,7 @@ extern int ZEXPORT unzOpenCurrentFile3 (file, method, level, raw, password)
     uInt iSizeVar;
     unz_s* s;
     file_in_zip_read_info_s* pfile_in_zip_read_info;
-    uLong offset_local_extrafield;  /* offset of the local extra field */
+    ZPOS64_T offset_local_extrafield;  /* offset of the local extra field */
     uInt  size_local_extrafield;    /* size of the local extra field */
 #    ifndef NOUNCRYPT
     char source[12];
@@ -1145,6 +1510,7 @@ extern int ZEXPORT unzOpenCurrentFile3 (file, method, level, raw, password)
     pfile_in_zip_read_info->byte_before_the_zipfile=s->byte_before_the_zipfile;
 
     pfile_in_zip_read_info->stream.total_out = 0;
+    pfile_in_zip_read_info->total_out_64 = 0;
 
     if ((s->cur_file_info.compression_method==Z_BZIP2ED) &&
         (!raw))
@@ -1221,12 +1587,12 @@ extern int ZEXPORT unzOpenCurrentFile3 (file, method, level, raw, password)
         int i;
         s->pcrc_32_tab = get_crc_table();
         init_keys(password,s->keys,s->pcrc_32_tab);
-        if (ZSEEK(s->z_filefunc, s->filestream,
+        if (ZSEEK64(s->z_filefunc, s->filestream,
                   s->pfile_in_zip_read->pos_in_zipfile +
                      s->pfile_in_zip_read->byte_before_the_zipfile,
                   SEEK_SET)!=0)
             return UNZ_INTERNALERROR;
-        if(ZREAD(s->z_filefunc, s->filestream,source, 12)<12)
+        if(ZREAD64(s->z_filefunc, s->filestream,source, 12)<12)
             return UNZ_INTERNALERROR;
 
         for (i = 0; i<12; i++)
@@ -1322,13 +1688,13 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
                 uReadThis = (uInt)pfile_in_zip_read_info->rest_read_compressed;
             if (uReadThis == 0)
                 return UNZ_EOF;
-            if (ZSEEK(pfile_in_zip_read_info->z_filefunc,
+            if (ZSEEK64(pfile_in_zip_read_info->z_filefunc,
                       pfile_in_zip_read_info->filestream,
                       pfile_in_zip_read_info->pos_in_zipfile +
                          pfile_in_zip_read_info->byte_before_the_zipfile,
                          ZLIB_FILEFUNC_SEEK_SET)!=0)
                 return UNZ_ERRNO;
-            if (ZREAD(pfile_in_zip_read_info->z_filefunc,
+            if (ZREAD64(pfile_in_zip_read_info->z_filefunc,
                       pfile_in_zip_read_info->filestream,
                       pfile_in_zip_read_info->read_buffer,
                       uReadThis)!=uReadThis)
@@ -1383,6 +1749,7 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
             pfile_in_zip_read_info->stream.next_out += uDoCopy;
             pfile_in_zip_read_info->stream.next_in += uDoCopy;
             pfile_in_zip_read_info->stream.total_out += uDoCopy;
+            pfile_in_zip_read_info->total_out_64 += uDoCopy;
             iRead += uDoCopy;
         }
         else
@@ -1416,6 +1783,7 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
 
             pfile_in_zip_read_info->rest_read_uncompressed -=
                 uOutThis;
+            pfile_in_zip_read_info->total_out_64 += uOutThis;
 
             iRead += (uInt)(uTotalOutAfter - uTotalOutBefore);
 
@@ -1462,6 +1830,7 @@ extern int ZEXPORT unzReadCurrentFile  (file, buf, len)
 
             pfile_in_zip_read_info->rest_read_uncompressed -=
                 uOutThis;
+            pfile_in_zip_read_info->total_out_64 += uOutThis;
 
             iRead += (uInt)(uTotalOutAfter - uTotalOutBefore);
 
@@ -1497,6 +1866,22 @@ extern z_off_t ZEXPORT unztell (file)
     return (z_off_t)pfile_in_zip_read_info->stream.total_out;
 }
 
+extern ZPOS64_T ZEXPORT unztell64 (file)
+    unzFile file;
+{
+    unz_s* s;
+    file_in_zip_read_info_s* pfile_in_zip_read_info;
+    if (file==NULL)
+        return (ZPOS64_T)-1;
+    s=(unz_s*)file;
+    pfile_in_zip_read_info=s->pfile_in_zip_read;
+
+    if (pfile_in_zip_read_info==NULL)
+        return (ZPOS64_T)-1;
+
+    return pfile_in_zip_read_info->total_out_64;
+}
+
 
 /*
   return 1 if the end of file was reached, 0 elsewhere
@@ -1542,7 +1927,7 @@ extern int ZEXPORT unzGetLocalExtrafield (file,buf,len)
     unz_s* s;
     file_in_zip_read_info_s* pfile_in_zip_read_info;
     uInt read_now;
-    uLong size_to_read;
+    ZPOS64_T size_to_read;
 
     if (file==NULL)
         return UNZ_PARAMERROR;
@@ -1566,14 +1951,14 @@ extern int ZEXPORT unzGetLocalExtrafield (file,buf,len)
     if (read_now==0)
         return 0;
 
-    if (ZSEEK(pfile_in_zip_read_info->z_filefunc,
+    if (ZSEEK64(pfile_in_zip_read_info->z_filefunc,
               pfile_in_zip_read_info->filestream,
               pfile_in_zip_read_info->offset_local_extrafield +
               pfile_in_zip_read_info->pos_local_extrafield,
               ZLIB_FILEFUNC_SEEK_SET)!=0)
         return UNZ_ERRNO;
 
-    if (ZREAD(pfile_in_zip_read_info->z_filefunc,
+    if (ZREAD64(pfile_in_zip_read_info->z_filefunc,
               pfile_in_zip_read_info->filestream,
               buf,read_now)!=read_now)
         return UNZ_ERRNO;
@@ -1647,13 +2032,13 @@ extern int ZEXPORT unzGetGlobalComment (file, szComment, uSizeBuf)
     if (uReadThis>s->gi.size_comment)
         uReadThis = s->gi.size_comment;
 
-    if (ZSEEK(s->z_filefunc,s->filestream,s->central_pos+22,ZLIB_FILEFUNC_SEEK_SET)!=0)
+    if (ZSEEK64(s->z_filefunc,s->filestream,s->comment_pos,ZLIB_FILEFUNC_SEEK_SET)!=0)
         return UNZ_ERRNO;
 
     if (uReadThis>0)
     {
       *szComment='\0';
-      if (ZREAD(s->z_filefunc,s->filestream,szComment,uReadThis)!=uReadThis)
+      if (ZREAD64(s->z_filefunc,s->filestream,szComment,uReadThis)!=uReadThis)
         return UNZ_ERRNO;
     }
 
@@ -1663,7 +2048,7 @@ extern int ZEXPORT unzGetGlobalComment (file, szComment, uSizeBuf)
 }
 
 /* Additions by RX '2004 */
-extern uLong ZEXPORT unzGetOffset (file)
+extern ZPOS64_T ZEXPORT unzGetOffset64 (file)
     unzFile file;
 {
     unz_s* s;
@@ -1679,9 +2064,16 @@ extern uLong ZEXPORT unzGetOffset (file)
     return s->pos_in_central_dir;
 }
 
-extern int ZEXPORT unzSetOffset (file, pos)
+extern uLong ZEXPORT unzGetOffset (file)
+    unzFile file;
+{
+    ZPOS64_T offset64 = unzGetOffset64(file);
+    return (uLong)offset64;
+}
+
+extern int ZEXPORT unzSetOffset64 (file, pos)
         unzFile file;
-        uLong pos;
+        ZPOS64_T pos;
 {
     unz_s* s;
     int err;
@@ -1698,3 +2090,46 @@ extern int ZEXPORT unzSetOffset (file, pos)
     s->current_file_ok = (err == UNZ_OK);
     return err;
 }
+
+extern int ZEXPORT unzSetOffset (file, pos)
+        unzFile file;
+        uLong pos;
+{
+    return unzSetOffset64(file,pos);
+}
+
+extern ZPOS64_T ZEXPORT unzGetCurrentFileZStreamPos64 (file)
+    unzFile file;
+{
+    unz_s* s;
+    file_in_zip_read_info_s* pfile_in_zip_read_info;
+
+    if (file==NULL)
+        return 0;
+    s=(unz_s*)file;
+    pfile_in_zip_read_info=s->pfile_in_zip_read;
+    if (pfile_in_zip_read_info==NULL)
+        return 0;
+    return pfile_in_zip_read_info->pos_in_zipfile +
+           pfile_in_zip_read_info->byte_before_the_zipfile;
+}
+
+extern uLong ZEXPORT unzGetCurrentFileZStreamPos (file)
+    unzFile file;
+{
+    return (uLong)unzGetCurrentFileZStreamPos64(file);
+}
+
+extern ZPOS64_T ZEXPORT unzGetCurrentFileLocalHeaderPos64 (file)
+    unzFile file;
+{
+    unz_s* s;
+
+    if (file==NULL)
+        return 0;
+    s=(unz_s*)file;
+    if (!s->current_file_ok)
+        return 0;
+    return s->cur_file_info_internal.offset_curfile +
+           s->byte_before_the_zipfile;
+}
@@ -94,7 +94,14 @@ typedef struct tm_unz_s
 } tm_unz;
 
 /* unz_global_info structure contain global data about the ZIPfile
-   These data comes from the end of central dir */
+   These data comes from the end of central dir (or its ZIP64 version) */
+typedef struct unz_global_info64_s
+{
+    ZPOS64_T number_entry;         /* total number of entries in
+                                     the central dir on this disk */
+    uLong size_comment;         /* size of the global comment of the zipfile */
+} unz_global_info64;
+
 typedef struct unz_global_info_s
 {
     uLong number_entry;         /* total number of entries in
@@ -104,6 +111,27 @@ typedef struct unz_global_info_s
 
 
 /* unz_file_info contain information about a file in the zipfile */
+typedef struct unz_file_info64_s
+{
+    uLong version;              /* version made by                 2 bytes */
+    uLong version_needed;       /* version needed to extract       2 bytes */
+    uLong flag;                 /* general purpose bit flag        2 bytes */
+    uLong compression_method;   /* compression method              2 bytes */
+    uLong dosDate;              /* last mod file date in Dos fmt   4 bytes */
+    uLong crc;                  /* crc-32                          4 bytes */
+    ZPOS64_T compressed_size;   /* compressed size                 8 bytes */
+    ZPOS64_T uncompressed_size; /* uncompressed size               8 bytes */
+    uLong size_filename;        /* filename length                 2 bytes */
+    uLong size_file_extra;      /* extra field length              2 bytes */
+    uLong size_file_comment;    /* file comment length             2 bytes */
+
+    uLong disk_num_start;       /* disk number start               2 bytes */
+    uLong internal_fa;          /* internal file attributes        2 bytes */
+    uLong external_fa;          /* external file attributes        4 bytes */
+
+    tm_unz tmu_date;
+} unz_file_info64;
+
 typedef struct unz_file_info_s
 {
     uLong version;              /* version made by                 2 bytes */
@@ -149,6 +177,13 @@ extern unzFile ZEXPORT unzOpen OF((const char *path));
        of this unzip package.
 */
 
+extern unzFile ZEXPORT unzOpen64 OF((const void *path));
+/*
+  Open a Zip file, like unzOpen. Both read ZIP64 archives (larger than 4 GB or
+    with more than 65535 entries) through 64 bit file offsets; path is a void*
+    so that a set of 64 bit file functions can take other kinds of names.
+*/
+
 extern unzFile ZEXPORT unzOpen2 OF((const char *path,
                                     zlib_filefunc_def* pzlib_filefunc_def));
 /*
@@ -156,6 +191,13 @@ extern unzFile ZEXPORT unzOpen2 OF((const char *path,
       for read/write the zip file (see ioapi.h)
 */
 
+extern unzFile ZEXPORT unzOpen2_64 OF((const void *path,
+                                       zlib_filefunc64_def* pzlib_filefunc_def));
+/*
+   Open a Zip file, like unzOpen64, but provide a set of file low level API
+      for read/write the zip file (see ioapi.h)
+*/
+
 extern int ZEXPORT unzClose OF((unzFile file));
 /*
   Close a ZipFile opened with unzipOpen.
@@ -170,6 +212,11 @@ extern int ZEXPORT unzGetGlobalInfo OF((unzFile file,
   No preparation of the structure is needed
   return UNZ_OK if there is no problem. */
 
+extern int ZEXPORT unzGetGlobalInfo64 OF((unzFile file,
+                                          unz_global_info64 *pglobal_info));
+/*
+  Same than unzGetGlobalInfo, with the 64 bit entry count of ZIP64 archives */
+
 
 extern int ZEXPORT unzGetGlobalComment OF((unzFile file,
                                            char *szComment,
@@ -227,6 +274,20 @@ extern int ZEXPORT unzGoToFilePos(
     unzFile file,
     unz_file_pos* file_pos);
 
+typedef struct unz64_file_pos_s
+{
+    ZPOS64_T pos_in_zip_directory;   /* offset in zip file directory  */
+    ZPOS64_T num_of_file;            /* # of file */
+} unz64_file_pos;
+
+extern int ZEXPORT unzGetFilePos64(
+    unzFile file,
+    unz64_file_pos* file_pos);
+
+extern int ZEXPORT unzGoToFilePos64(
+    unzFile file,
+    const unz64_file_pos* file_pos);
+
 /* ****************************************** */
 
 extern int ZEXPORT unzGetCurrentFileInfo OF((unzFile file,
@@ -250,6 +311,19 @@ extern int ZEXPORT unzGetCurrentFileInfo OF((unzFile file,
             (commentBufferSize is the size of the buffer)
 */
 
+extern int ZEXPORT unzGetCurrentFileInfo64 OF((unzFile file,
+                         unz_file_info64 *pfile_info,
+                         char *szFileName,
+                         uLong fileNameBufferSize,
+                         void *extraField,
+                         uLong extraFieldBufferSize,
+                         char *szComment,
+                         uLong commentBufferSize));
+/*
+  Same than unzGetCurrentFileInfo, with the 64 bit sizes of ZIP64 entries.
+  unzGetCurrentFileInfo reports 0xFFFFFFFF for a size that does not fit
+*/
+
 /***************************************************************************/
 /* for reading the content of the current zipfile, you can open it, read data
    from it, and close it (you can close it before reading all the file)
@@ -322,6 +396,11 @@ extern z_off_t ZEXPORT unztell OF((unzFile file));
   Give the current position in uncompressed data
 */
 
+extern ZPOS64_T ZEXPORT unztell64 OF((unzFile file));
+/*
+  Give the current position in uncompressed data, past 4 GB
+*/
+
 extern int ZEXPORT unzeof OF((unzFile file));
 /*
   return 1 if the end of file was reached, 0 elsewhere
@@ -347,9 +426,19 @@ extern int ZEXPORT unzGetLocalExtrafield OF((unzFile file,
 
 /* Get the current file offset */
 extern uLong ZEXPORT unzGetOffset (unzFile file);
+extern ZPOS64_T ZEXPORT unzGetOffset64 (unzFile file);
 
 /* Set the current file offset */
 extern int ZEXPORT unzSetOffset (unzFile file, uLong pos);
+extern int ZEXPORT unzSetOffset64 (unzFile file, ZPOS64_T pos);
+
+/* Get the position in the zipfile of the (compressed) data of the current file.
+   Only meaningful right after unzOpenCurrentFile*, before anything has been read. */
+extern uLong ZEXPORT unzGetCurrentFileZStreamPos (unzFile file);
+extern ZPOS64_T ZEXPORT unzGetCurrentFileZStreamPos64 (unzFile file);
+
+/* Get the position in the zipfile of the local header of the current file */
+extern ZPOS64_T ZEXPORT unzGetCurrentFileLocalHeaderPos64 (unzFile file);
 
 
 